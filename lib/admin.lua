@@ -46,6 +46,10 @@ function read_query(packet)
 			  type = proxy.MYSQL_TYPE_STRING },
 			{ name = "type",
 			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "tag",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "cluster",
+			  type = proxy.MYSQL_TYPE_STRING },
 		}
 
 		for i = 1, #proxy.global.backends do
@@ -67,8 +71,326 @@ function read_query(packet)
 				b.dst.name,          -- configured backend address
 				states[b.state + 1], -- the C-id is pushed down starting at 0
 				types[b.type + 1],   -- the C-id is pushed down starting at 0
+				b.tag,               -- group for the GROUP:tag hint, nil if untagged
+				b.cluster,           -- nil for the default cluster
+			}
+		end
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+breakers$") then
+		fields = {
+			{ name = "backend_ndx",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "address",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "breaker",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "requests",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "errors",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "timeouts",
+			  type = proxy.MYSQL_TYPE_LONG },
+		}
+
+		local breakers = {
+			"closed",
+			"open",
+			"half-open"
+		}
+		for i = 1, #proxy.global.backends do
+			local b = proxy.global.backends[i]
+
+			rows[#rows + 1] = {
+				i,
+				b.dst.name,
+				breakers[b.breaker + 1], -- the C-id is pushed down starting at 0
+				b.breaker_requests,      -- counters of the current window
+				b.breaker_errors,
+				b.breaker_timeouts,
 			}
 		end
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+backend_latency$") then
+		fields = {
+			{ name = "backend_ndx",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "address",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "latency",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "count",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "avg_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "p50_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "p90_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "p99_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "p999_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "max_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+
+		for i = 1, #proxy.global.backends do
+			local b = proxy.global.backends[i]
+
+			-- query: until the last packet of the result, connect: including the authentication
+			for _, latency in ipairs({ "query", "connect" }) do
+				local h = b[latency .. "_latency"]
+
+				rows[#rows + 1] = {
+					i,
+					b.dst.name,
+					latency,
+					h.count,
+					string.format("%.3f", h.avg / 1000),
+					string.format("%.3f", h.p50 / 1000),
+					string.format("%.3f", h.p90 / 1000),
+					string.format("%.3f", h.p99 / 1000),
+					string.format("%.3f", h.p999 / 1000),
+					string.format("%.3f", h.max / 1000),
+				}
+			end
+		end
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+plan_cache$") then
+		fields = {
+			{ name = "hits",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "misses",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "hit_rate",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "entries",
+			  type = proxy.MYSQL_TYPE_LONG },
+		}
+
+		local c = proxy.global.backends.plan_cache
+		if c then
+			local total = c.hits + c.misses
+			rows[#rows + 1] = {
+				c.hits,          -- queries routed without the tokenizer
+				c.misses,
+				total > 0 and string.format("%.2f%%", c.hits * 100 / total) or "0.00%",
+				c.entries,       -- summed over the event-threads
+			}
+		end
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+query_stats$") then
+		fields = {
+			{ name = "db",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "digest",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "count",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "errors",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "total_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "avg_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "max_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "rows",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "bytes",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+		}
+
+		local digests = proxy.global.backends.query_stats or { }
+		-- the most expensive query shapes first
+		table.sort(digests, function (a, b) return a.total_us > b.total_us end)
+		for i = 1, #digests do
+			local d = digests[i]
+
+			rows[#rows + 1] = {
+				d.db,
+				d.digest,        -- literals are replaced by ?
+				d.count,
+				d.errors,
+				string.format("%.3f", d.total_us / 1000),
+				string.format("%.3f", d.total_us / 1000 / d.count),
+				string.format("%.3f", d.max_us / 1000),
+				d.rows,
+				d.bytes,
+			}
+		end
+	elseif string.find(query:lower(), "^reset%s+query_stats$") then
+		proxy.global.backends.resetquerystats = 0
+		fields = {
+			{ name = "status",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+profile$") then
+		fields = {
+			{ name = "name",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "calls",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "total_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "avg_us",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "max_us",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "share",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+
+		local profile = proxy.global.backends.profile
+		-- the share is of the time in the connection states, the sections run inside of them
+		local total = 0
+		for i = 1, #profile do
+			if string.find(profile[i].name, "^CON_STATE_") then total = total + profile[i].total_us end
+		end
+		for i = 1, #profile do
+			local p = profile[i]
+
+			rows[#rows + 1] = {
+				p.name,
+				p.calls,
+				string.format("%.3f", p.total_us / 1000),
+				string.format("%.3f", p.total_us / p.calls),
+				string.format("%.3f", p.max_us),
+				total > 0 and string.format("%.2f%%", p.total_us * 100 / total) or "0.00%",
+			}
+		end
+	elseif string.find(query:lower(), "^set%s+profile%s+on$") or string.find(query:lower(), "^set%s+profile%s+off$") then
+		proxy.global.backends.profiling = string.find(query:lower(), "on$") ~= nil
+		fields = {
+			{ name = "status",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+	elseif string.find(query:lower(), "^reset%s+profile$") then
+		proxy.global.backends.resetprofile = 0
+		fields = {
+			{ name = "status",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+slow_queries$") then
+		fields = {
+			{ name = "time",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "total_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "route_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "pool_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "connect_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "repairs",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "repair_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "queries",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "backend_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "client_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "client",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "backend",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "user",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "db",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "error",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "query",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+
+		local queries = proxy.global.backends.slow_queries or { }
+		for i = 1, #queries do
+			local q = queries[i]
+
+			rows[#rows + 1] = {
+				os.date("%Y-%m-%d %H:%M:%S", q.time),
+				string.format("%.3f", q.total_us / 1000),
+				string.format("%.3f", q.route_us / 1000),
+				string.format("%.3f", q.pool_us / 1000),   -- connect_ms is part of it
+				string.format("%.3f", q.connect_us / 1000),
+				q.repairs,       -- COM_INIT_DB, SET NAMES, COM_CHANGE_USER
+				string.format("%.3f", q.repair_us / 1000),
+				q.queries,       -- more than 1 for sharded queries
+				string.format("%.3f", q.backend_us / 1000),
+				string.format("%.3f", q.client_us / 1000),
+				q.client,
+				q.backend,
+				q.user,
+				q.db,
+				q.error and "yes" or "no",
+				q.query ~= "" and q.query or string.format("command 0x%02x", q.command),
+			}
+		end
+	elseif string.find(query:lower(), "^select%s+*%s+from%s+processlist$") or string.find(query:lower(), "^show%s+processlist$") then
+		fields = {
+			{ name = "id",
+			  type = proxy.MYSQL_TYPE_LONGLONG },
+			{ name = "thread",
+			  type = proxy.MYSQL_TYPE_LONG },
+			{ name = "client",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "user",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "db",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "state",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "backend",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "trx",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "time_ms",
+			  type = proxy.MYSQL_TYPE_STRING },
+			{ name = "query",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
+
+		-- each event-thread lists its own connections, a busy one makes it time out
+		local ok, procs = pcall(function () return proxy.global.backends.processlist end)
+		if not ok then
+			set_error("processlist timed out, a event-thread is busy")
+			return proxy.PROXY_SEND_RESULT
+		end
+		table.sort(procs, function (a, b) return a.id < b.id end)
+		for i = 1, #procs do
+			local p = procs[i]
+			local trx = { }
+
+			-- the reasons the connection keeps its server connection
+			if p.in_transaction then trx[#trx + 1] = "in_transaction" end
+			if not p.autocommit then trx[#trx + 1] = "not_autocommit" end
+			if p.locks > 0 then trx[#trx + 1] = "locks=" .. p.locks end
+
+			rows[#rows + 1] = {
+				p.id,
+				p.thread,
+				p.client,
+				p.user,
+				p.db,
+				string.gsub(p.state, "^CON_STATE_", ""),
+				p.backend,
+				table.concat(trx, ","),
+				string.format("%.3f", p.state_ms),
+				(p.query and p.query ~= "") and p.query or (p.command > 0 and string.format("command 0x%02x", p.command) or nil),
+			}
+		end
+	elseif string.find(query:lower(), "^kill%s+%d+$") or string.find(query:lower(), "^kill%s+connection%s+%d+$") then
+		local id = tonumber(string.match(query:lower(), "(%d+)$"))
+		-- the connection is closed in its own event-thread
+		local ok, err = pcall(function () proxy.global.backends.kill = id end)
+		if not ok then
+			set_error("Unknown connection id: " .. id)
+			return proxy.PROXY_SEND_RESULT
+		end
+		fields = {
+			{ name = "status",
+			  type = proxy.MYSQL_TYPE_STRING },
+		}
 	elseif string.find(query:lower(), "^set%s+%a+%s+%d+$") then
 		local state,id = string.match(query:lower(), "^set%s+(%a+)%s+(%d+)$")
 		if proxy.global.backends[id] == nil then
@@ -274,6 +596,17 @@ function read_query(packet)
 		rows[#rows + 1] = { "ADD MASTER $backend", "example: \"add master 127.0.0.1:3306\", ..." }
 		rows[#rows + 1] = { "ADD SLAVE $backend", "example: \"add slave 127.0.0.1:3306\", ..." }
 		rows[#rows + 1] = { "REMOVE BACKEND $backend_id", "example: \"remove backend 1\", ..." }
+		rows[#rows + 1] = { "SELECT * FROM breakers", "lists the circuit breaker of each backend" }
+		rows[#rows + 1] = { "SELECT * FROM backend_latency", "shows the query and connect latency percentiles of each backend" }
+		rows[#rows + 1] = { "SELECT * FROM plan_cache", "shows the hit-rate of the routing-plan cache" }
+		rows[#rows + 1] = { "SELECT * FROM query_stats", "lists count, latency and rows of each query digest" }
+		rows[#rows + 1] = { "RESET QUERY_STATS", "starts counting the query digests from zero" }
+		rows[#rows + 1] = { "SELECT * FROM profile", "shows the time spent in each connection state, the tokenizer, routing and pool" }
+		rows[#rows + 1] = { "SET PROFILE ON|OFF", "starts or stops the profiling, see --con-profiling" }
+		rows[#rows + 1] = { "RESET PROFILE", "starts the profiling from zero" }
+		rows[#rows + 1] = { "SELECT * FROM slow_queries", "lists the last slow queries with the time of each phase, see --slow-query-threshold" }
+		rows[#rows + 1] = { "SELECT * FROM processlist", "lists the client connections, SHOW PROCESSLIST works too" }
+		rows[#rows + 1] = { "KILL $id", "closes the client connection with the id of the processlist" }
 
 		rows[#rows + 1] = { "SELECT * FROM clients", "lists the clients" }
 		rows[#rows + 1] = { "ADD CLIENT $client", "example: \"add client 192.168.1.2\", ..." }
@@ -0,0 +1,145 @@
+/**
+ * micro-benchmark of the SQL tokenizer
+ *
+ *   sql-tokenizer-bench [iterations [threads]]
+ *
+ * tokenizes a few typical queries in a loop in each thread and prints
+ * the time per query and the tokens per second over all threads, then
+ * compares the keyword lookup of the perfect hash with the binary search
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sql-tokenizer.h"
+
+typedef struct {
+	const gchar *name;
+	GString *query;
+} bench_query_t;
+
+typedef struct {
+	bench_query_t *query;
+	guint iterations;
+	guint64 tokens;
+} bench_thread_t;
+
+static gpointer bench_thread(gpointer user_data) {
+	bench_thread_t *bt = user_data;
+	guint i;
+
+	for (i = 0; i < bt->iterations; i++) {
+		GPtrArray *tokens = sql_tokens_new();
+
+		sql_tokenizer(tokens, bt->query->query->str, bt->query->query->len);
+		bt->tokens += tokens->len;
+
+		sql_tokens_free(tokens);
+	}
+
+	return NULL;
+}
+
+static void bench_run(bench_query_t *query, guint iterations, guint threads) {
+	bench_thread_t *bts = g_new0(bench_thread_t, threads);
+	GThread **thrs = g_new0(GThread *, threads);
+	GTimer *timer = g_timer_new();
+	guint64 tokens = 0;
+	gdouble elapsed;
+	guint i;
+
+	for (i = 0; i < threads; i++) {
+		bts[i].query = query;
+		bts[i].iterations = iterations;
+		thrs[i] = g_thread_create(bench_thread, &bts[i], TRUE, NULL);
+	}
+	for (i = 0; i < threads; i++) {
+		g_thread_join(thrs[i]);
+		tokens += bts[i].tokens;
+	}
+	elapsed = g_timer_elapsed(timer, NULL);
+
+	printf("%-12s %8lu bytes %8.2f us/query %10.0f tokens/s\n",
+			query->name,
+			(unsigned long)query->query->len,
+			elapsed * 1000000.0 / iterations,
+			tokens / elapsed);
+
+	g_timer_destroy(timer);
+	g_free(thrs);
+	g_free(bts);
+}
+
+typedef sql_token_id (*keyword_lookup_func)(const gchar *name, size_t name_len);
+
+static void bench_keywords(const gchar *name, keyword_lookup_func lookup, const gchar **words, guint iterations) {
+	GTimer *timer = g_timer_new();
+	guint64 lookups = 0;
+	gint sum = 0;
+	guint i, j;
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; words[j]; j++) {
+			sum += lookup(words[j], strlen(words[j]));
+			lookups++;
+		}
+	}
+
+	/* print the sum so the lookups can't be optimized away */
+	printf("%-12s %8.2f ns/lookup (%d)\n", name, g_timer_elapsed(timer, NULL) * 1000000000.0 / lookups, sum);
+
+	g_timer_destroy(timer);
+}
+
+int main(int argc, char **argv) {
+	bench_query_t queries[] = {
+		{ "select", NULL },
+		{ "join", NULL },
+		{ "insert-1k", NULL },
+	};
+	const gchar *words[] = {
+		"SELECT", "select", "FROM", "WHERE", "and", "ORDER", "BY", "LIMIT", "INSERT", "INTO", "VALUES",
+		"id", "user_id", "name", "email", "created_at", "status", "total", "users", "orders", "u", "o",
+		"SQL_CALC_FOUND_ROWS", "a_long_column_name_which_is_no_keyword",
+		NULL
+	};
+	guint iterations = argc > 1 ? atoi(argv[1]) : 100000;
+	guint threads = argc > 2 ? atoi(argv[2]) : 1;
+	guint i;
+
+	if (iterations == 0 || threads == 0) {
+		fprintf(stderr, "usage: %s [iterations [threads]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	g_thread_init(NULL);
+
+	queries[0].query = g_string_new("\x03SELECT id, name, email FROM users WHERE id = 42");
+	queries[1].query = g_string_new("\x03/*slave*/ SELECT u.id, u.name, o.total, o.created_at FROM shop.users AS u "
+			"JOIN shop.orders AS o ON o.user_id = u.id WHERE u.status = 'active' AND o.total > 10.5 "
+			"ORDER BY o.created_at DESC LIMIT 20");
+	queries[2].query = g_string_new("\x03INSERT INTO log (id, level, msg) VALUES ");
+	for (i = 0; i < 1000; i++) {
+		g_string_append_printf(queries[2].query, "%s(%u, 'info', 'row %u of the batch')", i ? "," : "", i, i);
+	}
+
+	printf("%u iterations in %u thread(s)\n", iterations, threads);
+	for (i = 0; i < G_N_ELEMENTS(queries); i++) {
+		/* the insert has 1000 times the tokens */
+		bench_run(&queries[i], i == 2 ? MAX(iterations / 1000, 1) : iterations, threads);
+		g_string_free(queries[i].query, TRUE);
+	}
+
+	/* keywords and identifiers as they show up in queries */
+	for (i = 0; words[i]; i++) {
+		if (sql_token_get_id_len(words[i], strlen(words[i])) != sql_token_get_id_len_bsearch(words[i], strlen(words[i]))) {
+			fprintf(stderr, "keyword lookups disagree on %s\n", words[i]);
+			return EXIT_FAILURE;
+		}
+	}
+	bench_keywords("perfect-hash", sql_token_get_id_len, words, iterations);
+	bench_keywords("bsearch", sql_token_get_id_len_bsearch, words, iterations);
+
+	return EXIT_SUCCESS;
+}
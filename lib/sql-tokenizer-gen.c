@@ -4,6 +4,126 @@
 #include <string.h>
 
 #include "sql-tokenizer.h"
+#include "sql-tokenizer-keywords.h"
+
+/**
+ * a keyword of the perfect hash
+ */
+typedef struct {
+	char name[SQL_KEYWORD_LEN_MAX]; /* lower-cased and zero-filled */
+	size_t len;
+	gint id;
+	guint64 hash;
+} keyword;
+
+/**
+ * build a perfect hash over the keywords and print it with the lookup function
+ *
+ * hash and displace: the keywords are put into buckets by the upper bits of their hash, the
+ * largest buckets first get a displacement which moves all their keywords to free slots.
+ * A lookup is one hash of the word, a mix with the displacement of its bucket and one compare.
+ */
+static void print_perfect_hash(GArray *keywords) {
+	guint n = keywords->len;
+	guint slots, buckets, i, j;
+	GPtrArray **bucket;
+	guint16 *disp;
+	gint *slot;
+
+	for (slots = 1; slots < 2 * n; slots <<= 1);
+	for (buckets = 1; buckets < n / 2; buckets <<= 1);
+
+	for (;;) {
+		gboolean is_ok = TRUE;
+
+		bucket = g_new0(GPtrArray *, buckets);
+		disp = g_new0(guint16, buckets);
+		slot = g_new(gint, slots);
+		for (i = 0; i < slots; i++) slot[i] = -1;
+
+		for (i = 0; i < buckets; i++) bucket[i] = g_ptr_array_new();
+		for (i = 0; i < n; i++) {
+			keyword *kw = &g_array_index(keywords, keyword, i);
+			g_ptr_array_add(bucket[(kw->hash >> 32) & (buckets - 1)], kw);
+		}
+
+		/* the largest bucket first */
+		for (j = n; j > 0 && is_ok; j--) {
+			for (i = 0; i < buckets && is_ok; i++) {
+				guint d, k;
+
+				if (bucket[i]->len != j) continue;
+
+				for (d = 0; d <= G_MAXUINT16; d++) {
+					guint l;
+
+					for (k = 0; k < j; k++) {
+						keyword *kw = bucket[i]->pdata[k];
+						guint s = sql_keyword_mix(kw->hash + d) & (slots - 1);
+
+						if (slot[s] != -1) break;
+						for (l = 0; l < k; l++) {
+							if (s == (sql_keyword_mix(((keyword *)bucket[i]->pdata[l])->hash + d) & (slots - 1))) break;
+						}
+						if (l < k) break;
+					}
+					if (k == j) break;
+				}
+				if (d > G_MAXUINT16) {
+					is_ok = FALSE;
+					break;
+				}
+
+				disp[i] = d;
+				for (k = 0; k < j; k++) {
+					keyword *kw = bucket[i]->pdata[k];
+					slot[sql_keyword_mix(kw->hash + d) & (slots - 1)] = kw - (keyword *)keywords->data;
+				}
+			}
+		}
+
+		if (is_ok) break;
+
+		/* no displacement found for a bucket, retry with more room */
+		for (i = 0; i < buckets; i++) g_ptr_array_free(bucket[i], TRUE);
+		g_free(bucket);
+		g_free(disp);
+		g_free(slot);
+		slots <<= 1;
+	}
+
+	printf("#define SQL_KEYWORDS_SLOTS %u\n", slots);
+	printf("#define SQL_KEYWORDS_BUCKETS %u\n\n", buckets);
+
+	printf("static const guint16 sql_keywords_disp[SQL_KEYWORDS_BUCKETS] = {");
+	for (i = 0; i < buckets; i++) {
+		printf("%s%u", (i % 16) ? ", " : (i ? ",\n\t" : "\n\t"), disp[i]);
+	}
+	printf("\n};\n\n");
+
+	printf("static const struct {\n\tconst char *name;\n\tsize_t len;\n\tint id;\n} sql_keywords_slots[SQL_KEYWORDS_SLOTS] = {");
+	for (i = 0; i < slots; i++) {
+		if (slot[i] == -1) {
+			printf("%s\n\t{ NULL, 0, -1 }", i ? "," : "");
+		} else {
+			keyword *kw = &g_array_index(keywords, keyword, slot[i]);
+			printf("%s\n\t{ \"%s\", %lu, %d }", i ? "," : "", kw->name, (unsigned long)kw->len, kw->id);
+		}
+	}
+	printf("\n};\n\n");
+
+	printf("int sql_keywords_lookup(const char *lower, size_t len) {\n");
+	printf("\tguint64 h = sql_keyword_hash(lower, len);\n");
+	printf("\tguint s = sql_keyword_mix(h + sql_keywords_disp[(h >> 32) & (SQL_KEYWORDS_BUCKETS - 1)]) & (SQL_KEYWORDS_SLOTS - 1);\n\n");
+	printf("\tif (sql_keywords_slots[s].len == len && 0 == memcmp(sql_keywords_slots[s].name, lower, len)) return sql_keywords_slots[s].id;\n\n");
+	printf("\treturn -1;\n");
+	printf("}\n");
+
+	for (i = 0; i < buckets; i++) g_ptr_array_free(bucket[i], TRUE);
+	g_free(bucket);
+	g_free(disp);
+	g_free(slot);
+}
 
 gboolean trav(gpointer _a, gpointer _b, gpointer _udata) {
 	gboolean *is_first = _udata;
@@ -21,26 +141,47 @@ gboolean trav(gpointer _a, gpointer _b, gpointer _udata) {
 
 int main() {
 	GTree *tokens;
+	GArray *keywords;
 	gboolean is_first = TRUE;
 	gint i;
 
 	tokens = g_tree_new((GCompareFunc)g_ascii_strcasecmp);
+	keywords = g_array_new(FALSE, TRUE, sizeof(keyword));
 
 	for (i = 0; i < sql_token_get_last_id(); i++) {
+		const char *name;
+		keyword kw;
+
 		/** only tokens with TK_SQL_* are keyworks */
 		if (0 != strncmp(sql_token_get_name(i, NULL), "TK_SQL_", sizeof("TK_SQL_") - 1)) continue;
 
-		g_tree_insert(tokens, (sql_token_get_name(i, NULL) + sizeof("TK_SQL_") - 1), GINT_TO_POINTER(i));
+		name = sql_token_get_name(i, NULL) + sizeof("TK_SQL_") - 1;
+		g_tree_insert(tokens, (gpointer)name, GINT_TO_POINTER(i));
+
+		kw.len = strlen(name);
+		if (kw.len > SQL_KEYWORD_LEN_MAX) {
+			g_error("keyword %s is longer than SQL_KEYWORD_LEN_MAX", name);
+		}
+		memset(kw.name, 0, sizeof(kw.name));
+		sql_keyword_tolower(kw.name, name, kw.len);
+		kw.id = i;
+		kw.hash = sql_keyword_hash(kw.name, kw.len);
+		g_array_append_val(keywords, kw);
 	}
 
+	printf("#include \"sql-tokenizer-keywords.h\"\n\n");
+
 	/* traverse the tree and output all keywords in a sorted way */
 	printf("static int sql_keywords[] = {");
 	g_tree_foreach(tokens, trav, &is_first);
 	printf("\n};\n");
 
 	printf("int *sql_keywords_get() { return sql_keywords; }\n");
-	printf("int sql_keywords_get_count() { return sizeof(sql_keywords) / sizeof(sql_keywords[0]); }\n");
+	printf("int sql_keywords_get_count() { return sizeof(sql_keywords) / sizeof(sql_keywords[0]); }\n\n");
+
+	print_perfect_hash(keywords);
 
+	g_array_free(keywords, TRUE);
 	g_tree_destroy(tokens);
 
 	return 0;
@@ -1,7 +1,77 @@
 #ifndef __SQL_TOKENIZER_KEYWORDS_H__
 #define __SQL_TOKENIZER_KEYWORDS_H__
 
+#include <string.h>
+#include <glib.h>
+
+#define SQL_KEYWORD_LEN_MAX 32 /**< longer words are no keywords, a multiple of 8 */
+
 int *sql_keywords_get(void);
 int sql_keywords_get_count(void);
 
+/**
+ * look up a lower-cased word in the perfect hash of the keywords
+ *
+ * generated by sql-tokenizer-gen
+ *
+ * @param lower  the word from sql_keyword_tolower()
+ * @return the TK_SQL_* id or -1
+ */
+int sql_keywords_lookup(const char *lower, size_t len);
+
+/**
+ * lower-case a word 8 bytes at a time
+ *
+ * only A-Z are changed, the rest of the last word of dst is zero-filled
+ *
+ * @param dst  SQL_KEYWORD_LEN_MAX bytes
+ * @param len  <= SQL_KEYWORD_LEN_MAX
+ */
+static inline void sql_keyword_tolower(char *dst, const char *name, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		guint64 w = 0, heptets, is_upper;
+
+		memcpy(&w, name + i, MIN(8, len - i));
+
+		/* the high bit of each byte tells if it is in A-Z, bytes >= 0x80 are left alone */
+		heptets = w & G_GUINT64_CONSTANT(0x7f7f7f7f7f7f7f7f);
+		is_upper = ((heptets + G_GUINT64_CONSTANT(0x3f3f3f3f3f3f3f3f)) ^ (heptets + G_GUINT64_CONSTANT(0x2525252525252525))) & ~w & G_GUINT64_CONSTANT(0x8080808080808080);
+		w |= is_upper >> 2;
+
+		memcpy(dst + i, &w, 8);
+	}
+}
+
+/**
+ * hash a lower-cased word 8 bytes at a time
+ */
+static inline guint64 sql_keyword_hash(const char *lower, size_t len) {
+	guint64 h = len;
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		guint64 w;
+
+		memcpy(&w, lower + i, 8);
+		h = (h ^ GUINT64_FROM_LE(w)) * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+	}
+
+	return h;
+}
+
+/**
+ * spread the hash plus the displacement of its bucket over the slots
+ */
+static inline guint64 sql_keyword_mix(guint64 h) {
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
 #endif
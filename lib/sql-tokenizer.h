@@ -377,6 +377,15 @@ sql_token_id sql_token_get_id(const gchar *name) G_GNUC_DEPRECATED;
  */
 sql_token_id sql_token_get_id_len(const gchar *name, size_t name_len);
 
+/**
+ * get the token_id for a literal with a binary search
+ *
+ * @internal       only used to compare with the perfect hash in the benchmark
+ *
+ * @see sql_token_get_id_len()
+ */
+sql_token_id sql_token_get_id_len_bsearch(const gchar *name, size_t name_len);
+
 
 /**
  * scan a string into SQL tokens
@@ -386,6 +395,7 @@ sql_token_id sql_token_get_id_len(const gchar *name, size_t name_len);
  * @param len      length of str
  * @return 0 on success
  *
+ * @note reentrant, each thread scans with its own scanner
  */
 int sql_tokenizer(GPtrArray *tokens, const gchar *str, gsize len);
 
@@ -401,6 +411,8 @@ GPtrArray * sql_tokens_new(void);
 /**
  * free a token-stream
  *
+ * the tokens are kept for reuse by the next sql_tokenizer() call of the thread
+ *
  * @param tokens   a token list to free
  */
 void sql_tokens_free(GPtrArray *tokens);
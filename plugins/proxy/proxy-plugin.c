@@ -93,6 +93,7 @@
 #endif
 
 #ifndef _WIN32
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -143,6 +144,7 @@ typedef int socklen_t;
 #include "network-injection.h"
 #include "network-injection-lua.h"
 #include "network-backend.h"
+#include "network-metrics.h"
 #include "glib-ext.h"
 #include "lua-env.h"
 
@@ -154,6 +156,7 @@ typedef int socklen_t;
 #include "chassis-gtimeval.h"
 
 #include "lib/sql-tokenizer.h"
+#include "lib/crc32.h"
 #include "chassis-event-thread.h"
 
 #define C(x) x, sizeof(x) - 1
@@ -177,11 +180,29 @@ static gboolean online = TRUE;
 
 static gchar op = COM_QUERY;
 
-typedef struct {
+typedef struct db_table db_table_t;
+
+/**
+ * maps a value of the sharding column to the number of its sub-table
+ */
+typedef guint (*shard_func_t)(db_table_t* dt, GString* value);
+
+struct db_table {
 	gchar* table_name;
 	gchar* column_name;
 	guint table_num;
-} db_table_t;
+	shard_func_t shard;     /**< resolved once from the sub-table settings */
+	GArray* bounds;         /**< range: gint64 upper bound of each sub-table but the last, exclusive */
+	GArray* ring;           /**< ring: shard_point_t sorted by hash, SHARD_RING_POINTS per sub-table */
+	gchar** clusters;       /**< cluster of each sub-table, NULL if it is in the cluster of the database */
+};
+
+#define SHARD_RING_POINTS 160
+
+typedef struct {
+	guint32 hash;
+	guint table;
+} shard_point_t;
 
 typedef enum {
 	OFF,
@@ -221,6 +242,13 @@ struct chassis_plugin_config {
 
 	gchar **tables;
 	GHashTable *dt_table;
+	GHashTable *dt_table_names;       /**< the table names of dt_table without their db */
+	gchar **table_clusters;           /**< db.table:first-last:cluster, the cluster of a range of sub-tables */
+
+	gchar **cluster_dbs;              /**< cluster:db, the databases served by a cluster */
+	gchar **cluster_backend_addresses; /**< cluster:host:port, read-write backends of a cluster */
+	gchar **cluster_read_only_backend_addresses; /**< cluster:host:port@weight#tag, read-only backends of a cluster */
+	GHashTable *db_cluster;           /**< db => cluster, databases not in here go to the default backends */
 
 	gchar **pwds;
 	GHashTable *pwd_table[2];
@@ -228,15 +256,232 @@ struct chassis_plugin_config {
 
 	network_mysqld_con *listen_con;
 
-	FILE *sql_log;
+	sql_log_t *sql_log;
 	gchar *sql_log_type;
 	gint sql_log_slow_ms;
+	gint sql_log_buffer_size;         /**< KB buffered per event-thread until the writer-thread gets to it */
+	gint sql_log_sample;              /**< log 1 in N queries, 0 logs none */
+	gint sql_log_digest_rate;         /**< queries logged per digest, second and event-thread, 0 is unlimited */
+	gint sql_log_errors;              /**< log all failed queries, ignoring the slow threshold, sampling and rate */
+	gchar *sql_log_format;            /**< text or binary */
+	gint sql_log_compress;            /**< compress the binary sql-log */
+
+	gint con_profiling;               /**< profile the connection states and the query routing from the start */
+	guint sql_log_flags;              /**< SQL_LOG_BINARY, SQL_LOG_COMPRESSED */
 
 	gchar *charset;
+
+	gint check_interval;              /**< milliseconds between two rounds of health-checks */
+	gint check_timeout;               /**< milliseconds to wait for the handshake of a backend */
+	gint check_rise;                  /**< successful checks until a DOWN backend is UP again */
+	gint check_fall;                  /**< failed checks until a UP backend is DOWN */
+
+	gint breaker_threshold;           /**< percentage of failed results which opens the breaker, 0 disables it */
+	gint breaker_min_requests;        /**< results needed in a window before the breaker may open */
+	gint breaker_window;              /**< seconds of a counting window */
+	gint breaker_cooldown;            /**< seconds until a open breaker lets a probe pass */
+	gint breaker_timeout;             /**< milliseconds after which a result counts as timeout, 0 disables it */
+
+	gint shard_query_timeout;         /**< seconds a concurrent sub-query waits for its backend, 0 disables it */
+	gint shard_merge_max_rows;        /**< rows of the sub-results a ORDER BY or aggregate merge may hold, 0 for no limit */
+
+	gint plan_cache_size;             /**< routing plans cached per event-thread, 0 disables the cache */
+	struct plan_cache **plan_caches;  /**< one per event-thread, indexed by chassis_event_thread_index() */
+	plan_cache_stats_t *plan_cache_stats;
+	guint plan_cache_num;
+
+	gint query_stats_size;            /**< query digests counted per event-thread, 0 disables the query stats */
+	query_stats_t *query_stats;
+
+	gint slow_query_threshold;        /**< milliseconds after which a query is recorded, 0 disables the recorder */
+	gint slow_query_size;             /**< slow queries kept per event-thread */
+	slow_queries_t *slow_queries;
+
+	gchar *metrics_address;           /**< listening address of the /metrics page, NULL if it is off */
+	network_metrics *metrics;
 };
 
 chassis_plugin_config *config = NULL;
 
+/**
+ * MurmurHash3, x86 32-bit variant
+ */
+static guint32 shard_murmur3(const gchar* key, gsize len, guint32 seed) {
+	const guchar* data = (const guchar*)key;
+	const guint32 c1 = 0xcc9e2d51, c2 = 0x1b873593;
+	gsize nblocks = len / 4, i;
+	guint32 h = seed, k;
+
+	for (i = 0; i < nblocks; ++i) {
+		const guchar* b = data + i * 4;
+		k = b[0] | (b[1] << 8) | (b[2] << 16) | ((guint32)b[3] << 24);
+
+		k *= c1;
+		k = (k << 15) | (k >> 17);
+		k *= c2;
+
+		h ^= k;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	const guchar* tail = data + nblocks * 4;
+	k = 0;
+	switch (len & 3) {
+	case 3: k ^= tail[2] << 16;
+	case 2: k ^= tail[1] << 8;
+	case 1: k ^= tail[0];
+		k *= c1;
+		k = (k << 15) | (k >> 17);
+		k *= c2;
+		h ^= k;
+	}
+
+	h ^= len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static guint shard_mod(db_table_t* dt, GString* value) {
+	return atoi(value->str) % dt->table_num;
+}
+
+static guint shard_crc32(db_table_t* dt, GString* value) {
+	guint32 crc = 0xFFFFFFFF;
+	gsize i;
+
+	for (i = 0; i < value->len; ++i) {
+		crc = (crc >> 8) ^ crc32tab[(crc ^ (guchar)value->str[i]) & 0xFF];
+	}
+
+	return (crc ^ 0xFFFFFFFF) % dt->table_num;
+}
+
+static guint shard_murmur(db_table_t* dt, GString* value) {
+	return shard_murmur3(S(value), 0) % dt->table_num;
+}
+
+/**
+ * consistent hashing: the value goes to the first point of the ring at or after its hash,
+ * a new sub-table only takes over the values next to its own points
+ */
+static guint shard_ring(db_table_t* dt, GString* value) {
+	guint32 hash = shard_murmur3(S(value), 0);
+	guint lo = 0, hi = dt->ring->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+
+		if (g_array_index(dt->ring, shard_point_t, mid).hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == dt->ring->len) lo = 0; /* wrap around */
+
+	return g_array_index(dt->ring, shard_point_t, lo).table;
+}
+
+static guint shard_range(db_table_t* dt, GString* value) {
+	gint64 v = g_ascii_strtoll(value->str, NULL, 10);
+	guint i;
+
+	for (i = 0; i < dt->bounds->len && v >= g_array_index(dt->bounds, gint64, i); ++i);
+
+	return i;
+}
+
+static gint shard_point_cmp(gconstpointer a, gconstpointer b) {
+	guint32 ha = ((const shard_point_t*)a)->hash;
+	guint32 hb = ((const shard_point_t*)b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/**
+ * resolve the sharding function of a table from the last part of its settings
+ *
+ *   mod                 value % table_num, the default
+ *   crc32, murmur       hash of the value % table_num, for string keys
+ *   ring                consistent hashing of the value
+ *   range:b1:b2:...     sub-table 0 holds the values below b1, 1 the ones below b2, ...
+ *
+ * @return FALSE if the method is unknown or doesn't fit table_num
+ */
+static gboolean db_table_set_shard(db_table_t* dt, const gchar* method) {
+	if (dt->table_num == 0) return FALSE;
+
+	if (method == NULL || strcasecmp(method, "mod") == 0) {
+		dt->shard = shard_mod;
+	} else if (strcasecmp(method, "crc32") == 0) {
+		dt->shard = shard_crc32;
+	} else if (strcasecmp(method, "murmur") == 0) {
+		dt->shard = shard_murmur;
+	} else if (strcasecmp(method, "ring") == 0) {
+		guint t, r;
+
+		dt->ring = g_array_sized_new(FALSE, FALSE, sizeof(shard_point_t), dt->table_num * SHARD_RING_POINTS);
+		for (t = 0; t < dt->table_num; ++t) {
+			for (r = 0; r < SHARD_RING_POINTS; ++r) {
+				gchar name[32];
+				shard_point_t point;
+
+				gint len = g_snprintf(name, sizeof(name), "%u-%u", t, r);
+				point.hash = shard_murmur3(name, len, 0);
+				point.table = t;
+				g_array_append_val(dt->ring, point);
+			}
+		}
+		g_array_sort(dt->ring, shard_point_cmp);
+
+		dt->shard = shard_ring;
+	} else if (strncasecmp(method, "range:", 6) == 0) {
+		gchar** bounds = g_strsplit(method + 6, ":", -1);
+		gboolean is_valid = TRUE;
+		guint i;
+
+		dt->bounds = g_array_new(FALSE, FALSE, sizeof(gint64));
+		for (i = 0; bounds[i]; ++i) {
+			gchar* end = NULL;
+			gint64 bound = g_ascii_strtoll(bounds[i], &end, 10);
+
+			if (end == bounds[i] || *end != '\0') is_valid = FALSE;
+			if (i > 0 && bound <= g_array_index(dt->bounds, gint64, i-1)) is_valid = FALSE;
+			g_array_append_val(dt->bounds, bound);
+		}
+		g_strfreev(bounds);
+
+		if (!is_valid || dt->bounds->len != dt->table_num - 1) return FALSE;
+
+		dt->shard = shard_range;
+	} else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void db_table_free(gpointer data) {
+	db_table_t* dt = data;
+
+	if (dt->bounds) g_array_free(dt->bounds, TRUE);
+	if (dt->ring) g_array_free(dt->ring, TRUE);
+
+	if (dt->clusters) {
+		guint i;
+		for (i = 0; i < dt->table_num; ++i) g_free(dt->clusters[i]);
+		g_free(dt->clusters);
+	}
+
+	g_free(dt);
+}
+
 guint get_table_index(GPtrArray* tokens, gint* d, gint* t) {
 	*d = *t = -1;
 
@@ -321,6 +566,43 @@ guint get_table_index(GPtrArray* tokens, gint* d, gint* t) {
 	return 0;
 }
 
+/**
+ * the ( of the first row of a INSERT ... VALUES
+ *
+ * @return its token index or -1
+ */
+static gint get_values_index(GPtrArray* tokens, gint start) {
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	gint len = tokens->len;
+	gint i;
+
+	for (i = start; i < len-1; ++i) {
+		gchar* str = ts[i]->text->str;
+		if ((strcasecmp(str, "VALUES") == 0 || strcasecmp(str, "VALUE") == 0) && ts[i+1]->token_id == TK_OBRACE) return i+1;
+	}
+
+	return -1;
+}
+
+/**
+ * the ) which closes the row starting at the ( at token index row
+ */
+static gint get_row_end(GPtrArray* tokens, gint row) {
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	gint len = tokens->len;
+	gint i, depth = 0;
+
+	for (i = row; i < len; ++i) {
+		if (ts[i]->token_id == TK_OBRACE) {
+			++depth;
+		} else if (ts[i]->token_id == TK_CBRACE && --depth == 0) {
+			break;
+		}
+	}
+
+	return i;
+}
+
 GArray* get_column_index(GPtrArray* tokens, gchar* table_name, gchar* column_name, guint sql_type, gint start) {
 	GArray* columns = g_array_new(FALSE, FALSE, sizeof(guint));
 
@@ -388,12 +670,13 @@ GArray* get_column_index(GPtrArray* tokens, gchar* table_name, gchar* column_nam
 				}
 			}
 		} else {
-			k = 2;
+			guint pos = 0; /* place of the column in the rows */
 			if (token_id == TK_OBRACE) {
 				gint found = -1;
 				for (j = start+1; j < len; ++j) {
 					token_id = ts[j]->token_id;
 					if (token_id == TK_CBRACE) break;
+					if (token_id == TK_COMMA) ++pos;
 					if (token_id == TK_LITERAL && strcasecmp(ts[j]->text->str, column_name) == 0) {
 						if (ts[j-1]->token_id != TK_DOT || strcasecmp(ts[j-2]->text->str, table_name) == 0) {
 							found = j;
@@ -401,16 +684,34 @@ GArray* get_column_index(GPtrArray* tokens, gchar* table_name, gchar* column_nam
 						}
 					}
 				}
-				k = found - start + 1;
+				if (found == -1) return columns;
 			}
 
-			for (i = start; i < len-1; ++i) {
-				gchar* str = ts[i]->text->str;
-				if ((strcasecmp(str, "VALUES") == 0 || strcasecmp(str, "VALUE") == 0) && ts[i+1]->token_id == TK_OBRACE) {
-					k += i;
-					if (k < len) g_array_append_val(columns, k);
+			/* the value of the column in every row of the VALUES list */
+			gint row = get_values_index(tokens, start);
+			while (row != -1) {
+				gint end = get_row_end(tokens, row);
+				guint depth = 0, n = 0;
+
+				for (k = row+1; (gint)k < end; ++k) {
+					token_id = ts[k]->token_id;
+					if (depth == 0 && n == pos) break;
+
+					if (token_id == TK_OBRACE) {
+						++depth;
+					} else if (token_id == TK_CBRACE) {
+						--depth;
+					} else if (token_id == TK_COMMA && depth == 0) {
+						++n;
+					}
+				}
+				if ((gint)k >= end) {
+					g_array_set_size(columns, 0);
 					break;
 				}
+				g_array_append_val(columns, k);
+
+				row = (end+2 < (gint)len && ts[end+1]->token_id == TK_COMMA && ts[end+2]->token_id == TK_OBRACE) ? end+2 : -1;
 			}
 		}
 	}
@@ -418,7 +719,311 @@ GArray* get_column_index(GPtrArray* tokens, gchar* table_name, gchar* column_nam
 	return columns;
 }
 
-GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, guint num) {
+/**
+ * find the LIMIT of a query: LIMIT count, LIMIT offset, count or LIMIT count OFFSET offset
+ *
+ * @return the token index of the count or -1, *offset is set to the token index of the offset or -1
+ */
+static gint get_limit_index(GPtrArray* tokens, gint* offset) {
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	gint len = tokens->len;
+	gint i;
+
+	*offset = -1;
+
+	for (i = len-2; i >= 0; --i) {
+		if (ts[i]->token_id != TK_SQL_LIMIT || ts[i+1]->token_id != TK_INTEGER) continue;
+
+		if (i+3 < len && ts[i+3]->token_id == TK_INTEGER) {
+			if (ts[i+2]->token_id == TK_COMMA) {
+				*offset = i+1;
+				return i+3;
+			}
+			if (ts[i+2]->token_id == TK_LITERAL && strcasecmp(ts[i+2]->text->str, "OFFSET") == 0) {
+				*offset = i+3;
+				return i+1;
+			}
+		}
+
+		return i+1;
+	}
+
+	return -1;
+}
+
+/**
+ * the aggregate function at token i
+ *
+ * @return MERGE_AGG_GROUP if it isn't COUNT, SUM, MIN, MAX or AVG
+ */
+static merge_agg_type_t get_agg_type(sql_token** ts, gint i, gint len) {
+	static const struct {
+		const gchar* name;
+		merge_agg_type_t type;
+	} funcs[] = {
+		{ "COUNT", MERGE_AGG_COUNT },
+		{ "SUM",   MERGE_AGG_SUM },
+		{ "MIN",   MERGE_AGG_MIN },
+		{ "MAX",   MERGE_AGG_MAX },
+		{ "AVG",   MERGE_AGG_AVG }
+	};
+	guint f;
+
+	if (ts[i]->token_id != TK_FUNCTION && ts[i]->token_id != TK_LITERAL) return MERGE_AGG_GROUP;
+	if (i+1 >= len || ts[i+1]->token_id != TK_OBRACE) return MERGE_AGG_GROUP;
+
+	for (f = 0; f < G_N_ELEMENTS(funcs); ++f) {
+		if (strcasecmp(ts[i]->text->str, funcs[f].name) == 0) return funcs[f].type;
+	}
+
+	return MERGE_AGG_GROUP;
+}
+
+/**
+ * the columns of a SELECT with COUNT, SUM, MIN, MAX or AVG, one merge_agg_t each
+ *
+ * a column is part of the group if the GROUP BY names it, by name, alias or position. aggs stays
+ * empty if the rows of the tables can't be merged: aggregates in expressions or with DISTINCT,
+ * a GROUP BY on expressions, a HAVING, or a LIMIT next to a GROUP BY which cuts off groups on each table
+ *
+ * without a ORDER BY MySQL sorts on the GROUP BY, its columns are added to order_by then
+ *
+ * @return TRUE if the query has aggregates to merge
+ */
+static gboolean get_aggregates(GPtrArray* tokens, GArray* aggs, GPtrArray* order_by) {
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	gint len = tokens->len;
+	gint i, item, depth = 0;
+	gboolean has_agg = FALSE, has_order = FALSE;
+	GPtrArray* names = g_ptr_array_new();     /* alias of each column, NULL if there is none */
+	GPtrArray* columns = g_ptr_array_new();   /* column name of each column, NULL for expressions */
+	GPtrArray* group_by = NULL;
+	merge_agg_t agg;
+
+	g_array_set_size(aggs, 0);
+
+	for (i = 1; i < len && ts[i]->token_id != TK_SQL_SELECT; ++i);
+	if (i+1 >= len || ts[i+1]->token_id == TK_SQL_DISTINCT) goto unsupported;
+
+	agg.type = MERGE_AGG_GROUP;
+	agg.start = agg.end = -1;
+
+	for (item = ++i; i < len; ++i) {
+		sql_token_id token_id = ts[i]->token_id;
+
+		if (token_id == TK_OBRACE) {
+			++depth;
+		} else if (token_id == TK_CBRACE) {
+			--depth;
+		} else if (depth == 0 && (token_id == TK_COMMA || token_id == TK_SQL_FROM)) {
+			/* select_expr [[AS] alias] */
+			gint end = i;
+			const gchar* name = NULL;
+			const gchar* column = NULL;
+
+			if (i - item >= 2 && ts[i-1]->token_id == TK_LITERAL) {
+				sql_token_id prev = ts[i-2]->token_id;
+				if (prev == TK_SQL_AS) {
+					end = i-2;
+				} else if (prev == TK_LITERAL || prev == TK_CBRACE) {
+					end = i-1;
+				}
+				if (end != i) name = ts[i-1]->text->str;
+			}
+
+			/* column, table.column or db.table.column */
+			if (end > item && ts[end-1]->token_id == TK_LITERAL && (end - item) % 2 == 1) {
+				gint k;
+				for (k = item+1; k < end && ts[k]->token_id == ((k - item) % 2 ? TK_DOT : TK_LITERAL); ++k);
+				if (k == end) column = ts[end-1]->text->str;
+			}
+
+			g_array_append_val(aggs, agg);
+			g_ptr_array_add(names, (gpointer)name);
+			g_ptr_array_add(columns, (gpointer)column);
+			if (token_id == TK_SQL_FROM) break;
+
+			agg.type = MERGE_AGG_GROUP;
+			agg.start = agg.end = -1;
+			item = i+1;
+		} else if (get_agg_type(ts, i, len) != MERGE_AGG_GROUP) {
+			gint k, brace = 0;
+
+			if (i != item || (i+2 < len && ts[i+2]->token_id == TK_SQL_DISTINCT)) goto unsupported;
+
+			for (k = i+1; k < len; ++k) {
+				if (ts[k]->token_id == TK_OBRACE) {
+					++brace;
+				} else if (ts[k]->token_id == TK_CBRACE && --brace == 0) {
+					break;
+				}
+			}
+			if (k >= len) goto unsupported;
+
+			agg.type = get_agg_type(ts, i, len);
+			agg.start = i;
+			agg.end = k;
+
+			/* nothing but a alias may follow the function */
+			if (++k < len && ts[k]->token_id == TK_SQL_AS) ++k;
+			if (k < len && ts[k]->token_id == TK_LITERAL) ++k;
+			if (k >= len || (ts[k]->token_id != TK_COMMA && ts[k]->token_id != TK_SQL_FROM)) goto unsupported;
+
+			has_agg = TRUE;
+			i = agg.end;
+		}
+	}
+	if (i >= len || !has_agg) goto unsupported;
+
+	for (depth = 0; i < len; ++i) {
+		sql_token_id token_id = ts[i]->token_id;
+
+		if (token_id == TK_OBRACE) {
+			++depth;
+		} else if (token_id == TK_CBRACE) {
+			--depth;
+		} else if (depth > 0) {
+			continue;
+		} else if (token_id == TK_SQL_HAVING || (token_id == TK_SQL_LIMIT && group_by != NULL)) {
+			goto unsupported;
+		} else if (token_id == TK_SQL_ORDER) {
+			has_order = TRUE;
+		} else if (token_id == TK_SQL_GROUP && i+1 < len && ts[i+1]->token_id == TK_SQL_BY && group_by == NULL) {
+			group_by = g_ptr_array_new();
+
+			for (i += 2; i < len; i += 2) {
+				guint column = aggs->len;
+
+				if (ts[i]->token_id == TK_INTEGER) {
+					column = atoi(ts[i]->text->str) - 1;
+				} else if (ts[i]->token_id == TK_LITERAL) {
+					while (i+2 < len && ts[i+1]->token_id == TK_DOT && ts[i+2]->token_id == TK_LITERAL) i += 2;
+
+					for (column = 0; column < aggs->len; ++column) {
+						const gchar* name = g_ptr_array_index(names, column);
+						if (name && strcasecmp(name, ts[i]->text->str) == 0) break;
+					}
+					if (column == aggs->len) {
+						for (column = 0; column < aggs->len; ++column) {
+							const gchar* name = g_ptr_array_index(columns, column);
+							if (name && strcasecmp(name, ts[i]->text->str) == 0) break;
+						}
+					}
+				}
+
+				/* the groups have to be in the result, GROUP BY col DESC isn't merged */
+				if (column >= aggs->len || g_array_index(aggs, merge_agg_t, column).type != MERGE_AGG_GROUP) goto unsupported;
+				g_ptr_array_add(group_by, GUINT_TO_POINTER(column));
+
+				if (i+1 < len && ts[i+1]->token_id == TK_SQL_ASC) ++i;
+				if (i+1 >= len || ts[i+1]->token_id != TK_COMMA) break;
+			}
+			if (i+1 < len && ts[i+1]->token_id != TK_SQL_ORDER && ts[i+1]->token_id != TK_SQL_LIMIT &&
+					ts[i+1]->token_id != TK_SQL_HAVING && ts[i+1]->token_id != TK_SEMICOLON) goto unsupported;
+		}
+	}
+
+	/* the other columns are in the group by chance, MySQL picks any of their values */
+	for (i = 0; i < (gint)aggs->len; ++i) {
+		merge_agg_t* column = &g_array_index(aggs, merge_agg_t, i);
+		if (column->type == MERGE_AGG_GROUP) column->type = MERGE_AGG_FIRST;
+	}
+
+	if (group_by) {
+		for (i = 0; i < (gint)group_by->len; ++i) {
+			guint column = GPOINTER_TO_UINT(g_ptr_array_index(group_by, i));
+			g_array_index(aggs, merge_agg_t, column).type = MERGE_AGG_GROUP;
+
+			if (order_by && !has_order) {
+				merge_order_t* order = g_new0(merge_order_t, 1);
+				order->pos = column + 1;
+				g_ptr_array_add(order_by, order);
+			}
+		}
+		g_ptr_array_free(group_by, TRUE);
+	}
+
+	g_ptr_array_free(names, TRUE);
+	g_ptr_array_free(columns, TRUE);
+	return TRUE;
+
+unsupported:
+	g_array_set_size(aggs, 0);
+	if (group_by) g_ptr_array_free(group_by, TRUE);
+	g_ptr_array_free(names, TRUE);
+	g_ptr_array_free(columns, TRUE);
+	return FALSE;
+}
+
+/**
+ * quote a string token again
+ *
+ * the tokenizer keeps backslash escapes as they are, but turns a doubled quote into one and keeps the
+ * other quote of a "..." string bare: 'it''s' and "O'Brien" come as it's and O'Brien. These quotes are doubled.
+ */
+static void sql_append_string(GString* sql, GString* text) {
+	gsize i;
+
+	g_string_append_c(sql, '\'');
+	for (i = 0; i < text->len; ++i) {
+		gchar c = text->str[i];
+
+		if (c == '\\' && i + 1 < text->len) {
+			g_string_append_len(sql, text->str + i, 2);
+			++i;
+		} else if (c == '\'') {
+			g_string_append_len(sql, C("''"));
+		} else {
+			g_string_append_c(sql, c);
+		}
+	}
+	g_string_append_c(sql, '\'');
+}
+
+static void sql_append_token(GString* sql, sql_token* token) {
+	if (token->token_id != TK_OBRACE) g_string_append_c(sql, ' ');
+
+	if (token->token_id == TK_STRING) {
+		sql_append_string(sql, token->text);
+	} else if (token->token_id == TK_COMMENT) {
+		g_string_append_printf(sql, "/*%s*/", token->text->str);
+	} else {
+		g_string_append(sql, token->text->str);
+	}
+}
+
+/**
+ * AVG(x) [AS a] becomes COUNT(x),SUM(x) AS a, the proxy divides the merged sums by the merged counts
+ */
+static void sql_append_avg(GString* sql, sql_token** ts, merge_agg_t* avg) {
+	gint i;
+
+	g_string_append(sql, " COUNT");
+	for (i = avg->start+1; i <= avg->end; ++i) sql_append_token(sql, ts[i]);
+
+	g_string_append(sql, ",SUM");
+	for (i = avg->start+1; i <= avg->end; ++i) sql_append_token(sql, ts[i]);
+
+	if (ts[avg->end+1]->token_id != TK_COMMA && ts[avg->end+1]->token_id != TK_SQL_FROM) return;
+
+	/* keep the column name MySQL would give it */
+	g_string_append(sql, " AS `");
+	for (i = avg->start; i <= avg->end; ++i) {
+		const gchar* c;
+		for (c = ts[i]->text->str; *c; ++c) {
+			if (*c == '`') g_string_append_c(sql, '`');
+			g_string_append_c(sql, *c);
+		}
+	}
+	g_string_append_c(sql, '`');
+}
+
+/**
+ * the sub-queries of a query on a sharded table
+ *
+ * clusters gets the cluster of the sub-table of each sub-query, NULL if table-clusters doesn't map it
+ */
+GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, db_table_t* dt, GPtrArray* clusters) {
 	GPtrArray* sqls = g_ptr_array_new();
 
 	sql_token** ts = (sql_token**)(tokens->pdata);
@@ -426,6 +1031,7 @@ GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, guint num
 	guint i;
 
 	if (columns->len == 1) {
+		guint shard = dt->shard(dt, ts[g_array_index(columns, guint, 0)]->text);
 		GString* sql = g_string_new(&op);
 
 		if (ts[1]->token_id == TK_COMMENT) {
@@ -440,7 +1046,7 @@ GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, guint num
 			if (token_id != TK_OBRACE) g_string_append_c(sql, ' '); 
 
 			if (i == table) {
-				g_string_append_printf(sql, "%s_%u", ts[i]->text->str, atoi(ts[g_array_index(columns, guint, 0)]->text->str) % num);
+				g_string_append_printf(sql, "%s_%u", ts[i]->text->str, shard);
 			} else if (token_id == TK_STRING) {
 				g_string_append_printf(sql, "'%s'", ts[i]->text->str);
 			} else if (token_id == TK_COMMENT) {
@@ -451,28 +1057,48 @@ GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, guint num
 		}
 
 		g_ptr_array_add(sqls, sql);
+		g_ptr_array_add(clusters, dt->clusters ? dt->clusters[shard] : NULL);
 	} else {
+		guint num = dt->table_num;
 		GArray* mt[num];
 		for (i = 0; i < num; ++i) mt[i] = g_array_new(FALSE, FALSE, sizeof(guint));
 
+		/* the token index of each value, grouped by sub-table */
 		guint clen = columns->len;
 		for (i = 0; i < clen; ++i) {
-			guint column_value = atoi(ts[g_array_index(columns, guint, i)]->text->str);
-			g_array_append_val(mt[column_value%num], column_value);
+			guint column = g_array_index(columns, guint, i);
+			g_array_append_val(mt[dt->shard(dt, ts[column]->text)], column);
 		}
 
 		guint property_index   = g_array_index(columns, guint, 0) - 3;
 		guint start_skip_index = property_index + 1;
 		guint end_skip_index   = property_index + (clen + 1) * 2;
 
+		/* the proxy skips the offset rows of the merged result, every table has to return offset + count rows */
+		guint shards = 0;
+		for (i = 0; i < num; ++i) {
+			if (mt[i]->len > 0) ++shards;
+		}
+		gint limit_offset = -1;
+		gint limit_count = shards > 1 ? get_limit_index(tokens, &limit_offset) : -1;
+
+		GArray* aggs = g_array_new(FALSE, FALSE, sizeof(merge_agg_t));
+		if (shards > 1) get_aggregates(tokens, aggs, NULL);
+
 		guint m;
 		for (m = 0; m < num; ++m) {
 			if (mt[m]->len > 0) {
 				GString* tmp = g_string_new(" IN(");
-				g_string_append_printf(tmp, "%u", g_array_index(mt[m], guint, 0));
 				guint k;
-				for (k = 1; k < mt[m]->len; ++k) {
-					g_string_append_printf(tmp, ",%u", g_array_index(mt[m], guint, k));
+				for (k = 0; k < mt[m]->len; ++k) {
+					sql_token* value = ts[g_array_index(mt[m], guint, k)];
+
+					if (k > 0) g_string_append_c(tmp, ',');
+					if (value->token_id == TK_STRING) {
+						g_string_append_printf(tmp, "'%s'", value->text->str);
+					} else {
+						g_string_append(tmp, value->text->str);
+					}
 				}
 				g_string_append_c(tmp, ')');
 
@@ -484,12 +1110,27 @@ GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, guint num
 				}
 				for (i = 2; i < len; ++i) {
 					if (i < start_skip_index || i > end_skip_index) {
+						merge_agg_t* avg = NULL;
+						for (k = 0; k < aggs->len; ++k) {
+							merge_agg_t* agg = &g_array_index(aggs, merge_agg_t, k);
+							if (agg->type == MERGE_AGG_AVG && agg->start == (gint)i) avg = agg;
+						}
+						if (avg) {
+							sql_append_avg(sql, ts, avg);
+							i = avg->end;
+							continue;
+						}
+
 						if (ts[i]->token_id != TK_OBRACE) g_string_append_c(sql, ' ');
 
 						if (i == table) {
 							g_string_append_printf(sql, "%s_%u", ts[i]->text->str, m);
 						} else if (i == property_index) {
 							g_string_append_printf(sql, "%s%s", ts[i]->text->str, tmp->str);
+						} else if (limit_offset != -1 && i == limit_offset) {
+							g_string_append_c(sql, '0');
+						} else if (limit_offset != -1 && i == limit_count) {
+							g_string_append_printf(sql, "%d", atoi(ts[limit_offset]->text->str) + atoi(ts[limit_count]->text->str));
 						} else if (ts[i]->token_id == TK_STRING) {
 							g_string_append_printf(sql, "'%s'", ts[i]->text->str);
 						} else if (ts[i]->token_id == TK_COMMENT) {
@@ -502,68 +1143,307 @@ GPtrArray* combine_sql(GPtrArray* tokens, gint table, GArray* columns, guint num
 				g_string_free(tmp, TRUE);
 
 				g_ptr_array_add(sqls, sql);
+				g_ptr_array_add(clusters, dt->clusters ? dt->clusters[m] : NULL);
 			}
 
 			g_array_free(mt[m], TRUE);
 		}
+
+		g_array_free(aggs, TRUE);
 	}
 
 	return sqls;
 }
 
-GPtrArray* sql_parse(network_mysqld_con* con, GPtrArray* tokens) {
-	//1. ͱ
-	gint db, table;
-	guint sql_type = get_table_index(tokens, &db, &table);
-	if (table == -1) return NULL;
+/**
+ * split a multi-row INSERT into one INSERT per sub-table, each with the rows which belong there
+ *
+ * columns has the token index of the sharding value of each row, in the order of the rows
+ */
+GPtrArray* combine_insert_sql(GPtrArray* tokens, gint table, GArray* columns, db_table_t* dt, GPtrArray* clusters) {
+	GPtrArray* sqls = g_ptr_array_new();
 
-	//2. 
-	gchar* table_name = NULL;
-	if (db == -1) {
-		table_name = g_strdup_printf("%s.%s", con->client->default_db->str, ((sql_token*)tokens->pdata[table])->text->str);
-	} else {
-		table_name = g_strdup_printf("%s.%s", ((sql_token*)tokens->pdata[db])->text->str, ((sql_token*)tokens->pdata[table])->text->str);
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	guint len = tokens->len;
+	guint num = dt->table_num;
+	guint clen = columns->len;
+	gint i, row;
+	guint m, r;
+
+	/* the first and the last token of each row */
+	gint first_row = get_values_index(tokens, table+1);
+	gint* rows = g_new0(gint, clen * 2);
+	for (r = 0, row = first_row; r < clen; ++r) {
+		rows[2*r] = row;
+		rows[2*r+1] = get_row_end(tokens, row);
+		row = rows[2*r+1] + 2;
 	}
+	guint tail = rows[2*clen-1] + 1;
 
-	db_table_t* dt = g_hash_table_lookup(config->dt_table, table_name);
-	if (dt == NULL) {
-		g_free(table_name);
-		return NULL;
-	}
+	GArray* mt[num];
+	for (m = 0; m < num; ++m) mt[m] = g_array_new(FALSE, FALSE, sizeof(guint));
 
-	GArray* columns = get_column_index(tokens, table_name, dt->column_name, sql_type, table+1);
-	g_free(table_name);
-	if (columns->len == 0) {
-		g_array_free(columns, TRUE);
-		return NULL;
+	for (r = 0; r < clen; ++r) {
+		g_array_append_val(mt[dt->shard(dt, ts[g_array_index(columns, guint, r)]->text)], r);
 	}
 
-	//3. ƴSQL
-	GPtrArray* sqls = combine_sql(tokens, table, columns, dt->table_num);
-	g_array_free(columns, TRUE);
-	return sqls;
-}
+	for (m = 0; m < num; ++m) {
+		if (mt[m]->len > 0) {
+			GString* sql = g_string_new(&op);
+			if (ts[1]->token_id == TK_COMMENT) {
+				g_string_append_printf(sql, "/*%s*/", ts[1]->text->str);
+			} else {
+				g_string_append(sql, ts[1]->text->str);
+			}
 
-int idle_rw(network_mysqld_con* con) {
-	int ret = -1;
-	guint i;
+			for (i = 2; i < first_row; ++i) {
+				if (i == table) {
+					g_string_append_printf(sql, " %s_%u", ts[i]->text->str, m);
+				} else {
+					sql_append_token(sql, ts[i]);
+				}
+			}
 
-	network_backends_t* backends = con->srv->backends;
+			for (r = 0; r < mt[m]->len; ++r) {
+				guint n = g_array_index(mt[m], guint, r);
 
-	guint count = network_backends_count(backends);
-	for (i = 0; i < count; ++i) {
-		network_backend_t* backend = network_backends_get(backends, i);
-		if (backend == NULL) continue;
+				if (r > 0) g_string_append_c(sql, ',');
+				for (i = rows[2*n]; i <= rows[2*n+1]; ++i) sql_append_token(sql, ts[i]);
+			}
 
-		if (chassis_event_thread_pool(backend) == NULL) continue;
+			for (i = tail; i < (gint)len; ++i) sql_append_token(sql, ts[i]); /* ON DUPLICATE KEY UPDATE */
 
-		if (backend->type == BACKEND_TYPE_RW && backend->state == BACKEND_STATE_UP) {
-			ret = i;
-			break;
+			g_ptr_array_add(sqls, sql);
+			g_ptr_array_add(clusters, dt->clusters ? dt->clusters[m] : NULL);
 		}
+
+		g_array_free(mt[m], TRUE);
 	}
 
-	return ret;
+	g_free(rows);
+
+	return sqls;
+}
+
+/**
+ * find the sharded table of the query
+ *
+ * @return the sharded table or NULL if the query doesn't touch one
+ */
+static db_table_t* get_db_table(network_mysqld_con* con, GPtrArray* tokens, guint* sql_type, gint* table, gchar** table_name) {
+	//1. ͱ
+	gint db;
+	*sql_type = get_table_index(tokens, &db, table);
+	if (*table == -1) return NULL;
+
+	//2. 
+	gchar* name = NULL;
+	if (db == -1) {
+		name = g_strdup_printf("%s.%s", con->client->default_db->str, ((sql_token*)tokens->pdata[*table])->text->str);
+	} else {
+		name = g_strdup_printf("%s.%s", ((sql_token*)tokens->pdata[db])->text->str, ((sql_token*)tokens->pdata[*table])->text->str);
+	}
+
+	db_table_t* dt = g_hash_table_lookup(config->dt_table, name);
+	if (dt == NULL || table_name == NULL) {
+		g_free(name);
+	} else {
+		*table_name = name;
+	}
+
+	return dt;
+}
+
+GPtrArray* sql_parse(network_mysqld_con* con, GPtrArray* tokens, GPtrArray* clusters) {
+	guint sql_type;
+	gint table;
+	gchar* table_name = NULL;
+
+	db_table_t* dt = get_db_table(con, tokens, &sql_type, &table, &table_name);
+	if (dt == NULL) return NULL;
+
+	GArray* columns = get_column_index(tokens, table_name, dt->column_name, sql_type, table+1);
+	g_free(table_name);
+	if (columns->len == 0) {
+		g_array_free(columns, TRUE);
+		return NULL;
+	}
+
+	//3. ƴSQL
+	GPtrArray* sqls = NULL;
+	if (sql_type == 3 && columns->len > 1) {
+		sqls = combine_insert_sql(tokens, table, columns, dt, clusters);
+	} else {
+		sqls = combine_sql(tokens, table, columns, dt, clusters);
+	}
+	g_array_free(columns, TRUE);
+	return sqls;
+}
+
+/**
+ * circuit breaker of a backend
+ *
+ * CLOSED:    results are counted per window, if more than breaker-threshold percent of them
+ *            are backend-side errors or timeouts the breaker opens
+ * OPEN:      the backend gets no traffic for breaker-cooldown seconds
+ * HALF_OPEN: one probe query per cooldown passes, its result closes or re-opens the breaker
+ *
+ * all fields are shared between the event-threads and only touched with atomic operations
+ */
+static gboolean breaker_allow(network_backend_t *backend) {
+	if (config->breaker_threshold == 0) return TRUE;
+
+	gint state = g_atomic_int_get(&backend->breaker_state);
+	if (state == BACKEND_BREAKER_CLOSED) return TRUE;
+
+	gint now = time(NULL);
+	gint since = g_atomic_int_get(&backend->breaker_since);
+	if (now - since < config->breaker_cooldown) return FALSE;
+
+	/* only one thread wins the probe */
+	if (!g_atomic_int_compare_and_exchange(&backend->breaker_since, since, now)) return FALSE;
+	g_atomic_int_compare_and_exchange(&backend->breaker_state, BACKEND_BREAKER_OPEN, BACKEND_BREAKER_HALF_OPEN);
+
+	return TRUE;
+}
+
+/**
+ * the query breaker_allow() let through didn't get a connection to the backend, let the next one probe it
+ */
+static void breaker_give_back(network_backend_t *backend) {
+	if (config->breaker_threshold == 0 || backend == NULL) return;
+
+	if (g_atomic_int_get(&backend->breaker_state) == BACKEND_BREAKER_HALF_OPEN) {
+		g_atomic_int_set(&backend->breaker_since, time(NULL) - config->breaker_cooldown);
+	}
+}
+
+/**
+ * count the latency of a result in the histogram of its backend, see SELECT * FROM backend_latency
+ */
+static void backend_latency_record(network_backend_t *backend, injection *inj) {
+	if (backend == NULL) return;
+
+	histogram_record(&(backend->query_latency[chassis_event_thread_index()]), inj->ts_read_query_result_last - inj->ts_read_query);
+}
+
+static void breaker_record(network_backend_t *backend, gboolean is_error, gboolean is_timeout) {
+	if (config->breaker_threshold == 0 || backend == NULL) return;
+
+	gint now = time(NULL);
+	gint window = g_atomic_int_get(&backend->breaker_window);
+	if (now - window >= config->breaker_window && g_atomic_int_compare_and_exchange(&backend->breaker_window, window, now)) {
+		g_atomic_int_set(&backend->breaker_requests, 0);
+		g_atomic_int_set(&backend->breaker_errors, 0);
+		g_atomic_int_set(&backend->breaker_timeouts, 0);
+	}
+
+	g_atomic_int_inc(&backend->breaker_requests);
+	if (is_error) g_atomic_int_inc(&backend->breaker_errors);
+	if (is_timeout) g_atomic_int_inc(&backend->breaker_timeouts);
+
+	gint state = g_atomic_int_get(&backend->breaker_state);
+	if (state == BACKEND_BREAKER_HALF_OPEN) {
+		if (is_error || is_timeout) {
+			if (g_atomic_int_compare_and_exchange(&backend->breaker_state, BACKEND_BREAKER_HALF_OPEN, BACKEND_BREAKER_OPEN)) {
+				g_atomic_int_set(&backend->breaker_since, now);
+				g_warning("%s: probe to %s failed, circuit breaker stays open", G_STRLOC, backend->addr->name->str);
+			}
+		} else if (g_atomic_int_compare_and_exchange(&backend->breaker_state, BACKEND_BREAKER_HALF_OPEN, BACKEND_BREAKER_CLOSED)) {
+			g_atomic_int_set(&backend->breaker_window, now);
+			g_atomic_int_set(&backend->breaker_requests, 0);
+			g_atomic_int_set(&backend->breaker_errors, 0);
+			g_atomic_int_set(&backend->breaker_timeouts, 0);
+			g_message("%s: probe to %s succeeded, circuit breaker closed", G_STRLOC, backend->addr->name->str);
+		}
+	} else if (state == BACKEND_BREAKER_CLOSED && (is_error || is_timeout)) {
+		gint requests = g_atomic_int_get(&backend->breaker_requests);
+		gint failed = g_atomic_int_get(&backend->breaker_errors) + g_atomic_int_get(&backend->breaker_timeouts);
+
+		if (requests >= config->breaker_min_requests && failed * 100 >= requests * config->breaker_threshold &&
+				g_atomic_int_compare_and_exchange(&backend->breaker_state, BACKEND_BREAKER_CLOSED, BACKEND_BREAKER_OPEN)) {
+			g_atomic_int_set(&backend->breaker_since, now);
+			g_critical("%s: %d of %d queries to %s failed, circuit breaker opened", G_STRLOC, failed, requests, backend->addr->name->str);
+		}
+	}
+}
+
+/**
+ * check if the ERR packet says something about the health of the backend
+ *
+ * syntax errors, duplicate keys, ... are the client's business and don't count
+ */
+static gboolean breaker_is_backend_error(network_packet *packet) {
+	GString *s = packet->data;
+
+	if (s == NULL || s->len < NET_HEADER_SIZE + 3 || (guchar)s->str[NET_HEADER_SIZE] != MYSQLD_PACKET_ERR) return FALSE;
+
+	switch ((guchar)s->str[NET_HEADER_SIZE + 1] | ((guchar)s->str[NET_HEADER_SIZE + 2] << 8)) {
+	case ER_CON_COUNT_ERROR:
+	case ER_OUT_OF_RESOURCES:
+	case ER_OUTOFMEMORY:
+	case ER_DISK_FULL:
+	case ER_SERVER_SHUTDOWN:
+	case ER_NET_READ_ERROR:
+	case ER_NET_READ_INTERRUPTED:
+	case ER_NET_ERROR_ON_WRITE:
+	case ER_NET_WRITE_INTERRUPTED:
+	case ER_TOO_MANY_USER_CONNECTIONS:
+	case ER_LOCK_WAIT_TIMEOUT:
+	case ER_QUERY_INTERRUPTED:
+	case ER_OPTION_PREVENTS_STATEMENT:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * the databases of cluster-dbs are served by the backends of their cluster only
+ */
+static gboolean backend_in_cluster(network_backend_t *backend, const gchar *cluster) {
+	if (cluster == NULL) return backend->cluster == NULL;
+	return backend->cluster != NULL && strcmp(backend->cluster, cluster) == 0;
+}
+
+/**
+ * check that a cluster has at least one backend
+ */
+static gboolean backends_have_cluster(network_backends_t *backends, const gchar *cluster) {
+	guint i, count = network_backends_count(backends);
+
+	for (i = 0; i < count; ++i) {
+		network_backend_t *backend = network_backends_get(backends, i);
+		if (backend != NULL && backend_in_cluster(backend, cluster)) return TRUE;
+	}
+
+	return FALSE;
+}
+
+int idle_rw(network_mysqld_con* con) {
+	int ret = -1, fallback = -1;
+	guint i;
+
+	network_backends_t* backends = con->srv->backends;
+
+	guint count = network_backends_count(backends);
+	for (i = 0; i < count; ++i) {
+		network_backend_t* backend = network_backends_get(backends, i);
+		if (backend == NULL) continue;
+
+		if (chassis_event_thread_pool(backend) == NULL) continue;
+
+		if (backend->type == BACKEND_TYPE_RW && backend->state == BACKEND_STATE_UP && backend_in_cluster(backend, con->cluster)) {
+			if (breaker_allow(backend)) {
+				ret = i;
+				break;
+			}
+			if (fallback == -1) fallback = i;
+		}
+	}
+
+	/* writes have nowhere else to go, an open breaker only moves them to another master */
+	return ret != -1 ? ret : fallback;
 }
 
 int idle_ro(network_mysqld_con* con) {
@@ -579,7 +1459,7 @@ int idle_ro(network_mysqld_con* con) {
 
 		if (chassis_event_thread_pool(backend) == NULL) continue;
 
-		if (backend->type == BACKEND_TYPE_RO && backend->state == BACKEND_STATE_UP) {
+		if (backend->type == BACKEND_TYPE_RO && backend->state == BACKEND_STATE_UP && backend_in_cluster(backend, con->cluster)) {
 			if (max_conns == -1 || backend->connected_clients < max_conns) {
 				max_conns = backend->connected_clients;
 			}
@@ -589,18 +1469,25 @@ int idle_ro(network_mysqld_con* con) {
 	return max_conns;
 }
 
-int wrr_ro(network_mysqld_con *con) {
+/**
+ * tagged slaves are reserved for the GROUP:tag hint, untagged ones for all other reads
+ */
+static gboolean backend_in_group(network_backend_t *backend, const gchar *tag) {
+	if (tag == NULL) return backend->tag == NULL;
+	return backend->tag != NULL && strcmp(backend->tag, tag) == 0;
+}
+
+static int wrr_ro_group(network_mysqld_con *con, g_wrr_poll *rwsplit, const gchar *tag) {
 	guint i;
 
 	network_backends_t* backends = con->srv->backends;
-	g_wrr_poll* rwsplit = backends->global_wrr;
 	guint ndx_num = network_backends_count(backends);
 
 	// set max weight if no init
 	if (rwsplit->max_weight == 0) {
 		for(i = 0; i < ndx_num; ++i) {
 			network_backend_t* backend = network_backends_get(backends, i);
-			if (backend == NULL) continue;
+			if (backend == NULL || backend->type != BACKEND_TYPE_RO || !backend_in_group(backend, tag) || !backend_in_cluster(backend, con->cluster)) continue;
 			if (rwsplit->max_weight < backend->weight) {
 				rwsplit->max_weight = backend->weight;
 				rwsplit->cur_weight = backend->weight;
@@ -620,7 +1507,10 @@ int wrr_ro(network_mysqld_con *con) {
 
 		if (chassis_event_thread_pool(backend) == NULL) goto next;
 
-		if (backend->type == BACKEND_TYPE_RO && backend->weight >= cur_weight && backend->state == BACKEND_STATE_UP) ndx = next_ndx;
+		if (backend->type != BACKEND_TYPE_RO || !backend_in_group(backend, tag) || !backend_in_cluster(backend, con->cluster) || backend->weight < cur_weight || backend->state != BACKEND_STATE_UP) goto next;
+
+		/* only the backend which is picked may take the probe of a half-open breaker */
+		if (breaker_allow(backend)) ndx = next_ndx;
 
 	next:
 		if (next_ndx >= ndx_num - 1) {
@@ -640,6 +1530,67 @@ int wrr_ro(network_mysqld_con *con) {
 	return ndx;
 }
 
+int wrr_ro(network_mysqld_con *con) {
+	network_backends_t *backends = con->srv->backends;
+	g_wrr_poll *rwsplit = backends->global_wrr;
+
+	if (con->cluster) {
+		g_mutex_lock(backends->backends_mutex);
+		rwsplit = g_hash_table_lookup(backends->cluster_wrr, con->cluster);
+		g_mutex_unlock(backends->backends_mutex);
+
+		if (rwsplit == NULL) return -1; /* the cluster has no slaves */
+	}
+
+	return wrr_ro_group(con, rwsplit, NULL);
+}
+
+static gboolean backend_is_usable(network_backend_t *backend) {
+	return backend->state == BACKEND_STATE_UP && chassis_event_thread_pool(backend) != NULL && breaker_allow(backend);
+}
+
+/**
+ * pick the backend a routing hint in the leading comment asks for
+ *
+ *   SLAVE:n          the n-th read-only backend of the cluster (counting from 1)
+ *   GROUP:tag        weighted round-robin over the read-only backends of the cluster tagged with #tag
+ *   BACKEND:ip:port  the backend with this address
+ *
+ * @return the backend index, -1 if there is no hint or the backend can't be used right now
+ */
+static int hint_rw_split(network_mysqld_con *con, const gchar *hint) {
+	network_backends_t *backends = con->srv->backends;
+	guint i, count = network_backends_count(backends);
+
+	if (strncasecmp(hint, C("SLAVE:")) == 0) {
+		gint n = atoi(hint + sizeof("SLAVE:") - 1);
+
+		for (i = 0; i < count && n > 0; ++i) {
+			network_backend_t *backend = network_backends_get(backends, i);
+			if (backend == NULL || backend->type != BACKEND_TYPE_RO || !backend_in_cluster(backend, con->cluster)) continue;
+			if (--n == 0) return backend_is_usable(backend) ? (int)i : -1;
+		}
+	} else if (strncasecmp(hint, C("GROUP:")) == 0) {
+		const gchar *tag = hint + sizeof("GROUP:") - 1;
+
+		g_mutex_lock(backends->backends_mutex);
+		g_wrr_poll *tag_wrr = g_hash_table_lookup(backends->tag_wrr, tag);
+		g_mutex_unlock(backends->backends_mutex);
+
+		if (tag_wrr) return wrr_ro_group(con, tag_wrr, tag);
+	} else if (strncasecmp(hint, C("BACKEND:")) == 0) {
+		const gchar *address = hint + sizeof("BACKEND:") - 1;
+
+		for (i = 0; i < count; ++i) {
+			network_backend_t *backend = network_backends_get(backends, i);
+			if (backend == NULL || strcmp(backend->addr->name->str, address) != 0) continue;
+			return backend_is_usable(backend) ? (int)i : -1;
+		}
+	}
+
+	return -1;
+}
+
 /**
  * call the lua function to intercept the handshake packet
  *
@@ -1088,40 +2039,60 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_auth_result) {
 	return NETWORK_SOCKET_SUCCESS;
 }
 
-int rw_split(GPtrArray* tokens, network_mysqld_con* con) {
-	if (tokens->len <= 1) { return idle_rw(con); }
+/**
+ * pick the backend of a read-only query
+ *
+ * @param comment the text of the comment the query starts with, NULL if there is none
+ */
+static int rw_split_comment(const gchar* comment, network_mysqld_con* con) {
+	if (comment != NULL && strcasecmp(comment, "MASTER") == 0) return idle_rw(con);
 
-	sql_token* first_token = tokens->pdata[1];
-	sql_token_id token_id = first_token->token_id;
-	if (token_id == TK_COMMENT && strcasecmp(first_token->text->str, "MASTER") == 0) return idle_rw(con);
+	if (g_hash_table_size(con->locks) > 0) return idle_rw(con);
 
-	if (tokens->len < 2 || g_hash_table_size(con->locks) > 0) return idle_rw(con);
+	if (comment != NULL) {
+		int ndx = hint_rw_split(con, comment);
+		if (ndx != -1) return ndx;
+	}
 
 	return wrr_ro(con);
 }
 
-void modify_user(network_mysqld_con* con) {
-	if (con->server == NULL) return;
+int rw_split(GPtrArray* tokens, network_mysqld_con* con) {
+	if (tokens->len <= 1) { return idle_rw(con); }
+
+	sql_token* first_token = tokens->pdata[1];
+	return rw_split_comment(first_token->token_id == TK_COMMENT ? first_token->text->str : NULL, con);
+}
 
+static GString *com_change_user_new(network_mysqld_con *con, network_socket *server, GString *expected_response) {
 	GString* client_user = con->client->response->username;
-	GString* server_user = con->server->response->username;
 
-	if (!g_string_equal(client_user, server_user)) {
-		GString* com_change_user = g_string_new(NULL);
+	if (g_string_equal(client_user, server->response->username)) return NULL;
 
-		g_string_append_c(com_change_user, COM_CHANGE_USER);
-		g_string_append_len(com_change_user, client_user->str, client_user->len + 1);
+	GString* hashed_password = g_hash_table_lookup(config->pwd_table[config->pwd_table_index], client_user->str);
+	if (!hashed_password) return NULL;
 
-		GString* hashed_password = g_hash_table_lookup(config->pwd_table[config->pwd_table_index], client_user->str);
-		if (!hashed_password) return;
+	GString* com_change_user = g_string_new(NULL);
 
-		GString* expected_response = g_string_sized_new(20);
-		network_mysqld_proto_password_scramble(expected_response, S(con->server->challenge->challenge), S(hashed_password));
+	g_string_append_c(com_change_user, COM_CHANGE_USER);
+	g_string_append_len(com_change_user, client_user->str, client_user->len + 1);
 
-		g_string_append_c(com_change_user, (expected_response->len & 0xff));
-		g_string_append_len(com_change_user, S(expected_response));
-		g_string_append_c(com_change_user, 0);
+	network_mysqld_proto_password_scramble(expected_response, S(server->challenge->challenge), S(hashed_password));
 
+	g_string_append_c(com_change_user, (expected_response->len & 0xff));
+	g_string_append_len(com_change_user, S(expected_response));
+	g_string_append_c(com_change_user, 0);
+
+	return com_change_user;
+}
+
+void modify_user(network_mysqld_con* con) {
+	if (con->server == NULL) return;
+
+	GString* expected_response = g_string_sized_new(20);
+	GString* com_change_user = com_change_user_new(con, con->server, expected_response);
+
+	if (com_change_user) {
 		injection* inj = injection_new(6, com_change_user);
 		inj->resultset_is_needed = TRUE;
 		network_mysqld_con_lua_t* st = con->plugin_con_state;
@@ -1129,8 +2100,32 @@ void modify_user(network_mysqld_con* con) {
 
 		g_string_truncate(con->client->response->response, 0);
 		g_string_assign(con->client->response->response, expected_response->str);
-		g_string_free(expected_response, TRUE);
 	}
+
+	g_string_free(expected_response, TRUE);
+}
+
+/**
+ * find the cluster serving the database of the query
+ *
+ * the schema qualifier of the table wins over the default db, COM_INIT_DB goes to the cluster of the new db
+ *
+ * @return the cluster name or NULL for the default backends
+ */
+const gchar *get_cluster(network_mysqld_con *con, GPtrArray *tokens, GString *packets) {
+	if (g_hash_table_size(config->db_cluster) == 0) return NULL;
+
+	const gchar *db = con->client->default_db->str;
+
+	if (packets->str[0] == COM_INIT_DB) {
+		db = packets->str + 1;
+	} else if (packets->str[0] == COM_QUERY) {
+		gint d, t;
+		get_table_index(tokens, &d, &t);
+		if (d != -1) db = ((sql_token*)tokens->pdata[d])->text->str;
+	}
+
+	return g_hash_table_lookup(config->db_cluster, db);
 }
 
 void modify_db(network_mysqld_con* con) {
@@ -1231,6 +2226,24 @@ void modify_charset(GPtrArray* tokens, network_mysqld_con* con) {
 	}
 }
 
+/**
+ * find the GET_LOCK of a SELECT GET_LOCK(...), leading comments are skipped
+ *
+ * @return the index of the GET_LOCK token or 0
+ */
+static guint sql_get_lock_index(GPtrArray* tokens) {
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	guint len = tokens->len;
+	guint i = 1;
+
+	if (len <= 1) return 0;
+
+	while (ts[i]->token_id == TK_COMMENT && ++i < len);
+	if (i + 1 >= len) return 0;
+
+	return (ts[i]->token_id == TK_SQL_SELECT && strcasecmp(ts[i+1]->text->str, "GET_LOCK") == 0) ? i + 1 : 0;
+}
+
 void check_flags(GPtrArray* tokens, network_mysqld_con* con) {
 	con->is_in_select_calc_found_rows = FALSE;
 
@@ -1238,8 +2251,10 @@ void check_flags(GPtrArray* tokens, network_mysqld_con* con) {
 	guint len = tokens->len;
 
 	if (len > 2) {
-		if (ts[1]->token_id == TK_SQL_SELECT && strcasecmp(ts[2]->text->str, "GET_LOCK") == 0) {
-			gchar* key = ts[4]->text->str;
+		/* GET_LOCK ( name */
+		guint lock = sql_get_lock_index(tokens);
+		if (lock != 0 && lock + 2 < len) {
+			gchar* key = ts[lock+2]->text->str;
 			if (!g_hash_table_lookup(con->locks, key)) g_hash_table_add(con->locks, g_strdup(key));
 		}
 
@@ -1337,107 +2352,2591 @@ GString* convert_use_database2com_init_db(char type, GString *origin_packets, GP
 }
 
 /**
- * gets called after a query has been read
+ * routing-plan cache
  *
- * - calls the lua script via network_mysqld_con_handle_proxy_stmt()
+ * the routing decision of proxy_read_query() only depends on the shape of a query, not on its
+ * literals. Each event-thread keeps a LRU of the decisions keyed by the default db and a
+ * fingerprint of the query text, repeated query shapes are routed without running the tokenizer.
  *
- * @see network_mysqld_con_handle_proxy_stmt
+ * queries which need their tokens later on (sharded tables, USE, SET, GET_LOCK) are never cached
  */
-NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
-	GString *packet;
-	network_socket *recv_sock, *send_sock;
-	network_mysqld_con_lua_t *st = con->plugin_con_state;
-	int proxy_query = 1;
-	network_mysqld_lua_stmt_ret ret;
+typedef struct {
+	GString *key;               /**< default db, '\0', fingerprint */
+	gboolean is_blacklisted;
+	gboolean is_write;
+	gboolean is_calc_found_rows;
+	const gchar *cluster;       /**< owned by config->db_cluster, NULL for the default backends */
+	gchar *comment;             /**< text of the comment the query starts with, see rw_split_comment() */
+	GList *link;                /**< our node in the LRU of the cache */
+} routing_plan_t;
+
+#define PLAN_CACHE_MAX_KEY 4096       /**< longer fingerprints aren't cached */
+
+typedef struct plan_cache {
+	GHashTable *plans;          /**< key => routing_plan_t */
+	GQueue *lru;                /**< the plans, most recently used first */
+	GString *key;               /**< scratch buffer for the key of the current query */
+	plan_cache_stats_t *stats;
+} plan_cache_t;
+
+static void routing_plan_free(routing_plan_t *plan) {
+	g_string_free(plan->key, TRUE);
+	g_free(plan->comment);
+	g_free(plan);
+}
 
-	NETWORK_MYSQLD_CON_TRACK_TIME(con, "proxy::ready_query::enter");
+static plan_cache_t *plan_cache_new(plan_cache_stats_t *stats) {
+	plan_cache_t *cache = g_new0(plan_cache_t, 1);
 
-	send_sock = NULL;
-	recv_sock = con->client;
-	st->injected.sent_resultset = 0;
+	cache->plans = g_hash_table_new_full((GHashFunc)g_string_hash, (GEqualFunc)g_string_equal, NULL, (GDestroyNotify)routing_plan_free);
+	cache->lru = g_queue_new();
+	cache->key = g_string_sized_new(256);
+	cache->stats = stats;
 
-	NETWORK_MYSQLD_CON_TRACK_TIME(con, "proxy::ready_query::enter_lua");
-	network_injection_queue_reset(st->injected.queries);
+	return cache;
+}
 
-	GString* packets = g_string_new(NULL);
-	int i;
-	for (i = 0; NULL != (packet = g_queue_peek_nth(recv_sock->recv_queue->chunks, i)); i++) {
-		g_string_append_len(packets, packet->str + NET_HEADER_SIZE, packet->len - NET_HEADER_SIZE);
-	}
+static void plan_cache_free(plan_cache_t *cache) {
+	g_queue_free(cache->lru);
+	g_hash_table_destroy(cache->plans);
+	g_string_free(cache->key, TRUE);
+	g_free(cache);
+}
 
-	char type = packets->str[0];
-	if (type == COM_QUIT || type == COM_PING) {
-		g_string_free(packets, TRUE);
-		network_mysqld_con_send_ok_full(con->client, 0, 0, 0x0002, 0);
-		ret = PROXY_SEND_RESULT;
+#define IS_IDENT_CHAR(c) (g_ascii_isalnum(c) || (c) == '_' || (c) == '$')
+
+/**
+ * the length of the number literal at s: digits with an optional fraction and exponent, 0x.. or 0b..
+ *
+ * @return 0 if the word at s is an identifier starting with digits, like 1db
+ */
+static gsize sql_number_len(const gchar *s, const gchar *end) {
+	const gchar *p = s;
+
+	if (p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		for (p += 2; p < end && g_ascii_isxdigit(*p); p++);
+	} else if (p + 1 < end && p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+		for (p += 2; p < end && (*p == '0' || *p == '1'); p++);
 	} else {
-		GPtrArray *tokens = sql_tokens_new();
-		sql_tokenizer(tokens, packets->str, packets->len);
+		while (p < end && g_ascii_isdigit(*p)) p++;
+		if (p < end && *p == '.') {
+			for (p++; p < end && g_ascii_isdigit(*p); p++);
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			const gchar *q = p + 1;
 
-		if (type == COM_QUERY && is_in_blacklist(tokens)) {
-			g_warning("Forbidden SQL: %s: %s", recv_sock->src->name->str, packets->str+1);
-			g_string_free(packets, TRUE);
-			network_mysqld_con_send_error_full(con->client, C("Proxy Warning - Syntax Forbidden"), ER_UNKNOWN_ERROR, "07000");
-			ret = PROXY_SEND_RESULT;
-		} else {
-			GPtrArray* sqls = NULL;
-			if (type == COM_QUERY && config->tables) {
-				sqls = sql_parse(con, tokens);
+			if (q < end && (*q == '+' || *q == '-')) q++;
+			if (q < end && g_ascii_isdigit(*q)) {
+				for (p = q; p < end && g_ascii_isdigit(*p); p++);
 			}
+		}
+	}
 
-            packets = convert_use_database2com_init_db(type, packets, tokens);
-			gboolean is_write = sql_is_write(tokens);
-
-			ret = PROXY_SEND_INJECTION;
-			injection* inj = NULL;
-			if (sqls == NULL) {
-				inj = injection_new(1, packets);
-				inj->resultset_is_needed = is_write;
-				g_queue_push_tail(st->injected.queries, inj);
-			} else {
-				g_string_free(packets, TRUE);
+	if (p < end && IS_IDENT_CHAR(*p)) return 0;
 
-				if (sqls->len == 1) {
-					inj = injection_new(1, sqls->pdata[0]);
-					inj->resultset_is_needed = is_write;
-					g_queue_push_tail(st->injected.queries, inj);
-				} else {
-					merge_res_t* merge_res = con->merge_res;
+	return p - s;
+}
 
-					merge_res->sub_sql_num = sqls->len;
-					merge_res->sub_sql_exed = 0;
-					merge_res->limit = G_MAXINT;
-					merge_res->affected_rows = 0;
-					merge_res->warnings = 0;
+/**
+ * append the fingerprint of a query to the key
+ *
+ * whitespace is collapsed, string and number literals become '?', lists of them a single '?'
+ * and lists of such tuples a single (?), like the rows of a multi-row INSERT.
+ * identifiers, keywords and comments are kept as they are: the comments carry the routing hints
+ *
+ * @param max_len  stop once the key is that long, G_MAXSIZE for the complete fingerprint
+ */
+static void sql_fingerprint(GString *key, const gchar *s, gsize len, gsize max_len) {
+	const gchar *end = s + len;
+	gboolean is_space = FALSE;
+
+	while (s < end && key->len < max_len) {
+		gchar c = *s;
+		gsize num_len = 0;
+
+		if (g_ascii_isspace(c)) {
+			is_space = TRUE;
+			s++;
+			continue;
+		}
 
-					sql_token** ts = (sql_token**)(tokens->pdata);
-					for (i = tokens->len-2; i >= 0; --i) {
-						if (ts[i]->token_id == TK_SQL_LIMIT && ts[i+1]->token_id == TK_INTEGER) {
-							merge_res->limit = atoi(ts[i+1]->text->str);
+		/* a space is only needed between two words */
+		gboolean is_in_word = !is_space && key->len > 0 && IS_IDENT_CHAR(key->str[key->len - 1]);
+		if (is_space && key->len > 0 && IS_IDENT_CHAR(key->str[key->len - 1]) && IS_IDENT_CHAR(c)) g_string_append_c(key, ' ');
+		is_space = FALSE;
+
+		if (c == '/' && s + 1 < end && s[1] == '*') {
+			const gchar *close = g_strstr_len(s + 2, end - s - 2, "*/");
+			const gchar *next = close ? close + 2 : end;
+			g_string_append_len(key, s, next - s);
+			s = next;
+		} else if (c == '-' && s + 2 < end && s[1] == '-' && g_ascii_isspace(s[2])) {
+			const gchar *eol = memchr(s, '\n', end - s);
+			const gchar *next = eol ? eol + 1 : end;
+			g_string_append_len(key, s, next - s);
+			s = next;
+		} else if (c == '`') {
+			const gchar *close = memchr(s + 1, '`', end - s - 1);
+			const gchar *next = close ? close + 1 : end;
+			g_string_append_len(key, s, next - s);
+			s = next;
+		} else if (g_ascii_isdigit(c) && !is_in_word && 0 == (num_len = sql_number_len(s, end))) {
+			/* not a number but a name like 1db, keep it */
+			const gchar *next = s;
+			while (next < end && IS_IDENT_CHAR(*next)) next++;
+			g_string_append_len(key, s, next - s);
+			s = next;
+		} else if (c == '\'' || c == '"' || (g_ascii_isdigit(c) && !is_in_word)) {
+			if (g_ascii_isdigit(c)) {
+				s += num_len;
+			} else {
+				for (s++; s < end; s++) {
+					if (*s == '\\') {
+						s++;
+					} else if (*s == c) {
+						if (s + 1 < end && s[1] == c) {
+							s++;
+						} else {
+							s++;
 							break;
 						}
 					}
-
-					GPtrArray* rows = merge_res->rows;
-					for (i = 0; i < rows->len; ++i) {
-						GPtrArray* row = g_ptr_array_index(rows, i);
-						guint j;
-						for (j = 0; j < row->len; ++j) {
-							g_free(g_ptr_array_index(row, j));
-						}
-						g_ptr_array_free(row, TRUE);
+				}
+			}
+
+			/* ?,? => ? */
+			if (key->len >= 2 && key->str[key->len - 1] == ',' && key->str[key->len - 2] == '?') {
+				g_string_truncate(key, key->len - 1);
+			} else {
+				g_string_append_c(key, '?');
+			}
+		} else {
+			g_string_append_c(key, c);
+			s++;
+
+			/* (?),(?) => (?) */
+			if (c == ')' && key->len >= 7 && 0 == memcmp(key->str + key->len - 7, "(?),(?)", 7)) {
+				g_string_truncate(key, key->len - 4);
+			}
+		}
+	}
+}
+
+/**
+ * the plan cache of the calling event-thread
+ *
+ * @return NULL if the cache is off
+ */
+static plan_cache_t *plan_cache_get(void) {
+	if (config->plan_caches == NULL) return NULL;
+
+	return config->plan_caches[chassis_event_thread_index()];
+}
+
+/**
+ * look up the plan of a COM_QUERY, leaves the key of the query in cache->key
+ *
+ * @return the cached plan or NULL
+ */
+static routing_plan_t *plan_cache_lookup(plan_cache_t *cache, network_mysqld_con *con, GString *packets) {
+	GString *default_db = con->client->default_db;
+
+	g_string_truncate(cache->key, 0);
+	g_string_append_len(cache->key, default_db->str, default_db->len + 1);
+	sql_fingerprint(cache->key, packets->str + 1, packets->len - 1, G_MAXSIZE);
+
+	routing_plan_t *plan = g_hash_table_lookup(cache->plans, cache->key);
+	if (plan == NULL) {
+		cache->stats->misses++;
+		return NULL;
+	}
+
+	g_queue_unlink(cache->lru, plan->link);
+	g_queue_push_head_link(cache->lru, plan->link);
+	cache->stats->hits++;
+
+	return plan;
+}
+
+/**
+ * add the plan for cache->key, evicts the least recently used plan if the cache is full
+ */
+static routing_plan_t *plan_cache_add(plan_cache_t *cache) {
+	if (cache->key->len > PLAN_CACHE_MAX_KEY) return NULL;
+
+	if (g_hash_table_size(cache->plans) >= (guint)config->plan_cache_size) {
+		routing_plan_t *old = g_queue_pop_tail(cache->lru);
+		g_hash_table_remove(cache->plans, old->key);
+	}
+
+	routing_plan_t *plan = g_new0(routing_plan_t, 1);
+	plan->key = g_string_new_len(S(cache->key));
+	g_queue_push_head(cache->lru, plan);
+	plan->link = g_queue_peek_head_link(cache->lru);
+	g_hash_table_insert(cache->plans, plan->key, plan);
+
+	cache->stats->entries = g_hash_table_size(cache->plans);
+
+	return plan;
+}
+
+/**
+ * check if the routing of a query can be replayed from its fingerprint
+ */
+static gboolean sql_is_plan_cacheable(network_mysqld_con *con, GPtrArray *tokens) {
+	sql_token **ts = (sql_token**)(tokens->pdata);
+	guint len = tokens->len;
+	guint i = 1;
+
+	if (len <= 1) return FALSE;
+
+	while (ts[i]->token_id == TK_COMMENT && ++i < len);
+	if (i == len) return FALSE;
+
+	/* modify_charset() and convert_use_database2com_init_db() look at the values */
+	if (ts[i]->token_id == TK_SQL_SET || ts[i]->token_id == TK_SQL_USE) return FALSE;
+
+	/* check_flags() remembers the name of the lock */
+	if (sql_get_lock_index(tokens) != 0) return FALSE;
+
+	if (g_hash_table_size(config->dt_table) > 0) {
+		guint sql_type;
+		gint table;
+		if (get_db_table(con, tokens, &sql_type, &table, NULL) != NULL) return FALSE;
+	}
+
+	return TRUE;
+}
+
+typedef enum {
+	SQL_CLASSIFY_DONE,          /**< the plan is complete */
+	SQL_CLASSIFY_TOKENIZE,      /**< the query has to be tokenized, its plan may be in the plan cache */
+	SQL_CLASSIFY_UNCACHEABLE    /**< the query has to be tokenized and its plan is never cached */
+} sql_classify_result_t;
+
+#define SQL_CLASSIFY_MAX_COMMENT 64   /**< longer leading comments are left to the tokenizer */
+#define SQL_CLASSIFY_MAX_NAME 256
+
+#define IS_WORD_CHAR(c) (g_ascii_isalnum(c) || (c) == '_' || (c) == '@')
+
+/**
+ * skip a '...', "..." or `...` quoted string the way the tokenizer does
+ *
+ * @return the char after the closing quote
+ */
+static const gchar *sql_classify_skip_quoted(const gchar *s, const gchar *end) {
+	gchar quote = *s;
+
+	for (s++; s < end; s++) {
+		if (*s == '\\') {
+			s++;
+		} else if (*s == quote) {
+			if (s + 1 < end && s[1] == quote) {
+				s++;
+			} else {
+				return s + 1;
+			}
+		}
+	}
+
+	return end;
+}
+
+/**
+ * the table name of a INSERT or REPLACE: a word or a `quoted` name without escapes
+ *
+ * @return the char after the name or NULL
+ */
+static const gchar *sql_classify_name(const gchar *s, const gchar *end, const gchar **name, gsize *name_len) {
+	while (s < end && g_ascii_isspace(*s)) s++;
+	if (s == end) return NULL;
+
+	if (*s == '`') {
+		const gchar *close = memchr(s + 1, '`', end - s - 1);
+		if (close == NULL || memchr(s + 1, '\\', close - s - 1) != NULL) return NULL;
+		*name = s + 1;
+		*name_len = close - s - 1;
+		return close + 1;
+	}
+
+	*name = s;
+	while (s < end && IS_WORD_CHAR(*s)) s++;
+	*name_len = s - *name;
+
+	return *name_len > 0 ? s : NULL;
+}
+
+/**
+ * find db and table of a INSERT or REPLACE, s points behind the first keyword
+ *
+ * @return the char after the table name or NULL if the statement doesn't look as expected
+ */
+static const gchar *sql_classify_insert_table(const gchar *s, const gchar *end, const gchar **db, gsize *db_len, const gchar **table, gsize *table_len) {
+	const gchar *name, *next;
+	gsize name_len;
+
+	for (;;) {
+		if (NULL == (next = sql_classify_name(s, end, &name, &name_len))) return NULL;
+
+		sql_token_id id = sql_token_get_id_len(name, name_len);
+		if (id != TK_SQL_LOW_PRIORITY && id != TK_SQL_DELAYED && id != TK_SQL_HIGH_PRIORITY && id != TK_SQL_IGNORE && id != TK_SQL_INTO) break;
+		s = next;
+	}
+
+	*db = NULL;
+	*db_len = 0;
+	*table = name;
+	*table_len = name_len;
+
+	s = next;
+	if (s < end && *s == '.') {
+		*db = name;
+		*db_len = name_len;
+		if (NULL == (s = sql_classify_name(s + 1, end, table, table_len))) return NULL;
+	}
+
+	return s;
+}
+
+/**
+ * could a word (or quoted name) be one of the sharded tables, whatever its db?
+ */
+static gboolean sql_classify_is_sharded_name(const gchar *w, gsize len) {
+	gchar name[SQL_CLASSIFY_MAX_NAME];
+
+	if (len >= sizeof(name)) return TRUE;
+
+	memcpy(name, w, len);
+	name[len] = '\0';
+
+	return g_hash_table_contains(config->dt_table_names, name);
+}
+
+/**
+ * does a SLEEP word (or quoted name) at w get called?
+ */
+static gboolean sql_classify_is_sleep(const gchar *w, gsize len, const gchar *s, const gchar *end) {
+	if (len != 5 || g_ascii_strncasecmp(w, "SLEEP", 5) != 0) return FALSE;
+
+	while (s < end && g_ascii_isspace(*s)) s++;
+
+	return s < end && *s == '(';
+}
+
+/**
+ * the kind of a COM_QUERY for the query counters, from its first word after the comments
+ */
+static chassis_query_type_t sql_query_type(GString *packets) {
+	const gchar *s = packets->str + 1;
+	const gchar *end = packets->str + packets->len;
+	const gchar *w;
+
+	while (s < end) {
+		if (g_ascii_isspace(*s)) {
+			s++;
+		} else if (*s == '/' && s + 1 < end && s[1] == '*') {
+			const gchar *close = g_strstr_len(s + 2, end - s - 2, "*/");
+			if (close == NULL) return QUERY_TYPE_OTHER;
+			s = close + 2;
+		} else {
+			break;
+		}
+	}
+
+	for (w = s; s < end && IS_WORD_CHAR(*s); s++);
+
+	switch (sql_token_get_id_len(w, s - w)) {
+	case TK_SQL_SELECT:  return QUERY_TYPE_SELECT;
+	case TK_SQL_INSERT:  return QUERY_TYPE_INSERT;
+	case TK_SQL_UPDATE:  return QUERY_TYPE_UPDATE;
+	case TK_SQL_DELETE:  return QUERY_TYPE_DELETE;
+	case TK_SQL_REPLACE: return QUERY_TYPE_REPLACE;
+	default:             return QUERY_TYPE_OTHER;
+	}
+}
+
+/**
+ * routing-only classification of a COM_QUERY, without tokenizing it
+ *
+ * a single pass over the query text which doesn't allocate: literals and comments are skipped,
+ * only the words the routing looks at are checked. It has to come to the same decision as
+ * is_in_blacklist(), sql_is_write(), get_cluster(), check_flags() and rw_split() on the tokens.
+ *
+ * only SELECT, INSERT, REPLACE, UPDATE and DELETE are classified. With sharded tables the table of
+ * INSERT and REPLACE is looked up, the other statements are classified if none of their words is the
+ * name of a sharded table. With clusters a SELECT, UPDATE or DELETE mustn't have a db.table, the
+ * default db picks the cluster. Everything else, statements on sharded tables, MySQL-specific
+ * comments or GET_LOCK() is left to the tokenizer.
+ *
+ * the queries sql_is_plan_cacheable() always refuses are told apart, they don't need a lookup in
+ * the plan cache. A word which is the name of a sharded table is enough for that.
+ *
+ * @param plan         filled with the routing decision
+ * @param comment_buf  SQL_CLASSIFY_MAX_COMMENT bytes for the leading comment, plan->comment points to it
+ */
+static sql_classify_result_t sql_classify(network_mysqld_con *con, GString *packets, routing_plan_t *plan, gchar *comment_buf) {
+	const gchar *s = packets->str + 1;
+	const gchar *end = packets->str + packets->len;
+	const gchar *db = NULL, *table = NULL;
+	gsize db_len = 0, table_len = 0;
+	sql_token_id first_id = TK_UNKNOWN;
+	gboolean is_first_token = TRUE;   /* nothing but whitespace seen yet */
+	gboolean is_first_word = FALSE;   /* the first keyword is the first token */
+	gboolean is_second_token = FALSE; /* nothing but whitespace since the first keyword */
+	gboolean has_where = FALSE;
+	gboolean has_dot = FALSE;
+	gboolean has_sharded_name = FALSE;
+	gboolean has_dt_table = (g_hash_table_size(config->dt_table) > 0);
+	gboolean need_table = (has_dt_table || g_hash_table_size(config->db_cluster) > 0);
+
+	memset(plan, 0, sizeof(*plan));
+
+	while (s < end) {
+		gchar c = *s;
+
+		if (g_ascii_isspace(c)) {
+			s++;
+		} else if (c == '/' && s + 1 < end && s[1] == '*') {
+			if (s + 2 < end && s[2] == '!') return SQL_CLASSIFY_TOKENIZE;
+
+			const gchar *close = g_strstr_len(s + 2, end - s - 2, "*/");
+			if (close == NULL) return SQL_CLASSIFY_TOKENIZE;
+
+			if (is_first_token) {
+				gsize len = close - s - 2;
+				if (len >= SQL_CLASSIFY_MAX_COMMENT) return SQL_CLASSIFY_TOKENIZE;
+				memcpy(comment_buf, s + 2, len);
+				comment_buf[len] = '\0';
+				plan->comment = comment_buf;
+			}
+			is_first_token = FALSE;
+			is_second_token = FALSE;
+			s = close + 2;
+		} else if (c == '-' && s + 2 < end && s[1] == '-' && g_ascii_isspace(s[2])) {
+			if (is_first_token) return SQL_CLASSIFY_TOKENIZE;
+
+			const gchar *eol = memchr(s, '\n', end - s);
+			s = eol ? eol + 1 : end;
+			is_second_token = FALSE;
+		} else if (c == '\'' || c == '"' || c == '`') {
+			const gchar *next = sql_classify_skip_quoted(s, end);
+			if (first_id == TK_UNKNOWN) return SQL_CLASSIFY_TOKENIZE;
+			if (sql_classify_is_sleep(s + 1, next - s - 2, next, end)) plan->is_blacklisted = TRUE;
+			if (c == '`' && has_dt_table && sql_classify_is_sharded_name(s + 1, next - s - 2)) has_sharded_name = TRUE;
+			is_first_token = FALSE;
+			is_second_token = FALSE;
+			s = next;
+		} else if (IS_WORD_CHAR(c)) {
+			const gchar *w = s;
+			while (s < end && IS_WORD_CHAR(*s)) s++;
+
+			sql_token_id id = sql_token_get_id_len(w, s - w);
+
+			if (first_id == TK_UNKNOWN) {
+				/* modify_charset() and convert_use_database2com_init_db() need the tokens */
+				if (id == TK_SQL_SET || id == TK_SQL_USE) return SQL_CLASSIFY_UNCACHEABLE;
+				if (id != TK_SQL_SELECT && id != TK_SQL_INSERT && id != TK_SQL_REPLACE && id != TK_SQL_UPDATE && id != TK_SQL_DELETE) return SQL_CLASSIFY_TOKENIZE;
+
+				first_id = id;
+				is_first_word = is_first_token;
+				is_first_token = FALSE;
+				is_second_token = TRUE;
+
+				if (need_table && (id == TK_SQL_INSERT || id == TK_SQL_REPLACE)) {
+					if (NULL == (s = sql_classify_insert_table(s, end, &db, &db_len, &table, &table_len))) return SQL_CLASSIFY_TOKENIZE;
+					is_second_token = FALSE;
+				}
+				continue;
+			}
+
+			if (id == TK_SQL_WHERE) {
+				has_where = TRUE;
+			} else if (id == TK_SQL_SQL_CALC_FOUND_ROWS) {
+				plan->is_calc_found_rows = TRUE;
+			} else if (s - w == 8 && g_ascii_strncasecmp(w, "GET_LOCK", 8) == 0) {
+				/* check_flags() remembers the lock of a SELECT GET_LOCK(...) */
+				return (first_id == TK_SQL_SELECT && is_second_token) ? SQL_CLASSIFY_UNCACHEABLE : SQL_CLASSIFY_TOKENIZE;
+			} else if (sql_classify_is_sleep(w, s - w, s, end)) {
+				plan->is_blacklisted = TRUE;
+			} else if (id == TK_LITERAL && has_dt_table && sql_classify_is_sharded_name(w, s - w)) {
+				has_sharded_name = TRUE;
+			}
+			is_first_token = FALSE;
+			is_second_token = FALSE;
+		} else {
+			if (first_id == TK_UNKNOWN) return SQL_CLASSIFY_TOKENIZE;
+			if (c == '.') has_dot = TRUE;
+			is_first_token = FALSE;
+			is_second_token = FALSE;
+			s++;
+		}
+	}
+
+	if (first_id == TK_UNKNOWN) return SQL_CLASSIFY_TOKENIZE;
+
+	if (is_first_word && (first_id == TK_SQL_DELETE || first_id == TK_SQL_UPDATE) && !has_where) plan->is_blacklisted = TRUE;
+
+	plan->is_write = (first_id != TK_SQL_SELECT);
+
+	if (need_table && first_id != TK_SQL_INSERT && first_id != TK_SQL_REPLACE) {
+		/* get_db_table() only finds a sharded table if its name is one of the words */
+		if (has_sharded_name) return SQL_CLASSIFY_UNCACHEABLE;
+
+		/* get_cluster() takes the db of the first db.table after FROM (or UPDATE), which isn't worth finding */
+		if (has_dot) return SQL_CLASSIFY_TOKENIZE;
+	}
+
+	if (need_table) {
+		gchar name[SQL_CLASSIFY_MAX_NAME];
+		GString *default_db = con->client->default_db;
+
+		if (db == NULL) {
+			db = default_db->str;
+			db_len = default_db->len;
+		}
+		if (db_len + 1 + table_len >= sizeof(name)) return SQL_CLASSIFY_TOKENIZE;
+
+		/* a sharded table gets rewritten by sql_parse() */
+		if (table != NULL) {
+			g_snprintf(name, sizeof(name), "%.*s.%.*s", (int)db_len, db, (int)table_len, table);
+			if (g_hash_table_lookup(config->dt_table, name) != NULL) return SQL_CLASSIFY_UNCACHEABLE;
+		}
+
+		g_snprintf(name, sizeof(name), "%.*s", (int)db_len, db);
+		plan->cluster = g_hash_table_lookup(config->db_cluster, name);
+	}
+
+	return SQL_CLASSIFY_DONE;
+}
+
+static void merge_order_clear(GPtrArray* order_by) {
+	guint i;
+
+	for (i = 0; i < order_by->len; ++i) {
+		merge_order_t* order = g_ptr_array_index(order_by, i);
+		g_free(order->name);
+		g_free(order);
+	}
+	g_ptr_array_set_size(order_by, 0);
+}
+
+static void merge_res_reset_results(merge_res_t* merge_res) {
+	guint i;
+
+	for (i = 0; i < merge_res->results->len; ++i) {
+		GQueue* result = g_ptr_array_index(merge_res->results, i);
+		GString* packet;
+		while ((packet = g_queue_pop_head(result))) g_string_free(packet, TRUE);
+		g_queue_free(result);
+	}
+	g_ptr_array_set_size(merge_res->results, 0);
+}
+
+static void merge_res_reset(merge_res_t* merge_res) {
+	merge_order_clear(merge_res->order_by);
+	g_array_set_size(merge_res->aggs, 0);
+
+	merge_res_reset_results(merge_res);
+
+	if (merge_res->error) {
+		g_string_free(merge_res->error, TRUE);
+		merge_res->error = NULL;
+	}
+	merge_res->buffered_rows = 0;
+}
+
+/**
+ * fail the merged result with a ERR of the proxy, the sub-results which are in already are dropped
+ */
+static void merge_res_error(merge_res_t* merge_res, const gchar* errmsg, gsize errmsg_len, guint errcode, const gchar* sqlstate) {
+	network_mysqld_err_packet_t* err_packet = network_mysqld_err_packet_new();
+
+	merge_res_reset_results(merge_res);
+
+	err_packet->errcode = errcode;
+	g_string_assign_len(err_packet->errmsg, errmsg, errmsg_len);
+	g_string_assign(err_packet->sqlstate, sqlstate);
+
+	merge_res->error = g_string_new(NULL);
+	network_mysqld_proto_append_err_packet(merge_res->error, err_packet);
+
+	network_mysqld_err_packet_free(err_packet);
+}
+
+/**
+ * the ORDER BY of a SELECT: column names, aliases or positions, each with ASC or DESC
+ *
+ * order_by stays empty if it has expressions, the sub-results are concatenated then
+ */
+static void get_order_by(GPtrArray* tokens, GPtrArray* order_by) {
+	sql_token** ts = (sql_token**)(tokens->pdata);
+	gint len = tokens->len;
+	gint i;
+
+	for (i = len-2; i > 0; --i) {
+		if (ts[i]->token_id == TK_SQL_ORDER && ts[i+1]->token_id == TK_SQL_BY) break;
+	}
+	if (i <= 0) return;
+
+	i += 2;
+	while (i < len) {
+		merge_order_t* order = g_new0(merge_order_t, 1);
+		g_ptr_array_add(order_by, order);
+
+		if (ts[i]->token_id == TK_INTEGER) {
+			order->pos = atoi(ts[i]->text->str);
+		} else if (ts[i]->token_id == TK_LITERAL) {
+			if (i+2 < len && ts[i+1]->token_id == TK_DOT && ts[i+2]->token_id == TK_LITERAL) i += 2; /* table.column */
+			order->name = g_strdup(ts[i]->text->str);
+		} else {
+			break;
+		}
+
+		if (++i < len && (ts[i]->token_id == TK_SQL_ASC || ts[i]->token_id == TK_SQL_DESC)) {
+			order->is_desc = (ts[i]->token_id == TK_SQL_DESC);
+			++i;
+		}
+
+		if (i < len && ts[i]->token_id == TK_COMMA) {
+			++i;
+		} else {
+			break;
+		}
+	}
+
+	if (i < len && ts[i]->token_id != TK_SQL_LIMIT && ts[i]->token_id != TK_SEMICOLON) merge_order_clear(order_by);
+}
+
+static gboolean merge_packet_is_eof(GString* packet) {
+	return (guchar)packet->str[NET_HEADER_SIZE] == MYSQLD_PACKET_EOF && packet->len < NET_HEADER_SIZE + 9;
+}
+
+static void merge_eof_packet(merge_res_t* merge_res, GString* packet) {
+	network_mysqld_eof_packet_t* eof_packet = network_mysqld_eof_packet_new();
+	network_packet p;
+
+	p.data = packet;
+	p.offset = NET_HEADER_SIZE;
+
+	if (0 == network_mysqld_proto_get_eof_packet(&p, eof_packet)) {
+		merge_res->warnings += eof_packet->warnings;
+		merge_res->server_status = eof_packet->server_status;
+	}
+
+	network_mysqld_eof_packet_free(eof_packet);
+}
+
+/**
+ * forward the packets of a sub-result to the client as they are, only the packet-ids are rewritten
+ *
+ * the field definitions go out with the first sub-result only, rows beyond the LIMIT are dropped,
+ * merge_rows_finish() sends the EOF which ends the merged result-set
+ */
+static void merge_rows_forward(network_mysqld_con* con, GQueue *chunks) {
+	merge_res_t* merge_res = con->merge_res;
+	network_socket* client = con->client;
+	GString* packet = g_queue_peek_head(chunks);
+
+	if (packet == NULL) return;
+
+	guchar status = packet->str[NET_HEADER_SIZE];
+	if (status == MYSQLD_PACKET_OK || status == MYSQLD_PACKET_ERR) return; /* not a result-set */
+
+	if (merge_res->order_by->len > 0 || merge_res->aggs->len > 0) {
+		/* merge_rows_finish() merges the sorted or aggregated sub-results */
+		GQueue* result = g_queue_new();
+		guint fields = 0;
+
+		if (merge_res->error) return;
+
+		while ((packet = g_queue_pop_head(chunks))) g_queue_push_tail(result, packet);
+		g_ptr_array_add(merge_res->results, result);
+
+		/* the rows are between the EOF after the field definitions and the last EOF */
+		for (fields = 0; fields < result->length && !merge_packet_is_eof(g_queue_peek_nth(result, fields)); ++fields);
+		merge_res->buffered_rows += result->length - MIN(fields + 2, result->length);
+
+		/* all sub-results have to be in before the merge, don't let a unbounded one eat the memory */
+		if (config->shard_merge_max_rows > 0 && merge_res->buffered_rows > (guint64)config->shard_merge_max_rows) {
+			merge_res_error(merge_res, C("Proxy Warning - Sharded result is too large to merge, see --shard-merge-max-rows"), ER_UNKNOWN_ERROR, "HY000");
+		}
+		return;
+	}
+
+	gboolean is_field = TRUE;
+	while ((packet = g_queue_pop_head(chunks))) {
+		gboolean is_eof = merge_packet_is_eof(packet);
+
+		if (is_field) {
+			if (is_eof) is_field = FALSE;
+
+			if (merge_res->is_fields_sent) {
+				g_string_free(packet, TRUE);
+			} else {
+				network_mysqld_queue_append_raw(client, client->send_queue, packet);
+			}
+		} else if (is_eof) {
+			merge_eof_packet(merge_res, packet);
+			g_string_free(packet, TRUE);
+		} else if (merge_res->offset > 0) {
+			--merge_res->offset;
+			g_string_free(packet, TRUE);
+		} else if (merge_res->sent_rows < merge_res->limit) {
+			network_mysqld_queue_append_raw(client, client->send_queue, packet);
+			++merge_res->sent_rows;
+		} else {
+			g_string_free(packet, TRUE);
+		}
+	}
+
+	merge_res->is_fields_sent = TRUE;
+}
+
+/**
+ * how the values of a column compare, they come as text
+ */
+typedef enum {
+	MERGE_KEY_STRING,
+	MERGE_KEY_INT,            /**< the integer types as gint64 */
+	MERGE_KEY_UINT,           /**< the UNSIGNED integer types as guint64 */
+	MERGE_KEY_DECIMAL,        /**< DECIMAL digit by digit, it has more digits than a double */
+	MERGE_KEY_DOUBLE          /**< FLOAT and DOUBLE */
+} merge_key_type_t;
+
+/**
+ * a ORDER BY column resolved against the field definitions
+ */
+typedef struct {
+	guint column;
+	gboolean is_desc;
+	merge_key_type_t type;
+	gboolean is_binary;
+} merge_key_t;
+
+/**
+ * the current row of a sorted sub-result
+ */
+typedef struct {
+	GQueue* result;
+	GString* row;
+	const gchar** values;   /**< the ORDER BY columns of the row, NULL for SQL NULL */
+	guint64* lens;
+} merge_cursor_t;
+
+static merge_key_type_t merge_key_type(network_mysqld_proto_fielddef_t* field) {
+	switch (field->type) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_INT24:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_LONGLONG:
+	case MYSQL_TYPE_YEAR:
+		return (field->flags & UNSIGNED_FLAG) ? MERGE_KEY_UINT : MERGE_KEY_INT;
+	case MYSQL_TYPE_DECIMAL:
+	case MYSQL_TYPE_NEWDECIMAL:
+		return MERGE_KEY_DECIMAL;
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+		return MERGE_KEY_DOUBLE;
+	default:
+		return MERGE_KEY_STRING;
+	}
+}
+
+static gdouble merge_value_to_double(const gchar* value, guint64 len) {
+	gchar buf[128];
+
+	len = MIN(len, sizeof(buf) - 1);
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	return g_ascii_strtod(buf, NULL);
+}
+
+static gint64 merge_value_to_int64(const gchar* value, guint64 len) {
+	gchar buf[32];
+
+	len = MIN(len, sizeof(buf) - 1);
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	return g_ascii_strtoll(buf, NULL, 10);
+}
+
+static guint64 merge_value_to_uint64(const gchar* value, guint64 len) {
+	gchar buf[32];
+
+	len = MIN(len, sizeof(buf) - 1);
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	return g_ascii_strtoull(buf, NULL, 10);
+}
+
+/**
+ * a DECIMAL as text split in its sign and digits
+ */
+typedef struct {
+	gboolean is_negative;
+	const gchar* digits;      /**< the integer part without leading zeros */
+	guint64 int_len;
+	const gchar* frac;        /**< the fraction without trailing zeros */
+	guint64 frac_len;
+} merge_decimal_t;
+
+static void merge_decimal_parse(const gchar* value, guint64 len, merge_decimal_t* d) {
+	const gchar* end = value + len;
+	const gchar* dot;
+
+	d->is_negative = FALSE;
+	if (value < end && (*value == '-' || *value == '+')) d->is_negative = (*value++ == '-');
+	while (value < end && *value == '0') ++value;
+
+	dot = memchr(value, '.', end - value);
+	d->digits = value;
+	d->int_len = (dot ? dot : end) - value;
+	d->frac = dot ? dot + 1 : end;
+	d->frac_len = end - d->frac;
+	while (d->frac_len > 0 && d->frac[d->frac_len - 1] == '0') --d->frac_len;
+
+	if (d->int_len == 0 && d->frac_len == 0) d->is_negative = FALSE; /* -0.00 */
+}
+
+/**
+ * compare two DECIMALs by sign, number of integer digits and then the digits
+ */
+static gint merge_decimal_cmp(const gchar* va, guint64 la, const gchar* vb, guint64 lb) {
+	merge_decimal_t a, b;
+	gint r;
+
+	merge_decimal_parse(va, la, &a);
+	merge_decimal_parse(vb, lb, &b);
+
+	if (a.is_negative != b.is_negative) return a.is_negative ? -1 : 1;
+
+	if (a.int_len != b.int_len) {
+		r = (a.int_len > b.int_len) ? 1 : -1;
+	} else if (0 == (r = memcmp(a.digits, b.digits, a.int_len))) {
+		r = memcmp(a.frac, b.frac, MIN(a.frac_len, b.frac_len));
+		if (r == 0) r = (a.frac_len > b.frac_len) - (a.frac_len < b.frac_len);
+	}
+	r = (r > 0) - (r < 0);
+
+	return a.is_negative ? -r : r;
+}
+
+static gint merge_value_cmp(const gchar* va, guint64 la, const gchar* vb, guint64 lb, merge_key_t* key) {
+	gint r;
+
+	if (va == NULL || vb == NULL) return (va != NULL) - (vb != NULL); /* NULL comes first like in MySQL */
+
+	switch (key->type) {
+	case MERGE_KEY_INT: {
+		gint64 ia = merge_value_to_int64(va, la);
+		gint64 ib = merge_value_to_int64(vb, lb);
+		r = (ia > ib) - (ia < ib);
+		break;
+	}
+	case MERGE_KEY_UINT: {
+		guint64 ua = merge_value_to_uint64(va, la);
+		guint64 ub = merge_value_to_uint64(vb, lb);
+		r = (ua > ub) - (ua < ub);
+		break;
+	}
+	case MERGE_KEY_DECIMAL:
+		r = merge_decimal_cmp(va, la, vb, lb);
+		break;
+	case MERGE_KEY_DOUBLE: {
+		gdouble da = merge_value_to_double(va, la);
+		gdouble db = merge_value_to_double(vb, lb);
+		r = (da > db) - (da < db);
+		break;
+	}
+	default:
+		r = key->is_binary ? memcmp(va, vb, MIN(la, lb)) : g_ascii_strncasecmp(va, vb, MIN(la, lb));
+		if (r == 0) r = (la > lb) - (la < lb);
+		break;
+	}
+
+	return r;
+}
+
+static gint merge_cursor_cmp(merge_cursor_t* a, merge_cursor_t* b, merge_key_t* keys, guint nkeys) {
+	guint k;
+
+	for (k = 0; k < nkeys; ++k) {
+		gint r = merge_value_cmp(a->values[k], a->lens[k], b->values[k], b->lens[k], &keys[k]);
+		if (r != 0) return keys[k].is_desc ? -r : r;
+	}
+
+	return 0;
+}
+
+/**
+ * decode the columns of a row, values[] points into the packet, NULL for SQL NULL
+ */
+static gboolean merge_row_values(GString* packet, const gchar** values, guint64* lens, guint ncolumns) {
+	network_packet p;
+	guint column;
+
+	if ((guchar)packet->str[NET_HEADER_SIZE] == MYSQLD_PACKET_ERR) return FALSE;
+
+	p.data = packet;
+	p.offset = NET_HEADER_SIZE;
+
+	for (column = 0; column < ncolumns; ++column) {
+		network_mysqld_lenenc_type lenenc_type;
+
+		if (network_mysqld_proto_peek_lenenc_type(&p, &lenenc_type)) return FALSE;
+
+		if (lenenc_type == NETWORK_MYSQLD_LENENC_TYPE_NULL) {
+			network_mysqld_proto_skip(&p, 1);
+			values[column] = NULL;
+			lens[column] = 0;
+		} else {
+			if (network_mysqld_proto_get_lenenc_int(&p, &lens[column])) return FALSE;
+			if (network_mysqld_proto_skip(&p, lens[column])) return FALSE;
+			values[column] = p.data->str + p.offset - lens[column];
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * resolve the ORDER BY columns against the field definitions of the result
+ *
+ * @return FALSE if a column isn't part of the result
+ */
+static gboolean merge_order_keys(GPtrArray* order_by, GPtrArray* fields, merge_key_t* keys) {
+	guint i;
+
+	for (i = 0; i < order_by->len; ++i) {
+		merge_order_t* order = g_ptr_array_index(order_by, i);
+		guint column = fields->len;
+
+		if (order->name == NULL) {
+			if (order->pos > 0) column = order->pos - 1;
+		} else {
+			for (column = 0; column < fields->len; ++column) {
+				network_mysqld_proto_fielddef_t* field = g_ptr_array_index(fields, column);
+				if (field->name && g_ascii_strcasecmp(field->name, order->name) == 0) break;
+			}
+		}
+		if (column >= fields->len) return FALSE;
+
+		network_mysqld_proto_fielddef_t* field = g_ptr_array_index(fields, column);
+		keys[i].column = column;
+		keys[i].is_desc = order->is_desc;
+		keys[i].type = merge_key_type(field);
+		keys[i].is_binary = (field->charsetnr == 63);
+	}
+
+	return TRUE;
+}
+
+/**
+ * move the cursor to the next row of its sub-result and decode the ORDER BY columns of it
+ *
+ * @return FALSE if the sub-result has no rows left
+ */
+static gboolean merge_cursor_next(merge_res_t* merge_res, merge_cursor_t* cursor, merge_key_t* keys, guint nkeys, guint max_column) {
+	GString* packet = g_queue_pop_head(cursor->result);
+	guint column, k;
+
+	cursor->row = NULL;
+
+	if (packet == NULL) return FALSE;
+
+	if (merge_packet_is_eof(packet) || (guchar)packet->str[NET_HEADER_SIZE] == MYSQLD_PACKET_ERR) {
+		if (merge_packet_is_eof(packet)) merge_eof_packet(merge_res, packet);
+		g_string_free(packet, TRUE);
+		return FALSE;
+	}
+
+	network_packet p;
+	p.data = packet;
+	p.offset = NET_HEADER_SIZE;
+
+	for (column = 0; column <= max_column; ++column) {
+		network_mysqld_lenenc_type lenenc_type;
+		const gchar* value = NULL;
+		guint64 len = 0;
+
+		if (network_mysqld_proto_peek_lenenc_type(&p, &lenenc_type)) break;
+
+		if (lenenc_type == NETWORK_MYSQLD_LENENC_TYPE_NULL) {
+			network_mysqld_proto_skip(&p, 1);
+		} else {
+			network_mysqld_proto_get_lenenc_int(&p, &len);
+			value = p.data->str + p.offset;
+			network_mysqld_proto_skip(&p, len);
+		}
+
+		for (k = 0; k < nkeys; ++k) {
+			if (keys[k].column == column) {
+				cursor->values[k] = value;
+				cursor->lens[k] = len;
+			}
+		}
+	}
+
+	cursor->row = packet;
+	return TRUE;
+}
+
+static void merge_heap_down(merge_cursor_t** heap, guint n, guint i, merge_key_t* keys, guint nkeys) {
+	while (TRUE) {
+		guint l = 2 * i + 1, r = l + 1, m = i;
+
+		if (l < n && merge_cursor_cmp(heap[l], heap[m], keys, nkeys) < 0) m = l;
+		if (r < n && merge_cursor_cmp(heap[r], heap[m], keys, nkeys) < 0) m = r;
+		if (m == i) return;
+
+		merge_cursor_t* tmp = heap[i];
+		heap[i] = heap[m];
+		heap[m] = tmp;
+		i = m;
+	}
+}
+
+/**
+ * k-way merge of the sorted sub-results on the ORDER BY columns
+ *
+ * every table already sorted and limited its rows, a heap with the current row of each
+ * sub-result picks the next one until offset + limit rows are through
+ */
+static void merge_rows_ordered(network_mysqld_con* con) {
+	merge_res_t* merge_res = con->merge_res;
+	network_socket* client = con->client;
+	GPtrArray* results = merge_res->results;
+	guint nkeys = merge_res->order_by->len;
+	guint max_column = 0;
+	GString* packet;
+	guint i, n;
+
+	GPtrArray* fields = network_mysqld_proto_fielddefs_new();
+	GQueue* first = g_ptr_array_index(results, 0);
+	network_mysqld_proto_get_fielddefs(first->head, fields);
+
+	merge_key_t* keys = g_new0(merge_key_t, nkeys);
+	gboolean is_resolved = merge_order_keys(merge_res->order_by, fields, keys);
+	network_mysqld_proto_fielddefs_free(fields);
+
+	for (i = 0; i < nkeys; ++i) max_column = MAX(max_column, keys[i].column);
+
+	if (!is_resolved) {
+		/* a ORDER BY column isn't part of the result, concatenate the sub-results */
+		merge_order_clear(merge_res->order_by);
+		for (i = 0; i < results->len; ++i) merge_rows_forward(con, g_ptr_array_index(results, i));
+
+		g_free(keys);
+		merge_res_reset(merge_res);
+		return;
+	}
+
+	merge_cursor_t* cursors = g_new0(merge_cursor_t, results->len);
+	merge_cursor_t** heap = g_new0(merge_cursor_t*, results->len);
+
+	for (i = 0, n = 0; i < results->len; ++i) {
+		merge_cursor_t* cursor = &cursors[i];
+
+		cursor->result = g_ptr_array_index(results, i);
+		cursor->values = g_new0(const gchar*, nkeys);
+		cursor->lens = g_new0(guint64, nkeys);
+
+		/* the field definitions of the first sub-result go to the client */
+		gboolean is_field = TRUE;
+		while (is_field && (packet = g_queue_pop_head(cursor->result))) {
+			is_field = !merge_packet_is_eof(packet);
+
+			if (i == 0) {
+				network_mysqld_queue_append_raw(client, client->send_queue, packet);
+			} else {
+				g_string_free(packet, TRUE);
+			}
+		}
+
+		if (merge_cursor_next(merge_res, cursor, keys, nkeys, max_column)) heap[n++] = cursor;
+	}
+	merge_res->is_fields_sent = TRUE;
+
+	for (i = n / 2; i-- > 0; ) merge_heap_down(heap, n, i, keys, nkeys);
+
+	while (n > 0 && merge_res->sent_rows < merge_res->limit) {
+		merge_cursor_t* top = heap[0];
+
+		if (merge_res->offset > 0) {
+			--merge_res->offset;
+			g_string_free(top->row, TRUE);
+		} else {
+			network_mysqld_queue_append_raw(client, client->send_queue, top->row);
+			++merge_res->sent_rows;
+		}
+
+		if (!merge_cursor_next(merge_res, top, keys, nkeys, max_column)) heap[0] = heap[--n];
+		merge_heap_down(heap, n, 0, keys, nkeys);
+	}
+
+	for (i = 0; i < results->len; ++i) {
+		if (cursors[i].row) g_string_free(cursors[i].row, TRUE);
+		g_free(cursors[i].values);
+		g_free(cursors[i].lens);
+	}
+	g_free(cursors);
+	g_free(heap);
+	g_free(keys);
+
+	merge_res_reset(merge_res);
+}
+
+/**
+ * a column of the aggregated result and where its values are in the rows of the tables
+ */
+typedef struct {
+	merge_agg_type_t type;
+	guint sub;                /**< column of the sub-results, AVG has its COUNT there and its SUM in the next one */
+	network_mysqld_proto_fielddef_t* field;
+	gboolean is_exact;        /**< SUM and AVG of integers and DECIMAL, added up digit by digit in dsum */
+	merge_key_t key;          /**< how MIN and MAX compare */
+} merge_agg_column_t;
+
+#define MERGE_DECIMAL_BASE       G_GINT64_CONSTANT(1000000000)
+#define MERGE_DECIMAL_LIMBS      10    /**< 9 digits each */
+#define MERGE_DECIMAL_MAX_DIGITS 65    /**< the precision of a DECIMAL, a sum beyond it is out of range */
+
+/**
+ * the value of a column in a group
+ */
+typedef struct {
+	GString* value;           /**< GROUP, FIRST, MIN and MAX, NULL for SQL NULL */
+	gint64 count;             /**< COUNT, the rows of AVG */
+	gint64 dsum[MERGE_DECIMAL_LIMBS]; /**< exact SUM and AVG, scaled by 10^decimals of the field, the least significant limb first */
+	gdouble sum;              /**< SUM and AVG of FLOAT and DOUBLE */
+	gboolean is_set;          /**< the group has a value for it */
+	gboolean is_overflow;     /**< dsum is out of range */
+} merge_agg_value_t;
+
+static const gint64 merge_decimal_pow10[9] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+
+/**
+ * carry the limbs into [0, 10^9), the last one keeps the sign
+ */
+static void merge_decimal_normalize(gint64* limbs) {
+	guint i;
+
+	for (i = 0; i + 1 < MERGE_DECIMAL_LIMBS; ++i) {
+		gint64 carry = limbs[i] / MERGE_DECIMAL_BASE;
+
+		limbs[i] -= carry * MERGE_DECIMAL_BASE;
+		if (limbs[i] < 0) {
+			limbs[i] += MERGE_DECIMAL_BASE;
+			--carry;
+		}
+		limbs[i + 1] += carry;
+	}
+}
+
+/**
+ * add a DECIMAL to a sum which is scaled by 10^scale
+ *
+ * @return FALSE if the value has more digits than a DECIMAL or more decimals than scale
+ */
+static gboolean merge_decimal_add(gint64* limbs, const gchar* value, guint64 len, guint scale) {
+	merge_decimal_t d;
+	guint64 pos;
+
+	merge_decimal_parse(value, len, &d);
+	if (d.frac_len > scale || d.int_len + scale > MERGE_DECIMAL_MAX_DIGITS) return FALSE;
+
+	/* from the last digit of the scaled value to the first one */
+	for (pos = 0; pos < d.int_len + scale; ++pos) {
+		gint digit;
+
+		if (pos < scale) {
+			guint64 f = scale - 1 - pos;
+			digit = (f < d.frac_len) ? d.frac[f] - '0' : 0;
+		} else {
+			digit = d.digits[d.int_len - 1 - (pos - scale)] - '0';
+		}
+		if (digit < 0 || digit > 9) return FALSE;
+
+		limbs[pos / 9] += (d.is_negative ? -digit : digit) * merge_decimal_pow10[pos % 9];
+	}
+	merge_decimal_normalize(limbs);
+
+	return TRUE;
+}
+
+/**
+ * the digits of the absolute value of a sum without leading zeros, none for 0
+ *
+ * @return TRUE if the sum is negative
+ */
+static gboolean merge_decimal_digits(const gint64* sum, GString* digits) {
+	gint64 limbs[MERGE_DECIMAL_LIMBS];
+	gboolean is_negative = (sum[MERGE_DECIMAL_LIMBS - 1] < 0);
+	gint i;
+
+	for (i = 0; i < MERGE_DECIMAL_LIMBS; ++i) limbs[i] = is_negative ? -sum[i] : sum[i];
+	if (is_negative) merge_decimal_normalize(limbs);
+
+	g_string_truncate(digits, 0);
+	for (i = MERGE_DECIMAL_LIMBS - 1; i >= 0; --i) {
+		if (digits->len > 0) {
+			g_string_append_printf(digits, "%09"G_GINT64_FORMAT, limbs[i]);
+		} else if (limbs[i] != 0) {
+			g_string_append_printf(digits, "%"G_GINT64_FORMAT, limbs[i]);
+		}
+	}
+
+	return is_negative;
+}
+
+/**
+ * divide the digits of a sum scaled by 10^scale by count, rounded half up to out_scale decimals
+ *
+ * @return FALSE if count is too large for the long division
+ */
+static gboolean merge_decimal_div(GString* digits, guint scale, guint out_scale, guint64 count, GString* quotient) {
+	guint64 rem = 0;
+	gsize i, n;
+
+	if (count == 0 || count > G_MAXUINT64 / 10) return FALSE;
+
+	/* one more digit to round on */
+	n = digits->len + (out_scale - scale) + 1;
+
+	g_string_truncate(quotient, 0);
+	for (i = 0; i < n; ++i) {
+		rem = rem * 10 + (i < digits->len ? digits->str[i] - '0' : 0);
+		g_string_append_c(quotient, '0' + (gchar)(rem / count));
+		rem %= count;
+	}
+
+	if (quotient->str[--n] >= '5') {
+		for (i = n; i > 0 && quotient->str[i - 1] == '9'; --i) quotient->str[i - 1] = '0';
+
+		if (i > 0) {
+			quotient->str[i - 1]++;
+		} else {
+			g_string_prepend_c(quotient, '1');
+			++n;
+		}
+	}
+	g_string_truncate(quotient, n);
+
+	for (i = 0; i < quotient->len && quotient->str[i] == '0'; ++i);
+	g_string_erase(quotient, 0, i);
+
+	return TRUE;
+}
+
+/**
+ * append digits scaled by 10^scale as a DECIMAL
+ *
+ * @return FALSE if it has more digits than a DECIMAL
+ */
+static gboolean merge_agg_append_decimal(GString* row, GString* digits, gboolean is_negative, guint scale) {
+	GString* value;
+
+	if (digits->len > MERGE_DECIMAL_MAX_DIGITS) return FALSE;
+
+	value = g_string_sized_new(digits->len + scale + 3);
+	if (is_negative && digits->len > 0) g_string_append_c(value, '-');
+
+	if (digits->len > scale) {
+		g_string_append_len(value, digits->str, digits->len - scale);
+	} else {
+		g_string_append_c(value, '0');
+	}
+	if (scale > 0) {
+		g_string_append_c(value, '.');
+		if (digits->len < scale) {
+			gsize zeros = scale - digits->len;
+			while (zeros--) g_string_append_c(value, '0');
+			g_string_append_len(value, S(digits));
+		} else {
+			g_string_append_len(value, digits->str + digits->len - scale, scale);
+		}
+	}
+
+	network_mysqld_proto_append_lenenc_string_len(row, S(value));
+	g_string_free(value, TRUE);
+
+	return TRUE;
+}
+
+static void merge_agg_add(merge_agg_column_t* column, merge_agg_value_t* agg, const gchar** values, guint64* lens) {
+	const gchar* value = values[column->sub];
+	guint64 len = lens[column->sub];
+
+	switch (column->type) {
+	case MERGE_AGG_GROUP:
+	case MERGE_AGG_FIRST:
+		if (!agg->is_set && value) agg->value = g_string_new_len(value, len);
+		agg->is_set = TRUE;
+		break;
+	case MERGE_AGG_COUNT:
+		if (value) agg->count += merge_value_to_int64(value, len);
+		break;
+	case MERGE_AGG_SUM:
+		if (value == NULL) break;
+
+		if (!column->is_exact) {
+			agg->sum += merge_value_to_double(value, len);
+		} else if (!merge_decimal_add(agg->dsum, value, len, column->field->decimals)) {
+			agg->is_overflow = TRUE;
+		}
+		agg->is_set = TRUE;
+		break;
+	case MERGE_AGG_MIN:
+	case MERGE_AGG_MAX:
+		if (value == NULL) break;
+
+		if (agg->is_set) {
+			gint r = merge_value_cmp(value, len, S(agg->value), &column->key);
+			if (column->type == MERGE_AGG_MIN ? r >= 0 : r <= 0) break;
+
+			g_string_truncate(agg->value, 0);
+			g_string_append_len(agg->value, value, len);
+		} else {
+			agg->value = g_string_new_len(value, len);
+			agg->is_set = TRUE;
+		}
+		break;
+	case MERGE_AGG_AVG:
+		if (value) agg->count += merge_value_to_int64(value, len);
+
+		value = values[column->sub + 1];
+		len = lens[column->sub + 1];
+		if (value == NULL) break;
+
+		if (!column->is_exact) {
+			agg->sum += merge_value_to_double(value, len);
+		} else if (!merge_decimal_add(agg->dsum, value, len, column->field->decimals)) {
+			agg->is_overflow = TRUE;
+		}
+		break;
+	}
+}
+
+static void merge_agg_append_double(GString* row, gdouble d, guint decimals) {
+	gchar format[8], buf[400];
+
+	if (decimals >= 31) {
+		/* FLOAT and DOUBLE without a fixed scale */
+		g_strlcpy(format, "%.15g", sizeof(format));
+	} else {
+		g_snprintf(format, sizeof(format), "%%.%uf", decimals);
+	}
+	g_ascii_formatd(buf, sizeof(buf), format, d);
+	network_mysqld_proto_append_lenenc_string_len(row, buf, strlen(buf));
+}
+
+/**
+ * append the value of a column of a group to a row packet
+ *
+ * @return FALSE if a SUM or AVG is out of range
+ */
+static gboolean merge_agg_append(GString* row, merge_agg_column_t* column, merge_agg_value_t* agg) {
+	gboolean is_ok = TRUE;
+	gchar buf[32];
+
+	switch (column->type) {
+	case MERGE_AGG_COUNT:
+		g_snprintf(buf, sizeof(buf), "%"G_GINT64_FORMAT, agg->count);
+		network_mysqld_proto_append_lenenc_string_len(row, buf, strlen(buf));
+		break;
+	case MERGE_AGG_SUM:
+		if (!agg->is_set) {
+			network_mysqld_proto_append_lenenc_string_len(row, NULL, 0);
+		} else if (column->is_exact) {
+			GString* digits = g_string_new(NULL);
+			gboolean is_negative = merge_decimal_digits(agg->dsum, digits);
+
+			is_ok = !agg->is_overflow && merge_agg_append_decimal(row, digits, is_negative, column->field->decimals);
+			g_string_free(digits, TRUE);
+		} else {
+			merge_agg_append_double(row, agg->sum, column->field->decimals);
+		}
+		break;
+	case MERGE_AGG_AVG:
+		if (agg->count == 0) {
+			network_mysqld_proto_append_lenenc_string_len(row, NULL, 0);
+		} else if (column->is_exact) {
+			/* AVG() has 4 decimals more than its argument */
+			guint decimals = column->field->decimals;
+			GString* digits = g_string_new(NULL);
+			GString* quotient = g_string_new(NULL);
+			gboolean is_negative = merge_decimal_digits(agg->dsum, digits);
+
+			is_ok = !agg->is_overflow &&
+				merge_decimal_div(digits, decimals, MIN(decimals + 4, 30), agg->count, quotient) &&
+				merge_agg_append_decimal(row, quotient, is_negative, MIN(decimals + 4, 30));
+			g_string_free(quotient, TRUE);
+			g_string_free(digits, TRUE);
+		} else {
+			guint decimals = column->field->decimals;
+			merge_agg_append_double(row, agg->sum / agg->count, decimals >= 31 ? decimals : MIN(decimals + 4, 30));
+		}
+		break;
+	default:
+		if (agg->value) {
+			network_mysqld_proto_append_lenenc_string_len(row, S(agg->value));
+		} else {
+			network_mysqld_proto_append_lenenc_string_len(row, NULL, 0);
+		}
+		break;
+	}
+
+	return is_ok;
+}
+
+typedef struct {
+	merge_key_t* keys;
+	guint nkeys;
+} merge_sort_t;
+
+static gint merge_cursor_sort(gconstpointer a, gconstpointer b, gpointer user_data) {
+	merge_sort_t* sort = user_data;
+
+	return merge_cursor_cmp(*(merge_cursor_t**)a, *(merge_cursor_t**)b, sort->keys, sort->nkeys);
+}
+
+/**
+ * merge the rows of the sub-results group by group
+ *
+ * each table returns COUNT, SUM, MIN and MAX of its own rows per group, they are added up or
+ * compared here, AVG comes as COUNT and SUM and is divided at the end. the groups are sorted on
+ * the ORDER BY, get_aggregates() put the GROUP BY there if there is none
+ *
+ * @return FALSE if a SUM or AVG is out of range, a ERR is sent instead of the result
+ */
+static gboolean merge_rows_aggregate(network_mysqld_con* con) {
+	merge_res_t* merge_res = con->merge_res;
+	network_socket* client = con->client;
+	GPtrArray* results = merge_res->results;
+	GArray* aggs = merge_res->aggs;
+	guint ncolumns = aggs->len, nsub = 0;
+	GString* packet;
+	guint i, j;
+
+	for (i = 0; i < ncolumns; ++i) nsub += (g_array_index(aggs, merge_agg_t, i).type == MERGE_AGG_AVG) ? 2 : 1;
+
+	GPtrArray* fields = network_mysqld_proto_fielddefs_new();
+	GQueue* first = g_ptr_array_index(results, 0);
+	network_mysqld_proto_get_fielddefs(first->head, fields);
+
+	if (fields->len != nsub) {
+		/* SELECT * next to a aggregate, the columns of the tables don't match the select list */
+		network_mysqld_proto_fielddefs_free(fields);
+		g_array_set_size(aggs, 0);
+
+		if (merge_res->order_by->len > 0) {
+			merge_rows_ordered(con);
+		} else {
+			for (i = 0; i < results->len; ++i) merge_rows_forward(con, g_ptr_array_index(results, i));
+			merge_res_reset(merge_res);
+		}
+		return TRUE;
+	}
+
+	merge_agg_column_t* columns = g_new0(merge_agg_column_t, ncolumns);
+	for (i = 0, j = 0; i < ncolumns; ++i) {
+		merge_agg_column_t* column = &columns[i];
+
+		column->type = g_array_index(aggs, merge_agg_t, i).type;
+		column->sub = j;
+		j += (column->type == MERGE_AGG_AVG) ? 2 : 1;
+
+		column->field = g_ptr_array_index(fields, j - 1); /* the SUM of AVG */
+		column->key.type = merge_key_type(column->field);
+		column->key.is_binary = (column->field->charsetnr == 63);
+		column->is_exact = (column->key.type == MERGE_KEY_INT || column->key.type == MERGE_KEY_UINT || column->key.type == MERGE_KEY_DECIMAL);
+	}
+
+	GHashTable* groups = g_hash_table_new_full(g_hash_table_string_hash, g_hash_table_string_equal, g_hash_table_string_free, NULL);
+	GPtrArray* group_list = g_ptr_array_new();   /* the groups in the order they came in */
+	GPtrArray* field_packets = g_ptr_array_new();
+	const gchar** values = g_new0(const gchar*, nsub);
+	guint64* lens = g_new0(guint64, nsub);
+	GString* key = g_string_new(NULL);
+
+	for (i = 0; i < results->len; ++i) {
+		GQueue* result = g_ptr_array_index(results, i);
+		gboolean is_field = TRUE;
+
+		packet = g_queue_pop_head(result); /* the field count */
+		g_string_free(packet, TRUE);
+
+		while ((packet = g_queue_pop_head(result))) {
+			if (is_field) {
+				is_field = !merge_packet_is_eof(packet);
+
+				if (i == 0 && is_field) {
+					g_ptr_array_add(field_packets, packet);
+					continue;
+				}
+			} else if (merge_packet_is_eof(packet)) {
+				merge_eof_packet(merge_res, packet);
+			} else if (merge_row_values(packet, values, lens, nsub)) {
+				merge_agg_value_t* group;
+
+				g_string_truncate(key, 0);
+				for (j = 0; j < ncolumns; ++j) {
+					guint sub = columns[j].sub;
+					gsize start;
+
+					if (columns[j].type != MERGE_AGG_GROUP) continue;
+
+					if (values[sub] == NULL) {
+						g_string_append_c(key, 'N');
+						continue;
+					}
+
+					g_string_append_printf(key, "%"G_GUINT64_FORMAT":", lens[sub]);
+					start = key->len;
+					g_string_append_len(key, values[sub], lens[sub]);
+
+					/* 'a' and 'A' are the same group in a case-insensitive collation */
+					if (!columns[j].key.is_binary) {
+						for (; start < key->len; ++start) key->str[start] = g_ascii_tolower(key->str[start]);
+					}
+				}
+
+				group = g_hash_table_lookup(groups, key);
+				if (group == NULL) {
+					group = g_new0(merge_agg_value_t, ncolumns);
+					g_hash_table_insert(groups, g_string_new_len(S(key)), group);
+					g_ptr_array_add(group_list, group);
+				}
+
+				for (j = 0; j < ncolumns; ++j) merge_agg_add(&columns[j], &group[j], values, lens);
+			}
+
+			g_string_free(packet, TRUE);
+		}
+	}
+
+	/* the groups become rows */
+	merge_sort_t sort;
+	sort.nkeys = merge_res->order_by->len;
+	sort.keys = g_new0(merge_key_t, sort.nkeys + 1);
+
+	GPtrArray* out_fields = g_ptr_array_sized_new(ncolumns);
+	for (i = 0; i < ncolumns; ++i) g_ptr_array_add(out_fields, columns[i].field);
+	if (!merge_order_keys(merge_res->order_by, out_fields, sort.keys)) sort.nkeys = 0; /* the groups stay as they came in */
+	g_ptr_array_free(out_fields, TRUE);
+
+	merge_cursor_t* cursors = g_new0(merge_cursor_t, group_list->len);
+	GPtrArray* rows = g_ptr_array_sized_new(group_list->len);
+	const gchar** row_values = g_new0(const gchar*, ncolumns);
+	guint64* row_lens = g_new0(guint64, ncolumns);
+	gboolean is_out_of_range = FALSE;
+
+	for (i = 0; i < group_list->len; ++i) {
+		merge_agg_value_t* group = g_ptr_array_index(group_list, i);
+		merge_cursor_t* cursor = &cursors[i];
+		GString* row = g_string_sized_new(64);
+
+		g_string_append_len(row, C("\0\0\0\0"));
+		for (j = 0; j < ncolumns; ++j) {
+			if (!merge_agg_append(row, &columns[j], &group[j])) is_out_of_range = TRUE;
+			if (group[j].value) g_string_free(group[j].value, TRUE);
+		}
+		network_mysqld_proto_set_packet_len(row, row->len - NET_HEADER_SIZE);
+		network_mysqld_proto_set_packet_id(row, 0);
+		g_free(group);
+
+		cursor->row = row;
+		cursor->values = g_new0(const gchar*, sort.nkeys + 1);
+		cursor->lens = g_new0(guint64, sort.nkeys + 1);
+		if (sort.nkeys > 0 && merge_row_values(row, row_values, row_lens, ncolumns)) {
+			for (j = 0; j < sort.nkeys; ++j) {
+				cursor->values[j] = row_values[sort.keys[j].column];
+				cursor->lens[j] = row_lens[sort.keys[j].column];
+			}
+		}
+
+		g_ptr_array_add(rows, cursor);
+	}
+
+	if (is_out_of_range) {
+		network_mysqld_con_send_error_full(client, C("Proxy Warning - SUM or AVG over the shards is out of range"), ER_UNKNOWN_ERROR, "22003");
+
+		for (i = 0; i < field_packets->len; ++i) g_string_free(g_ptr_array_index(field_packets, i), TRUE);
+	} else {
+		/* the result-set: the fields of the select list, AVG gets the definition of its SUM */
+		packet = g_string_new(NULL);
+		network_mysqld_proto_append_lenenc_int(packet, ncolumns);
+		network_mysqld_queue_append(client, client->send_queue, S(packet));
+		g_string_free(packet, TRUE);
+
+		for (i = 0; i < field_packets->len; ++i) {
+			for (j = 0; j < ncolumns && columns[j].sub + (columns[j].type == MERGE_AGG_AVG) != i; ++j);
+
+			packet = g_ptr_array_index(field_packets, i);
+			if (j < ncolumns) {
+				network_mysqld_queue_append_raw(client, client->send_queue, packet);
+			} else {
+				g_string_free(packet, TRUE);
+			}
+		}
+
+		network_mysqld_eof_packet_t* eof_packet = network_mysqld_eof_packet_new();
+		packet = g_string_new(NULL);
+		eof_packet->server_status = merge_res->server_status;
+		network_mysqld_proto_append_eof_packet(packet, eof_packet);
+		network_mysqld_queue_append(client, client->send_queue, S(packet));
+		g_string_free(packet, TRUE);
+		network_mysqld_eof_packet_free(eof_packet);
+
+		merge_res->is_fields_sent = TRUE;
+	}
+
+	if (!is_out_of_range && sort.nkeys > 0) g_ptr_array_sort_with_data(rows, merge_cursor_sort, &sort);
+
+	for (i = 0; i < rows->len; ++i) {
+		merge_cursor_t* cursor = g_ptr_array_index(rows, i);
+
+		if (is_out_of_range) {
+			g_string_free(cursor->row, TRUE);
+		} else if (merge_res->offset > 0) {
+			--merge_res->offset;
+			g_string_free(cursor->row, TRUE);
+		} else if (merge_res->sent_rows < merge_res->limit) {
+			network_mysqld_queue_append_raw(client, client->send_queue, cursor->row);
+			++merge_res->sent_rows;
+		} else {
+			g_string_free(cursor->row, TRUE);
+		}
+
+		g_free(cursor->values);
+		g_free(cursor->lens);
+	}
+
+	g_ptr_array_free(rows, TRUE);
+	g_free(cursors);
+	g_free(row_values);
+	g_free(row_lens);
+	g_free(sort.keys);
+	g_string_free(key, TRUE);
+	g_free(values);
+	g_free(lens);
+	g_ptr_array_free(field_packets, TRUE);
+	g_ptr_array_free(group_list, TRUE);
+	g_hash_table_destroy(groups);
+	g_free(columns);
+	network_mysqld_proto_fielddefs_free(fields);
+
+	merge_res_reset(merge_res);
+
+	return !is_out_of_range;
+}
+
+static void merge_rows_finish(network_mysqld_con* con) {
+	merge_res_t* merge_res = con->merge_res;
+
+	if (merge_res->error) {
+		network_mysqld_queue_append(con->client, con->client->send_queue, S(merge_res->error));
+		merge_res_reset(merge_res);
+		return;
+	}
+
+	if (merge_res->results->len > 0) {
+		if (merge_res->aggs->len > 0) {
+			if (!merge_rows_aggregate(con)) return;
+		} else {
+			merge_rows_ordered(con);
+		}
+	}
+
+	if (!merge_res->is_fields_sent) {
+		network_mysqld_con_send_ok_full(con->client, 0, 0, merge_res->server_status, merge_res->warnings);
+		return;
+	}
+
+	network_mysqld_eof_packet_t* eof_packet = network_mysqld_eof_packet_new();
+	GString* packet = g_string_new(NULL);
+
+	eof_packet->server_status = merge_res->server_status;
+	eof_packet->warnings = merge_res->warnings;
+	network_mysqld_proto_append_eof_packet(packet, eof_packet);
+
+	network_mysqld_queue_append(con->client, con->client->send_queue, S(packet));
+
+	g_string_free(packet, TRUE);
+	network_mysqld_eof_packet_free(eof_packet);
+}
+
+/**
+ * the id of a ipv4 address in the binary sql-log
+ */
+static guint64 sql_log_address(network_address *addr) {
+	if (addr->addr.common.sa_family != AF_INET) return 0;
+
+	return ((guint64)ntohl(addr->addr.ipv4.sin_addr.s_addr) << 16) | ntohs(addr->addr.ipv4.sin_port);
+}
+
+void log_sql(network_mysqld_con* con, network_socket* server, injection* inj) {
+	if (sql_log_type == OFF) return;
+	
+	float latency_ms = (inj->ts_read_query_result_last - inj->ts_read_query)/1000.0;
+	guint ndx = chassis_event_thread_index();
+	gboolean is_error = (inj->qstat.query_status != MYSQLD_PACKET_OK);
+	gboolean log_all = (config->sql_log_errors && is_error);
+	guint64 digest = 0;
+	GString* message;
+
+	if (!log_all) {
+		if ((gint)latency_ms < config->sql_log_slow_ms) return;
+
+		if (!sql_log_sample(config->sql_log, ndx, config->sql_log_sample)) return;
+	}
+
+	if (config->sql_log_digest_rate > 0 || (config->sql_log_flags & SQL_LOG_BINARY)) {
+		GString *default_db = con->client->default_db;
+
+		message = sql_log_scratch(config->sql_log, ndx);
+		g_string_append_len(message, default_db->str, default_db->len + 1);
+		sql_fingerprint(message, inj->query->str + 1, inj->query->len - 1, G_MAXSIZE);
+		digest = sql_log_digest(S(message));
+
+		if (!log_all && config->sql_log_digest_rate > 0 && !sql_log_limit(config->sql_log, ndx, digest, config->sql_log_digest_rate)) return;
+	}
+
+	/* built in the buffer of this thread, the writer-thread does the write() */
+	message = sql_log_scratch(config->sql_log, ndx);
+
+	if (config->sql_log_flags & SQL_LOG_BINARY) {
+		sql_log_record_t rec;
+
+		rec.flags = is_error ? SQL_LOG_RECORD_ERR : 0;
+		rec.time = time(NULL);
+		rec.latency_us = inj->ts_read_query_result_last - inj->ts_read_query;
+		rec.client = sql_log_address(con->client->src);
+		rec.backend = sql_log_address(server->dst);
+		rec.digest = digest;
+		rec.rows = inj->rows;
+		rec.bytes = inj->bytes;
+		rec.query = inj->query->str + 1;
+		rec.query_len = inj->query->len - 1;
+
+		sql_log_record_append(message, &rec);
+	} else {
+		g_string_append(message, sql_log_timestamp(config->sql_log, ndx));
+		g_string_append_printf(message, " C:%s S:%s %s %.3f \"%s\"\n", con->client->src->name->str, server->dst->name->str,
+				is_error ? "ERR" : "OK", latency_ms, inj->query->str+1);
+	}
+
+	sql_log_append(config->sql_log, ndx, S(message));
+}
+
+/**
+ * start counting a COM_QUERY of the client for SELECT * FROM query_stats
+ *
+ * the digest is taken from the query as the client sent it, before a sharded query is rewritten
+ */
+static void query_stats_start(network_mysqld_con *con, GString *packets) {
+	query_stats_trace_t *t = &(con->digest);
+	GString *default_db = con->client->default_db;
+
+	t->start = 0;
+
+	if (config->query_stats == NULL || packets->len == 0 || packets->str[0] != COM_QUERY) return;
+
+	if (t->key == NULL) t->key = g_string_sized_new(256);
+
+	/* the same key as the plan cache */
+	g_string_truncate(t->key, 0);
+	g_string_append_len(t->key, default_db->str, default_db->len + 1);
+	sql_fingerprint(t->key, packets->str + 1, packets->len - 1, QUERY_STATS_MAX_KEY);
+
+	t->start = chassis_get_rel_microseconds();
+	t->rows = t->bytes = 0;
+	t->is_error = FALSE;
+}
+
+/**
+ * a injection which runs the query of the client is done, a sharded query has several
+ */
+static void query_stats_add(network_mysqld_con *con, injection *inj) {
+	query_stats_trace_t *t = &(con->digest);
+
+	if (t->start == 0) return;
+
+	t->rows += inj->rows;
+	t->bytes += inj->bytes;
+	if (inj->qstat.query_status != MYSQLD_PACKET_OK) t->is_error = TRUE;
+}
+
+/**
+ * the last packet of the result is written to the client, count the query once
+ */
+static void query_stats_finish(network_mysqld_con *con) {
+	query_stats_trace_t *t = &(con->digest);
+
+	if (t->start == 0) return;
+
+	query_stats_record(config->query_stats, chassis_event_thread_index(), t->key, chassis_get_rel_microseconds() - t->start,
+			t->rows, t->bytes, t->is_error);
+	t->start = 0;
+}
+
+/**
+ * start tracing where the time of a query goes, for SELECT * FROM slow_queries
+ *
+ * the start of the query is kept for the processlist even if the recorder is off
+ */
+static void slow_query_start(network_mysqld_con *con, GString *packets) {
+	slow_query_trace_t *t = &(con->trace);
+
+	if (packets->len == 0) return;
+
+	if (config->slow_queries) {
+		memset(t, 0, G_STRUCT_OFFSET(slow_query_trace_t, query));
+		t->start = chassis_get_rel_microseconds();
+	}
+	t->command = packets->str[0];
+	t->query_len = 0;
+
+	/* the other commands are binary or have no arguments worth to show */
+	if (t->command == COM_QUERY || t->command == COM_INIT_DB) {
+		t->query_len = MIN(packets->len - 1, SLOW_QUERY_MAX_QUERY);
+		memcpy(t->query, packets->str + 1, t->query_len);
+	}
+}
+
+/**
+ * a injected query goes to the backend, everything until the first one is routing
+ */
+static void slow_query_sent(network_mysqld_con *con) {
+	slow_query_trace_t *t = &(con->trace);
+
+	if (t->start == 0) return;
+
+	t->sent = chassis_get_rel_microseconds();
+	if (t->repairs == 0 && t->queries == 0) t->route_us = t->sent - t->start - MIN(t->pool_us, t->sent - t->start);
+}
+
+/**
+ * the result of a query sent to the backend is complete
+ *
+ * COM_INIT_DB, SET NAMES and COM_CHANGE_USER only sync the server connection with the client,
+ * everything else is the query itself
+ *
+ * @param inj  NULL if the query was forwarded as is
+ */
+static void slow_query_received(network_mysqld_con *con, network_socket *server, injection *inj) {
+	slow_query_trace_t *t = &(con->trace);
+	guint64 now, us;
+
+	if (t->start == 0) return;
+
+	now = inj ? inj->ts_read_query_result_last : chassis_get_rel_microseconds();
+	us = now - MIN(t->sent, now);
+	if (inj && inj->id >= 2 && inj->id <= 6) {
+		t->repairs++;
+		t->repair_us += us;
+	} else {
+		t->queries++;
+		t->backend_us += us;
+		t->result_done = now;
+		if (inj && inj->qstat.query_status == MYSQLD_PACKET_ERR) t->is_error = TRUE;
+	}
+
+	if (server) g_strlcpy(t->backend, server->dst->name->str, sizeof(t->backend));
+}
+
+/**
+ * a sub-query of a fanned-out query is done, they run concurrently and the slowest one counts
+ */
+static void slow_query_shard_received(network_mysqld_con *con, injection *inj) {
+	slow_query_trace_t *t = &(con->trace);
+
+	if (t->start == 0) return;
+
+	t->queries++;
+	t->backend_us = MAX(t->backend_us, inj->ts_read_query_result_last - inj->ts_read_query);
+}
+
+/**
+ * the result for the client is complete without a injected query, the proxy answered itself
+ * or merged the results of a fanned-out query
+ */
+static void slow_query_answered(network_mysqld_con *con, gboolean is_error) {
+	slow_query_trace_t *t = &(con->trace);
+
+	if (t->start == 0) return;
+
+	t->result_done = chassis_get_rel_microseconds();
+	if (t->sent == 0) t->route_us = t->result_done - t->start - MIN(t->pool_us, t->result_done - t->start);
+	if (is_error) t->is_error = TRUE;
+}
+
+/**
+ * the last packet of the result is written to the client, record the query if it was slow
+ */
+static void slow_query_finish(network_mysqld_con *con) {
+	slow_query_trace_t *t = &(con->trace);
+	network_socket *client = con->client;
+	guint64 now, total_us;
+
+	if (t->start == 0) return;
+
+	now = chassis_get_rel_microseconds();
+	total_us = now - t->start;
+	t->start = 0;
+
+	if (total_us < config->slow_queries->threshold_us) return;
+
+	if (t->result_done) t->client_us = now - t->result_done;
+
+	slow_queries_record(config->slow_queries, chassis_event_thread_index(), t, total_us,
+			client->src->name->str,
+			client->response ? client->response->username->str : NULL,
+			client->default_db->str);
+}
+
+/**
+ * a sharded query whose sub-queries run concurrently, each one on its own backend connection
+ *
+ * the client connection stays in CON_STATE_READ_QUERY without any event until the last
+ * sub-query is done, fanout_finish() sends the merged result and resumes it
+ */
+typedef struct {
+	network_mysqld_con *con;
+	guint pending;                  /**< sub-queries which are still running */
+	GPtrArray *subs;                /**< the running fanout_sub_t, for KILL */
+	gboolean is_write;              /**< sum up the affected rows instead of merging the rows */
+	gboolean is_failed;             /**< a backend connection broke */
+	GString *error;                 /**< payload of the first ERR packet, it ends the merged result */
+	guint64 affected_rows;
+	guint16 warnings;
+	guint16 server_status;
+} fanout_t;
+
+typedef struct {
+	fanout_t *fanout;
+	network_backend_t *backend;
+	network_socket *sock;
+	GQueue *cmds;                   /**< COM_CHANGE_USER, SET CHARACTER_SET_*, COM_INIT_DB and the sub-query, sent one after the other */
+	injection *inj;                 /**< the sub-query, for the breaker and the sql-log */
+	gboolean is_reading;            /**< the head of cmds is sent, we wait for its response */
+	gboolean is_resultset;
+	guint eof_packets;              /**< a result-set ends with its second EOF packet */
+} fanout_sub_t;
+
+/**
+ * the commands which bring a pooled connection in line with the client before the sub-query
+ *
+ * same as modify_user(), modify_charset() and modify_db() do for con->server
+ */
+static GQueue *fanout_sub_cmds(network_mysqld_con *con, network_socket *sock, GString *query) {
+	GQueue *cmds = g_queue_new();
+	network_socket *client = con->client;
+	char cmd = COM_QUERY;
+
+	GString *expected_response = g_string_sized_new(20);
+	GString *com_change_user = com_change_user_new(con, sock, expected_response);
+	if (com_change_user) {
+		g_queue_push_tail(cmds, com_change_user);
+
+		if (sock->response) network_mysqld_auth_response_free(sock->response);
+		sock->response = network_mysqld_auth_response_copy(client->response);
+		g_string_assign_len(sock->response->response, S(expected_response));
+	}
+	g_string_free(expected_response, TRUE);
+
+	if (!g_string_equal(client->charset_client, sock->charset_client)) {
+		GString* set = g_string_new_len(&cmd, 1);
+		g_string_append(set, "SET CHARACTER_SET_CLIENT=");
+		g_string_append(set, client->charset_client->str);
+		g_string_assign_len(sock->charset_client, S(client->charset_client));
+		g_queue_push_tail(cmds, set);
+	}
+	if (!g_string_equal(client->charset_results, sock->charset_results)) {
+		GString* set = g_string_new_len(&cmd, 1);
+		g_string_append(set, "SET CHARACTER_SET_RESULTS=");
+		g_string_append(set, client->charset_results->str);
+		g_string_assign_len(sock->charset_results, S(client->charset_results));
+		g_queue_push_tail(cmds, set);
+	}
+	if (!g_string_equal(client->charset_connection, sock->charset_connection)) {
+		GString* set = g_string_new_len(&cmd, 1);
+		g_string_append(set, "SET CHARACTER_SET_CONNECTION=");
+		g_string_append(set, client->charset_connection->str);
+		g_string_assign_len(sock->charset_connection, S(client->charset_connection));
+		g_queue_push_tail(cmds, set);
+	}
+
+	if (client->default_db->len > 0) {
+		GString* init_db = g_string_new(NULL);
+		g_string_append_c(init_db, COM_INIT_DB);
+		g_string_append_len(init_db, S(client->default_db));
+		g_queue_push_tail(cmds, init_db);
+	}
+
+	g_queue_push_tail(cmds, g_string_new_len(S(query)));
+
+	return cmds;
+}
+
+static void fanout_sub_handle(int event_fd, short events, void *user_data);
+
+/**
+ * wait for the backend of a sub-query, a shard which doesn't answer within --shard-query-timeout fails the sub-query
+ */
+static void fanout_sub_wait(fanout_sub_t *sub, short ev_type) {
+	network_socket *sock = sub->sock;
+
+	event_set(&(sock->event), sock->fd, ev_type, fanout_sub_handle, sub);
+	chassis_event_add_self(sub->fanout->con->srv, &(sock->event), config->shard_query_timeout);
+}
+
+static void fanout_sub_send(fanout_sub_t *sub) {
+	GString *cmd = g_queue_peek_head(sub->cmds);
+
+	network_mysqld_queue_reset(sub->sock);
+	network_mysqld_queue_append(sub->sock, sub->sock->send_queue, S(cmd));
+
+	if (g_queue_get_length(sub->cmds) == 1) sub->inj->ts_read_query = chassis_get_rel_microseconds();
+
+	sub->is_reading   = FALSE;
+	sub->is_resultset = FALSE;
+	sub->eof_packets  = 0;
+}
+
+/**
+ * @return TRUE if the packet is the last one of the response
+ */
+static gboolean fanout_sub_is_finished(fanout_sub_t *sub, GString *packet) {
+	guchar status = packet->str[NET_HEADER_SIZE];
+
+	if (!sub->is_resultset) {
+		switch (status) {
+		case MYSQLD_PACKET_OK:
+		case MYSQLD_PACKET_ERR:
+		case MYSQLD_PACKET_EOF: /* COM_CHANGE_USER wants a old password */
+			return TRUE;
+		default:
+			sub->is_resultset = TRUE; /* the field-count */
+			return FALSE;
+		}
+	}
+
+	if (status == MYSQLD_PACKET_ERR) return TRUE;
+	if (status == MYSQLD_PACKET_EOF && packet->len < NET_HEADER_SIZE + 9) return ++sub->eof_packets == 2;
+
+	return FALSE;
+}
+
+/**
+ * send the merged result of all sub-queries to the client and resume the connection
+ */
+static void fanout_finish(fanout_t *fanout) {
+	network_mysqld_con *con = fanout->con;
+
+	/* a ERR may follow rows which are already forwarded, it ends the result-set then */
+	if (fanout->error) {
+		network_mysqld_queue_append(con->client, con->client->send_queue, S(fanout->error));
+	} else if (fanout->is_failed) {
+		network_mysqld_con_send_error_full(con->client, C("Proxy Warning - Query failed on a shard"), ER_UNKNOWN_ERROR, "07000");
+	} else if (fanout->is_write) {
+		network_mysqld_con_send_ok_full(con->client, fanout->affected_rows, 0, fanout->server_status, fanout->warnings);
+	} else {
+		merge_rows_finish(con);
+	}
+	slow_query_answered(con, fanout->error || fanout->is_failed);
+
+	if (fanout->error) g_string_free(fanout->error, TRUE);
+	g_ptr_array_free(fanout->subs, TRUE);
+	g_free(fanout);
+
+	con->fanout = NULL;
+
+	con->resultset_is_finished = TRUE;
+	con->state = CON_STATE_SEND_QUERY_RESULT;
+
+	network_mysqld_con_handle(-1, 0, con);
+}
+
+/**
+ * merge the response of a sub-query and give its connection back to the pool
+ *
+ * @param is_reusable  FALSE if the connection is broken or out of sync with the client
+ */
+static void fanout_sub_done(fanout_sub_t *sub, gboolean is_reusable) {
+	fanout_t *fanout = sub->fanout;
+	network_mysqld_con *con = fanout->con;
+	network_socket *sock = sub->sock;
+	injection *inj = sub->inj;
+	GQueue *chunks = sock->recv_queue->chunks;
+	GString *first = g_queue_peek_head(chunks);
+	GString *last = g_queue_peek_tail(chunks);
+	GString *p;
+
+	inj->ts_read_query_result_last = chassis_get_rel_microseconds();
+	gboolean is_slow = config->breaker_timeout > 0 && inj->ts_read_query_result_last - inj->ts_read_query > (guint64)config->breaker_timeout * 1000;
+	backend_latency_record(sub->backend, inj);
+
+	if (last == NULL) {
+		fanout->is_failed = TRUE;
+		inj->qstat.query_status = MYSQLD_PACKET_ERR;
+		breaker_record(sub->backend, TRUE, is_slow);
+	} else if ((guchar)last->str[NET_HEADER_SIZE] == MYSQLD_PACKET_ERR) {
+		network_packet packet;
+
+		packet.data = last;
+		packet.offset = 0;
+
+		if (fanout->error == NULL) fanout->error = g_string_new_len(last->str + NET_HEADER_SIZE, last->len - NET_HEADER_SIZE);
+		inj->qstat.query_status = MYSQLD_PACKET_ERR;
+		breaker_record(sub->backend, breaker_is_backend_error(&packet), is_slow);
+	} else {
+		if ((guchar)first->str[NET_HEADER_SIZE] == MYSQLD_PACKET_OK) {
+			network_mysqld_ok_packet_t *ok_packet = network_mysqld_ok_packet_new();
+			network_packet packet;
+
+			packet.data = first;
+			packet.offset = NET_HEADER_SIZE;
+
+			if (0 == network_mysqld_proto_get_ok_packet(&packet, ok_packet)) {
+				fanout->affected_rows += ok_packet->affected_rows;
+				fanout->warnings += ok_packet->warnings;
+				fanout->server_status = ok_packet->server_status;
+			}
+			network_mysqld_ok_packet_free(ok_packet);
+		} else if (!fanout->is_write) {
+			merge_rows_forward(con, chunks);
+
+			/* hand the rows to the client right away, fanout_finish() flushes the rest */
+			network_mysqld_write(con->srv, con->client);
+		}
+
+		inj->qstat.query_status = MYSQLD_PACKET_OK;
+		breaker_record(sub->backend, FALSE, is_slow);
+	}
+
+	log_sql(con, sock, inj);
+	query_stats_add(con, inj);
+	slow_query_shard_received(con, inj);
+
+	while ((p = g_queue_pop_head(chunks))) g_string_free(p, TRUE);
+
+	if (is_reusable) {
+		network_mysqld_queue_reset(sock);
+		network_connection_pool_lua_add_socket(con, sub->backend, sock);
+	} else {
+		network_socket_free(sock);
+
+		if (!g_atomic_int_compare_and_exchange(&sub->backend->connected_clients, 0, 0)) {
+			g_atomic_int_dec_and_test(&sub->backend->connected_clients);
+		}
+	}
+
+	while ((p = g_queue_pop_head(sub->cmds))) g_string_free(p, TRUE);
+	g_queue_free(sub->cmds);
+	injection_free(inj);
+	g_ptr_array_remove_fast(fanout->subs, sub);
+	g_free(sub);
+
+	if (--fanout->pending == 0) fanout_finish(fanout);
+}
+
+/**
+ * drop what we got so far of a sub-query whose connection broke
+ */
+static void fanout_sub_fail(fanout_sub_t *sub) {
+	GString *p;
+
+	while ((p = g_queue_pop_head(sub->sock->recv_queue->chunks))) g_string_free(p, TRUE);
+
+	fanout_sub_done(sub, FALSE);
+}
+
+/**
+ * fail the sub-queries of a sharded query which are still running, for KILL
+ *
+ * the last one runs fanout_finish() which resumes the connection, the fanout is gone then
+ */
+static void fanout_cancel(network_mysqld_con *con) {
+	fanout_t *fanout = con->fanout;
+	guint n = fanout->subs->len;
+
+	while (n-- > 0) {
+		fanout_sub_t *sub = g_ptr_array_index(fanout->subs, n);
+
+		event_del(&(sub->sock->event));
+		fanout_sub_fail(sub);
+	}
+}
+
+/**
+ * event handler of the backend connection of a sub-query
+ *
+ * sends the commands of the sub-query one by one and reads their responses
+ */
+static void fanout_sub_handle(int event_fd, short events, void *user_data) {
+	fanout_sub_t *sub = user_data;
+	network_socket *sock = sub->sock;
+	chassis *srv = sub->fanout->con->srv;
+
+	if (events == EV_TIMEOUT) {
+		g_critical("%s: %s didn't answer within %d seconds while running \"%s\"", G_STRLOC, sock->dst->name->str, config->shard_query_timeout, sub->inj->query->str + 1);
+		fanout_sub_fail(sub);
+		return;
+	}
+
+	if (events == EV_READ) {
+		int b = -1;
+
+		if (ioctl(event_fd, FIONREAD, &b) || b == 0) {
+			g_critical("%s: the connection to %s broke while running \"%s\"", G_STRLOC, sock->dst->name->str, sub->inj->query->str + 1);
+			fanout_sub_fail(sub);
+			return;
+		}
+
+		sock->to_read = b;
+	}
+
+	if (!sub->is_reading) {
+		switch (network_mysqld_write(srv, sock)) {
+		case NETWORK_SOCKET_SUCCESS:
+			sub->is_reading = TRUE;
+			fanout_sub_wait(sub, EV_READ);
+			break;
+		case NETWORK_SOCKET_WAIT_FOR_EVENT:
+			fanout_sub_wait(sub, EV_WRITE);
+			break;
+		default:
+			fanout_sub_fail(sub);
+			break;
+		}
+
+		return;
+	}
+
+	switch (network_socket_read(sock)) {
+	case NETWORK_SOCKET_SUCCESS:
+		break;
+	case NETWORK_SOCKET_WAIT_FOR_EVENT:
+		fanout_sub_wait(sub, EV_READ);
+		return;
+	default:
+		fanout_sub_fail(sub);
+		return;
+	}
+
+	network_socket_retval_t ret;
+	while (NETWORK_SOCKET_SUCCESS == (ret = network_mysqld_con_get_packet(srv, sock))) {
+		GString *packet = g_queue_peek_tail(sock->recv_queue->chunks);
+
+		if (!fanout_sub_is_finished(sub, packet)) continue;
+
+		if (g_queue_get_length(sub->cmds) == 1) {
+			fanout_sub_done(sub, TRUE);
+			return;
+		}
+
+		/* the connection couldn't be prepared, report the ERR and close it */
+		if ((guchar)packet->str[NET_HEADER_SIZE] == MYSQLD_PACKET_ERR) {
+			fanout_sub_done(sub, FALSE);
+			return;
+		}
+
+		/* a EOF is COM_CHANGE_USER asking for a old password or another auth-method, it is no result */
+		if ((guchar)packet->str[NET_HEADER_SIZE] != MYSQLD_PACKET_OK) {
+			g_critical("%s: %s refused to prepare the connection for \"%s\"", G_STRLOC, sock->dst->name->str, sub->inj->query->str + 1);
+			fanout_sub_fail(sub);
+			return;
+		}
+
+		GString *p;
+		while ((p = g_queue_pop_head(sock->recv_queue->chunks))) g_string_free(p, TRUE);
+		g_string_free(g_queue_pop_head(sub->cmds), TRUE);
+
+		fanout_sub_send(sub);
+		fanout_sub_wait(sub, EV_WRITE);
+		return;
+	}
+
+	if (ret == NETWORK_SOCKET_WAIT_FOR_EVENT) {
+		fanout_sub_wait(sub, EV_READ);
+	} else {
+		fanout_sub_fail(sub);
+	}
+}
+
+/**
+ * run the sub-queries of a sharded query concurrently
+ *
+ * every sub-query gets its own connection, reads are spread over the slaves like rw_split() does,
+ * writes go to the master
+ *
+ * @return 0 if the sub-queries are running, the strings in sqls are taken over then
+ *         -1 if not all of them could get a connection, nothing is taken over
+ */
+static int fanout_start(network_mysqld_con *con, GPtrArray *sqls, GPtrArray *clusters, GPtrArray *tokens, gboolean is_write) {
+	GHashTable *pwd_table = config->pwd_table[config->pwd_table_index];
+	network_backend_t **backends = g_new0(network_backend_t *, sqls->len);
+	network_socket **socks = g_new0(network_socket *, sqls->len);
+	const gchar *cluster = con->cluster;
+	guint i;
+
+	for (i = 0; i < sqls->len; ++i) {
+		/* each sub-table on the backends of its own cluster */
+		if (g_ptr_array_index(clusters, i)) con->cluster = g_ptr_array_index(clusters, i);
+
+		network_backend_t *backend = network_backends_get(con->srv->backends, is_write ? idle_rw(con) : rw_split(tokens, con));
+		if (backend == NULL && !is_write) backend = network_backends_get(con->srv->backends, idle_rw(con));
+
+		con->cluster = cluster;
+
+		if (backend == NULL || NULL == (socks[i] = network_connection_pool_lua_get_socket(con, backend, pwd_table))) {
+			breaker_give_back(backend);
+			break;
+		}
+		backends[i] = backend;
+	}
+
+	if (i < sqls->len) {
+		guint j;
+
+		for (j = 0; j < i; ++j) {
+			network_connection_pool_lua_add_socket(con, backends[j], socks[j]);
+			breaker_give_back(backends[j]);
+		}
+
+		g_free(backends);
+		g_free(socks);
+		return -1;
+	}
+
+	fanout_t *fanout = g_new0(fanout_t, 1);
+	fanout->con = con;
+	fanout->pending = sqls->len;
+	fanout->is_write = is_write;
+	fanout->server_status = SERVER_STATUS_AUTOCOMMIT;
+	fanout->subs = g_ptr_array_sized_new(sqls->len);
+
+	con->fanout = fanout;
+	con->fanout_cancel = fanout_cancel;
+
+	for (i = 0; i < sqls->len; ++i) {
+		fanout_sub_t *sub = g_new0(fanout_sub_t, 1);
+
+		sub->fanout  = fanout;
+		sub->backend = backends[i];
+		sub->sock    = socks[i];
+		sub->inj     = injection_new(is_write ? 8 : 7, sqls->pdata[i]);
+		sub->cmds    = fanout_sub_cmds(con, sub->sock, sub->inj->query);
+		g_ptr_array_add(fanout->subs, sub);
+
+		fanout_sub_send(sub);
+		fanout_sub_wait(sub, EV_WRITE);
+	}
+
+	g_free(backends);
+	g_free(socks);
+	return 0;
+}
+
+/**
+ * route a sharded query to the cluster of its sub-tables
+ *
+ * sub-tables which table-clusters doesn't map stay in the cluster of the database
+ *
+ * @return FALSE if the sub-queries need more than one cluster, con->cluster is left alone then
+ */
+static gboolean set_shard_cluster(network_mysqld_con *con, GPtrArray *clusters) {
+	const gchar *cluster = NULL;
+	guint i;
+
+	for (i = 0; i < clusters->len; ++i) {
+		const gchar *c = g_ptr_array_index(clusters, i);
+
+		if (c == NULL) c = con->cluster;
+		if (i > 0 && g_strcmp0(c, cluster) != 0) return FALSE;
+		cluster = c;
+	}
+
+	if (clusters->len > 0) con->cluster = cluster;
+	return TRUE;
+}
+
+/**
+ * run the sub-queries of a sharded query one after the other on con->server
+ */
+static void push_sharded_injections(network_mysqld_con *con, GPtrArray *sqls, gboolean is_write) {
+	network_mysqld_con_lua_t *st = con->plugin_con_state;
+	int id = is_write ? 8 : 7;
+	guint i;
+
+	for (i = 0; i < sqls->len; ++i) {
+		injection *inj = injection_new(id, sqls->pdata[i]);
+		inj->resultset_is_needed = TRUE;
+		g_queue_push_tail(st->injected.queries, inj);
+	}
+}
+
+/**
+ * gets called after a query has been read
+ *
+ * - calls the lua script via network_mysqld_con_handle_proxy_stmt()
+ *
+ * @see network_mysqld_con_handle_proxy_stmt
+ */
+NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
+	GString *packet;
+	network_socket *recv_sock, *send_sock;
+	network_mysqld_con_lua_t *st = con->plugin_con_state;
+	int proxy_query = 1;
+	network_mysqld_lua_stmt_ret ret;
+	GPtrArray *fanout_sqls = NULL;
+	gboolean is_fanout = FALSE;
+	network_profile_t *profile = con->srv->backends->profile;
+	guint64 profile_start;
+
+	NETWORK_MYSQLD_CON_TRACK_TIME(con, "proxy::ready_query::enter");
+
+	send_sock = NULL;
+	recv_sock = con->client;
+	st->injected.sent_resultset = 0;
+
+	NETWORK_MYSQLD_CON_TRACK_TIME(con, "proxy::ready_query::enter_lua");
+	network_injection_queue_reset(st->injected.queries);
+
+	GString* packets = g_string_new(NULL);
+	int i;
+	for (i = 0; NULL != (packet = g_queue_peek_nth(recv_sock->recv_queue->chunks, i)); i++) {
+		g_string_append_len(packets, packet->str + NET_HEADER_SIZE, packet->len - NET_HEADER_SIZE);
+	}
+
+	char type = packets->str[0];
+	chassis_event_thread_stats(con->srv)->queries[type == COM_QUERY ? sql_query_type(packets) : QUERY_TYPE_COMMAND]++;
+	slow_query_start(con, packets);
+	query_stats_start(con, packets);
+
+	if (type == COM_QUIT || type == COM_PING) {
+		g_string_free(packets, TRUE);
+		network_mysqld_con_send_ok_full(con->client, 0, 0, 0x0002, 0);
+		ret = PROXY_SEND_RESULT;
+	} else {
+		routing_plan_t classified;
+		gchar comment_buf[SQL_CLASSIFY_MAX_COMMENT];
+		plan_cache_t *plan_cache = NULL;
+		routing_plan_t *plan = NULL;
+		gboolean is_cacheable = FALSE;
+
+		if (type == COM_QUERY) {
+			profile_start = network_profile_start(profile);
+			switch (sql_classify(con, packets, &classified, comment_buf)) {
+			case SQL_CLASSIFY_DONE:
+				plan = &classified;
+				break;
+			case SQL_CLASSIFY_TOKENIZE:
+				if (NULL != (plan_cache = plan_cache_get())) plan = plan_cache_lookup(plan_cache, con, packets);
+				break;
+			case SQL_CLASSIFY_UNCACHEABLE:
+				break;
+			}
+			network_profile_stop(profile, PROFILE_CLASSIFY, profile_start);
+		}
+
+		/* with a plan the tokens stay empty, everything which needs them is taken from the plan */
+		GPtrArray *tokens = sql_tokens_new();
+		if (plan == NULL) {
+			profile_start = network_profile_start(profile);
+			sql_tokenizer(tokens, packets->str, packets->len);
+			network_profile_stop(profile, PROFILE_TOKENIZER, profile_start);
+			is_cacheable = (plan_cache != NULL && sql_is_plan_cacheable(con, tokens));
+		}
+
+		gboolean is_blacklisted = (type == COM_QUERY && (plan ? plan->is_blacklisted : is_in_blacklist(tokens)));
+		if (is_blacklisted && is_cacheable) {
+			routing_plan_t *p = plan_cache_add(plan_cache);
+			if (p) p->is_blacklisted = TRUE;
+		}
+
+		if (is_blacklisted) {
+			g_warning("Forbidden SQL: %s: %s", recv_sock->src->name->str, packets->str+1);
+			g_string_free(packets, TRUE);
+			network_mysqld_con_send_error_full(con->client, C("Proxy Warning - Syntax Forbidden"), ER_UNKNOWN_ERROR, "07000");
+			ret = PROXY_SEND_RESULT;
+		} else {
+			GPtrArray* sqls = NULL;
+			GPtrArray* clusters = g_ptr_array_new(); /* the cluster of each sub-query */
+			gboolean is_one_cluster = TRUE;
+			gboolean is_pinned;
+			if (type == COM_QUERY && config->tables && plan == NULL) {
+				profile_start = network_profile_start(profile);
+				sqls = sql_parse(con, tokens, clusters);
+				network_profile_stop(profile, PROFILE_SHARDING, profile_start);
+			}
+
+            packets = convert_use_database2com_init_db(type, packets, tokens);
+			gboolean is_write = plan ? plan->is_write : sql_is_write(tokens);
+			con->cluster = plan ? plan->cluster : get_cluster(con, tokens, packets); /* before packets are freed for a sharded query */
+
+			ret = PROXY_SEND_INJECTION;
+			injection* inj = NULL;
+			if (sqls == NULL) {
+				inj = injection_new(1, packets);
+				inj->resultset_is_needed = is_write;
+				g_queue_push_tail(st->injected.queries, inj);
+			} else {
+				g_string_free(packets, TRUE);
+
+				is_one_cluster = set_shard_cluster(con, clusters);
+				is_pinned = (con->is_in_transaction || con->is_not_autocommit || g_hash_table_size(con->locks) > 0);
+
+				/* the held connection can't serve sub-tables of an other cluster */
+				if (is_pinned && (!is_one_cluster ||
+						(con->server != NULL && st->backend != NULL && !backend_in_cluster(st->backend, con->cluster)))) {
+					g_ptr_array_foreach(sqls, g_list_string_free, NULL);
+					network_mysqld_con_send_error_full(con->client, C("Proxy Warning - Sharded query spans clusters inside a transaction"), ER_UNKNOWN_ERROR, "07000");
+					ret = PROXY_SEND_RESULT;
+				} else if (sqls->len == 1) {
+					inj = injection_new(1, sqls->pdata[0]);
+					inj->resultset_is_needed = is_write;
+					g_queue_push_tail(st->injected.queries, inj);
+				} else {
+					merge_res_t* merge_res = con->merge_res;
+
+					merge_res->sub_sql_num = sqls->len;
+					merge_res->sub_sql_exed = 0;
+					merge_res->limit = G_MAXINT;
+					merge_res->sent_rows = 0;
+					merge_res->is_fields_sent = FALSE;
+					merge_res->affected_rows = 0;
+					merge_res->warnings = 0;
+					merge_res->server_status = SERVER_STATUS_AUTOCOMMIT;
+
+					merge_res->offset = 0;
+
+					sql_token** ts = (sql_token**)(tokens->pdata);
+					gint limit_offset;
+					gint limit_count = get_limit_index(tokens, &limit_offset);
+					if (limit_count != -1) merge_res->limit = atoi(ts[limit_count]->text->str);
+					if (limit_offset != -1) merge_res->offset = atoi(ts[limit_offset]->text->str);
+
+					merge_res_reset(merge_res);
+					if (!is_write) {
+						get_order_by(tokens, merge_res->order_by);
+						get_aggregates(tokens, merge_res->aggs, merge_res->order_by);
 					}
-					g_ptr_array_set_size(rows, 0);
 
-					int id = is_write ? 8 : 7;
-					for (i = 0; i < sqls->len; ++i) {
-						inj = injection_new(id, sqls->pdata[i]);
-						inj->resultset_is_needed = TRUE;
-						g_queue_push_tail(st->injected.queries, inj);
+					/* outside of a transaction the sub-queries don't have to share con->server */
+					if (!is_pinned) {
+						fanout_sqls = sqls;
+					} else {
+						push_sharded_injections(con, sqls, is_write);
 					}
 				}
 
-				g_ptr_array_free(sqls, TRUE);
+				if (sqls != fanout_sqls) g_ptr_array_free(sqls, TRUE);
 			}
             /* the sql after SQL_CALC_FOUND_ROWS must be "select FOUND_ROWS();"
              * if not, must redo the read write split operation. because the write sql 
@@ -1448,40 +4947,97 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
             }
             
 			check_flags(tokens, con);
+			if (plan) con->is_in_select_calc_found_rows = plan->is_calc_found_rows;
+
+			if (is_cacheable) {
+				routing_plan_t *p = plan_cache_add(plan_cache);
+				if (p) {
+					sql_token *first_token = tokens->pdata[1];
+					p->is_write = is_write;
+					p->is_calc_found_rows = con->is_in_select_calc_found_rows;
+					p->cluster = con->cluster;
+					if (first_token->token_id == TK_COMMENT) p->comment = g_strdup(first_token->text->str);
+				}
+			}
+
+			if (con->server != NULL && st->backend != NULL && !backend_in_cluster(st->backend, con->cluster) &&
+					!con->is_in_transaction && !con->is_not_autocommit && g_hash_table_size(con->locks) == 0) {
+				network_connection_pool_lua_add_connection(con);
+			}
+
+			if (fanout_sqls != NULL) {
+				slow_query_sent(con);
+				if (0 == fanout_start(con, fanout_sqls, clusters, tokens, is_write)) {
+					is_fanout = TRUE;
+				} else if (is_one_cluster) {
+					push_sharded_injections(con, fanout_sqls, is_write);
+				} else {
+					g_ptr_array_foreach(fanout_sqls, g_list_string_free, NULL);
+					network_mysqld_con_send_error_full(con->client, C("Proxy Warning - No backend for a shard"), ER_UNKNOWN_ERROR, "07000");
+					ret = PROXY_SEND_RESULT;
+				}
+				g_ptr_array_free(fanout_sqls, TRUE);
+			}
+			g_ptr_array_free(clusters, TRUE);
 
-			if (con->server == NULL) {
+			if (is_fanout || ret == PROXY_SEND_RESULT) {
+				/* the error is sent already or fanout_finish() sends the result */
+			} else if (con->server == NULL) {
 				int backend_ndx = -1;
 
 				if (!con->is_in_transaction && !con->is_not_autocommit && g_hash_table_size(con->locks) == 0) {
 					if (type == COM_QUERY) {
+						profile_start = network_profile_start(profile);
 						if (is_write ) {
 							backend_ndx = idle_rw(con);
 						} else {
-							backend_ndx = rw_split(tokens, con);
+							backend_ndx = plan ? rw_split_comment(plan->comment, con) : rw_split(tokens, con);
 						}
+						network_profile_stop(profile, PROFILE_ROUTING, profile_start);
 						send_sock = network_connection_pool_lua_swap(con, backend_ndx, config->pwd_table[config->pwd_table_index]);
 					} else if (type == COM_INIT_DB || type == COM_SET_OPTION || type == COM_FIELD_LIST) {
 						backend_ndx = wrr_ro(con);
 						send_sock = network_connection_pool_lua_swap(con, backend_ndx, config->pwd_table[config->pwd_table_index]);
 					}
+					if (send_sock == NULL) breaker_give_back(network_backends_get(con->srv->backends, backend_ndx));
 				}
 
 				if (send_sock == NULL) {
 					backend_ndx = idle_rw(con);
 					send_sock = network_connection_pool_lua_swap(con, backend_ndx, config->pwd_table[config->pwd_table_index]);
+					if (send_sock == NULL) breaker_give_back(network_backends_get(con->srv->backends, backend_ndx));
 				}
 				con->server = send_sock;
 			}
 
-			modify_db(con);
-			modify_charset(tokens, con);
-			modify_user(con);
+			if (!is_fanout && ret != PROXY_SEND_RESULT) {
+				modify_db(con);
+				modify_charset(tokens, con);
+				modify_user(con);
+			}
 		}
 
 		sql_tokens_free(tokens);
 	}
 	NETWORK_MYSQLD_CON_TRACK_TIME(con, "proxy::ready_query::leave_lua");
 
+	if (is_fanout) {
+		/* track the command for the result fanout_finish() will send, the connection waits in CON_STATE_READ_QUERY until then */
+		network_packet p;
+
+		p.data = g_queue_peek_head(recv_sock->recv_queue->chunks);
+		p.offset = 0;
+
+		network_mysqld_con_reset_command_response_state(con);
+		if (0 != network_mysqld_con_command_states_init(con, &p)) {
+			g_debug("%s: ", G_STRLOC);
+		}
+
+		while ((packet = g_queue_pop_head(recv_sock->recv_queue->chunks))) g_string_free(packet, TRUE);
+
+		return NETWORK_SOCKET_SUCCESS;
+	}
+
 	/**
 	 * if we disconnected in read_query_result() we have no connection open
 	 * when we try to execute the next query 
@@ -1553,6 +5109,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
 
 	if (proxy_query) {
 		con->state = CON_STATE_SEND_QUERY;
+		slow_query_sent(con);
 	} else {
 		GList *cur;
 
@@ -1571,6 +5128,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
 
 		con->state = CON_STATE_SEND_QUERY_RESULT;
 		con->resultset_is_finished = TRUE; /* we don't have more too send */
+		slow_query_answered(con, FALSE);
 	}
 	NETWORK_MYSQLD_CON_TRACK_TIME(con, "proxy::ready_query::done");
 
@@ -1619,6 +5177,8 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_send_query_result) {
 
 	if (st->injected.queries->length == 0) {
 		/* we have nothing more to send, let's see what the next state is */
+		slow_query_finish(con);
+		query_stats_finish(con);
 
 		con->state = CON_STATE_READ_QUERY;
 
@@ -1645,6 +5205,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_send_query_result) {
 
 	network_mysqld_queue_reset(send_sock);
 	network_mysqld_queue_append(send_sock, send_sock->send_queue, S(inj->query));
+	slow_query_sent(con);
 
 	network_mysqld_con_reset_command_response_state(con);
 
@@ -1653,96 +5214,6 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_send_query_result) {
 	return NETWORK_SOCKET_SUCCESS;
 }
 
-void merge_rows(network_mysqld_con* con, injection* inj) {
-	if (!inj->resultset_is_needed || !con->server->recv_queue->chunks || inj->qstat.binary_encoded) return;
-
-	proxy_resultset_t* res = proxy_resultset_new();
-
-	res->result_queue = con->server->recv_queue->chunks;
-	res->qstat = inj->qstat;
-	res->rows  = inj->rows;
-	res->bytes = inj->bytes;
-
-	parse_resultset_fields(res);
-
-	GList* res_row = res->rows_chunk_head;
-	while (res_row) {
-		network_packet packet;
-		packet.data = res_row->data;
-		packet.offset = 0;
-
-		network_mysqld_proto_skip_network_header(&packet);
-		network_mysqld_lenenc_type lenenc_type;
-		network_mysqld_proto_peek_lenenc_type(&packet, &lenenc_type);
-
-		switch (lenenc_type) {
-			case NETWORK_MYSQLD_LENENC_TYPE_ERR:
-			case NETWORK_MYSQLD_LENENC_TYPE_EOF:
-				proxy_resultset_free(res);
-				return;
-
-			case NETWORK_MYSQLD_LENENC_TYPE_INT:
-			case NETWORK_MYSQLD_LENENC_TYPE_NULL:
-				break;
-		}
-
-		GPtrArray* row = g_ptr_array_new();
-
-		guint len = res->fields->len;
-		guint i;
-		for (i = 0; i < len; i++) {
-			guint64 field_len;
-
-			network_mysqld_proto_peek_lenenc_type(&packet, &lenenc_type);
-
-			switch (lenenc_type) {
-				case NETWORK_MYSQLD_LENENC_TYPE_NULL:
-					network_mysqld_proto_skip(&packet, 1);
-					break;
-
-				case NETWORK_MYSQLD_LENENC_TYPE_INT:
-					network_mysqld_proto_get_lenenc_int(&packet, &field_len);
-					g_ptr_array_add(row, g_strndup(packet.data->str + packet.offset, field_len));
-					network_mysqld_proto_skip(&packet, field_len);
-					break;
-
-				default:
-					break;
-			}
-		}
-
-		g_ptr_array_add(con->merge_res->rows, row);
-		if (con->merge_res->rows->len >= con->merge_res->limit) break;
-		res_row = res_row->next;
-	}
-
-	proxy_resultset_free(res);
-}
-
-void log_sql(network_mysqld_con* con, injection* inj) {
-	if (sql_log_type == OFF) return;
-	
-	float latency_ms = (inj->ts_read_query_result_last - inj->ts_read_query)/1000.0;
-	if ((gint)latency_ms < config->sql_log_slow_ms) return;
-
-	GString* message = g_string_new(NULL);
-
-	time_t t = time(NULL);
-	struct tm* tm = localtime(&t);
-	g_string_printf(message, "[%02d/%02d/%d %02d:%02d:%02d] C:%s S:", tm->tm_mon+1, tm->tm_mday, tm->tm_year+1900, tm->tm_hour, tm->tm_min, tm->tm_sec, con->client->src->name->str);
-
-	if (inj->qstat.query_status == MYSQLD_PACKET_OK) {
-		g_string_append_printf(message, "%s OK %.3f \"%s\"\n", con->server->dst->name->str, latency_ms, inj->query->str+1);
-	} else {
-		g_string_append_printf(message, "%s ERR %.3f \"%s\"\n", con->server->dst->name->str, latency_ms, inj->query->str+1);
-	}
-
-	fwrite(message->str, message->len, 1, config->sql_log);
-	g_string_free(message, TRUE);
-
-	if (sql_log_type == REALTIME) fflush(config->sql_log);
-}
-
 /**
  * handle the query-result we received from the server
  *
@@ -1826,7 +5297,12 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query_result) {
 			}
 			inj->ts_read_query_result_last = chassis_get_rel_microseconds();
 			/* g_get_current_time(&(inj->ts_read_query_result_last)); */
+
+			breaker_record(st->backend, breaker_is_backend_error(&packet),
+					config->breaker_timeout > 0 && inj->ts_read_query_result_last - inj->ts_read_query > (guint64)config->breaker_timeout * 1000);
+			backend_latency_record(st->backend, inj);
 		}
+		slow_query_received(con, con->server, inj);
 
 		network_mysqld_queue_reset(recv_sock); /* reset the packet-id checks as the server-side is finished */
 
@@ -1836,38 +5312,43 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query_result) {
 			inj = g_queue_pop_head(st->injected.queries);
 			char* str = inj->query->str + 1;
 			if (inj->id == 1) {
-				if (*(str-1) == COM_QUERY) log_sql(con, inj);
+				if (*(str-1) == COM_QUERY) log_sql(con, con->server, inj);
+				query_stats_add(con, inj);
 				ret = PROXY_SEND_RESULT;
 			} else if (inj->id == 7) {
-				log_sql(con, inj);
+				log_sql(con, con->server, inj);
+				query_stats_add(con, inj);
 
         
+				/* the rows go to the client while the next sub-query runs */
 				merge_res_t* merge_res = con->merge_res;
-				if (inj->qstat.query_status == MYSQLD_PACKET_OK && merge_res->rows->len < merge_res->limit) merge_rows(con, inj);
+				if (inj->qstat.query_status != MYSQLD_PACKET_OK) {
+					GString* err = g_queue_peek_tail(recv_sock->recv_queue->chunks);
+
+					/* the other sub-queries still run to keep con->server in sync, the first ERR is the answer */
+					if (merge_res->error == NULL && err) merge_res->error = g_string_new_len(err->str + NET_HEADER_SIZE, err->len - NET_HEADER_SIZE);
+				} else if (merge_res->error == NULL) {
+					merge_rows_forward(con, recv_sock->recv_queue->chunks);
+				}
 
 				if ((++merge_res->sub_sql_exed) < merge_res->sub_sql_num) {
 					ret = PROXY_IGNORE_RESULT;
 				} else {
 					network_injection_queue_reset(st->injected.queries);
+					while ((p = g_queue_pop_head(recv_sock->recv_queue->chunks))) g_string_free(p, TRUE);
 					ret = PROXY_SEND_RESULT;
 
-					if (inj->qstat.query_status == MYSQLD_PACKET_OK) {
-						proxy_resultset_t* res = proxy_resultset_new();
-
-						if (inj->resultset_is_needed && !inj->qstat.binary_encoded) res->result_queue = con->server->recv_queue->chunks;
-						res->qstat = inj->qstat;
-						res->rows  = inj->rows;
-						res->bytes = inj->bytes;
-						parse_resultset_fields(res);
-
-						while ((p = g_queue_pop_head(recv_sock->recv_queue->chunks))) g_string_free(p, TRUE);
-						network_mysqld_con_send_resultset(send_sock, res->fields, merge_res->rows);
-
-						proxy_resultset_free(res);
+					/* a ERR may follow rows which are already forwarded, it ends the result-set then */
+					if (merge_res->error) {
+						network_mysqld_queue_append(con->client, con->client->send_queue, S(merge_res->error));
+						merge_res_reset(merge_res);
+					} else {
+						merge_rows_finish(con);
 					}
 				}
 			} else if (inj->id == 8) {
-				log_sql(con, inj);
+				log_sql(con, con->server, inj);
+				query_stats_add(con, inj);
 
 				if (inj->qstat.query_status == MYSQLD_PACKET_OK) {
 					network_mysqld_ok_packet_t *ok_packet = network_mysqld_ok_packet_new();
@@ -2281,7 +5762,9 @@ chassis_plugin_config * network_mysqld_proxy_plugin_new(void) {
 	config->ip_table[1] = g_hash_table_new_full(g_int_hash, g_int_equal, g_free, NULL);
 	config->ip_table_index = 0;
 	config->lvs_table = g_hash_table_new_full(g_int_hash, g_int_equal, g_free, NULL);
-	config->dt_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	config->dt_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, db_table_free);
+	config->dt_table_names = g_hash_table_new(g_str_hash, g_str_equal);
+	config->db_cluster = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	config->pwd_table[0] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, string_free);
 	config->pwd_table[1] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, string_free);
 	config->pwd_table_index = 0;
@@ -2289,6 +5772,28 @@ chassis_plugin_config * network_mysqld_proxy_plugin_new(void) {
 	config->sql_log_type = NULL;
 	config->charset = NULL;
 	config->sql_log_slow_ms = 0;
+	config->sql_log_buffer_size = 1024;
+	config->sql_log_sample = 1;
+	config->sql_log_digest_rate = 0;
+	config->sql_log_errors = 0;
+	config->sql_log_format = NULL;
+	config->sql_log_compress = 0;
+	config->con_profiling = 0;
+	config->check_interval = 2000;
+	config->check_timeout = 1000;
+	config->check_rise = 2;
+	config->check_fall = 2;
+	config->breaker_threshold = 0;
+	config->breaker_min_requests = 20;
+	config->breaker_window = 10;
+	config->breaker_cooldown = 5;
+	config->breaker_timeout = 0;
+	config->shard_query_timeout = 60;
+	config->shard_merge_max_rows = 100000;
+	config->plan_cache_size = 1024;
+	config->query_stats_size = 1024;
+	config->slow_query_threshold = 1000;
+	config->slow_query_size = 100;
 
 	return config;
 }
@@ -2349,17 +5854,39 @@ void network_mysqld_proxy_plugin_free(chassis_plugin_config *oldconfig) {
 
 	g_hash_table_remove_all(config->dt_table);
 	g_hash_table_destroy(config->dt_table);
+	g_hash_table_destroy(config->dt_table_names);
+	g_strfreev(config->table_clusters);
+
+	g_strfreev(config->cluster_dbs);
+	g_strfreev(config->cluster_backend_addresses);
+	g_strfreev(config->cluster_read_only_backend_addresses);
+	g_hash_table_destroy(config->db_cluster);
 
 	g_hash_table_remove_all(config->pwd_table[0]);
 	g_hash_table_destroy(config->pwd_table[0]);
 	g_hash_table_remove_all(config->pwd_table[1]);
 	g_hash_table_destroy(config->pwd_table[1]);
 
-	if (config->sql_log) fclose(config->sql_log);
+	sql_log_free(config->sql_log);
 	if (config->sql_log_type) g_free(config->sql_log_type);
+	if (config->sql_log_format) g_free(config->sql_log_format);
 
 	if (config->charset) g_free(config->charset);
 
+	if (config->plan_caches) {
+		for (i = 0; i < config->plan_cache_num; i++) {
+			plan_cache_free(config->plan_caches[i]);
+		}
+		g_free(config->plan_caches);
+		g_free(config->plan_cache_stats);
+	}
+
+	query_stats_free(config->query_stats);
+	slow_queries_free(config->slow_queries);
+
+	if (config->metrics_address) g_free(config->metrics_address);
+	network_metrics_free(config->metrics);
+
 	g_free(config);
 }
 
@@ -2390,7 +5917,13 @@ static GOptionEntry * network_mysqld_proxy_plugin_get_options(chassis_plugin_con
 	
 		{ "lvs-ips", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "all lvs ips", NULL },
 
-		{ "tables", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "sub-table settings", NULL },
+		{ "tables", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "sub-table settings, the sharding function is mod (default), crc32, murmur, ring or range:b1:b2:...", "<db.table.column.num[.function]>" },
+
+		{ "table-clusters", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "cluster of a range of sub-tables", "<db.table:first-last:cluster>" },
+
+		{ "cluster-dbs", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "databases served by a cluster", "<cluster:db>" },
+		{ "cluster-backend-addresses", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "address:port of the master of a cluster", "<cluster:host:port>" },
+		{ "cluster-read-only-backend-addresses", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "address:port of the slaves of a cluster", "<cluster:host:port>" },
 	
 		{ "pwds", 0, 0, G_OPTION_ARG_STRING_ARRAY, NULL, "password settings", NULL },
 		
@@ -2398,6 +5931,37 @@ static GOptionEntry * network_mysqld_proxy_plugin_get_options(chassis_plugin_con
 
 		{ "sql-log", 0, 0, G_OPTION_ARG_STRING, NULL, "sql log type(default: OFF)", NULL },
 		{ "sql-log-slow", 0, 0, G_OPTION_ARG_INT, NULL, "only log sql which takes longer than this milliseconds (default: 0)", NULL },
+		{ "sql-log-buffer-size", 0, 0, G_OPTION_ARG_INT, NULL, "KB of sql log buffered per event-thread, records which don't fit are dropped (default: 1024)", NULL },
+		{ "sql-log-sample", 0, 0, G_OPTION_ARG_INT, NULL, "log 1 in N of the sql over sql-log-slow, 0 logs none (default: 1)", NULL },
+		{ "sql-log-digest-rate", 0, 0, G_OPTION_ARG_INT, NULL, "log at most N sql of the same digest per second and event-thread (default: 0, unlimited)", NULL },
+		{ "sql-log-errors", 0, 0, G_OPTION_ARG_NONE, NULL, "log all failed sql, regardless of sql-log-slow, sql-log-sample and sql-log-digest-rate", NULL },
+		{ "sql-log-format", 0, 0, G_OPTION_ARG_STRING, NULL, "format of the sql log, binary is read with mysql-sql-log-dump (default: text)", "(text|binary)" },
+		{ "sql-log-compress", 0, 0, G_OPTION_ARG_NONE, NULL, "compress the binary sql log", NULL },
+
+		{ "check-interval", 0, 0, G_OPTION_ARG_INT, NULL, "milliseconds between two health-checks of the backends (default: 2000)", NULL },
+		{ "check-timeout", 0, 0, G_OPTION_ARG_INT, NULL, "milliseconds until a health-check fails (default: 1000)", NULL },
+		{ "check-rise", 0, 0, G_OPTION_ARG_INT, NULL, "successful health-checks until a backend is UP (default: 2)", NULL },
+		{ "check-fall", 0, 0, G_OPTION_ARG_INT, NULL, "failed health-checks until a backend is DOWN (default: 2)", NULL },
+
+		{ "breaker-threshold", 0, 0, G_OPTION_ARG_INT, NULL, "percentage of errors and timeouts which opens the circuit breaker of a backend (default: 0, disabled)", NULL },
+		{ "breaker-min-requests", 0, 0, G_OPTION_ARG_INT, NULL, "queries per window before the circuit breaker may open (default: 20)", NULL },
+		{ "breaker-window", 0, 0, G_OPTION_ARG_INT, NULL, "seconds of the circuit breaker counting window (default: 10)", NULL },
+		{ "breaker-cooldown", 0, 0, G_OPTION_ARG_INT, NULL, "seconds until a open circuit breaker lets a probe query pass (default: 5)", NULL },
+		{ "breaker-timeout", 0, 0, G_OPTION_ARG_INT, NULL, "milliseconds after which a query counts as timeout for the circuit breaker (default: 0, disabled)", NULL },
+
+		{ "shard-query-timeout", 0, 0, G_OPTION_ARG_INT, NULL, "seconds a sub-query of a sharded query may wait for its backend before it fails (default: 60, 0 disables it)", NULL },
+		{ "shard-merge-max-rows", 0, 0, G_OPTION_ARG_INT, NULL, "rows a sharded SELECT with ORDER BY or aggregates may hold in memory for the merge, more fail the query (default: 100000, 0 for no limit)", NULL },
+
+		{ "plan-cache-size", 0, 0, G_OPTION_ARG_INT, NULL, "routing plans cached per event-thread (default: 1024, 0 disables the cache)", NULL },
+
+		{ "query-stats-size", 0, 0, G_OPTION_ARG_INT, NULL, "query digests counted per event-thread (default: 1024, 0 disables the query stats)", NULL },
+
+		{ "slow-query-threshold", 0, 0, G_OPTION_ARG_INT, NULL, "milliseconds after which a query is kept with the time of each phase, see SELECT * FROM slow_queries (default: 1000, 0 disables it)", NULL },
+		{ "slow-query-size", 0, 0, G_OPTION_ARG_INT, NULL, "slow queries kept per event-thread, the oldest is overwritten (default: 100)", NULL },
+
+		{ "con-profiling", 0, 0, G_OPTION_ARG_NONE, NULL, "count the cpu cycles spent in each connection state, the tokenizer, routing and pool (default: off, see SELECT * FROM profile)", NULL },
+
+		{ "metrics-address", 0, 0, G_OPTION_ARG_STRING, NULL, "listening address:port of the HTTP server for Prometheus at /metrics (default: off)", "<host:port>" },
 
 		{ NULL,                       0, 0, G_OPTION_ARG_NONE,   NULL, NULL, NULL }
 	};
@@ -2416,10 +5980,37 @@ static GOptionEntry * network_mysqld_proxy_plugin_get_options(chassis_plugin_con
 	config_entries[i++].arg_data = &(config->client_ips);
 	config_entries[i++].arg_data = &(config->lvs_ips);
 	config_entries[i++].arg_data = &(config->tables);
+	config_entries[i++].arg_data = &(config->table_clusters);
+	config_entries[i++].arg_data = &(config->cluster_dbs);
+	config_entries[i++].arg_data = &(config->cluster_backend_addresses);
+	config_entries[i++].arg_data = &(config->cluster_read_only_backend_addresses);
 	config_entries[i++].arg_data = &(config->pwds);
 	config_entries[i++].arg_data = &(config->charset);
 	config_entries[i++].arg_data = &(config->sql_log_type);
 	config_entries[i++].arg_data = &(config->sql_log_slow_ms);
+	config_entries[i++].arg_data = &(config->sql_log_buffer_size);
+	config_entries[i++].arg_data = &(config->sql_log_sample);
+	config_entries[i++].arg_data = &(config->sql_log_digest_rate);
+	config_entries[i++].arg_data = &(config->sql_log_errors);
+	config_entries[i++].arg_data = &(config->sql_log_format);
+	config_entries[i++].arg_data = &(config->sql_log_compress);
+	config_entries[i++].arg_data = &(config->check_interval);
+	config_entries[i++].arg_data = &(config->check_timeout);
+	config_entries[i++].arg_data = &(config->check_rise);
+	config_entries[i++].arg_data = &(config->check_fall);
+	config_entries[i++].arg_data = &(config->breaker_threshold);
+	config_entries[i++].arg_data = &(config->breaker_min_requests);
+	config_entries[i++].arg_data = &(config->breaker_window);
+	config_entries[i++].arg_data = &(config->breaker_cooldown);
+	config_entries[i++].arg_data = &(config->breaker_timeout);
+	config_entries[i++].arg_data = &(config->shard_query_timeout);
+	config_entries[i++].arg_data = &(config->shard_merge_max_rows);
+	config_entries[i++].arg_data = &(config->plan_cache_size);
+	config_entries[i++].arg_data = &(config->query_stats_size);
+	config_entries[i++].arg_data = &(config->slow_query_threshold);
+	config_entries[i++].arg_data = &(config->slow_query_size);
+	config_entries[i++].arg_data = &(config->con_profiling);
+	config_entries[i++].arg_data = &(config->metrics_address);
 
 	return config_entries;
 }
@@ -2435,49 +6026,339 @@ void handler(int sig) {
 	}
 }
 
-gpointer check_state(network_backends_t *bs) {
-	GPtrArray *backends = bs->backends;
-	GPtrArray *raw_pwds = bs->raw_pwds;
-	MYSQL mysql;
-	mysql_init(&mysql);
-	guint i, tm = 1;
-	sleep(1);
+/**
+ * one health-check probe against a backend
+ *
+ * the probe logs in like a client: it reads the handshake, authenticates as the first user of
+ * pwds, runs SELECT 1 and says COM_QUIT. Everything is non-blocking, so all backends are probed
+ * in parallel. An ERR packet (e.g. Too many connections, Access denied), a reset or a timeout
+ * count as failure. Without pwds it can only check that mysqld sends its handshake.
+ */
+typedef enum {
+	CHECK_HANDSHAKE,           /**< waiting for the handshake of mysqld */
+	CHECK_AUTH,                /**< the auth response is sent, waiting for OK */
+	CHECK_QUERY,               /**< SELECT 1 is sent, waiting for the end of its result */
+	CHECK_DONE
+} backend_check_state_t;
 
-	while (TRUE) {
-		guint len = backends->len;
+typedef struct {
+	network_backend_t *backend;
+	const gchar *user;         /**< NULL if pwds is empty */
+	GString *hashed_password;
+	int fd;
+	struct event_base *base;
+	struct event ev;
+	struct timeval timeout;
+	backend_check_state_t state;
+	GString *in;               /**< received bytes which are no complete packet yet */
+	GString *out;              /**< packets not sent yet */
+	guint eofs;                /**< EOF packets of the result of SELECT 1 */
+	gboolean ok;
+} backend_check_t;
+
+static void check_backend_done(backend_check_t *chk, gboolean ok) {
+	/* say goodbye, so mysqld doesn't count a aborted connection */
+	if (ok && chk->state == CHECK_QUERY) send(chk->fd, "\x01\x00\x00\x00" "\x01", 5, 0);
+
+	chk->ok = ok;
+	chk->state = CHECK_DONE;
+	closesocket(chk->fd);
+	chk->fd = -1;
+}
+
+static void check_backend_send(backend_check_t *chk, guint8 packet_id, const gchar *payload, gsize len) {
+	network_mysqld_proto_append_packet_len(chk->out, len);
+	network_mysqld_proto_append_packet_id(chk->out, packet_id);
+	g_string_append_len(chk->out, payload, len);
+}
+
+/**
+ * handle one packet from the backend
+ *
+ * @return FALSE if the check failed
+ */
+static gboolean check_backend_packet(backend_check_t *chk, guint8 packet_id, GString *payload) {
+	network_packet packet;
+	guchar type = payload->len ? payload->str[0] : 0xff;
+	gboolean ok = FALSE;
+
+	packet.data = payload;
+	packet.offset = 0;
+
+	switch (chk->state) {
+	case CHECK_HANDSHAKE: {
+		network_mysqld_auth_challenge *challenge = network_mysqld_auth_challenge_new();
+
+		if (0 == network_mysqld_proto_get_auth_challenge(&packet, challenge)) {
+			ok = TRUE;
+			if (chk->user == NULL) {
+				check_backend_done(chk, TRUE);
+			} else {
+				network_mysqld_auth_response *auth = network_mysqld_auth_response_new();
+				GString *response = g_string_new(NULL);
 
-		for (i = 0; i < len; ++i) {
-			network_backend_t *backend = g_ptr_array_index(backends, i);
-			if (backend == NULL || backend->state == BACKEND_STATE_UP || backend->state == BACKEND_STATE_OFFLINE) continue;
+				auth->capabilities = CLIENT_LONG_PASSWORD | CLIENT_LONG_FLAG | CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION;
+				auth->max_packet_size = 0x01000000;
+				auth->charset = 8; /* latin1 */
+				g_string_assign(auth->username, chk->user);
+				network_mysqld_proto_password_scramble(auth->response, S(challenge->challenge), S(chk->hashed_password));
+				network_mysqld_proto_append_auth_response(response, auth);
 
-			gchar *ip = inet_ntoa(backend->addr->addr.ipv4.sin_addr);
-			guint port = ntohs(backend->addr->addr.ipv4.sin_port);
-			mysql_options(&mysql, MYSQL_OPT_CONNECT_TIMEOUT, &tm);
+				check_backend_send(chk, packet_id + 1, S(response));
+				chk->state = CHECK_AUTH;
 
-			gchar *user = NULL, *pwd = NULL;
-			if (raw_pwds->len > 0) {
-				gchar *user_pwd = g_ptr_array_index(raw_pwds, 0);
-				gchar *pos = strchr(user_pwd, ':');
-				g_assert(pos);
-				user = g_strndup(user_pwd, pos-user_pwd);
-				pwd = decrypt(pos+1);
+				g_string_free(response, TRUE);
+				network_mysqld_auth_response_free(auth);
 			}
-			if (mysql_real_connect(&mysql, ip, user, pwd, NULL, port, NULL, 0) && mysql_query(&mysql, "SELECT 1") == 0) {
-				backend->state = BACKEND_STATE_UP;
-			} else if (backend->state == BACKEND_STATE_UNKNOWN) {
-				backend->state = BACKEND_STATE_DOWN;
+		}
+		network_mysqld_auth_challenge_free(challenge);
+		break;
+	}
+	case CHECK_AUTH:
+		if (type == MYSQLD_PACKET_OK) {
+			check_backend_send(chk, 0, C("\x03" "SELECT 1"));
+			chk->state = CHECK_QUERY;
+			ok = TRUE;
+		} else if (type == MYSQLD_PACKET_EOF && payload->len > 1) {
+			/* auth-switch: answer with a new scramble if it stays mysql_native_password */
+			gchar *plugin = NULL;
+			GString *response = g_string_new(NULL);
+
+			if (0 == network_mysqld_proto_skip(&packet, 1) &&
+					0 == network_mysqld_proto_get_string(&packet, &plugin) &&
+					0 == strcmp(plugin, "mysql_native_password") &&
+					payload->len - packet.offset >= 20) {
+				network_mysqld_proto_password_scramble(response, payload->str + packet.offset, 20, S(chk->hashed_password));
+				check_backend_send(chk, packet_id + 1, S(response));
+				ok = TRUE;
+			}
+
+			g_free(plugin);
+			g_string_free(response, TRUE);
+		}
+		break;
+	case CHECK_QUERY:
+		if (type == MYSQLD_PACKET_ERR) break;
+
+		ok = TRUE;
+		/* the column-count, the field definitions, EOF, the row and EOF */
+		if (type == MYSQLD_PACKET_EOF && payload->len < 9 && ++chk->eofs == 2) check_backend_done(chk, TRUE);
+		break;
+	case CHECK_DONE:
+		break;
+	}
+
+	return ok;
+}
+
+static void check_backend_handle(int event_fd, short events, void *user_data);
+
+static void check_backend_wait(backend_check_t *chk) {
+	event_set(&(chk->ev), chk->fd, EV_READ | (chk->out->len ? EV_WRITE : 0), check_backend_handle, chk);
+	event_base_set(chk->base, &(chk->ev));
+	event_add(&(chk->ev), &(chk->timeout));
+}
+
+static void check_backend_handle(int event_fd, short events, void *user_data) {
+	backend_check_t *chk = user_data;
+	gssize len;
+
+	if (events & EV_TIMEOUT) {
+		check_backend_done(chk, FALSE);
+		return;
+	}
+
+	if ((events & EV_WRITE) && chk->out->len > 0) {
+		len = send(event_fd, S(chk->out), 0);
+		if (len > 0) {
+			g_string_erase(chk->out, 0, len);
+		} else if (!(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+			check_backend_done(chk, FALSE);
+			return;
+		}
+	}
+
+	if (events & EV_READ) {
+		gchar buf[1024];
+
+		/* a failed connect() makes the socket readable too, recv() reports the error */
+		len = recv(event_fd, buf, sizeof(buf), 0);
+		if (len > 0) {
+			g_string_append_len(chk->in, buf, len);
+		} else if (!(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+			check_backend_done(chk, FALSE);
+			return;
+		}
+
+		while (chk->in->len >= NET_HEADER_SIZE) {
+			guint32 packet_len = network_mysqld_proto_get_packet_len(chk->in);
+			guint8 packet_id = network_mysqld_proto_get_packet_id(chk->in);
+			GString *payload;
+			gboolean ok;
+
+			if (chk->in->len < NET_HEADER_SIZE + packet_len) break;
+
+			payload = g_string_new_len(chk->in->str + NET_HEADER_SIZE, packet_len);
+			g_string_erase(chk->in, 0, NET_HEADER_SIZE + packet_len);
+			ok = check_backend_packet(chk, packet_id, payload);
+			g_string_free(payload, TRUE);
+
+			if (!ok) check_backend_done(chk, FALSE);
+			if (chk->state == CHECK_DONE) return;
+		}
+	}
+
+	check_backend_wait(chk);
+}
+
+static backend_check_t *check_backend_start(struct event_base *base, network_backend_t *backend, const gchar *user, GString *hashed_password) {
+	backend_check_t *chk = g_new0(backend_check_t, 1);
+	chk->backend = backend;
+	chk->user = user;
+	chk->hashed_password = hashed_password;
+	chk->base = base;
+	chk->in = g_string_new(NULL);
+	chk->out = g_string_new(NULL);
+	chk->timeout.tv_sec  = config->check_timeout / 1000;
+	chk->timeout.tv_usec = (config->check_timeout % 1000) * 1000;
+
+	if (-1 == (chk->fd = socket(backend->addr->addr.common.sa_family, SOCK_STREAM, 0))) {
+		g_critical("%s: socket(%s) failed: %s (%d)", G_STRLOC, backend->addr->name->str, g_strerror(errno), errno);
+		return chk;
+	}
+	fcntl(chk->fd, F_SETFL, O_NONBLOCK | O_RDWR);
+
+	if (-1 == connect(chk->fd, &(backend->addr->addr.common), backend->addr->len) && errno != EINPROGRESS) {
+		check_backend_done(chk, FALSE);
+		return chk;
+	}
+
+	check_backend_wait(chk);
+
+	return chk;
+}
+
+/**
+ * apply the rise/fall thresholds to the result of a probe
+ *
+ * @return TRUE if the backend just went DOWN
+ */
+static gboolean check_backend_apply(network_backend_t *backend, gboolean ok) {
+	if (backend->state == BACKEND_STATE_OFFLINE) {
+		backend->check_rise = backend->check_fall = 0;
+		return FALSE;
+	}
+
+	if (ok) {
+		backend->check_fall = 0;
+		if (backend->state == BACKEND_STATE_UP) return FALSE;
+
+		/* a backend in UNKNOWN state hasn't served anything yet, bring it up at once */
+		if (++backend->check_rise >= config->check_rise || backend->state == BACKEND_STATE_UNKNOWN) {
+			g_message("%s: backend %s is UP after %u successful checks", G_STRLOC, backend->addr->name->str, backend->check_rise);
+			backend->state = BACKEND_STATE_UP;
+			backend->check_rise = 0;
+		}
+	} else {
+		backend->check_rise = 0;
+		if (backend->state == BACKEND_STATE_UNKNOWN) {
+			backend->state = BACKEND_STATE_DOWN;
+		} else if (backend->state == BACKEND_STATE_UP && ++backend->check_fall >= config->check_fall) {
+			g_critical("%s: backend %s is DOWN after %u failed checks", G_STRLOC, backend->addr->name->str, backend->check_fall);
+			backend->state = BACKEND_STATE_DOWN;
+			backend->check_fall = 0;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * probe all backends in parallel every check-interval milliseconds
+ */
+gpointer check_state(chassis *chas) {
+	network_backends_t *bs = chas->backends;
+	struct event_base *base = event_base_new();
+	GPtrArray *checks = g_ptr_array_new();
+	GString *hashed_password = g_string_new(NULL);
+	guint i;
+	sleep(1);
+
+	while (!chassis_is_shutdown()) {
+		GTimeVal begin, end;
+		gchar *user = NULL;
+		g_get_current_time(&begin);
+
+		/* log in as the first user of pwds, like the old blocking check did */
+		if (bs->raw_pwds->len > 0) {
+			gchar *user_pwd = g_ptr_array_index(bs->raw_pwds, 0);
+			gchar *pos = strchr(user_pwd, ':');
+			gchar *pwd = decrypt(pos + 1);
+
+			if (pwd) {
+				user = g_strndup(user_pwd, pos - user_pwd);
+				g_string_truncate(hashed_password, 0);
+				network_mysqld_proto_password_hash(hashed_password, pwd, strlen(pwd));
+				g_free(pwd);
 			}
-			mysql_close(&mysql);
-			g_free(user);
-			g_free(pwd);
 		}
 
-		sleep(4);
+		g_mutex_lock(bs->backends_mutex);
+		for (i = 0; i < bs->backends->len; ++i) {
+			network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+			if (backend == NULL || backend->state == BACKEND_STATE_OFFLINE) continue;
+			g_ptr_array_add(checks, check_backend_start(base, backend, user, hashed_password));
+		}
+		g_mutex_unlock(bs->backends_mutex);
+
+		/* returns when all probes are answered or timed out */
+		event_base_dispatch(base);
+
+		gboolean went_down = FALSE;
+		for (i = 0; i < checks->len; ++i) {
+			backend_check_t *chk = g_ptr_array_index(checks, i);
+			if (chk->fd != -1) closesocket(chk->fd);
+			if (check_backend_apply(chk->backend, chk->ok)) went_down = TRUE;
+			g_string_free(chk->in, TRUE);
+			g_string_free(chk->out, TRUE);
+			g_free(chk);
+		}
+		g_ptr_array_set_size(checks, 0);
+		g_free(user);
+
+		/* the pooled connections to a dead backend are useless, let the event-threads close them */
+		if (went_down) chassis_event_purge_pools(chas);
+
+		g_get_current_time(&end);
+		gint64 elapsed = (end.tv_sec - begin.tv_sec) * G_GINT64_CONSTANT(1000) + (end.tv_usec - begin.tv_usec) / 1000;
+		if (elapsed < config->check_interval) g_usleep((config->check_interval - elapsed) * 1000);
 	}
 
+	g_ptr_array_free(checks, TRUE);
+	g_string_free(hashed_password, TRUE);
+	event_base_free(base);
+
 	return NULL;
 }
 
+/**
+ * add a cluster:host:port backend
+ */
+static int add_cluster_backend(network_backends_t *bs, gchar *address, backend_type_t type) {
+	gchar *pos = strchr(address, ':');
+	if (pos == NULL || pos == address) {
+		g_critical("%s: incorrect cluster backend %s, use cluster:host:port", G_STRLOC, address);
+		return -1;
+	}
+
+	gchar *cluster = g_strndup(address, pos - address);
+	int ret = network_backends_add_cluster(bs, pos+1, type, cluster);
+	g_free(cluster);
+
+	return ret;
+}
+
 /**
  * init the plugin with the parsed config
  */
@@ -2500,6 +6381,78 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 		config->backend_addresses[0] = g_strdup("127.0.0.1:3306");
 	}
 
+	if (config->check_interval <= 0 || config->check_timeout <= 0 || config->check_rise <= 0 || config->check_fall <= 0) {
+		g_critical("%s: --check-interval, --check-timeout, --check-rise and --check-fall have to be > 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->breaker_threshold < 0 || config->breaker_threshold > 100 || config->breaker_window <= 0 || config->breaker_cooldown <= 0 || config->breaker_timeout < 0) {
+		g_critical("%s: --breaker-threshold has to be in [0, 100], --breaker-window and --breaker-cooldown > 0, --breaker-timeout >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->shard_merge_max_rows < 0) {
+		g_critical("%s: --shard-merge-max-rows has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->shard_query_timeout < 0) {
+		g_critical("%s: --shard-query-timeout has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->plan_cache_size < 0) {
+		g_critical("%s: --plan-cache-size has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->sql_log_buffer_size <= 0) {
+		g_critical("%s: --sql-log-buffer-size has to be > 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->sql_log_sample < 0) {
+		g_critical("%s: --sql-log-sample has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->sql_log_digest_rate < 0) {
+		g_critical("%s: --sql-log-digest-rate has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->sql_log_format == NULL || strcasecmp(config->sql_log_format, "text") == 0) {
+		config->sql_log_flags = 0;
+	} else if (strcasecmp(config->sql_log_format, "binary") == 0) {
+		config->sql_log_flags = SQL_LOG_BINARY;
+	} else {
+		g_critical("%s: --sql-log-format has to be text or binary, not %s", G_STRLOC, config->sql_log_format);
+		return -1;
+	}
+
+	if (config->sql_log_compress) {
+		if (!(config->sql_log_flags & SQL_LOG_BINARY)) {
+			g_critical("%s: --sql-log-compress needs --sql-log-format=binary", G_STRLOC);
+			return -1;
+		}
+		config->sql_log_flags |= SQL_LOG_COMPRESSED;
+	}
+
+	if (config->query_stats_size < 0) {
+		g_critical("%s: --query-stats-size has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->slow_query_threshold < 0) {
+		g_critical("%s: --slow-query-threshold has to be >= 0", G_STRLOC);
+		return -1;
+	}
+
+	if (config->slow_query_size <= 0) {
+		g_critical("%s: --slow-query-size has to be > 0", G_STRLOC);
+		return -1;
+	}
+
 	/** 
 	 * create a connection handle for the listen socket 
 	 */
@@ -2535,6 +6488,27 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 		}
 	}
 
+	for (i = 0; config->cluster_dbs && config->cluster_dbs[i]; i++) {
+		gchar *pos = strchr(config->cluster_dbs[i], ':');
+		if (pos == NULL || pos == config->cluster_dbs[i] || *(pos+1) == '\0') {
+			g_critical("%s: incorrect cluster-dbs setting %s, use cluster:db", G_STRLOC, config->cluster_dbs[i]);
+			return -1;
+		}
+		g_hash_table_insert(config->db_cluster, g_strdup(pos+1), g_strndup(config->cluster_dbs[i], pos - config->cluster_dbs[i]));
+	}
+
+	for (i = 0; config->cluster_backend_addresses && config->cluster_backend_addresses[i]; i++) {
+		if (-1 == add_cluster_backend(chas->backends, config->cluster_backend_addresses[i], BACKEND_TYPE_RW)) {
+			return -1;
+		}
+	}
+
+	for (i = 0; config->cluster_read_only_backend_addresses && config->cluster_read_only_backend_addresses[i]; i++) {
+		if (-1 == add_cluster_backend(chas->backends, config->cluster_read_only_backend_addresses[i], BACKEND_TYPE_RO)) {
+			return -1;
+		}
+	}
+
 	for (i = 0; config->client_ips && config->client_ips[i]; i++) {
 		g_ptr_array_add(chas->backends->raw_ips, g_strdup(config->client_ips[i]));
 		guint* sum = g_new0(guint, 1);
@@ -2565,14 +6539,18 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 	}
 
 	if (sql_log_type != OFF) {
-		gchar* sql_log_filename = g_strdup_printf("%s/sql_%s.log", chas->log_path, chas->instance_name);
-		config->sql_log = fopen(sql_log_filename, "a");
+		/* REALTIME only means the records reach the file sooner */
+		gchar* sql_log_filename = g_strdup_printf("%s/sql_%s.%s", chas->log_path, chas->instance_name,
+				(config->sql_log_flags & SQL_LOG_BINARY) ? "bin" : "log");
+		config->sql_log = sql_log_new(sql_log_filename, config->sql_log_flags, chas->event_thread_count + 1, config->sql_log_buffer_size * 1024,
+				sql_log_type == REALTIME ? 10 * 1000 : 100 * 1000);
 		if (config->sql_log == NULL) {
 			g_critical("Failed to open %s", sql_log_filename);
 			g_free(sql_log_filename);
 			return -1;
 		}
 		g_free(sql_log_filename);
+		chas->backends->sql_log = config->sql_log;
 	}
 
 	for (i = 0; config->tables && config->tables[i]; i++) {
@@ -2587,7 +6565,7 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 					dt->column_name = token;
 					if ((token = strsep(&config->tables[i], ".")) != NULL) {
 						dt->table_num = atoi(token);
-						is_complete = TRUE;
+						is_complete = db_table_set_shard(dt, config->tables[i]);
 					}
 				}
 			}
@@ -2596,11 +6574,43 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 		if (is_complete) {
 			gchar* key = g_strdup_printf("%s.%s", db, dt->table_name);
 			g_hash_table_insert(config->dt_table, key, dt);
+			g_hash_table_add(config->dt_table_names, dt->table_name);
 		} else {
 			g_critical("incorrect sub-table settings");
-			g_free(dt);
+			db_table_free(dt);
+			return -1;
+		}
+	}
+
+	for (i = 0; config->table_clusters && config->table_clusters[i]; i++) {
+		gchar **parts = g_strsplit(config->table_clusters[i], ":", 3);
+		db_table_t *dt = NULL;
+		guint first = 0, last = 0, t;
+
+		if (g_strv_length(parts) == 3 && *parts[1] && *parts[2] && NULL != (dt = g_hash_table_lookup(config->dt_table, parts[0]))) {
+			gchar *dash = strchr(parts[1], '-');
+			first = atoi(parts[1]);
+			last = dash ? atoi(dash+1) : first;
+		}
+
+		if (dt == NULL || first > last || last >= dt->table_num) {
+			g_critical("%s: incorrect table-clusters setting %s, use db.table:first-last:cluster", G_STRLOC, config->table_clusters[i]);
+			g_strfreev(parts);
+			return -1;
+		}
+
+		if (!backends_have_cluster(chas->backends, parts[2])) {
+			g_critical("%s: table-clusters setting %s names the cluster %s, which no cluster-backend-addresses or cluster-read-only-backend-addresses serve", G_STRLOC, config->table_clusters[i], parts[2]);
+			g_strfreev(parts);
 			return -1;
 		}
+
+		if (dt->clusters == NULL) dt->clusters = g_new0(gchar *, dt->table_num);
+		for (t = first; t <= last; ++t) {
+			g_free(dt->clusters[t]);
+			dt->clusters[t] = g_strdup(parts[2]);
+		}
+		g_strfreev(parts);
 	}
 
 	for (i = 0; config->pwds && config->pwds[i]; i++) {
@@ -2633,6 +6643,37 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 	chas->backends->pwd_table = config->pwd_table;
 	chas->backends->pwd_table_index = &(config->pwd_table_index);
 
+	/* index 0 is the main-thread */
+	if (config->plan_cache_size > 0) {
+		config->plan_cache_num = chas->event_thread_count + 1;
+		config->plan_cache_stats = g_new0(plan_cache_stats_t, config->plan_cache_num);
+		config->plan_caches = g_new0(plan_cache_t*, config->plan_cache_num);
+		for (i = 0; i < config->plan_cache_num; i++) {
+			config->plan_caches[i] = plan_cache_new(&(config->plan_cache_stats[i]));
+		}
+		chas->backends->plan_cache_stats = config->plan_cache_stats;
+	}
+
+	if (config->query_stats_size > 0) {
+		config->query_stats = query_stats_new(chas->event_thread_count + 1, config->query_stats_size);
+		chas->backends->query_stats = config->query_stats;
+	}
+
+	if (config->slow_query_threshold > 0) {
+		config->slow_queries = slow_queries_new(chas->event_thread_count + 1, config->slow_query_size, (guint64)config->slow_query_threshold * 1000);
+		chas->backends->slow_queries = config->slow_queries;
+	}
+
+	if (config->con_profiling) g_atomic_int_set(&chas->backends->profile->enabled, 1);
+
+	if (config->metrics_address) {
+		config->metrics = network_metrics_new(chas);
+		if (0 != network_metrics_listen(config->metrics, config->metrics_address)) {
+			g_critical("%s: can't listen on --metrics-address=%s", G_STRLOC, config->metrics_address);
+			return -1;
+		}
+	}
+
 	/* load the script and setup the global tables */
 	network_mysqld_lua_setup_global(chas->sc->L, chas);
 
@@ -2644,7 +6685,7 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas, chassis_plugin_confi
 	event_base_set(chas->event_base, &(listen_sock->event));
 	event_add(&(listen_sock->event), NULL);
 
-	g_thread_create((GThreadFunc)check_state, chas->backends, FALSE, NULL);
+	g_thread_create((GThreadFunc)check_state, chas, FALSE, NULL);
 
 	return 0;
 }
@@ -106,6 +106,70 @@ void chassis_event_add_local(chassis *chas, struct event *ev) {		//
 	event_add(ev, NULL);
 }
 
+/**
+ * close the pooled connections of all backends which are DOWN
+ *
+ * the pools are only touched by their own thread, so this has to run inside the event-thread
+ */
+static void chassis_event_thread_purge_pools(chassis_event_thread_t *thread, gpointer G_GNUC_UNUSED user_data) {
+	network_backends_t *bs = thread->chas->backends;
+	guint i;
+
+	if (bs == NULL) return;
+
+	g_mutex_lock(bs->backends_mutex);
+	for (i = 0; i < bs->backends->len; ++i) {
+		network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+		if (backend->state != BACKEND_STATE_DOWN || thread->index >= backend->pools->len) continue;
+
+		network_connection_pool *pool = g_ptr_array_index(backend->pools, thread->index);
+		guint n = network_connection_pool_purge(pool);
+		if (n > 0) g_message("%s: closed %u pooled connections to %s in thread %u", G_STRLOC, n, backend->addr->name->str, thread->index);
+	}
+	g_mutex_unlock(bs->backends_mutex);
+}
+
+/**
+ * a function chassis_event_threads_call() runs in each event-thread or chassis_event_thread_call() in one
+ */
+typedef struct {
+	chassis_event_thread_func func;
+	gpointer user_data;
+	GDestroyNotify free_func;  /**< frees user_data after a chassis_event_thread_call() */
+
+	GMutex *mutex;           /**< held while func runs, so it may collect into user_data. NULL if nobody waits for it */
+	GCond *cond;
+	guint pending;           /**< threads which didn't run it yet */
+	gboolean is_cancelled;   /**< the caller gave up waiting, user_data is gone */
+
+	volatile gint ref_count;
+} chassis_event_call_t;
+
+static void chassis_event_call_unref(chassis_event_call_t *call) {
+	if (!g_atomic_int_dec_and_test(&call->ref_count)) return;
+
+	if (call->cond) g_cond_free(call->cond);
+	if (call->mutex) g_mutex_free(call->mutex);
+	g_free(call);
+}
+
+static void chassis_event_call_run(chassis_event_call_t *call, chassis_event_thread_t *thread) {
+	if (call->mutex == NULL) {
+		call->func(thread, call->user_data);
+		if (call->free_func) call->free_func(call->user_data);
+		chassis_event_call_unref(call);
+		return;
+	}
+
+	g_mutex_lock(call->mutex);
+	if (!call->is_cancelled) call->func(thread, call->user_data);
+	call->pending--;
+	g_cond_signal(call->cond);
+	g_mutex_unlock(call->mutex);
+
+	chassis_event_call_unref(call);
+}
+
 void chassis_event_handle(int G_GNUC_UNUSED event_fd, short G_GNUC_UNUSED events, void* user_data) {
 	chassis_event_thread_t* thread = user_data;
 
@@ -113,7 +177,26 @@ void chassis_event_handle(int G_GNUC_UNUSED event_fd, short G_GNUC_UNUSED events
 	if (read(thread->notify_receive_fd, ping, 1) != 1) g_error("pipes - read error");
 
 	network_mysqld_con* client_con = g_async_queue_try_pop(thread->event_queue);
-	if (client_con != NULL) network_mysqld_con_handle(-1, 0, client_con);
+	chassis_event_call_t *call;
+
+	if (client_con != NULL) {
+		thread->stats.connections++;
+		thread->stats.clients++;
+		chassis_event_thread_link(thread, client_con);
+		network_mysqld_con_handle(-1, 0, client_con);
+	} else if (NULL != (call = g_async_queue_try_pop(thread->call_queue))) {
+		chassis_event_call_run(call, thread);
+	}
+
+	/* a ping without anything queued is left over from a call chassis_event_thread_run_waiting_calls() took already */
+}
+
+void chassis_event_purge_pools(chassis *chas) {	//called by the health-check thread after a backend went DOWN
+	guint i;
+
+	for (i = 0; i < chas->threads->len; ++i) {
+		chassis_event_thread_call(chas, i, chassis_event_thread_purge_pools, NULL, NULL);
+	}
 }
 
 /**
@@ -125,6 +208,7 @@ chassis_event_thread_t *chassis_event_thread_new(guint index) {
 	thread->index = index;
 
 	thread->event_queue = g_async_queue_new();
+	thread->call_queue = g_async_queue_new();
 
 	return thread;
 }
@@ -156,6 +240,12 @@ void chassis_event_thread_free(chassis_event_thread_t *thread) {
 	}
 	g_async_queue_unref(thread->event_queue);
 
+	chassis_event_call_t *call;
+	while ((call = g_async_queue_try_pop(thread->call_queue))) {
+		chassis_event_call_run(call, thread);
+	}
+	g_async_queue_unref(thread->call_queue);
+
 	g_free(thread);
 }
 
@@ -252,3 +342,206 @@ network_connection_pool* chassis_event_thread_pool(network_backend_t* backend) {
 	guint index = GPOINTER_TO_UINT(g_private_get(&tls_index));
 	return g_ptr_array_index(backend->pools, index);
 }
+
+/**
+ * the index of the calling event-thread, 0 for the main-thread
+ *
+ * for per-thread state which is only touched by its own thread, like the pools
+ */
+guint chassis_event_thread_index(void) {
+	return GPOINTER_TO_UINT(g_private_get(&tls_index));
+}
+
+/**
+ * the counters of the calling event-thread
+ */
+chassis_event_thread_stats_t *chassis_event_thread_stats(chassis *chas) {
+	chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, chassis_event_thread_index());
+
+	return &(thread->stats);
+}
+
+/**
+ * the event-thread of each connection id, so KILL knows where to go without asking all threads
+ */
+static GStaticMutex con_threads_mutex = G_STATIC_MUTEX_INIT;
+static GHashTable *con_threads = NULL;
+
+/**
+ * the thread owns the client connection from now on
+ *
+ * the connections of a thread are a intrusive list which only the thread itself touches, others
+ * get at them through chassis_event_threads_call() and chassis_event_thread_call()
+ */
+void chassis_event_thread_link(chassis_event_thread_t *thread, network_mysqld_con *con) {
+	static volatile gint last_id = 0;
+
+	/* 0 means not linked, skip it when the ids wrap around */
+	do {
+		con->id = g_atomic_int_exchange_and_add(&last_id, 1) + 1;
+	} while (con->id == 0);
+	con->thread = thread->index;
+	con->state_since = chassis_get_rel_microseconds();
+
+	g_static_mutex_lock(&con_threads_mutex);
+	if (con_threads == NULL) con_threads = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(con_threads, GUINT_TO_POINTER(con->id), GUINT_TO_POINTER(thread->index));
+	g_static_mutex_unlock(&con_threads_mutex);
+
+	con->prev_con = NULL;
+	con->next_con = thread->cons;
+	if (thread->cons) thread->cons->prev_con = con;
+	thread->cons = con;
+}
+
+/**
+ * remove the connection from the list of its thread, has to be called in that thread
+ */
+void chassis_event_thread_unlink(network_mysqld_con *con) {
+	chassis_event_thread_t *thread = g_ptr_array_index(con->srv->threads, con->thread);
+
+	if (con->prev_con) {
+		con->prev_con->next_con = con->next_con;
+	} else {
+		thread->cons = con->next_con;
+	}
+	if (con->next_con) con->next_con->prev_con = con->prev_con;
+
+	g_static_mutex_lock(&con_threads_mutex);
+	g_hash_table_remove(con_threads, GUINT_TO_POINTER(con->id));
+	g_static_mutex_unlock(&con_threads_mutex);
+
+	con->prev_con = con->next_con = NULL;
+	con->id = 0;
+}
+
+/**
+ * the event-thread which owns a client connection
+ *
+ * @return the index of the thread, -1 if there is no connection with that id
+ */
+gint chassis_event_thread_of(guint32 id) {
+	gpointer index;
+	gint ret = -1;
+
+	g_static_mutex_lock(&con_threads_mutex);
+	if (con_threads && g_hash_table_lookup_extended(con_threads, GUINT_TO_POINTER(id), NULL, &index)) ret = GPOINTER_TO_INT(index);
+	g_static_mutex_unlock(&con_threads_mutex);
+
+	return ret;
+}
+
+/**
+ * run func in a event-thread without waiting for it
+ *
+ * also the calling thread only runs it from its event-loop, so func may close the connection
+ * which asked for it
+ *
+ * @param free_func  frees user_data after func ran, may be NULL
+ */
+void chassis_event_thread_call(chassis *chas, guint index, chassis_event_thread_func func, gpointer user_data, GDestroyNotify free_func) {
+	chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, index);
+	chassis_event_call_t *call = g_new0(chassis_event_call_t, 1);
+
+	call->func = func;
+	call->user_data = user_data;
+	call->free_func = free_func;
+	call->ref_count = 1;
+
+	g_async_queue_push(thread->call_queue, call);
+	if (write(thread->notify_send_fd, "", 1) != 1) g_error("pipes - write error: %s", g_strerror(errno));
+}
+
+/**
+ * run the chassis_event_threads_call() of others which wait for the calling thread
+ *
+ * two threads which wait for each other would block until the timeout otherwise. the calls
+ * of chassis_event_thread_call() stay queued, they may close the connection we run for. the
+ * notifications of the calls we ran find a empty queue later, which is harmless
+ */
+static void chassis_event_thread_run_waiting_calls(chassis_event_thread_t *thread) {
+	GQueue *later = g_queue_new();
+	chassis_event_call_t *call;
+
+	while ((call = g_async_queue_try_pop(thread->call_queue))) {
+		if (call->mutex) {
+			chassis_event_call_run(call, thread);
+		} else {
+			g_queue_push_tail(later, call);
+		}
+	}
+
+	while ((call = g_queue_pop_head(later))) g_async_queue_push(thread->call_queue, call);
+	g_queue_free(later);
+}
+
+/**
+ * run func in each event-thread and wait until all are done
+ *
+ * the calls are serialized, func may collect into user_data without a lock. the calling thread
+ * runs it directly and keeps answering the calls of other threads while it waits, its own
+ * connections wait that long though. use it for reading, chassis_event_thread_call() for changes
+ *
+ * @param timeout_ms  give up waiting for busy threads, they skip func then
+ * @return FALSE if not all threads made it in time
+ */
+gboolean chassis_event_threads_call(chassis *chas, chassis_event_thread_func func, gpointer user_data, guint timeout_ms) {
+	chassis_event_call_t *call = g_new0(chassis_event_call_t, 1);
+	guint self = chassis_event_thread_index();
+	gboolean is_done = TRUE;
+	GTimeVal deadline;
+	guint i;
+
+	call->func = func;
+	call->user_data = user_data;
+	call->mutex = g_mutex_new();
+	call->cond = g_cond_new();
+	call->ref_count = 1;
+
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, (glong)timeout_ms * 1000);
+
+	g_mutex_lock(call->mutex);
+	for (i = 0; i < chas->threads->len; ++i) {
+		chassis_event_thread_t *thread = chas->threads->pdata[i];
+
+		if (i == self) {
+			func(thread, user_data);
+			continue;
+		}
+
+		call->pending++;
+		g_atomic_int_inc(&call->ref_count);
+		g_async_queue_push(thread->call_queue, call);
+		if (write(thread->notify_send_fd, "", 1) != 1) g_error("pipes - write error: %s", g_strerror(errno));
+	}
+
+	while (call->pending > 0) {
+		GTimeVal now, slice;
+
+		g_get_current_time(&now);
+		if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_usec >= deadline.tv_usec)) {
+			is_done = FALSE;
+			break;
+		}
+
+		/* wake up every few ms to answer the threads which wait for us */
+		slice = now;
+		g_time_val_add(&slice, 5 * 1000);
+		if (slice.tv_sec > deadline.tv_sec || (slice.tv_sec == deadline.tv_sec && slice.tv_usec > deadline.tv_usec)) slice = deadline;
+
+		if (g_cond_timed_wait(call->cond, call->mutex, &slice)) continue;
+
+		if (self < chas->threads->len) {
+			g_mutex_unlock(call->mutex);
+			chassis_event_thread_run_waiting_calls(chas->threads->pdata[self]);
+			g_mutex_lock(call->mutex);
+		}
+	}
+	call->is_cancelled = TRUE;
+	g_mutex_unlock(call->mutex);
+
+	chassis_event_call_unref(call);
+
+	return is_done;
+}
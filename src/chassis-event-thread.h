@@ -32,6 +32,35 @@
 CHASSIS_API void chassis_event_add(network_mysqld_con *client_con);
 CHASSIS_API void chassis_event_add_self(chassis *chas, struct event *ev, int timeout);
 CHASSIS_API void chassis_event_add_local(chassis *chas, struct event *ev);
+CHASSIS_API void chassis_event_purge_pools(chassis *chas);
+
+/**
+ * kinds of client commands for chassis_event_thread_stats_t::queries
+ */
+typedef enum {
+	QUERY_TYPE_SELECT,
+	QUERY_TYPE_INSERT,
+	QUERY_TYPE_UPDATE,
+	QUERY_TYPE_DELETE,
+	QUERY_TYPE_REPLACE,
+	QUERY_TYPE_OTHER,       /**< other COM_QUERYs like SET or BEGIN */
+	QUERY_TYPE_COMMAND,     /**< commands other than COM_QUERY */
+	QUERY_TYPE_MAX
+} chassis_query_type_t;
+
+/**
+ * counters of a event-thread
+ *
+ * only written by the thread itself, readers like the metrics page read them without a lock
+ */
+typedef struct {
+	guint64 events;                   /**< calls of network_mysqld_con_handle(), the load of the thread */
+	guint64 connections;              /**< client connections handed to the thread */
+	gint clients;                     /**< open client connections */
+	guint64 bytes_in;                 /**< read from clients and servers */
+	guint64 bytes_out;                /**< written to clients and servers */
+	guint64 queries[QUERY_TYPE_MAX];
+} chassis_event_thread_stats_t;
 
 /**
  * a event-thread
@@ -52,8 +81,18 @@ typedef struct {
 	guint index;
 
 	GAsyncQueue *event_queue;
+	GAsyncQueue *call_queue;          /**< chassis_event_threads_call() and chassis_event_thread_call() ask the thread to run something */
+
+	chassis_event_thread_stats_t stats;
+
+	network_mysqld_con *cons;         /**< the client connections of the thread, only touched by the thread itself */
 } chassis_event_thread_t;
 
+/**
+ * runs inside of a event-thread, so it may touch the connections of the thread
+ */
+typedef void (*chassis_event_thread_func)(chassis_event_thread_t *thread, gpointer user_data);
+
 CHASSIS_API chassis_event_thread_t *chassis_event_thread_new();
 CHASSIS_API void chassis_event_thread_free(chassis_event_thread_t *thread);
 CHASSIS_API void chassis_event_handle(int event_fd, short events, void *user_data);
@@ -64,5 +103,13 @@ CHASSIS_API int chassis_event_threads_init_thread(chassis_event_thread_t *thread
 CHASSIS_API void chassis_event_threads_start(GPtrArray *threads);
 
 CHASSIS_API network_connection_pool* chassis_event_thread_pool(network_backend_t* backend);
+CHASSIS_API guint chassis_event_thread_index(void);
+CHASSIS_API chassis_event_thread_stats_t *chassis_event_thread_stats(chassis *chas);
+
+CHASSIS_API void chassis_event_thread_link(chassis_event_thread_t *thread, network_mysqld_con *con);
+CHASSIS_API void chassis_event_thread_unlink(network_mysqld_con *con);
+CHASSIS_API gboolean chassis_event_threads_call(chassis *chas, chassis_event_thread_func func, gpointer user_data, guint timeout_ms);
+CHASSIS_API void chassis_event_thread_call(chassis *chas, guint index, chassis_event_thread_func func, gpointer user_data, GDestroyNotify free_func);
+CHASSIS_API gint chassis_event_thread_of(guint32 id);
 
 #endif
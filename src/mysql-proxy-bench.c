@@ -0,0 +1,697 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+
+/**
+ * load generator and latency benchmark for the proxy
+ *
+ *   mysql-proxy-bench [options]
+ *
+ * runs --connections client connections, each in its own thread, for --time seconds after
+ * --warmup seconds. each query picks one of the --workload's at random:
+ *
+ *   point       SELECT c FROM <table> WHERE id = ?
+ *   range       SELECT c FROM <table> WHERE id BETWEEN ? AND ?
+ *   insert      INSERT INTO <table> (id, k, c, pad) VALUES (...), --insert-rows rows per INSERT
+ *   sharded-in  SELECT c FROM <table> WHERE id IN (?, ...), fans out on a sharded table
+ *   trx         BEGIN, --trx-queries point selects, an UPDATE and COMMIT as one operation
+ *
+ * prints throughput and the latency distribution of each workload, with --json as a document
+ * which can be compared between builds. --prepare creates and fills the table, --cleanup drops it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mysql.h>
+#include <glib.h>
+
+#include "chassis-timings.h"
+#include "network-histogram.h"
+
+#define S(x) x->str, x->len
+
+typedef enum {
+	BENCH_POINT,
+	BENCH_RANGE,
+	BENCH_INSERT,
+	BENCH_SHARDED_IN,
+	BENCH_TRX,
+	BENCH_MAX
+} bench_workload_t;
+
+static const gchar *bench_workload_names[BENCH_MAX] = {
+	"point",
+	"range",
+	"insert",
+	"sharded-in",
+	"trx",
+};
+
+typedef enum {
+	BENCH_WARMUP,
+	BENCH_MEASURE,
+	BENCH_STOP
+} bench_phase_t;
+
+/**
+ * percentiles in the report, the --json one has the non-empty histogram buckets too
+ */
+static const gdouble bench_percentiles[] = { 50, 75, 90, 95, 99, 99.9, 99.99 };
+
+typedef struct {
+	gchar *host;
+	gint port;
+	gchar *socket;
+	gchar *user;
+	gchar *password;
+	gchar *database;
+	gchar *table;
+
+	gint connections;
+	gint time;              /**< seconds measured */
+	gint warmup;            /**< seconds before, not measured */
+	gint report_interval;   /**< seconds between the progress lines, 0 for none */
+	gint rows;              /**< ids 1 ... rows are in the table */
+	gint range_size;
+	gint in_size;
+	gint trx_queries;
+	gint insert_rows;       /**< rows per INSERT of the insert workload */
+	gint batch;             /**< rows per INSERT of --prepare */
+
+	bench_workload_t workloads[BENCH_MAX];
+	guint workload_count;
+
+	guint64 insert_base;    /**< the inserts use ids from here on */
+
+	volatile gint phase;    /**< bench_phase_t */
+} bench_config_t;
+
+typedef struct {
+	guint64 ops;
+	guint64 errors;
+	histogram_t latency;    /**< microseconds of the successful operations */
+} bench_stats_t;
+
+/**
+ * a client connection and its thread, the stats are only written by the thread
+ */
+typedef struct {
+	bench_config_t *config;
+	guint index;
+
+	MYSQL *mysql;
+	GRand *rand;
+	GString *query;
+	guint64 inserts;
+	gboolean has_logged_error;
+
+	bench_stats_t stats[BENCH_MAX];
+
+	GThread *thr;
+} bench_conn_t;
+
+static MYSQL *bench_connect(bench_config_t *config) {
+	MYSQL *mysql = mysql_init(NULL);
+
+	/* libmysql only takes the socket if the host is NULL or localhost */
+	if (!mysql_real_connect(mysql, config->socket ? NULL : config->host, config->user, config->password, config->database,
+				config->port, config->socket, 0)) {
+		g_critical("%s: connecting to %s:%d failed: %s", G_STRLOC, config->host, config->port, mysql_error(mysql));
+		mysql_close(mysql);
+		return NULL;
+	}
+
+	return mysql;
+}
+
+/**
+ * send a query and read its result
+ */
+static gboolean bench_query(bench_conn_t *bc, const gchar *query, gsize query_len) {
+	MYSQL_RES *res;
+
+	if (mysql_real_query(bc->mysql, query, query_len)) {
+		if (!bc->has_logged_error) {
+			g_warning("%s: connection %u: %s failed: %s (more errors are only counted)", G_STRLOC, bc->index, query, mysql_error(bc->mysql));
+			bc->has_logged_error = TRUE;
+		}
+		return FALSE;
+	}
+
+	if (NULL != (res = mysql_store_result(bc->mysql))) {
+		mysql_free_result(res);
+	} else if (mysql_field_count(bc->mysql) != 0) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static guint bench_random_id(bench_conn_t *bc) {
+	return g_rand_int_range(bc->rand, 1, bc->config->rows + 1);
+}
+
+/**
+ * append a quoted string of random digit groups like sysbench
+ */
+static void bench_append_random_str(bench_conn_t *bc, GString *s, guint len) {
+	guint i;
+
+	g_string_append_c(s, '\'');
+	for (i = 0; i < len; i++) {
+		g_string_append_c(s, (i % 12 == 11) ? '-' : '0' + g_rand_int_range(bc->rand, 0, 10));
+	}
+	g_string_append_c(s, '\'');
+}
+
+static void bench_append_row(bench_conn_t *bc, GString *s, guint64 id) {
+	g_string_append_printf(s, "(%" G_GUINT64_FORMAT ", %u, ", id, bench_random_id(bc));
+	bench_append_random_str(bc, s, 119);
+	g_string_append(s, ", ");
+	bench_append_random_str(bc, s, 59);
+	g_string_append_c(s, ')');
+}
+
+static gboolean bench_trx(bench_conn_t *bc) {
+	bench_config_t *config = bc->config;
+	GString *q = bc->query;
+	gint i;
+
+	if (!bench_query(bc, "BEGIN", sizeof("BEGIN") - 1)) return FALSE;
+
+	for (i = 0; i < config->trx_queries; i++) {
+		g_string_printf(q, "SELECT c FROM %s WHERE id = %u", config->table, bench_random_id(bc));
+		if (!bench_query(bc, S(q))) goto rollback;
+	}
+
+	g_string_printf(q, "UPDATE %s SET k = k + 1 WHERE id = %u", config->table, bench_random_id(bc));
+	if (!bench_query(bc, S(q))) goto rollback;
+
+	return bench_query(bc, "COMMIT", sizeof("COMMIT") - 1);
+
+rollback:
+	mysql_real_query(bc->mysql, "ROLLBACK", sizeof("ROLLBACK") - 1);
+
+	return FALSE;
+}
+
+static gboolean bench_run(bench_conn_t *bc, bench_workload_t workload) {
+	bench_config_t *config = bc->config;
+	GString *q = bc->query;
+	guint id;
+	gint i;
+
+	switch (workload) {
+	case BENCH_POINT:
+		g_string_printf(q, "SELECT c FROM %s WHERE id = %u", config->table, bench_random_id(bc));
+		break;
+	case BENCH_RANGE:
+		id = g_rand_int_range(bc->rand, 1, MAX(config->rows - config->range_size, 1) + 1);
+		g_string_printf(q, "SELECT c FROM %s WHERE id BETWEEN %u AND %u", config->table, id, id + config->range_size - 1);
+		break;
+	case BENCH_INSERT:
+		/* the connections take turns, so the ids don't collide */
+		g_string_printf(q, "INSERT INTO %s (id, k, c, pad) VALUES ", config->table);
+		for (i = 0; i < config->insert_rows; i++) {
+			if (i) g_string_append_c(q, ',');
+			bench_append_row(bc, q, config->insert_base + bc->index + bc->inserts++ * config->connections);
+		}
+		break;
+	case BENCH_SHARDED_IN:
+		g_string_printf(q, "SELECT c FROM %s WHERE id IN (", config->table);
+		for (i = 0; i < config->in_size; i++) {
+			g_string_append_printf(q, "%s%u", i ? ", " : "", bench_random_id(bc));
+		}
+		g_string_append_c(q, ')');
+		break;
+	case BENCH_TRX:
+		return bench_trx(bc);
+	default:
+		g_assert_not_reached();
+	}
+
+	return bench_query(bc, S(q));
+}
+
+static gpointer bench_conn_loop(gpointer user_data) {
+	bench_conn_t *bc = user_data;
+	bench_config_t *config = bc->config;
+	gint phase;
+
+	mysql_thread_init();
+
+	while (BENCH_STOP != (phase = g_atomic_int_get(&config->phase))) {
+		bench_workload_t workload = config->workloads[g_rand_int_range(bc->rand, 0, config->workload_count)];
+		bench_stats_t *stats = &(bc->stats[workload]);
+		guint64 start = chassis_get_rel_microseconds();
+		gboolean is_ok = bench_run(bc, workload);
+		guint64 latency_us = chassis_get_rel_microseconds() - start;
+
+		if (phase == BENCH_MEASURE) {
+			if (is_ok) {
+				stats->ops++;
+				histogram_record(&(stats->latency), latency_us);
+			} else {
+				stats->errors++;
+			}
+		}
+
+		/* the proxy may have closed the connection, KILL or a failover */
+		if (!is_ok && mysql_ping(bc->mysql)) {
+			MYSQL *mysql = bench_connect(config);
+
+			if (mysql) {
+				mysql_close(bc->mysql);
+				bc->mysql = mysql;
+			} else {
+				g_usleep(G_USEC_PER_SEC / 10);
+			}
+		}
+	}
+
+	mysql_thread_end();
+
+	return NULL;
+}
+
+/**
+ * create the table and fill it with ids 1 ... --rows
+ *
+ * sharded tables have to be created on the backends first, the rows are inserted through the proxy
+ */
+static int bench_prepare(bench_config_t *config) {
+	bench_conn_t bc;
+	GString *q;
+	gint id;
+	int ret = 0;
+
+	memset(&bc, 0, sizeof(bc));
+	bc.config = config;
+	if (NULL == (bc.mysql = bench_connect(config))) return -1;
+	bc.rand = g_rand_new();
+	bc.query = q = g_string_sized_new(config->batch * 256);
+
+	g_string_printf(q, "CREATE TABLE IF NOT EXISTS %s ("
+			"id BIGINT UNSIGNED NOT NULL PRIMARY KEY, "
+			"k INT UNSIGNED NOT NULL DEFAULT 0, "
+			"c CHAR(120) NOT NULL DEFAULT '', "
+			"pad CHAR(60) NOT NULL DEFAULT '', "
+			"KEY k (k)) ENGINE=InnoDB", config->table);
+	if (!bench_query(&bc, S(q))) ret = -1;
+
+	for (id = 1; ret == 0 && id <= config->rows; ) {
+		gint i;
+
+		g_string_printf(q, "INSERT INTO %s (id, k, c, pad) VALUES ", config->table);
+		for (i = 0; i < config->batch && id <= config->rows; i++, id++) {
+			if (i) g_string_append(q, ", ");
+			bench_append_row(&bc, q, id);
+		}
+		if (!bench_query(&bc, S(q))) ret = -1;
+	}
+
+	if (ret == 0) fprintf(stderr, "%s: %d rows inserted\n", config->table, config->rows);
+
+	g_string_free(q, TRUE);
+	g_rand_free(bc.rand);
+	mysql_close(bc.mysql);
+
+	return ret;
+}
+
+static int bench_cleanup(bench_config_t *config) {
+	MYSQL *mysql = bench_connect(config);
+	gchar *q;
+	int ret = 0;
+
+	if (!mysql) return -1;
+
+	q = g_strdup_printf("DROP TABLE IF EXISTS %s", config->table);
+	if (mysql_query(mysql, q)) {
+		g_critical("%s: %s failed: %s", G_STRLOC, q, mysql_error(mysql));
+		ret = -1;
+	}
+	g_free(q);
+	mysql_close(mysql);
+
+	return ret;
+}
+
+/**
+ * the inserts start after the largest id of the table, so a run can follow another one
+ */
+static guint64 bench_insert_base(bench_config_t *config) {
+	MYSQL *mysql = bench_connect(config);
+	guint64 base = config->rows + 1;
+	gchar *q;
+
+	if (!mysql) return base;
+
+	q = g_strdup_printf("SELECT MAX(id) FROM %s", config->table);
+	if (0 == mysql_query(mysql, q)) {
+		MYSQL_RES *res = mysql_store_result(mysql);
+		MYSQL_ROW row;
+
+		if (res && (row = mysql_fetch_row(res)) && row[0]) {
+			base = MAX(base, g_ascii_strtoull(row[0], NULL, 10) + 1);
+		}
+		if (res) mysql_free_result(res);
+	}
+	g_free(q);
+	mysql_close(mysql);
+
+	return base;
+}
+
+static guint64 bench_ops(bench_conn_t *conns, guint n) {
+	guint64 ops = 0;
+	guint i, w;
+
+	for (i = 0; i < n; i++) {
+		for (w = 0; w < BENCH_MAX; w++) {
+			ops += conns[i].stats[w].ops;
+		}
+	}
+
+	return ops;
+}
+
+static void json_append_string(GString *s, const gchar *str) {
+	g_string_append_c(s, '"');
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			g_string_append_c(s, '\\');
+			g_string_append_c(s, *str);
+		} else if ((guchar)*str < 0x20) {
+			g_string_append_printf(s, "\\u%04x", (guchar)*str);
+		} else {
+			g_string_append_c(s, *str);
+		}
+	}
+	g_string_append_c(s, '"');
+}
+
+static void bench_print_text(GString *out, const gchar *name, bench_stats_t *stats, gdouble elapsed) {
+	const histogram_t *h = &(stats->latency);
+
+	g_string_append_printf(out, "%-12s %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			name,
+			stats->ops,
+			stats->errors,
+			stats->ops / elapsed,
+			h->count ? h->sum / 1000.0 / h->count : 0.0,
+			histogram_percentile(h, 50) / 1000.0,
+			histogram_percentile(h, 95) / 1000.0,
+			histogram_percentile(h, 99) / 1000.0,
+			histogram_percentile(h, 99.9) / 1000.0,
+			h->max / 1000.0);
+}
+
+static void bench_print_json(GString *out, const gchar *name, bench_stats_t *stats, gdouble elapsed) {
+	const histogram_t *h = &(stats->latency);
+	gboolean is_first = TRUE;
+	guint i;
+
+	g_string_append(out, "    ");
+	json_append_string(out, name);
+	g_string_append_printf(out, ": {\n"
+			"      \"ops\": %" G_GUINT64_FORMAT ",\n"
+			"      \"errors\": %" G_GUINT64_FORMAT ",\n"
+			"      \"ops_per_sec\": %.1f,\n"
+			"      \"latency_us\": {\n"
+			"        \"mean\": %.1f,\n",
+			stats->ops,
+			stats->errors,
+			stats->ops / elapsed,
+			h->count ? (gdouble)h->sum / h->count : 0.0);
+	for (i = 0; i < G_N_ELEMENTS(bench_percentiles); i++) {
+		g_string_append_printf(out, "        \"p%g\": %" G_GUINT64_FORMAT ",\n", bench_percentiles[i], histogram_percentile(h, bench_percentiles[i]));
+	}
+	g_string_append_printf(out, "        \"max\": %" G_GUINT64_FORMAT ",\n", h->max);
+
+	/* [ upper bound of the bucket, count ] of the non-empty buckets */
+	g_string_append(out, "        \"histogram\": [");
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (h->buckets[i] == 0) continue;
+
+		g_string_append_printf(out, "%s[%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT "]", is_first ? "" : ", ",
+				histogram_bucket_max(i), h->buckets[i]);
+		is_first = FALSE;
+	}
+	g_string_append(out, "]\n      }\n    }");
+}
+
+static int bench_parse_workloads(bench_config_t *config, const gchar *s) {
+	gchar **names = g_strsplit(s, ",", -1);
+	int ret = 0;
+	guint i, w;
+
+	config->workload_count = 0;
+	for (i = 0; names[i]; i++) {
+		gchar *name = g_strstrip(names[i]);
+
+		if (strcmp(name, "all") == 0) {
+			for (w = 0; w < BENCH_MAX; w++) config->workloads[w] = w;
+			config->workload_count = BENCH_MAX;
+			continue;
+		}
+		for (w = 0; w < BENCH_MAX; w++) {
+			if (strcmp(name, bench_workload_names[w]) == 0) break;
+		}
+		if (w == BENCH_MAX) {
+			g_critical("%s: unknown workload %s, use point, range, insert, sharded-in, trx or all", G_STRLOC, name);
+			ret = -1;
+			break;
+		}
+		if (config->workload_count < BENCH_MAX) config->workloads[config->workload_count++] = w;
+	}
+	g_strfreev(names);
+
+	if (ret == 0 && config->workload_count == 0) {
+		g_critical("%s: --workload is empty", G_STRLOC);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	bench_config_t config;
+	gchar *workload = NULL;
+	gboolean prepare = FALSE, cleanup = FALSE, json = FALSE;
+	GOptionEntry entries[] = {
+		{ "host", 'h', 0, G_OPTION_ARG_STRING, &config.host, "host of the proxy (default: 127.0.0.1)", "<host>" },
+		{ "port", 'P', 0, G_OPTION_ARG_INT, &config.port, "port of the proxy (default: 1234)", "<port>" },
+		{ "socket", 'S', 0, G_OPTION_ARG_STRING, &config.socket, "unix socket instead of --host and --port", "<path>" },
+		{ "user", 'u', 0, G_OPTION_ARG_STRING, &config.user, "user (default: root)", "<user>" },
+		{ "password", 'p', 0, G_OPTION_ARG_STRING, &config.password, "password", "<password>" },
+		{ "database", 'D', 0, G_OPTION_ARG_STRING, &config.database, "default database (default: test)", "<db>" },
+		{ "table", 0, 0, G_OPTION_ARG_STRING, &config.table, "table of the workloads (default: sbtest)", "<table>" },
+		{ "connections", 'c', 0, G_OPTION_ARG_INT, &config.connections, "concurrent client connections, each in its own thread (default: 16)", "<n>" },
+		{ "time", 't', 0, G_OPTION_ARG_INT, &config.time, "seconds to measure (default: 10)", "<seconds>" },
+		{ "warmup", 0, 0, G_OPTION_ARG_INT, &config.warmup, "seconds to run before measuring (default: 2)", "<seconds>" },
+		{ "report-interval", 0, 0, G_OPTION_ARG_INT, &config.report_interval, "print the throughput every n seconds to stderr (default: 0, off)", "<seconds>" },
+		{ "workload", 'w', 0, G_OPTION_ARG_STRING, &workload, "comma separated workloads, each query picks one at random (default: point)", "(point|range|insert|sharded-in|trx|all),..." },
+		{ "rows", 0, 0, G_OPTION_ARG_INT, &config.rows, "ids 1 to n are in the table (default: 100000)", "<n>" },
+		{ "range-size", 0, 0, G_OPTION_ARG_INT, &config.range_size, "rows of a range select (default: 100)", "<n>" },
+		{ "in-size", 0, 0, G_OPTION_ARG_INT, &config.in_size, "ids in the IN list of sharded-in (default: 10)", "<n>" },
+		{ "trx-queries", 0, 0, G_OPTION_ARG_INT, &config.trx_queries, "point selects per transaction before its UPDATE (default: 4)", "<n>" },
+		{ "insert-rows", 0, 0, G_OPTION_ARG_INT, &config.insert_rows, "rows per INSERT of the insert workload (default: 1)", "<n>" },
+		{ "prepare", 0, 0, G_OPTION_ARG_NONE, &prepare, "create the table, insert --rows rows and exit", NULL },
+		{ "batch", 0, 0, G_OPTION_ARG_INT, &config.batch, "rows per INSERT of --prepare (default: 100)", "<n>" },
+		{ "cleanup", 0, 0, G_OPTION_ARG_NONE, &cleanup, "drop the table and exit", NULL },
+		{ "json", 0, 0, G_OPTION_ARG_NONE, &json, "print the results as JSON", NULL },
+		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+	};
+	GOptionContext *option_ctx;
+	GError *gerr = NULL;
+	bench_conn_t *conns;
+	bench_stats_t total;
+	GString *out;
+	guint64 start, last_ops = 0;
+	gdouble elapsed;
+	gint i, w, sec;
+
+	memset(&config, 0, sizeof(config));
+	config.port = 1234;
+	config.connections = 16;
+	config.time = 10;
+	config.warmup = 2;
+	config.rows = 100000;
+	config.range_size = 100;
+	config.in_size = 10;
+	config.trx_queries = 4;
+	config.insert_rows = 1;
+	config.batch = 100;
+
+	option_ctx = g_option_context_new("- load generator and latency benchmark for the proxy");
+	g_option_context_add_main_entries(option_ctx, entries, NULL);
+	if (FALSE == g_option_context_parse(option_ctx, &argc, &argv, &gerr)) {
+		g_critical("%s", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(option_ctx);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(option_ctx);
+
+	if (!config.host) config.host = g_strdup("127.0.0.1");
+	if (!config.user) config.user = g_strdup("root");
+	if (!config.database) config.database = g_strdup("test");
+	if (!config.table) config.table = g_strdup("sbtest");
+
+	if (config.connections <= 0 || config.time <= 0 || config.warmup < 0 || config.report_interval < 0 ||
+			config.rows <= 0 || config.range_size <= 0 || config.in_size <= 0 || config.trx_queries < 0 || config.insert_rows <= 0 || config.batch <= 0) {
+		g_critical("%s: --connections, --time, --rows, --range-size, --in-size, --insert-rows and --batch have to be > 0, the others >= 0", G_STRLOC);
+		return EXIT_FAILURE;
+	}
+	if (0 != bench_parse_workloads(&config, workload ? workload : "point")) return EXIT_FAILURE;
+
+	g_thread_init(NULL);
+	if (mysql_library_init(0, NULL, NULL)) {
+		g_critical("%s: mysql_library_init() failed", G_STRLOC);
+		return EXIT_FAILURE;
+	}
+
+	if (prepare) return bench_prepare(&config) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (cleanup) return bench_cleanup(&config) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	for (w = 0; w < (gint)config.workload_count; w++) {
+		if (config.workloads[w] == BENCH_INSERT) config.insert_base = bench_insert_base(&config);
+	}
+
+	/* connect all first, the connect time isn't part of the measurement */
+	conns = g_new0(bench_conn_t, config.connections);
+	for (i = 0; i < config.connections; i++) {
+		bench_conn_t *bc = &(conns[i]);
+
+		bc->config = &config;
+		bc->index = i;
+		bc->rand = g_rand_new();
+		bc->query = g_string_sized_new(1024);
+		if (NULL == (bc->mysql = bench_connect(&config))) return EXIT_FAILURE;
+	}
+
+	config.phase = BENCH_WARMUP;
+	for (i = 0; i < config.connections; i++) {
+		conns[i].thr = g_thread_create(bench_conn_loop, &(conns[i]), TRUE, NULL);
+	}
+
+	if (config.warmup > 0) g_usleep((gulong)config.warmup * G_USEC_PER_SEC);
+	g_atomic_int_set(&config.phase, BENCH_MEASURE);
+	start = chassis_get_rel_microseconds();
+
+	for (sec = 1; sec <= config.time; sec++) {
+		guint64 until = start + (guint64)sec * G_USEC_PER_SEC;
+		guint64 now = chassis_get_rel_microseconds();
+
+		if (now < until) g_usleep(until - now);
+
+		if (config.report_interval > 0 && sec % config.report_interval == 0) {
+			/* the counters are read while the threads write them, good enough for a progress line */
+			guint64 ops = bench_ops(conns, config.connections);
+
+			fprintf(stderr, "[%4ds] %10.1f ops/s\n", sec, (gdouble)(ops - last_ops) / config.report_interval);
+			last_ops = ops;
+		}
+	}
+
+	g_atomic_int_set(&config.phase, BENCH_STOP);
+	elapsed = (chassis_get_rel_microseconds() - start) / 1000000.0;
+
+	for (i = 0; i < config.connections; i++) {
+		g_thread_join(conns[i].thr);
+	}
+
+	memset(&total, 0, sizeof(total));
+	out = g_string_new(NULL);
+
+	if (json) {
+		g_string_append(out, "{\n  \"config\": {\n    \"host\": ");
+		json_append_string(out, config.socket ? config.socket : config.host);
+		g_string_append_printf(out, ",\n    \"port\": %d,\n    \"table\": ", config.port);
+		json_append_string(out, config.table);
+		g_string_append_printf(out, ",\n    \"connections\": %d,\n    \"time\": %d,\n    \"warmup\": %d,\n    \"rows\": %d,\n"
+				"    \"range_size\": %d,\n    \"in_size\": %d,\n    \"trx_queries\": %d,\n    \"insert_rows\": %d,\n    \"workloads\": [",
+				config.connections, config.time, config.warmup, config.rows, config.range_size, config.in_size, config.trx_queries, config.insert_rows);
+		for (w = 0; w < (gint)config.workload_count; w++) {
+			if (w) g_string_append(out, ", ");
+			json_append_string(out, bench_workload_names[config.workloads[w]]);
+		}
+		g_string_append_printf(out, "]\n  },\n  \"elapsed\": %.3f,\n  \"workloads\": {\n", elapsed);
+	} else {
+		g_string_append_printf(out, "%d connections, %.1f s\n", config.connections, elapsed);
+		g_string_append_printf(out, "%-12s %10s %8s %10s %9s %9s %9s %9s %9s %9s\n",
+				"workload", "ops", "errors", "ops/s", "avg_ms", "p50_ms", "p95_ms", "p99_ms", "p99.9_ms", "max_ms");
+	}
+
+	for (w = 0; w < BENCH_MAX; w++) {
+		bench_stats_t stats;
+		gboolean is_used = FALSE;
+		gint j;
+
+		for (j = 0; j < (gint)config.workload_count; j++) {
+			if (config.workloads[j] == (bench_workload_t)w) is_used = TRUE;
+		}
+		if (!is_used) continue;
+
+		memset(&stats, 0, sizeof(stats));
+		for (i = 0; i < config.connections; i++) {
+			stats.ops += conns[i].stats[w].ops;
+			stats.errors += conns[i].stats[w].errors;
+			histogram_merge(&(stats.latency), &(conns[i].stats[w].latency));
+		}
+		total.ops += stats.ops;
+		total.errors += stats.errors;
+		histogram_merge(&(total.latency), &(stats.latency));
+
+		if (json) {
+			bench_print_json(out, bench_workload_names[w], &stats, elapsed);
+			g_string_append(out, ",\n");
+		} else {
+			bench_print_text(out, bench_workload_names[w], &stats, elapsed);
+		}
+	}
+
+	if (json) {
+		bench_print_json(out, "total", &total, elapsed);
+		g_string_append(out, "\n  }\n}\n");
+	} else if (config.workload_count > 1) {
+		bench_print_text(out, "total", &total, elapsed);
+	}
+
+	fwrite(out->str, out->len, 1, stdout);
+	g_string_free(out, TRUE);
+
+	for (i = 0; i < config.connections; i++) {
+		mysql_close(conns[i].mysql);
+		g_string_free(conns[i].query, TRUE);
+		g_rand_free(conns[i].rand);
+	}
+	g_free(conns);
+	mysql_library_end();
+
+	return total.errors > 0 && total.ops == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
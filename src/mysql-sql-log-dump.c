@@ -0,0 +1,481 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+/**
+ * read the binary sql-log of --sql-log-format=binary
+ *
+ *   mysql-sql-log-dump [options] <file> ...
+ *
+ * prints the records in the format of the text sql-log, or with --aggregate one line per
+ * digest. --since, --until, --slow, --errors, --client, --backend, --digest and --match
+ * filter the records.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "network-sql-log.h"
+
+#define READ_SIZE (1024 * 1024)
+
+typedef struct {
+	time_t since;
+	time_t until;
+	guint64 slow_us;
+	gboolean errors;
+	guint64 client, client_mask;
+	guint64 backend, backend_mask;
+	guint64 digest;
+	gboolean has_digest;
+	const gchar *match;
+	gboolean verbose;
+} dump_filter_t;
+
+typedef struct {
+	guint64 digest;
+	guint64 count;
+	guint64 errors;
+	guint64 total_us;
+	guint64 max_us;
+	guint64 rows;
+	guint64 bytes;
+	GString *query;         /**< the first query of the digest */
+} dump_digest_t;
+
+typedef struct {
+	dump_filter_t filter;
+
+	GHashTable *digests;    /**< NULL if we print the records */
+
+	GString *out;
+	time_t ts_sec;
+	gchar ts[24];
+
+	guint64 records;
+	guint64 matched;
+} dump_t;
+
+/**
+ * parse host[:port] into the id of the sql-log and the mask of what to compare
+ */
+static gboolean dump_parse_address(const gchar *s, guint64 *id, guint64 *mask) {
+	guint a, b, c, d, port;
+	gchar tail;
+
+	if (5 == sscanf(s, "%u.%u.%u.%u:%u%c", &a, &b, &c, &d, &port, &tail) && a < 256 && b < 256 && c < 256 && d < 256 && port < 65536) {
+		*id = ((guint64)((a << 24) | (b << 16) | (c << 8) | d) << 16) | port;
+		*mask = G_GUINT64_CONSTANT(0xffffffffffff);
+		return TRUE;
+	}
+	if (4 == sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) && a < 256 && b < 256 && c < 256 && d < 256) {
+		*id = (guint64)((a << 24) | (b << 16) | (c << 8) | d) << 16;
+		*mask = G_GUINT64_CONSTANT(0xffffffff0000);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * parse unix seconds or YYYY-MM-DD HH:MM:SS in the local time
+ */
+static gboolean dump_parse_time(const gchar *s, time_t *t) {
+	struct tm tm;
+	gchar tail;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%d-%d-%d %d:%d:%d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tail) == 6) {
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+		return TRUE;
+	}
+
+	{
+		gchar *end;
+		gint64 v = g_ascii_strtoll(s, &end, 10);
+
+		if (*s == '\0' || *end != '\0') return FALSE;
+		*t = v;
+	}
+
+	return TRUE;
+}
+
+static void dump_address(GString *out, guint64 id) {
+	guint32 ip = id >> 16;
+
+	if (id == 0) {
+		g_string_append(out, "-");
+		return;
+	}
+
+	g_string_append_printf(out, "%u.%u.%u.%u:%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, (guint)(id & 0xffff));
+}
+
+static gboolean dump_filter(dump_filter_t *f, sql_log_record_t *rec) {
+	if (f->since && (time_t)rec->time < f->since) return FALSE;
+	if (f->until && (time_t)rec->time >= f->until) return FALSE;
+	if (rec->latency_us < f->slow_us) return FALSE;
+	if (f->errors && !(rec->flags & SQL_LOG_RECORD_ERR)) return FALSE;
+	if (f->client_mask && (rec->client & f->client_mask) != f->client) return FALSE;
+	if (f->backend_mask && (rec->backend & f->backend_mask) != f->backend) return FALSE;
+	if (f->has_digest && rec->digest != f->digest) return FALSE;
+	if (f->match && !g_strstr_len(rec->query, rec->query_len, f->match)) return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * print a record like the text sql-log does
+ */
+static void dump_print(dump_t *dump, sql_log_record_t *rec) {
+	GString *out = dump->out;
+
+	if ((time_t)rec->time != dump->ts_sec) {
+		time_t t = rec->time;
+		struct tm tm;
+
+		localtime_r(&t, &tm);
+		g_snprintf(dump->ts, sizeof(dump->ts), "[%02d/%02d/%d %02d:%02d:%02d]", tm.tm_mon+1, tm.tm_mday, tm.tm_year+1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		dump->ts_sec = t;
+	}
+
+	g_string_append(out, dump->ts);
+	g_string_append(out, " C:");
+	dump_address(out, rec->client);
+	g_string_append(out, " S:");
+	dump_address(out, rec->backend);
+	g_string_append_printf(out, " %s %.3f ", (rec->flags & SQL_LOG_RECORD_ERR) ? "ERR" : "OK", rec->latency_us / 1000.0);
+	if (dump->filter.verbose) {
+		g_string_append_printf(out, "%016" G_GINT64_MODIFIER "x %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " ", rec->digest, rec->rows, rec->bytes);
+	}
+	g_string_append_c(out, '"');
+	g_string_append_len(out, rec->query, rec->query_len);
+	g_string_append(out, "\"\n");
+
+	if (out->len >= READ_SIZE) {
+		fwrite(out->str, out->len, 1, stdout);
+		g_string_truncate(out, 0);
+	}
+}
+
+static void dump_aggregate(dump_t *dump, sql_log_record_t *rec) {
+	dump_digest_t *d = g_hash_table_lookup(dump->digests, &rec->digest);
+
+	if (!d) {
+		d = g_new0(dump_digest_t, 1);
+		d->digest = rec->digest;
+		d->query = g_string_new_len(rec->query, rec->query_len);
+		g_hash_table_insert(dump->digests, &d->digest, d);
+	}
+
+	d->count++;
+	if (rec->flags & SQL_LOG_RECORD_ERR) d->errors++;
+	d->total_us += rec->latency_us;
+	if (rec->latency_us > d->max_us) d->max_us = rec->latency_us;
+	d->rows += rec->rows;
+	d->bytes += rec->bytes;
+}
+
+/**
+ * handle the complete records in stream and remove them
+ *
+ * @return FALSE if a record is broken
+ */
+static gboolean dump_records(dump_t *dump, GString *stream) {
+	gsize off = 0;
+
+	while (off < stream->len) {
+		sql_log_record_t rec;
+		gssize len = sql_log_record_get((guchar *)stream->str + off, stream->len - off, &rec);
+
+		if (len == 0) break;
+		if (len < 0) return FALSE;
+		off += len;
+
+		dump->records++;
+		if (!dump_filter(&dump->filter, &rec)) continue;
+		dump->matched++;
+
+		if (dump->digests) {
+			dump_aggregate(dump, &rec);
+		} else {
+			dump_print(dump, &rec);
+		}
+	}
+
+	g_string_erase(stream, 0, off);
+
+	return TRUE;
+}
+
+/**
+ * decompress the complete blocks in in to stream and remove them
+ *
+ * @return FALSE if a block is broken
+ */
+static gboolean dump_blocks(GString *in, GString *stream) {
+	gsize off = 0;
+
+	while (off < in->len) {
+		const guchar *p = (guchar *)in->str + off;
+		const guchar *end = (guchar *)in->str + in->len;
+		guint64 raw_len, packed_len;
+		gsize before = stream->len;
+
+		if (!sql_log_varint_get(&p, end, &raw_len) || !sql_log_varint_get(&p, end, &packed_len)) break;
+
+		if (packed_len == 0) {
+			if (raw_len > (guint64)(end - p)) break;
+			g_string_append_len(stream, (const gchar *)p, raw_len);
+			p += raw_len;
+		} else {
+			if (packed_len > (guint64)(end - p)) break;
+			if (!sql_log_decompress(stream, p, packed_len) || stream->len - before != raw_len) return FALSE;
+			p += packed_len;
+		}
+
+		off = p - (guchar *)in->str;
+	}
+
+	g_string_erase(in, 0, off);
+
+	return TRUE;
+}
+
+static int dump_file(dump_t *dump, const gchar *filename) {
+	FILE *f;
+	gchar header[SQL_LOG_HEADER_LEN];
+	GString *in, *stream;
+	gboolean is_compressed;
+	int ret = 0;
+
+	if (NULL == (f = fopen(filename, "rb"))) {
+		g_critical("%s: fopen(%s) failed: %s (%d)", G_STRLOC, filename, g_strerror(errno), errno);
+		return -1;
+	}
+
+	if (1 != fread(header, sizeof(header), 1, f) ||
+	    0 != memcmp(header, SQL_LOG_MAGIC, sizeof(SQL_LOG_MAGIC) - 1) ||
+	    header[6] != SQL_LOG_VERSION ||
+	    !(header[7] & SQL_LOG_BINARY)) {
+		g_critical("%s: %s isn't a binary sql-log of version %d", G_STRLOC, filename, SQL_LOG_VERSION);
+		fclose(f);
+		return -1;
+	}
+	is_compressed = (header[7] & SQL_LOG_COMPRESSED) != 0;
+
+	in = g_string_sized_new(READ_SIZE * 2);
+	stream = is_compressed ? g_string_sized_new(READ_SIZE * 4) : in;
+
+	for (;;) {
+		gsize len = in->len;
+		gsize n;
+
+		g_string_set_size(in, len + READ_SIZE);
+		n = fread(in->str + len, 1, READ_SIZE, f);
+		g_string_set_size(in, len + n);
+		if (n == 0) break;
+
+		if ((is_compressed && !dump_blocks(in, stream)) || !dump_records(dump, stream)) {
+			g_critical("%s: %s is broken", G_STRLOC, filename);
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ret == 0 && ferror(f)) {
+		g_critical("%s: reading %s failed: %s (%d)", G_STRLOC, filename, g_strerror(errno), errno);
+		ret = -1;
+	}
+
+	/* a record cut off by a crash */
+	if (ret == 0 && (in->len > 0 || stream->len > 0)) {
+		g_warning("%s: %s ends with a incomplete record", G_STRLOC, filename);
+	}
+
+	if (is_compressed) g_string_free(stream, TRUE);
+	g_string_free(in, TRUE);
+	fclose(f);
+
+	return ret;
+}
+
+static const gchar *sort_by = "total";
+
+static gint dump_digest_cmp(gconstpointer _a, gconstpointer _b) {
+	const dump_digest_t *a = *(dump_digest_t **)_a;
+	const dump_digest_t *b = *(dump_digest_t **)_b;
+	guint64 va, vb;
+
+	if (0 == strcmp(sort_by, "count")) {
+		va = a->count; vb = b->count;
+	} else if (0 == strcmp(sort_by, "max")) {
+		va = a->max_us; vb = b->max_us;
+	} else if (0 == strcmp(sort_by, "avg")) {
+		va = a->total_us / a->count; vb = b->total_us / b->count;
+	} else if (0 == strcmp(sort_by, "errors")) {
+		va = a->errors; vb = b->errors;
+	} else {
+		va = a->total_us; vb = b->total_us;
+	}
+
+	return va < vb ? 1 : (va > vb ? -1 : 0);
+}
+
+static void dump_digest_free(gpointer data) {
+	dump_digest_t *d = data;
+
+	g_string_free(d->query, TRUE);
+	g_free(d);
+}
+
+/**
+ * print the digests, the most expensive first
+ */
+static void dump_digests(dump_t *dump, guint limit) {
+	GPtrArray *arr = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer value;
+	guint i;
+
+	g_hash_table_iter_init(&iter, dump->digests);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		g_ptr_array_add(arr, value);
+	}
+	g_ptr_array_sort(arr, dump_digest_cmp);
+
+	g_string_append(dump->out, "digest\tcount\terrors\ttotal_ms\tavg_ms\tmax_ms\trows\tbytes\tquery\n");
+	for (i = 0; i < arr->len && (limit == 0 || i < limit); i++) {
+		dump_digest_t *d = g_ptr_array_index(arr, i);
+
+		g_string_append_printf(dump->out, "%016" G_GINT64_MODIFIER "x\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%.3f\t%.3f\t%.3f\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%s\n",
+				d->digest, d->count, d->errors,
+				d->total_us / 1000.0, d->total_us / 1000.0 / d->count, d->max_us / 1000.0,
+				d->rows, d->bytes, d->query->str);
+	}
+
+	g_ptr_array_free(arr, TRUE);
+}
+
+int main(int argc, char **argv) {
+	gchar *since = NULL, *until = NULL, *client = NULL, *backend = NULL, *digest = NULL, *match = NULL, *sort = NULL;
+	gint slow_ms = 0, limit = 0;
+	gboolean errors = FALSE, aggregate = FALSE, verbose = FALSE;
+	GOptionEntry entries[] = {
+		{ "since", 0, 0, G_OPTION_ARG_STRING, &since, "only records at or after this time", "<unix-time|YYYY-MM-DD HH:MM:SS>" },
+		{ "until", 0, 0, G_OPTION_ARG_STRING, &until, "only records before this time", "<unix-time|YYYY-MM-DD HH:MM:SS>" },
+		{ "slow", 0, 0, G_OPTION_ARG_INT, &slow_ms, "only records which took at least this milliseconds", "<ms>" },
+		{ "errors", 0, 0, G_OPTION_ARG_NONE, &errors, "only failed queries", NULL },
+		{ "client", 0, 0, G_OPTION_ARG_STRING, &client, "only queries of this client", "<ip[:port]>" },
+		{ "backend", 0, 0, G_OPTION_ARG_STRING, &backend, "only queries sent to this backend", "<ip[:port]>" },
+		{ "digest", 0, 0, G_OPTION_ARG_STRING, &digest, "only queries of this digest", "<hex>" },
+		{ "match", 0, 0, G_OPTION_ARG_STRING, &match, "only queries containing this string", "<string>" },
+		{ "aggregate", 'a', 0, G_OPTION_ARG_NONE, &aggregate, "print count, errors, latency, rows and bytes per digest", NULL },
+		{ "sort", 0, 0, G_OPTION_ARG_STRING, &sort, "order of --aggregate (default: total)", "(total|count|avg|max|errors)" },
+		{ "limit", 0, 0, G_OPTION_ARG_INT, &limit, "print only the first digests of --aggregate", "<n>" },
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "print digest, rows and bytes of each record too", NULL },
+		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+	};
+	GOptionContext *option_ctx;
+	GError *gerr = NULL;
+	dump_t dump;
+	int exit_code = EXIT_SUCCESS;
+	int i;
+
+	memset(&dump, 0, sizeof(dump));
+
+	option_ctx = g_option_context_new("<file> ... - print the binary sql-log");
+	g_option_context_add_main_entries(option_ctx, entries, NULL);
+	if (FALSE == g_option_context_parse(option_ctx, &argc, &argv, &gerr)) {
+		g_critical("%s", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(option_ctx);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(option_ctx);
+
+	if (argc < 2) {
+		g_critical("%s: no sql-log given, see --help", G_STRLOC);
+		return EXIT_FAILURE;
+	}
+
+	if ((since && !dump_parse_time(since, &dump.filter.since)) ||
+	    (until && !dump_parse_time(until, &dump.filter.until))) {
+		g_critical("%s: --since and --until take unix time or YYYY-MM-DD HH:MM:SS", G_STRLOC);
+		return EXIT_FAILURE;
+	}
+	if ((client && !dump_parse_address(client, &dump.filter.client, &dump.filter.client_mask)) ||
+	    (backend && !dump_parse_address(backend, &dump.filter.backend, &dump.filter.backend_mask))) {
+		g_critical("%s: --client and --backend take ip[:port]", G_STRLOC);
+		return EXIT_FAILURE;
+	}
+	if (digest) {
+		gchar *end;
+
+		dump.filter.digest = g_ascii_strtoull(digest, &end, 16);
+		if (*digest == '\0' || *end != '\0') {
+			g_critical("%s: --digest takes the hex digest", G_STRLOC);
+			return EXIT_FAILURE;
+		}
+		dump.filter.has_digest = TRUE;
+	}
+	if (sort) {
+		if (strcmp(sort, "total") && strcmp(sort, "count") && strcmp(sort, "avg") && strcmp(sort, "max") && strcmp(sort, "errors")) {
+			g_critical("%s: --sort takes total, count, avg, max or errors", G_STRLOC);
+			return EXIT_FAILURE;
+		}
+		sort_by = sort;
+	}
+	dump.filter.slow_us = slow_ms > 0 ? (guint64)slow_ms * 1000 : 0;
+	dump.filter.errors = errors;
+	dump.filter.match = match;
+	dump.filter.verbose = verbose;
+
+	if (aggregate) dump.digests = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, dump_digest_free);
+	dump.out = g_string_sized_new(READ_SIZE * 2);
+
+	for (i = 1; i < argc; i++) {
+		if (0 != dump_file(&dump, argv[i])) exit_code = EXIT_FAILURE;
+	}
+
+	if (dump.digests) {
+		dump_digests(&dump, limit > 0 ? limit : 0);
+		g_hash_table_destroy(dump.digests);
+	}
+
+	fwrite(dump.out->str, dump.out->len, 1, stdout);
+	g_string_free(dump.out, TRUE);
+
+	fprintf(stderr, "%" G_GUINT64_FORMAT " records, %" G_GUINT64_FORMAT " matched\n", dump.records, dump.matched);
+
+	return exit_code;
+}
@@ -36,6 +36,37 @@
 #include "network-address-lua.h"
 #include "network-mysqld-lua.h"
 
+/**
+ * push the percentiles of the per-thread histograms summed up
+ */
+static void network_backend_lua_push_latency(lua_State *L, network_backend_t *backend, histogram_t *histograms) {
+	histogram_t *h = g_new0(histogram_t, 1);
+	guint i;
+
+	/* there is a pool and a histogram for each event-thread */
+	for (i = 0; i < backend->pools->len; i++) {
+		histogram_merge(h, &(histograms[i]));
+	}
+
+	lua_newtable(L);
+	lua_pushnumber(L, h->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->count ? h->sum / h->count : 0);
+	lua_setfield(L, -2, "avg");
+	lua_pushnumber(L, histogram_percentile(h, 50));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, histogram_percentile(h, 90));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, histogram_percentile(h, 99));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, histogram_percentile(h, 99.9));
+	lua_setfield(L, -2, "p999");
+	lua_pushnumber(L, h->max);
+	lua_setfield(L, -2, "max");
+
+	g_free(h);
+}
+
 /**
  * get the info about a backend
  *
@@ -44,6 +75,9 @@
  *   address           => ip:port or unix-path of to the backend
  *   state             => int(BACKEND_STATE_UP|BACKEND_STATE_DOWN) 
  *   type              => int(BACKEND_TYPE_RW|BACKEND_TYPE_RO) 
+ *   breaker           => int(BACKEND_BREAKER_CLOSED|BACKEND_BREAKER_OPEN|BACKEND_BREAKER_HALF_OPEN)
+ *   breaker_requests, breaker_errors, breaker_timeouts => counters of the current breaker window
+ *   query_latency, connect_latency => count, avg, p50, p90, p99, p999 and max in microseconds
  *
  * @return nil or requested information
  * @see backend_state_t backend_type_t
@@ -69,6 +103,30 @@ static int proxy_backend_get(lua_State *L) {
 		}
 	} else if (strleq(key, keysize, C("weight"))) {
 		lua_pushinteger(L, backend->weight);
+	} else if (strleq(key, keysize, C("tag"))) {
+		if (backend->tag) {
+			lua_pushstring(L, backend->tag);
+		} else {
+			lua_pushnil(L);
+		}
+	} else if (strleq(key, keysize, C("cluster"))) {
+		if (backend->cluster) {
+			lua_pushstring(L, backend->cluster);
+		} else {
+			lua_pushnil(L);
+		}
+	} else if (strleq(key, keysize, C("breaker"))) {
+		lua_pushinteger(L, g_atomic_int_get(&backend->breaker_state));
+	} else if (strleq(key, keysize, C("breaker_requests"))) {
+		lua_pushinteger(L, g_atomic_int_get(&backend->breaker_requests));
+	} else if (strleq(key, keysize, C("breaker_errors"))) {
+		lua_pushinteger(L, g_atomic_int_get(&backend->breaker_errors));
+	} else if (strleq(key, keysize, C("breaker_timeouts"))) {
+		lua_pushinteger(L, g_atomic_int_get(&backend->breaker_timeouts));
+	} else if (strleq(key, keysize, C("query_latency"))) {
+		network_backend_lua_push_latency(L, backend, backend->query_latency);
+	} else if (strleq(key, keysize, C("connect_latency"))) {
+		network_backend_lua_push_latency(L, backend, backend->connect_latency);
 	} else {
 		lua_pushnil(L);
 	}
@@ -110,6 +168,294 @@ int network_backend_lua_getmetatable(lua_State *L) {
 	return proxy_getmetatable(L, methods);
 }
 
+/**
+ * get proxy.global.backends.plan_cache
+ *
+ * the counters of the routing-plan caches of all event-threads summed up
+ *
+ *   hits, misses => queries which skipped or needed the tokenizer
+ *   entries      => cached plans
+ *
+ * @return nil if the plan cache is off or the table of counters
+ */
+static int proxy_backends_plan_cache_get(lua_State *L, network_backends_t *bs) {
+	guint64 hits = 0, misses = 0;
+	guint entries = 0, i;
+
+	if (bs->plan_cache_stats == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	for (i = 0; i <= bs->event_thread_count; ++i) {
+		plan_cache_stats_t *stats = &(bs->plan_cache_stats[i]);
+
+		hits += stats->hits;
+		misses += stats->misses;
+		entries += stats->entries;
+	}
+
+	lua_newtable(L);
+	lua_pushnumber(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, entries);
+	lua_setfield(L, -2, "entries");
+
+	return 1;
+}
+
+/**
+ * get proxy.global.backends.query_stats
+ *
+ * the counters of each query digest summed over the event-threads
+ *
+ *   db, digest                 => default db and fingerprint of the query
+ *   count, errors              => queries and the ones which failed
+ *   total_us, max_us           => latency
+ *   rows, bytes                => size of the result-sets
+ *
+ * @return nil if the query stats are off or a array of tables
+ */
+static int proxy_backends_query_stats_get(lua_State *L, network_backends_t *bs) {
+	GPtrArray *digests;
+	guint i;
+
+	if (bs->query_stats == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	digests = query_stats_merge(bs->query_stats);
+
+	lua_createtable(L, digests->len, 0);
+	for (i = 0; i < digests->len; i++) {
+		query_digest_t *digest = g_ptr_array_index(digests, i);
+		gsize db_len = strlen(digest->key->str);
+
+		lua_createtable(L, 0, 8);
+		lua_pushlstring(L, digest->key->str, db_len);
+		lua_setfield(L, -2, "db");
+		lua_pushlstring(L, digest->key->str + db_len + 1, digest->key->len - db_len - 1);
+		lua_setfield(L, -2, "digest");
+		lua_pushnumber(L, digest->count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, digest->errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushnumber(L, digest->total_us);
+		lua_setfield(L, -2, "total_us");
+		lua_pushnumber(L, digest->max_us);
+		lua_setfield(L, -2, "max_us");
+		lua_pushnumber(L, digest->rows);
+		lua_setfield(L, -2, "rows");
+		lua_pushnumber(L, digest->bytes);
+		lua_setfield(L, -2, "bytes");
+
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	g_ptr_array_free(digests, TRUE);
+
+	return 1;
+}
+
+/**
+ * get proxy.global.backends.slow_queries
+ *
+ * the last slow queries of all event-threads, the newest first
+ *
+ *   time                       => when the query finished, unix time
+ *   total_us                   => from reading the query to writing the last packet of the result
+ *   route_us                   => classify, parse and pick the backend
+ *   pool_us, connect_us        => taking server connections from the pool, of that connecting
+ *   repairs, repair_us         => COM_INIT_DB, SET NAMES and COM_CHANGE_USER to sync the server connection
+ *   queries, backend_us        => sent to the backends and the time until their result was complete
+ *   client_us                  => writing the result to the client
+ *   client, backend, user, db  => where the query came from and went to
+ *   command, query, error      => COM_*, the start of the query and if it failed
+ *
+ * @return nil if the recorder is off or a array of tables
+ */
+static int proxy_backends_slow_queries_get(lua_State *L, network_backends_t *bs) {
+	GPtrArray *queries;
+	guint i;
+
+	if (bs->slow_queries == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	queries = slow_queries_get(bs->slow_queries);
+
+	lua_createtable(L, queries->len, 0);
+	for (i = 0; i < queries->len; i++) {
+		slow_query_t *q = g_ptr_array_index(queries, i);
+
+		lua_createtable(L, 0, 17);
+		lua_pushnumber(L, q->time);
+		lua_setfield(L, -2, "time");
+		lua_pushnumber(L, q->total_us);
+		lua_setfield(L, -2, "total_us");
+		lua_pushnumber(L, q->trace.route_us);
+		lua_setfield(L, -2, "route_us");
+		lua_pushnumber(L, q->trace.pool_us);
+		lua_setfield(L, -2, "pool_us");
+		lua_pushnumber(L, q->trace.connect_us);
+		lua_setfield(L, -2, "connect_us");
+		lua_pushnumber(L, q->trace.repairs);
+		lua_setfield(L, -2, "repairs");
+		lua_pushnumber(L, q->trace.repair_us);
+		lua_setfield(L, -2, "repair_us");
+		lua_pushnumber(L, q->trace.queries);
+		lua_setfield(L, -2, "queries");
+		lua_pushnumber(L, q->trace.backend_us);
+		lua_setfield(L, -2, "backend_us");
+		lua_pushnumber(L, q->trace.client_us);
+		lua_setfield(L, -2, "client_us");
+		lua_pushstring(L, q->client);
+		lua_setfield(L, -2, "client");
+		lua_pushstring(L, q->trace.backend);
+		lua_setfield(L, -2, "backend");
+		lua_pushstring(L, q->user);
+		lua_setfield(L, -2, "user");
+		lua_pushstring(L, q->db);
+		lua_setfield(L, -2, "db");
+		lua_pushinteger(L, q->trace.command);
+		lua_setfield(L, -2, "command");
+		lua_pushlstring(L, q->trace.query, q->trace.query_len);
+		lua_setfield(L, -2, "query");
+		lua_pushboolean(L, q->trace.is_error);
+		lua_setfield(L, -2, "error");
+
+		lua_rawseti(L, -2, i + 1);
+
+		g_free(q);
+	}
+
+	g_ptr_array_free(queries, TRUE);
+
+	return 1;
+}
+
+/**
+ * the chassis stored by network_mysqld_init()
+ */
+static chassis *proxy_backends_chassis(lua_State *L) {
+	chassis *chas;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CHASSIS_LUA_REGISTRY_KEY);
+	chas = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return chas;
+}
+
+/**
+ * get proxy.global.backends.processlist
+ *
+ * the client connections of all event-threads
+ *
+ *   id, thread                 => id for KILL and the owning event-thread
+ *   client, user, db           => where the connection comes from
+ *   state, state_ms            => CON_STATE_* and the time since it went into it
+ *   backend                    => the server connection it holds, nil if none
+ *   in_transaction, autocommit => transaction state of the client
+ *   locks                      => held by GET_LOCK()
+ *   command, query             => COM_* and the start of the current or last query
+ *
+ * @return a array of tables, raises a error if a event-thread didn't answer in time
+ */
+static int proxy_backends_processlist_get(lua_State *L) {
+	GPtrArray *procs = network_mysqld_processlist(proxy_backends_chassis(L));
+	guint i;
+
+	if (procs == NULL) return luaL_error(L, "processlist timed out, a event-thread is busy");
+
+	lua_createtable(L, procs->len, 0);
+	for (i = 0; i < procs->len; i++) {
+		network_mysqld_process_t *p = g_ptr_array_index(procs, i);
+
+		lua_createtable(L, 0, 14);
+		lua_pushinteger(L, p->id);
+		lua_setfield(L, -2, "id");
+		lua_pushinteger(L, p->thread);
+		lua_setfield(L, -2, "thread");
+		lua_pushstring(L, p->client);
+		lua_setfield(L, -2, "client");
+		lua_pushstring(L, p->user);
+		lua_setfield(L, -2, "user");
+		lua_pushstring(L, p->db);
+		lua_setfield(L, -2, "db");
+		lua_pushstring(L, network_mysqld_con_state_get_name(p->state));
+		lua_setfield(L, -2, "state");
+		lua_pushnumber(L, p->state_us / 1000.0);
+		lua_setfield(L, -2, "state_ms");
+		lua_pushstring(L, p->backend);
+		lua_setfield(L, -2, "backend");
+		lua_pushboolean(L, p->is_in_transaction);
+		lua_setfield(L, -2, "in_transaction");
+		lua_pushboolean(L, !p->is_not_autocommit);
+		lua_setfield(L, -2, "autocommit");
+		lua_pushinteger(L, p->locks);
+		lua_setfield(L, -2, "locks");
+		lua_pushinteger(L, p->command);
+		lua_setfield(L, -2, "command");
+		lua_pushstring(L, p->query);
+		lua_setfield(L, -2, "query");
+
+		lua_rawseti(L, -2, i + 1);
+
+		network_mysqld_process_free(p);
+	}
+
+	g_ptr_array_free(procs, TRUE);
+
+	return 1;
+}
+
+/**
+ * get proxy.global.backends.profile
+ *
+ * the time spent in each connection state and section, summed over the event-threads
+ *
+ *   name                       => CON_STATE_* or classify, tokenizer, sharding, routing, pool
+ *   calls                      => how often it ran
+ *   total_us, max_us           => time spent in it
+ *
+ * @return a array of tables, enabled tells if the counters are running
+ */
+static int proxy_backends_profile_get(lua_State *L, network_backends_t *bs) {
+	network_profile_t *p = bs->profile;
+	guint slot;
+	int n = 0;
+
+	lua_createtable(L, PROFILE_MAX, 1);
+	lua_pushboolean(L, g_atomic_int_get(&p->enabled));
+	lua_setfield(L, -2, "enabled");
+
+	for (slot = 0; slot < PROFILE_MAX; slot++) {
+		network_profile_counter_t sum;
+
+		network_profile_sum(p, slot, &sum);
+		if (sum.calls == 0) continue;
+
+		lua_createtable(L, 0, 4);
+		lua_pushstring(L, network_profile_slot_name(slot));
+		lua_setfield(L, -2, "name");
+		lua_pushnumber(L, sum.calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushnumber(L, sum.cycles * 1000000.0 / p->frequency);
+		lua_setfield(L, -2, "total_us");
+		lua_pushnumber(L, sum.max_cycles * 1000000.0 / p->frequency);
+		lua_setfield(L, -2, "max_us");
+
+		lua_rawseti(L, -2, ++n);
+	}
+
+	return 1;
+}
+
 /**
  * get proxy.global.backends[ndx]
  *
@@ -123,6 +469,21 @@ static int proxy_backends_get(lua_State *L) {
 	network_backend_t **backend_p;
 
 	network_backends_t *bs = *(network_backends_t **)luaL_checkself(L);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		gsize keysize = 0;
+		const char *key = lua_tolstring(L, 2, &keysize);
+
+		if (strleq(key, keysize, C("plan_cache"))) return proxy_backends_plan_cache_get(L, bs);
+		if (strleq(key, keysize, C("query_stats"))) return proxy_backends_query_stats_get(L, bs);
+		if (strleq(key, keysize, C("profile"))) return proxy_backends_profile_get(L, bs);
+		if (strleq(key, keysize, C("slow_queries"))) return proxy_backends_slow_queries_get(L, bs);
+		if (strleq(key, keysize, C("processlist"))) return proxy_backends_processlist_get(L);
+
+		lua_pushnil(L);
+		return 1;
+	}
+
 	int backend_ndx = luaL_checkinteger(L, 2) - 1; /** lua is indexes from 1, C from 0 */
 	
 	/* check that we are in range for a _int_ */
@@ -189,6 +550,18 @@ static int proxy_backends_set(lua_State *L) {
 		g_free(address);
 	} else if (strleq(key, keysize, C("saveconfig"))) {
 		network_backends_save(bs);
+	} else if (strleq(key, keysize, C("resetquerystats"))) {
+		if (bs->query_stats) query_stats_reset(bs->query_stats);
+	} else if (strleq(key, keysize, C("profiling"))) {
+		g_atomic_int_set(&bs->profile->enabled, lua_toboolean(L, -1));
+	} else if (strleq(key, keysize, C("resetprofile"))) {
+		network_profile_reset(bs->profile);
+	} else if (strleq(key, keysize, C("kill"))) {
+		lua_Integer id = luaL_checkinteger(L, -1);
+
+		if (0 != network_mysqld_kill(proxy_backends_chassis(L), id)) {
+			return luaL_error(L, "Unknown connection id: %d", (int)id);
+		}
 	} else {
 		return luaL_error(L, "proxy.global.backends.%s is not writable", key);
 	}
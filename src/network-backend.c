@@ -44,6 +44,11 @@ network_backend_t *network_backend_new(guint event_thread_count) {
 	b->uuid = g_string_new(NULL);
 	b->addr = network_address_new();
 
+	/* indexed by chassis_event_thread_index() like the pools */
+	b->query_latency = g_new0(histogram_t, event_thread_count + 1);
+	b->connect_latency = g_new0(histogram_t, event_thread_count + 1);
+	b->pool_stats = g_new0(backend_pool_stats_t, event_thread_count + 1);
+
 	return b;
 }
 
@@ -59,6 +64,12 @@ void network_backend_free(network_backend_t *b) {
 
 	if (b->addr)     network_address_free(b->addr);
 	if (b->uuid)     g_string_free(b->uuid, TRUE);
+	if (b->tag)      g_free(b->tag);
+	if (b->cluster)  g_free(b->cluster);
+
+	g_free(b->query_latency);
+	g_free(b->connect_latency);
+	g_free(b->pool_stats);
 
 	g_free(b);
 }
@@ -71,10 +82,13 @@ network_backends_t *network_backends_new(guint event_thread_count, gchar *defaul
 	bs->backends = g_ptr_array_new();
 	bs->backends_mutex = g_mutex_new();	/*remove lock*/
 	bs->global_wrr = g_wrr_poll_new();
+	bs->tag_wrr = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_wrr_poll_free);
+	bs->cluster_wrr = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_wrr_poll_free);
 	bs->event_thread_count = event_thread_count;
 	bs->default_file = g_strdup(default_file);
 	bs->raw_ips = g_ptr_array_new_with_free_func(g_free);
 	bs->raw_pwds = g_ptr_array_new_with_free_func(g_free);
+	bs->profile = network_profile_new(event_thread_count + 1);
 
 	return bs;
 }
@@ -112,10 +126,13 @@ void network_backends_free(network_backends_t *bs) {
 	g_mutex_free(bs->backends_mutex);	/*remove lock*/
 
 	g_wrr_poll_free(bs->global_wrr);
+	g_hash_table_destroy(bs->tag_wrr);
+	g_hash_table_destroy(bs->cluster_wrr);
 	g_free(bs->default_file);
 
 	g_ptr_array_free(bs->raw_ips, TRUE);
 	g_ptr_array_free(bs->raw_pwds, TRUE);
+	network_profile_free(bs->profile);
 
 	g_free(bs);
 }
@@ -365,6 +382,8 @@ int network_backends_save(network_backends_t *bs) {
 
 	GString *master = g_string_new(NULL);
 	GString *slave  = g_string_new(NULL);
+	GString *cluster_master = g_string_new(NULL);
+	GString *cluster_slave  = g_string_new(NULL);
 	guint i;
 	GPtrArray *backends = bs->backends;
 
@@ -372,14 +391,33 @@ int network_backends_save(network_backends_t *bs) {
 	guint len = backends->len;
 	for (i = 0; i < len; ++i) {
 		network_backend_t *backend = g_ptr_array_index(backends, i);
+		GString *str = NULL;
 		if (backend->type == BACKEND_TYPE_RW) {
-			g_string_append_printf(master, ",%s", backend->addr->name->str);
+			str = backend->cluster ? cluster_master : master;
 		} else if (backend->type == BACKEND_TYPE_RO) {
-			g_string_append_printf(slave, ",%s", backend->addr->name->str);
+			str = backend->cluster ? cluster_slave : slave;
+		} else {
+			continue;
 		}
+
+		g_string_append_c(str, ',');
+		if (backend->cluster) g_string_append_printf(str, "%s:", backend->cluster);
+		g_string_append(str, backend->addr->name->str);
+		if (backend->type == BACKEND_TYPE_RO && backend->weight > 1) g_string_append_printf(str, "@%u", backend->weight);
+		if (backend->tag) g_string_append_printf(str, "#%s", backend->tag);
 	}
 	g_mutex_unlock(bs->backends_mutex);
 
+	/* only touch the cluster keys if they are used, older configs stay as they are */
+	if (cluster_master->len != 0 || g_key_file_has_key(keyfile, "mysql-proxy", "cluster-backend-addresses", NULL)) {
+		g_key_file_set_value(keyfile, "mysql-proxy", "cluster-backend-addresses", cluster_master->len ? cluster_master->str+1 : "");
+	}
+	if (cluster_slave->len != 0 || g_key_file_has_key(keyfile, "mysql-proxy", "cluster-read-only-backend-addresses", NULL)) {
+		g_key_file_set_value(keyfile, "mysql-proxy", "cluster-read-only-backend-addresses", cluster_slave->len ? cluster_slave->str+1 : "");
+	}
+	g_string_free(cluster_master, TRUE);
+	g_string_free(cluster_slave, TRUE);
+
 	if (master->len != 0) {
 		g_key_file_set_value(keyfile, "mysql-proxy", "proxy-backend-addresses", master->str+1);
 	} else {
@@ -440,11 +478,28 @@ int network_backends_save(network_backends_t *bs) {
  *        2) differentiate between reasons for "we didn't add" (now -1 in all cases)
  */
 int network_backends_add(network_backends_t *bs, /* const */ gchar *address, backend_type_t type) {
+	return network_backends_add_cluster(bs, address, type, NULL);
+}
+
+/**
+ * add a backend to a cluster
+ *
+ * backends of a cluster only serve the databases mapped to it, cluster NULL is the default cluster
+ */
+int network_backends_add_cluster(network_backends_t *bs, /* const */ gchar *address, backend_type_t type, const gchar *cluster) {
 	network_backend_t *new_backend;
 	guint i;
 
 	new_backend = network_backend_new(bs->event_thread_count);
 	new_backend->type = type;
+	if (cluster) new_backend->cluster = g_strdup(cluster);
+
+	/* host:port@weight#tag, the tag puts the backend into a group for the GROUP:tag routing hint */
+	gchar *t = strrchr(address, '#');
+	if (t != NULL) {
+		*t = '\0';
+		if (*(t+1) != '\0') new_backend->tag = g_strdup(t+1);
+	}
 
 	gchar *p = NULL;
 	if (type == BACKEND_TYPE_RO) {
@@ -459,6 +514,8 @@ int network_backends_add(network_backends_t *bs, /* const */ gchar *address, bac
 
 	if (0 != network_address_set_address(new_backend->addr, address)) {
 		network_backend_free(new_backend);
+		if (p != NULL) *p = '@';
+		if (t != NULL) *t = '#';
 		return -1;
 	}
 
@@ -475,6 +532,8 @@ int network_backends_add(network_backends_t *bs, /* const */ gchar *address, bac
 
 			g_mutex_unlock(bs->backends_mutex);	/*remove lock*/
 			g_critical("backend %s is already known!", address);
+			if (p != NULL) *p = '@';
+			if (t != NULL) *t = '#';
 			return -1;
 		}
 	}
@@ -485,11 +544,30 @@ int network_backends_add(network_backends_t *bs, /* const */ gchar *address, bac
 		bs->backends->pdata[first_slave] = bs->backends->pdata[bs->backends->len - 1];
 		bs->backends->pdata[bs->backends->len - 1] = temp_backend;
 	}
+	if (new_backend->cluster && type == BACKEND_TYPE_RO) {
+		g_wrr_poll *cluster_wrr = g_hash_table_lookup(bs->cluster_wrr, new_backend->cluster);
+		if (cluster_wrr == NULL) {
+			g_hash_table_insert(bs->cluster_wrr, g_strdup(new_backend->cluster), g_wrr_poll_new());
+		} else {
+			cluster_wrr->max_weight = 0;
+		}
+	}
+	if (new_backend->tag && type == BACKEND_TYPE_RO) {
+		g_wrr_poll *tag_wrr = g_hash_table_lookup(bs->tag_wrr, new_backend->tag);
+		if (tag_wrr == NULL) {
+			g_hash_table_insert(bs->tag_wrr, g_strdup(new_backend->tag), g_wrr_poll_new());
+		} else {
+			tag_wrr->max_weight = 0; /* recalculate it with the new member */
+		}
+	}
 	g_mutex_unlock(bs->backends_mutex);	/*remove lock*/
 
-	g_message("added %s backend: %s", (type == BACKEND_TYPE_RW) ? "read/write" : "read-only", address);
+	g_message("added %s backend: %s%s%s%s%s", (type == BACKEND_TYPE_RW) ? "read/write" : "read-only", address,
+			new_backend->cluster ? " to cluster " : "", new_backend->cluster ? new_backend->cluster : "",
+			new_backend->tag ? " in group " : "", new_backend->tag ? new_backend->tag : "");
 
 	if (p != NULL) *p = '@';
+	if (t != NULL) *t = '#';
 
 	return 0;
 }
@@ -33,6 +33,11 @@
 #define ERR_PWD_DECRYPT		2
 
 #include "network-conn-pool.h"
+#include "network-query-stats.h"
+#include "network-histogram.h"
+#include "network-sql-log.h"
+#include "network-profile.h"
+#include "network-slow-query.h"
 #include "network-exports.h"
 
 typedef enum { 
@@ -48,6 +53,20 @@ typedef enum {
 	BACKEND_TYPE_RO
 } backend_type_t;
 
+typedef enum {
+	BACKEND_BREAKER_CLOSED,
+	BACKEND_BREAKER_OPEN,
+	BACKEND_BREAKER_HALF_OPEN
+} backend_breaker_t;
+
+/**
+ * usage of the connection pool of a backend in one event-thread, only written by that thread
+ */
+typedef struct {
+	guint64 hits;            /**< server connections taken from the pool */
+	guint64 misses;          /**< the pool was empty, a new connection was needed */
+} backend_pool_stats_t;
+
 typedef struct {
 	network_address *addr;
    
@@ -64,6 +83,23 @@ typedef struct {
 	GString *uuid;           /**< the UUID of the backend */
 
 	guint weight;
+
+	gchar *tag;              /**< the backend group from host:port@weight#tag, NULL if untagged */
+	gchar *cluster;          /**< the cluster from cluster-[read-only-]backend-addresses, NULL for the default one */
+
+	guint check_rise;        /**< consecutive successful health-checks, reset on failure */
+	guint check_fall;        /**< consecutive failed health-checks, reset on success */
+
+	gint breaker_state;      /**< CLOSED, OPEN or HALF_OPEN, see backend_breaker_t */
+	gint breaker_since;      /**< when the breaker opened or let the last probe pass */
+	gint breaker_window;     /**< start of the current counting window */
+	gint breaker_requests;   /**< results in the current window */
+	gint breaker_errors;     /**< backend-side errors in the current window */
+	gint breaker_timeouts;   /**< too slow results in the current window */
+
+	histogram_t *query_latency;   /**< microseconds from sending a query to its last result packet, one per event-thread */
+	histogram_t *connect_latency; /**< microseconds to connect and authenticate a new server connection, one per event-thread */
+	backend_pool_stats_t *pool_stats; /**< one per event-thread */
 } network_backend_t;
 
 NETWORK_API network_backend_t *network_backend_new();
@@ -75,10 +111,21 @@ typedef struct {
     guint next_ndx;
 } g_wrr_poll;
 
+/**
+ * counters of the routing-plan cache of one event-thread, only written by that thread
+ */
+typedef struct {
+	guint64 hits;
+	guint64 misses;
+	guint entries;
+} plan_cache_stats_t;
+
 typedef struct {
 	GPtrArray *backends;
 	GMutex    *backends_mutex;	/*remove lock*/
 	g_wrr_poll *global_wrr;
+	GHashTable *tag_wrr;		/**< tag => g_wrr_poll of the read-only backends in that group */
+	GHashTable *cluster_wrr;	/**< cluster => g_wrr_poll of the read-only backends of that cluster */
 	guint event_thread_count;
 	gchar *default_file;
 	GHashTable **ip_table;
@@ -87,11 +134,17 @@ typedef struct {
 	GHashTable **pwd_table;
 	gint *pwd_table_index;
 	GPtrArray *raw_pwds;
+	plan_cache_stats_t *plan_cache_stats;	/**< event_thread_count + 1 entries, NULL if the plan cache is off */
+	query_stats_t *query_stats;	/**< NULL if the query stats are off */
+	sql_log_t *sql_log;		/**< NULL if the sql-log is off */
+	network_profile_t *profile;	/**< off until enabled by --con-profiling or the admin */
+	slow_queries_t *slow_queries;	/**< NULL if --slow-query-threshold is 0 */
 } network_backends_t;
 
 NETWORK_API network_backends_t *network_backends_new(guint event_thread_count, gchar *default_file);
 NETWORK_API void network_backends_free(network_backends_t *);
 NETWORK_API int network_backends_add(network_backends_t *backends, gchar *address, backend_type_t type);
+NETWORK_API int network_backends_add_cluster(network_backends_t *backends, gchar *address, backend_type_t type, const gchar *cluster);
 NETWORK_API int network_backends_remove(network_backends_t *backends, guint index);
 NETWORK_API int network_backends_addclient(network_backends_t *backends, gchar *address);
 NETWORK_API int network_backends_removeclient(network_backends_t *backends, gchar *address);
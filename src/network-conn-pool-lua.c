@@ -46,6 +46,7 @@
 #include "network-mysqld.h"
 #include "network-mysqld-packet.h"
 #include "chassis-event-thread.h"
+#include "chassis-timings.h"
 #include "network-mysqld-lua.h"
 
 #include "network-conn-pool.h"
@@ -90,12 +91,37 @@ static void network_mysqld_con_idle_handle(int event_fd, short events, void *use
 	}
 }
 
+/**
+ * move a authed server socket of the backend into the connection pool of the current thread
+ */
+int network_connection_pool_lua_add_socket(network_mysqld_con *con, network_backend_t *backend, network_socket *sock) {
+	network_connection_pool_entry *pool_entry = NULL;
+
+	/* the server connection is still authed */
+	sock->is_authed = 1;
+
+	/* insert the server socket into the connection pool */
+	network_connection_pool* pool = chassis_event_thread_pool(backend);
+	pool_entry = network_connection_pool_add(pool, sock);
+
+	if (pool_entry) {
+		event_set(&(sock->event), sock->fd, EV_READ, network_mysqld_con_idle_handle, pool_entry);
+		chassis_event_add_local(con->srv, &(sock->event)); /* add a event, but stay in the same thread */
+	}
+
+    if (!g_atomic_int_compare_and_exchange(&backend->connected_clients, 0, 0)) {
+        g_atomic_int_dec_and_test(&backend->connected_clients);    
+        //g_critical("add_connection: %08x's connected_clients is %d\n", backend,  backend->connected_clients);
+    }
+
+	return 0;
+}
+
 /**
  * move the con->server into connection pool and disconnect the 
  * proxy from its backend 
  */
 int network_connection_pool_lua_add_connection(network_mysqld_con *con) {
-	network_connection_pool_entry *pool_entry = NULL;
 	network_mysqld_con_lua_t *st = con->plugin_con_state;
 
 	/* con-server is already disconnected, got out */
@@ -114,22 +140,7 @@ int network_connection_pool_lua_add_connection(network_mysqld_con *con) {
         g_string_assign_len(con->server->response->username, C("mysql_proxy_invalid_user"));
     }
 
-	/* the server connection is still authed */
-	con->server->is_authed = 1;
-
-	/* insert the server socket into the connection pool */
-	network_connection_pool* pool = chassis_event_thread_pool(st->backend);
-	pool_entry = network_connection_pool_add(pool, con->server);
-
-	if (pool_entry) {
-		event_set(&(con->server->event), con->server->fd, EV_READ, network_mysqld_con_idle_handle, pool_entry);
-		chassis_event_add_local(con->srv, &(con->server->event)); /* add a event, but stay in the same thread */
-	}
-
-    if (!g_atomic_int_compare_and_exchange(&st->backend->connected_clients, 0, 0)) {
-        g_atomic_int_dec_and_test(&st->backend->connected_clients);    
-        //g_critical("add_connection: %08x's connected_clients is %d\n", backend,  backend->connected_clients);
-    }
+	network_connection_pool_lua_add_socket(con, st->backend, con->server);
 
 //	st->backend->connected_clients--;
 	st->backend = NULL;
@@ -285,6 +296,56 @@ network_socket *self_connect(network_mysqld_con *con, network_backend_t *backend
 	return sock;
 }
 
+/**
+ * get a authed server socket of the backend
+ *
+ * takes a idle one from the connection pool of the current thread or connects a new one
+ *
+ * @return NULL if the backend can't be reached
+ */
+network_socket *network_connection_pool_lua_get_socket(network_mysqld_con *con, network_backend_t *backend, GHashTable *pwd_table) {
+	network_socket *sock;
+	guint index = chassis_event_thread_index();
+	network_profile_t *profile = con->srv->backends->profile;
+	guint64 profile_start = network_profile_start(profile);
+	guint64 trace_start = con->trace.start ? chassis_get_rel_microseconds() : 0;
+
+	network_connection_pool* pool = chassis_event_thread_pool(backend);
+	if (NULL == (sock = network_connection_pool_get(pool))) {
+		/**
+		 * no connections in the pool
+		 */
+		guint64 start = chassis_get_rel_microseconds();
+		guint64 now;
+
+		backend->pool_stats[index].misses++;
+
+		sock = self_connect(con, backend, pwd_table);
+		now = chassis_get_rel_microseconds();
+		if (NULL != sock) {
+			histogram_record(&(backend->connect_latency[index]), now - start);
+		}
+		network_profile_stop(profile, PROFILE_POOL, profile_start);
+
+		if (trace_start) {
+			con->trace.connect_us += now - start;
+			con->trace.pool_us += now - trace_start;
+		}
+
+		return sock;
+	}
+	backend->pool_stats[index].hits++;
+
+	if (!g_atomic_int_compare_and_exchange(&backend->connected_clients, 0, 0)) {
+		g_atomic_int_dec_and_test(&backend->connected_clients);
+		//g_critical("pool_lua_swap:%08x's connected_clients is %d\n", backend,  backend->connected_clients);
+	}
+	network_profile_stop(profile, PROFILE_POOL, profile_start);
+	if (trace_start) con->trace.pool_us += chassis_get_rel_microseconds() - trace_start;
+
+	return sock;
+}
+
 /**
  * swap the server connection with a connection from
  * the connection pool
@@ -318,17 +379,9 @@ network_socket *network_connection_pool_lua_swap(network_mysqld_con *con, int ba
 #ifdef DEBUG_CONN_POOL
 	g_debug("%s: (swap) check if we have a connection for this user in the pool '%s'", G_STRLOC, con->client->response ? con->client->response->username->str: "empty_user");
 #endif
-       int flag = 0;
-	network_connection_pool* pool = chassis_event_thread_pool(backend);
-	if (NULL == (send_sock = network_connection_pool_get(pool))) {
-		/**
-		 * no connections in the pool
-		 */
-        flag = 1;
-		if (NULL == (send_sock = self_connect(con, backend, pwd_table))) {
-			st->backend_ndx = -1;
-			return NULL;
-		}
+	if (NULL == (send_sock = network_connection_pool_lua_get_socket(con, backend, pwd_table))) {
+		st->backend_ndx = -1;
+		return NULL;
 	}
 
 	/* the backend is up and cool, take and move the current backend into the pool */
@@ -341,11 +394,6 @@ network_socket *network_connection_pool_lua_swap(network_mysqld_con *con, int ba
 	st->backend = backend;
 //	st->backend->connected_clients++;
 	st->backend_ndx = backend_ndx;
-    
-        if (flag == 0 && !g_atomic_int_compare_and_exchange(&st->backend->connected_clients, 0, 0)) {
-            g_atomic_int_dec_and_test(&st->backend->connected_clients);
-            //g_critical("pool_lua_swap:%08x's connected_clients is %d\n", backend,  backend->connected_clients);
-        }
 
 	return send_sock;
 }
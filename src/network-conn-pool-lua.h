@@ -30,6 +30,8 @@
 NETWORK_API int network_connection_pool_getmetatable(lua_State *L);
 
 NETWORK_API int network_connection_pool_lua_add_connection(network_mysqld_con *con);
+NETWORK_API int network_connection_pool_lua_add_socket(network_mysqld_con *con, network_backend_t *backend, network_socket *sock);
+NETWORK_API network_socket *network_connection_pool_lua_get_socket(network_mysqld_con *con, network_backend_t *backend, GHashTable *pwd_table);
 NETWORK_API network_socket *network_connection_pool_lua_swap(network_mysqld_con *con, int backend_ndx, GHashTable *pwd_table);
 
 #endif
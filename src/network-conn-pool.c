@@ -82,12 +82,30 @@ network_connection_pool *network_connection_pool_new(void) {
  */
 void network_connection_pool_free(network_connection_pool *pool) {
 	if (pool) {
-		network_connection_pool_entry *entry = NULL;
-		while ((entry = g_queue_pop_head(pool))) network_connection_pool_entry_free(entry, TRUE);
+		network_connection_pool_purge(pool);
 		g_queue_free(pool);
 	}
 }
 
+/**
+ * close all idling connections of the pool
+ *
+ * has to be called from the thread owning the pool
+ *
+ * @return number of closed connections
+ */
+guint network_connection_pool_purge(network_connection_pool *pool) {
+	network_connection_pool_entry *entry = NULL;
+	guint n = 0;
+
+	while ((entry = g_queue_pop_head(pool))) {
+		network_connection_pool_entry_free(entry, TRUE);
+		++n;
+	}
+
+	return n;
+}
+
 /**
  * get a connection from the pool
  *
@@ -0,0 +1,76 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#include <glib.h>
+
+#include "network-histogram.h"
+
+/**
+ * add the counts of src to dst
+ *
+ * src may be written by its thread meanwhile, we may miss the samples in flight
+ */
+void histogram_merge(histogram_t *dst, const histogram_t *src) {
+	guint i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max) dst->max = src->max;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+}
+
+/**
+ * the largest value of a bucket, the inverse of histogram_bucket()
+ */
+guint64 histogram_bucket_max(guint bucket) {
+	guint shift;
+
+	if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) return bucket;
+
+	shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+
+	return ((guint64)(bucket - (shift << HISTOGRAM_SUB_BITS)) << shift) + (G_GUINT64_CONSTANT(1) << shift) - 1;
+}
+
+/**
+ * the value below which percentile % of the samples are
+ *
+ * @param percentile  in [0, 100], e.g. 99.9
+ * @return 0 if there are no samples
+ */
+guint64 histogram_percentile(const histogram_t *h, gdouble percentile) {
+	guint64 rank, seen = 0;
+	guint i;
+
+	if (h->count == 0) return 0;
+
+	rank = (guint64)(h->count * percentile / 100.0 + 0.5);
+	if (rank < 1) rank = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) return MIN(histogram_bucket_max(i), h->max);
+	}
+
+	return h->max;
+}
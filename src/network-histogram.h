@@ -0,0 +1,77 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+ 
+
+#ifndef _NETWORK_HISTOGRAM_H_
+#define _NETWORK_HISTOGRAM_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "network-exports.h"
+
+/**
+ * log-linear latency histogram, like HdrHistogram
+ *
+ * values below 2 * HISTOGRAM_SUB_BUCKETS get a bucket each, above each power of two is split
+ * into HISTOGRAM_SUB_BUCKETS linear buckets. so a bucket is at most 1/16 = 6.25% wide and
+ * microseconds up to 2^36 (19 hours) fit into 528 buckets.
+ */
+#define HISTOGRAM_SUB_BITS    4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS    36	/**< larger values are counted in the last bucket */
+#define HISTOGRAM_BUCKETS     ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * one histogram per event-thread, only written by that thread and summed up when read
+ */
+typedef struct {
+	guint64 count;
+	guint64 sum;
+	guint64 max;
+	guint64 buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static inline guint histogram_bucket(guint64 value) {
+	gint shift;
+
+	if (value >= G_GUINT64_CONSTANT(1) << HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+
+	shift = (gint)g_bit_storage(value) - HISTOGRAM_SUB_BITS - 1;
+	if (shift <= 0) return value;
+
+	return (shift << HISTOGRAM_SUB_BITS) + (value >> shift);
+}
+
+static inline void histogram_record(histogram_t *h, guint64 value) {
+	h->count++;
+	h->sum += value;
+	if (value > h->max) h->max = value;
+	h->buckets[histogram_bucket(value)]++;
+}
+
+NETWORK_API void histogram_merge(histogram_t *dst, const histogram_t *src);
+NETWORK_API guint64 histogram_percentile(const histogram_t *h, gdouble percentile);
+NETWORK_API guint64 histogram_bucket_max(guint bucket);
+
+#endif /* _NETWORK_HISTOGRAM_H_ */
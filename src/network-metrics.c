@@ -0,0 +1,453 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include <glib.h>
+
+#include "network-metrics.h"
+#include "network-backend.h"
+#include "network-histogram.h"
+#include "chassis-event-thread.h"
+#include "chassis-stats.h"
+
+#define METRICS_MAX_REQUEST 8192    /**< longer requests are dropped */
+#define METRICS_TIMEOUT     5       /**< seconds a client may take for the request and the response */
+#define METRICS_LATENCY_MIN_US 127        /**< the first bucket of the latency histograms, 2^7 - 1 */
+#define METRICS_LATENCY_MAX_US 67108863   /**< the last one before +Inf, 2^26 - 1 or 67 s */
+
+/**
+ * a client of the metrics listener
+ *
+ * reads the request, then sends the response from the same buffer and closes the connection
+ */
+typedef struct {
+	network_socket *sock;
+	GString *buf;
+	gsize written;
+	gboolean is_responding;
+	chassis *chas;
+} network_metrics_client;
+
+network_metrics *network_metrics_new(chassis *chas) {
+	network_metrics *metrics = g_new0(network_metrics, 1);
+
+	metrics->chas = chas;
+
+	return metrics;
+}
+
+void network_metrics_free(network_metrics *metrics) {
+	if (!metrics) return;
+
+	if (metrics->listen_sock) network_socket_free(metrics->listen_sock);
+
+	g_free(metrics);
+}
+
+static void network_metrics_client_free(network_metrics_client *client) {
+	network_socket_free(client->sock);
+	g_string_free(client->buf, TRUE);
+	g_free(client);
+}
+
+static void network_metrics_client_handle(int event_fd, short events, void *user_data);
+
+static void network_metrics_client_wait(network_metrics_client *client, short ev_type) {
+	struct timeval timeout = { METRICS_TIMEOUT, 0 };
+
+	event_set(&(client->sock->event), client->sock->fd, ev_type, network_metrics_client_handle, client);
+	event_base_set(client->chas->event_base, &(client->sock->event));
+	event_add(&(client->sock->event), &timeout);
+}
+
+static const gchar *metrics_backend_type(backend_type_t type) {
+	switch (type) {
+	case BACKEND_TYPE_RW: return "rw";
+	case BACKEND_TYPE_RO: return "ro";
+	default:              return "unknown";
+	}
+}
+
+static const gchar *metrics_backend_state(backend_state_t state) {
+	switch (state) {
+	case BACKEND_STATE_UP:      return "up";
+	case BACKEND_STATE_DOWN:    return "down";
+	case BACKEND_STATE_OFFLINE: return "offline";
+	default:                    return "unknown";
+	}
+}
+
+static const gchar *metrics_query_type(chassis_query_type_t type) {
+	switch (type) {
+	case QUERY_TYPE_SELECT:  return "select";
+	case QUERY_TYPE_INSERT:  return "insert";
+	case QUERY_TYPE_UPDATE:  return "update";
+	case QUERY_TYPE_DELETE:  return "delete";
+	case QUERY_TYPE_REPLACE: return "replace";
+	case QUERY_TYPE_OTHER:   return "other";
+	default:                 return "command";
+	}
+}
+
+static void metrics_family(GString *out, const gchar *name, const gchar *type, const gchar *help) {
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * append the labels of a backend, escaped as the text format wants it
+ */
+static void metrics_backend_labels(GString *out, network_backend_t *backend) {
+	const gchar *s;
+
+	g_string_append(out, "{backend=\"");
+	for (s = backend->addr->name->str; *s; s++) {
+		if (*s == '\\' || *s == '"') g_string_append_c(out, '\\');
+		g_string_append_c(out, *s);
+	}
+	g_string_append_printf(out, "\",type=\"%s\"", metrics_backend_type(backend->type));
+}
+
+/**
+ * a latency histogram of each backend
+ *
+ * the buckets end at 2^n - 1 microseconds, every 16th bucket of the histogram_t, a power of two apart
+ */
+static void metrics_backend_latency(GString *out, network_backends_t *bs, const gchar *name, const gchar *help, gboolean is_connect) {
+	histogram_t *h = g_new(histogram_t, 1);
+	guint i, j, b;
+
+	metrics_family(out, name, "histogram", help);
+	for (i = 0; i < bs->backends->len; i++) {
+		network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+		histogram_t *histograms = is_connect ? backend->connect_latency : backend->query_latency;
+		guint64 count = 0;
+
+		memset(h, 0, sizeof(*h));
+		for (j = 0; j < backend->pools->len; j++) {
+			histogram_merge(h, &(histograms[j]));
+		}
+
+		for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			guint64 max = histogram_bucket_max(b);
+
+			count += h->buckets[b];
+
+			if ((max & (max + 1)) != 0 || max < METRICS_LATENCY_MIN_US || max > METRICS_LATENCY_MAX_US) continue;
+
+			g_string_append_printf(out, "%s_bucket", name);
+			metrics_backend_labels(out, backend);
+			g_string_append_printf(out, ",le=\"%.6f\"} %" G_GUINT64_FORMAT "\n", max / 1000000.0, count);
+		}
+
+		/* the buckets are counted while they are read, the total of them is what +Inf and _count have to agree on */
+		g_string_append_printf(out, "%s_bucket", name);
+		metrics_backend_labels(out, backend);
+		g_string_append_printf(out, ",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n", count);
+		g_string_append_printf(out, "%s_sum", name);
+		metrics_backend_labels(out, backend);
+		g_string_append_printf(out, "} %.6f\n", h->sum / 1000000.0);
+		g_string_append_printf(out, "%s_count", name);
+		metrics_backend_labels(out, backend);
+		g_string_append_printf(out, "} %" G_GUINT64_FORMAT "\n", count);
+	}
+
+	g_free(h);
+}
+
+/**
+ * render all metrics in the Prometheus text format
+ */
+void network_metrics_render(chassis *chas, GString *out) {
+	network_backends_t *bs = chas->backends;
+	guint64 queries[QUERY_TYPE_MAX] = { 0 };
+	gint clients = 0;
+	guint i, j;
+
+	/* the event-threads, index 0 is the main-thread */
+	metrics_family(out, "atlas_thread_events_total", "counter", "Connection events handled by the event-thread.");
+	for (i = 0; i < chas->threads->len; i++) {
+		chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, i);
+		g_string_append_printf(out, "atlas_thread_events_total{thread=\"%u\"} %" G_GUINT64_FORMAT "\n", i, thread->stats.events);
+	}
+	metrics_family(out, "atlas_thread_connections_total", "counter", "Client connections handed to the event-thread.");
+	for (i = 0; i < chas->threads->len; i++) {
+		chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, i);
+		g_string_append_printf(out, "atlas_thread_connections_total{thread=\"%u\"} %" G_GUINT64_FORMAT "\n", i, thread->stats.connections);
+	}
+	metrics_family(out, "atlas_thread_clients", "gauge", "Open client connections of the event-thread.");
+	for (i = 0; i < chas->threads->len; i++) {
+		chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, i);
+		g_string_append_printf(out, "atlas_thread_clients{thread=\"%u\"} %d\n", i, thread->stats.clients);
+		clients += thread->stats.clients;
+	}
+	metrics_family(out, "atlas_thread_received_bytes_total", "counter", "Bytes read from clients and servers.");
+	for (i = 0; i < chas->threads->len; i++) {
+		chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, i);
+		g_string_append_printf(out, "atlas_thread_received_bytes_total{thread=\"%u\"} %" G_GUINT64_FORMAT "\n", i, thread->stats.bytes_in);
+	}
+	metrics_family(out, "atlas_thread_sent_bytes_total", "counter", "Bytes written to clients and servers.");
+	for (i = 0; i < chas->threads->len; i++) {
+		chassis_event_thread_t *thread = g_ptr_array_index(chas->threads, i);
+		g_string_append_printf(out, "atlas_thread_sent_bytes_total{thread=\"%u\"} %" G_GUINT64_FORMAT "\n", i, thread->stats.bytes_out);
+		for (j = 0; j < QUERY_TYPE_MAX; j++) queries[j] += thread->stats.queries[j];
+	}
+
+	metrics_family(out, "atlas_client_connections", "gauge", "Open client connections.");
+	g_string_append_printf(out, "atlas_client_connections %d\n", clients);
+
+	metrics_family(out, "atlas_queries_total", "counter", "Client commands by the kind of statement.");
+	for (j = 0; j < QUERY_TYPE_MAX; j++) {
+		g_string_append_printf(out, "atlas_queries_total{type=\"%s\"} %" G_GUINT64_FORMAT "\n", metrics_query_type(j), queries[j]);
+	}
+
+	if (bs) {
+		g_mutex_lock(bs->backends_mutex);
+
+		metrics_family(out, "atlas_backend_state", "gauge", "State of the backend, 1 for the current state.");
+		for (i = 0; i < bs->backends->len; i++) {
+			network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+			g_string_append(out, "atlas_backend_state");
+			metrics_backend_labels(out, backend);
+			g_string_append_printf(out, ",state=\"%s\"} 1\n", metrics_backend_state(backend->state));
+		}
+		metrics_family(out, "atlas_backend_connected_clients", "gauge", "Server connections of the backend in use.");
+		for (i = 0; i < bs->backends->len; i++) {
+			network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+			g_string_append(out, "atlas_backend_connected_clients");
+			metrics_backend_labels(out, backend);
+			g_string_append_printf(out, "} %d\n", g_atomic_int_get(&backend->connected_clients));
+		}
+		metrics_family(out, "atlas_backend_pool_connections", "gauge", "Idle server connections in the pools of the event-threads.");
+		for (i = 0; i < bs->backends->len; i++) {
+			network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+			guint idle = 0;
+
+			for (j = 0; j < backend->pools->len; j++) {
+				idle += g_queue_get_length(g_ptr_array_index(backend->pools, j));
+			}
+			g_string_append(out, "atlas_backend_pool_connections");
+			metrics_backend_labels(out, backend);
+			g_string_append_printf(out, "} %u\n", idle);
+		}
+		metrics_family(out, "atlas_backend_pool_hits_total", "counter", "Server connections taken from a pool.");
+		for (i = 0; i < bs->backends->len; i++) {
+			network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+			guint64 hits = 0;
+
+			for (j = 0; j < backend->pools->len; j++) hits += backend->pool_stats[j].hits;
+			g_string_append(out, "atlas_backend_pool_hits_total");
+			metrics_backend_labels(out, backend);
+			g_string_append_printf(out, "} %" G_GUINT64_FORMAT "\n", hits);
+		}
+		metrics_family(out, "atlas_backend_pool_misses_total", "counter", "Server connections opened as the pool was empty.");
+		for (i = 0; i < bs->backends->len; i++) {
+			network_backend_t *backend = g_ptr_array_index(bs->backends, i);
+			guint64 misses = 0;
+
+			for (j = 0; j < backend->pools->len; j++) misses += backend->pool_stats[j].misses;
+			g_string_append(out, "atlas_backend_pool_misses_total");
+			metrics_backend_labels(out, backend);
+			g_string_append_printf(out, "} %" G_GUINT64_FORMAT "\n", misses);
+		}
+
+		metrics_backend_latency(out, bs, "atlas_backend_query_latency_seconds", "Time from sending a query to the last packet of its result.", FALSE);
+		metrics_backend_latency(out, bs, "atlas_backend_connect_latency_seconds", "Time to connect and authenticate a new server connection.", TRUE);
+
+		g_mutex_unlock(bs->backends_mutex);
+
+		if (bs->plan_cache_stats) {
+			guint64 hits = 0, misses = 0;
+
+			for (i = 0; i <= bs->event_thread_count; i++) {
+				hits += bs->plan_cache_stats[i].hits;
+				misses += bs->plan_cache_stats[i].misses;
+			}
+			metrics_family(out, "atlas_plan_cache_hits_total", "counter", "Queries routed with a cached plan.");
+			g_string_append_printf(out, "atlas_plan_cache_hits_total %" G_GUINT64_FORMAT "\n", hits);
+			metrics_family(out, "atlas_plan_cache_misses_total", "counter", "Queries which needed the tokenizer.");
+			g_string_append_printf(out, "atlas_plan_cache_misses_total %" G_GUINT64_FORMAT "\n", misses);
+		}
+
+		if (bs->sql_log) {
+			metrics_family(out, "atlas_sql_log_written_bytes_total", "counter", "Bytes written to the sql log.");
+			g_string_append_printf(out, "atlas_sql_log_written_bytes_total %" G_GUINT64_FORMAT "\n", bs->sql_log->written);
+			metrics_family(out, "atlas_sql_log_dropped_total", "counter", "Sql log records dropped as the buffer of the thread was full.");
+			g_string_append_printf(out, "atlas_sql_log_dropped_total %" G_GUINT64_FORMAT "\n", sql_log_dropped(bs->sql_log));
+			metrics_family(out, "atlas_sql_log_skipped_total", "counter", "Sql log records skipped by the sampling or the rate limit per digest.");
+			g_string_append_printf(out, "atlas_sql_log_skipped_total{reason=\"sample\"} %" G_GUINT64_FORMAT "\n", sql_log_sampled_out(bs->sql_log));
+			g_string_append_printf(out, "atlas_sql_log_skipped_total{reason=\"rate\"} %" G_GUINT64_FORMAT "\n", sql_log_limited(bs->sql_log));
+		}
+	}
+
+	if (chas->stats) {
+		metrics_family(out, "atlas_lua_mem_bytes", "gauge", "Memory used by the Lua scripts.");
+		g_string_append_printf(out, "atlas_lua_mem_bytes %d\n", g_atomic_int_get(&chas->stats->lua_mem_bytes));
+		metrics_family(out, "atlas_lua_mem_bytes_max", "gauge", "Peak of the memory used by the Lua scripts.");
+		g_string_append_printf(out, "atlas_lua_mem_bytes_max %d\n", g_atomic_int_get(&chas->stats->lua_mem_bytes_max));
+		metrics_family(out, "atlas_lua_mem_alloc_total", "counter", "Allocations by the Lua scripts.");
+		g_string_append_printf(out, "atlas_lua_mem_alloc_total %d\n", g_atomic_int_get(&chas->stats->lua_mem_alloc));
+		metrics_family(out, "atlas_lua_mem_free_total", "counter", "Frees by the Lua scripts.");
+		g_string_append_printf(out, "atlas_lua_mem_free_total %d\n", g_atomic_int_get(&chas->stats->lua_mem_free));
+	}
+}
+
+/**
+ * replace the request in client->buf with the response
+ */
+static void network_metrics_respond(network_metrics_client *client) {
+	GString *body = g_string_sized_new(16384);
+	const gchar *status;
+
+	if (0 == strncmp(client->buf->str, "GET /metrics", sizeof("GET /metrics") - 1) &&
+			(client->buf->str[sizeof("GET /metrics") - 1] == ' ' || client->buf->str[sizeof("GET /metrics") - 1] == '?')) {
+		status = "200 OK";
+		network_metrics_render(client->chas, body);
+	} else {
+		status = "404 Not Found";
+		g_string_append(body, "only /metrics is served here\n");
+	}
+
+	g_string_printf(client->buf,
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %" G_GSIZE_FORMAT "\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			status, body->len);
+	g_string_append_len(client->buf, body->str, body->len);
+	client->is_responding = TRUE;
+
+	g_string_free(body, TRUE);
+}
+
+static void network_metrics_client_handle(int event_fd, short events, void *user_data) {
+	network_metrics_client *client = user_data;
+	gssize len;
+
+	if (events == EV_TIMEOUT) {
+		network_metrics_client_free(client);
+		return;
+	}
+
+	if (!client->is_responding) {
+		gchar buf[1024];
+
+		if (-1 == (len = recv(event_fd, buf, sizeof(buf), 0))) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				network_metrics_client_wait(client, EV_READ);
+			} else {
+				network_metrics_client_free(client);
+			}
+			return;
+		} else if (len == 0) {
+			network_metrics_client_free(client);
+			return;
+		}
+
+		g_string_append_len(client->buf, buf, len);
+
+		/* we only look at the request-line, but wait for the end of the headers */
+		if (NULL == g_strstr_len(client->buf->str, client->buf->len, "\r\n\r\n") &&
+				NULL == g_strstr_len(client->buf->str, client->buf->len, "\n\n")) {
+			if (client->buf->len > METRICS_MAX_REQUEST) {
+				network_metrics_client_free(client);
+			} else {
+				network_metrics_client_wait(client, EV_READ);
+			}
+			return;
+		}
+
+		network_metrics_respond(client);
+	}
+
+	if (-1 == (len = send(event_fd, client->buf->str + client->written, client->buf->len - client->written, 0))) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			network_metrics_client_wait(client, EV_WRITE);
+		} else {
+			network_metrics_client_free(client);
+		}
+		return;
+	}
+
+	client->written += len;
+	if (client->written < client->buf->len) {
+		network_metrics_client_wait(client, EV_WRITE);
+	} else {
+		network_metrics_client_free(client);
+	}
+}
+
+static void network_metrics_accept(int G_GNUC_UNUSED event_fd, short G_GNUC_UNUSED events, void *user_data) {
+	network_metrics *metrics = user_data;
+	network_metrics_client *client;
+	network_socket *sock;
+
+	if (NULL == (sock = network_socket_accept(metrics->listen_sock))) return;
+
+	client = g_new0(network_metrics_client, 1);
+	client->sock = sock;
+	client->buf = g_string_sized_new(1024);
+	client->chas = metrics->chas;
+
+	network_metrics_client_wait(client, EV_READ);
+}
+
+/**
+ * listen on address and serve the metrics from the main event-loop
+ *
+ * @return 0 on success, -1 if the address can't be bound
+ */
+int network_metrics_listen(network_metrics *metrics, const gchar *address) {
+	network_socket *listen_sock = network_socket_new();
+
+	if (0 != network_address_set_address(listen_sock->dst, address)) {
+		network_socket_free(listen_sock);
+		return -1;
+	}
+
+	if (0 != network_socket_bind(listen_sock)) {
+		network_socket_free(listen_sock);
+		return -1;
+	}
+
+	g_message("%s: metrics listening on %s", G_STRLOC, address);
+
+	event_set(&(listen_sock->event), listen_sock->fd, EV_READ|EV_PERSIST, network_metrics_accept, metrics);
+	event_base_set(metrics->chas->event_base, &(listen_sock->event));
+	event_add(&(listen_sock->event), NULL);
+
+	metrics->listen_sock = listen_sock;
+
+	return 0;
+}
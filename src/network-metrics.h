@@ -0,0 +1,52 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+ 
+
+#ifndef _NETWORK_METRICS_H_
+#define _NETWORK_METRICS_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "chassis-mainloop.h"
+#include "network-socket.h"
+#include "network-exports.h"
+
+/**
+ * a HTTP listener which serves /metrics in the Prometheus text format
+ *
+ * it runs in the main-thread and reads the counters of the event-threads and
+ * backends without locking them
+ */
+typedef struct {
+	chassis *chas;
+
+	network_socket *listen_sock;
+} network_metrics;
+
+NETWORK_API network_metrics *network_metrics_new(chassis *chas);
+NETWORK_API void network_metrics_free(network_metrics *metrics);
+NETWORK_API int network_metrics_listen(network_metrics *metrics, const gchar *address);
+NETWORK_API void network_metrics_render(chassis *chas, GString *out);
+
+#endif /* _NETWORK_METRICS_H_ */
@@ -171,8 +171,10 @@ network_mysqld_con *network_mysqld_con_new() {
 
 	con->locks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
-	con->merge_res = g_new(merge_res_t, 1);
-	con->merge_res->rows = g_ptr_array_new();
+	con->merge_res = g_new0(merge_res_t, 1);
+	con->merge_res->order_by = g_ptr_array_new();
+	con->merge_res->aggs = g_array_new(FALSE, FALSE, sizeof(merge_agg_t));
+	con->merge_res->results = g_ptr_array_new();
 
 	con->challenge = g_string_sized_new(20);
 
@@ -202,6 +204,8 @@ void network_mysqld_con_free(network_mysqld_con *con) {
 		con->parse.data_free(con->parse.data);
 	}
 
+	if (con->id) chassis_event_thread_unlink(con);
+
 	if (con->server) network_socket_free(con->server);
 	if (con->client) network_socket_free(con->client);
     
@@ -227,24 +231,35 @@ void network_mysqld_con_free(network_mysqld_con *con) {
 	g_hash_table_destroy(con->locks);
 
 	if (con->merge_res) {
-		GPtrArray* rows = con->merge_res->rows;
-		if (rows) {
-			guint i;
-			for (i = 0; i < rows->len; ++i) {
-				GPtrArray* row = g_ptr_array_index(rows, i);
-				guint j;
-				for (j = 0; j < row->len; ++j) {
-					g_free(g_ptr_array_index(row, j));
-				}
-				g_ptr_array_free(row, TRUE);
-			}
-			g_ptr_array_free(rows, TRUE);
+		merge_res_t* merge_res = con->merge_res;
+		guint i;
+
+		for (i = 0; i < merge_res->order_by->len; ++i) {
+			merge_order_t* order = g_ptr_array_index(merge_res->order_by, i);
+			g_free(order->name);
+			g_free(order);
 		}
-		g_free(con->merge_res);
+		g_ptr_array_free(merge_res->order_by, TRUE);
+
+		g_array_free(merge_res->aggs, TRUE);
+
+		for (i = 0; i < merge_res->results->len; ++i) {
+			GQueue* result = g_ptr_array_index(merge_res->results, i);
+			GString* packet;
+			while ((packet = g_queue_pop_head(result))) g_string_free(packet, TRUE);
+			g_queue_free(result);
+		}
+		g_ptr_array_free(merge_res->results, TRUE);
+
+		if (merge_res->error) g_string_free(merge_res->error, TRUE);
+
+		g_free(merge_res);
 	}
 
 	if (con->challenge) g_string_free(con->challenge, TRUE);
 
+	if (con->digest.key) g_string_free(con->digest.key, TRUE);
+
 	g_free(con);
 }
 
@@ -581,8 +596,14 @@ network_socket_retval_t network_mysqld_con_get_packet(chassis G_GNUC_UNUSED*chas
  * the packet is added to the con->recv_queue and contains a full mysql packet
  * with packet-header and everything 
  */
-network_socket_retval_t network_mysqld_read(chassis G_GNUC_UNUSED*chas, network_socket *con) {
-	switch (network_socket_read(con)) {
+network_socket_retval_t network_mysqld_read(chassis *chas, network_socket *con) {
+	chassis_event_thread_stats_t *stats = chassis_event_thread_stats(chas);
+	off_t to_read = con->to_read;
+	network_socket_retval_t ret = network_socket_read(con);
+
+	stats->bytes_in += to_read - con->to_read;
+
+	switch (ret) {
 	case NETWORK_SOCKET_WAIT_FOR_EVENT:
 		return NETWORK_SOCKET_WAIT_FOR_EVENT;
 	case NETWORK_SOCKET_ERROR:
@@ -597,11 +618,14 @@ network_socket_retval_t network_mysqld_read(chassis G_GNUC_UNUSED*chas, network_
 	return network_mysqld_con_get_packet(chas, con);
 }
 
-network_socket_retval_t network_mysqld_write(chassis G_GNUC_UNUSED*chas, network_socket *con) {
+network_socket_retval_t network_mysqld_write(chassis *chas, network_socket *con) {
 	network_socket_retval_t ret;
+	gsize to_write = con->send_queue->len;
 
 	ret = network_socket_write(con, -1);
 
+	chassis_event_thread_stats(chas)->bytes_out += to_write - con->send_queue->len;
+
 	return ret;
 }
 
@@ -854,6 +878,12 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 	g_assert(srv);
 	g_assert(con);
 
+	chassis_event_thread_stats_t *stats = chassis_event_thread_stats(srv);
+	stats->events++;
+
+	network_profile_t *profile = srv->backends->profile;
+	guint64 profile_start;
+
 	if (events == EV_READ) {
 		int b = -1;
 
@@ -908,7 +938,8 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 
 #define WAIT_FOR_EVENT(ev_struct, ev_type, timeout) \
 	event_set(&(ev_struct->event), ev_struct->fd, ev_type, network_mysqld_con_handle, user_data); \
-	chassis_event_add_self(srv, &(ev_struct->event), timeout);
+	chassis_event_add_self(srv, &(ev_struct->event), timeout); \
+	network_profile_stop(profile, ostate, profile_start);
 
 	/**
 	 * loop on the same connection as long as we don't end up in a stable state
@@ -922,6 +953,7 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 
 	do {
 		ostate = con->state;
+		profile_start = network_profile_start(profile);
 #ifdef NETWORK_DEBUG_TRACE_STATE_CHANGES
 		/* if you need the state-change information without dtrace, enable this */
 		g_debug("%s: [%d] %s",
@@ -931,6 +963,7 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 #endif
 
 		MYSQLPROXY_STATE_CHANGE(event_fd, events, con->state);
+		if (con->is_killed) con->state = CON_STATE_ERROR; /* KILL from the admin */
 		switch (con->state) {
 		case CON_STATE_ERROR:
 			/* we can't go on, close the connection */
@@ -948,6 +981,7 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 			*/
 			plugin_call_cleanup(srv, con);
 			network_mysqld_con_free(con);
+			stats->clients--;
 
 			con = NULL;
 
@@ -961,6 +995,7 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 			plugin_call_cleanup(srv, con);
 
 			network_mysqld_con_free(con);
+			stats->clients--;
 
 			con = NULL;
 
@@ -1766,6 +1801,9 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 			break;
 		}
 
+		network_profile_stop(profile, ostate, profile_start);
+		if (ostate != con->state) con->state_since = chassis_get_rel_microseconds();
+
 		event_fd = -1;
 		events   = 0;
 	} while (ostate != con->state);
@@ -1774,6 +1812,131 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
 	return;
 }
 
+static gchar *network_mysqld_process_str(GString *s) {
+	return (s && s->len) ? g_strdup(s->str) : NULL;
+}
+
+/**
+ * copy the connections of a event-thread into the processlist
+ */
+static void network_mysqld_processlist_thread(chassis_event_thread_t *thread, gpointer user_data) {
+	GPtrArray *procs = user_data;
+	guint64 now = chassis_get_rel_microseconds();
+	network_mysqld_con *con;
+
+	for (con = thread->cons; con; con = con->next_con) {
+		network_mysqld_process_t *p = g_new0(network_mysqld_process_t, 1);
+		network_socket *client = con->client;
+
+		p->id = con->id;
+		p->thread = con->thread;
+		p->client = g_strdup(client->src->name->str);
+		p->user = client->response ? network_mysqld_process_str(client->response->username) : NULL;
+		p->db = network_mysqld_process_str(client->default_db);
+		p->backend = con->server ? g_strdup(con->server->dst->name->str) : NULL;
+		p->state = con->state;
+		p->state_us = now - MIN(con->state_since, now);
+		p->is_in_transaction = con->is_in_transaction;
+		p->is_not_autocommit = con->is_not_autocommit;
+		p->locks = g_hash_table_size(con->locks);
+		p->command = con->trace.command;
+		p->query = g_strndup(con->trace.query, con->trace.query_len);
+
+		g_ptr_array_add(procs, p);
+	}
+}
+
+/**
+ * list the client connections of all event-threads
+ *
+ * each thread copies its own connections, the list needs no lock
+ *
+ * @return array of network_mysqld_process_t, free them with network_mysqld_process_free()
+ *         NULL if a event-thread didn't answer within a second
+ */
+GPtrArray *network_mysqld_processlist(chassis *srv) {
+	GPtrArray *procs = g_ptr_array_new();
+
+	if (!chassis_event_threads_call(srv, network_mysqld_processlist_thread, procs, 1000)) {
+		g_message("%s: not all event-threads answered in time", G_STRLOC);
+
+		g_ptr_array_foreach(procs, (GFunc)network_mysqld_process_free, NULL);
+		g_ptr_array_free(procs, TRUE);
+		return NULL;
+	}
+
+	return procs;
+}
+
+void network_mysqld_process_free(network_mysqld_process_t *p) {
+	if (!p) return;
+
+	g_free(p->client);
+	g_free(p->user);
+	g_free(p->db);
+	g_free(p->backend);
+	g_free(p->query);
+	g_free(p);
+}
+
+/**
+ * stop waiting on the socket
+ *
+ * @return TRUE if the connection was waiting for it
+ */
+static gboolean network_mysqld_kill_event(network_socket *sock) {
+	if (!sock || !event_pending(&(sock->event), EV_READ | EV_WRITE | EV_TIMEOUT, NULL)) return FALSE;
+
+	event_del(&(sock->event));
+
+	return TRUE;
+}
+
+static void network_mysqld_kill_thread(chassis_event_thread_t *thread, gpointer user_data) {
+	guint32 id = GPOINTER_TO_UINT(user_data);
+	network_mysqld_con *con;
+
+	for (con = thread->cons; con; con = con->next_con) {
+		gboolean is_waiting;
+
+		if (con->id != id) continue;
+
+		con->is_killed = TRUE;
+
+		/* the client has no event while the sub-queries of a sharded query run, the last one resumes it */
+		if (con->fanout) {
+			con->fanout_cancel(con);
+			return;
+		}
+
+		/* both, a query may wait for the server while the client already sent the next packet */
+		is_waiting = network_mysqld_kill_event(con->client);
+		is_waiting = network_mysqld_kill_event(con->server) || is_waiting;
+
+		/* without a pending event somebody else resumes the connection later, network_mysqld_con_handle() closes it then */
+		if (is_waiting) network_mysqld_con_handle(-1, 0, con);
+
+		return;
+	}
+}
+
+/**
+ * close a client connection in its event-thread
+ *
+ * doesn't wait for the thread, it may be busy and the connection may be the one which asks
+ *
+ * @return 0 if the connection is going to be closed, -1 if there is no connection with that id
+ */
+int network_mysqld_kill(chassis *srv, guint32 id) {
+	gint thread = chassis_event_thread_of(id);
+
+	if (thread < 0) return -1;
+
+	chassis_event_thread_call(srv, thread, network_mysqld_kill_thread, GUINT_TO_POINTER(id), NULL);
+
+	return 0;
+}
+
 /**
  * accept a connection
  *
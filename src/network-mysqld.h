@@ -232,13 +232,49 @@ typedef enum {
  */
 NETWORK_API const char *network_mysqld_con_state_get_name(network_mysqld_con_state_t state);
 
+/**
+ * a column of the ORDER BY of a sharded SELECT
+ */
+typedef struct {
+	gchar *name;              /**< column name or alias, NULL for a position */
+	guint pos;                /**< ORDER BY 2 */
+	gboolean is_desc;
+} merge_order_t;
+
+typedef enum {
+	MERGE_AGG_GROUP,          /**< a column of the GROUP BY */
+	MERGE_AGG_FIRST,          /**< a plain column next to aggregates without GROUP BY, any value will do */
+	MERGE_AGG_COUNT,
+	MERGE_AGG_SUM,
+	MERGE_AGG_MIN,
+	MERGE_AGG_MAX,
+	MERGE_AGG_AVG             /**< the tables return COUNT and SUM instead */
+} merge_agg_type_t;
+
+/**
+ * a column of the result of a sharded SELECT with aggregates
+ */
+typedef struct {
+	merge_agg_type_t type;
+	gint start;               /**< token index of the function name */
+	gint end;                 /**< token index of the closing brace */
+} merge_agg_t;
+
 typedef struct {
 	guint sub_sql_num;
 	guint sub_sql_exed;
-	GPtrArray* rows;
 	int limit;
+	guint offset;             /**< rows to skip before the first one is sent */
+	GPtrArray *order_by;      /**< merge_order_t, the sub-results are merged on these columns */
+	GArray *aggs;             /**< merge_agg_t of each column, the rows of the sub-results are aggregated if it isn't empty */
+	GPtrArray *results;       /**< GQueue of the packets of each sub-result, kept until all of them are in if order_by or aggs is set */
+	guint64 buffered_rows;    /**< rows in results, they are limited by --shard-merge-max-rows */
+	guint sent_rows;          /**< rows forwarded to the client so far */
+	gboolean is_fields_sent;  /**< the field definitions of the first result-set are forwarded */
+	GString *error;           /**< payload of the first ERR of a sub-query, it is sent instead of the merged result */
 	guint64 affected_rows;
 	guint16 warnings;
+	guint16 server_status;
 } merge_res_t;
 
 /**
@@ -366,8 +402,47 @@ struct network_mysqld_con {
 	merge_res_t* merge_res;
 
 	GString* challenge;
+
+	const gchar* cluster;	/**< the cluster the current query is routed to, NULL for the default one */
+
+	slow_query_trace_t trace;	/**< where the time of the current query goes, for SELECT * FROM slow_queries, and its start for the processlist */
+	query_stats_trace_t digest;	/**< the current query for SELECT * FROM query_stats */
+
+	guint32 id;                     /**< of the processlist, 0 until a event-thread owns the connection */
+	guint thread;                   /**< index of the owning event-thread */
+	network_mysqld_con *prev_con;   /**< in the list of the owning event-thread */
+	network_mysqld_con *next_con;
+	guint64 state_since;            /**< when the connection went into its current state */
+	gboolean is_killed;             /**< close the connection as soon as the owning thread handles it */
+
+	/**
+	 * a sharded query whose sub-queries run on connections of their own, NULL if there is none
+	 *
+	 * fanout_cancel() fails all of them, which resumes the connection. KILL uses it
+	 */
+	gpointer fanout;
+	void (*fanout_cancel)(network_mysqld_con *con);
 };
 
+/**
+ * a row of the processlist, copied by the event-thread owning the connection
+ */
+typedef struct {
+	guint32 id;
+	guint thread;
+	gchar *client;
+	gchar *user;
+	gchar *db;
+	gchar *backend;                 /**< NULL if the connection has no server connection right now */
+	network_mysqld_con_state_t state;
+	guint64 state_us;               /**< time in the current state */
+	gboolean is_in_transaction;
+	gboolean is_not_autocommit;
+	guint locks;                    /**< held by GET_LOCK() */
+	guint8 command;                 /**< of the current or last query */
+	gchar *query;                   /**< the start of the current or last query */
+} network_mysqld_process_t;
+
 
 
 NETWORK_API void g_list_string_free(gpointer data, gpointer UNUSED_PARAM(user_data));
@@ -402,6 +477,9 @@ NETWORK_API network_socket_retval_t network_mysqld_con_get_packet(chassis G_GNUC
 NETWORK_API int network_mysqld_init(chassis *srv, gchar *default_file);
 NETWORK_API void network_mysqld_add_connection(chassis *srv, network_mysqld_con *con);
 NETWORK_API void network_mysqld_con_handle(int event_fd, short events, void *user_data);
+NETWORK_API GPtrArray *network_mysqld_processlist(chassis *srv);
+NETWORK_API void network_mysqld_process_free(network_mysqld_process_t *p);
+NETWORK_API int network_mysqld_kill(chassis *srv, guint32 id);
 NETWORK_API int network_mysqld_queue_append(network_socket *sock, network_queue *queue, const char *data, size_t len);
 NETWORK_API int network_mysqld_queue_append_raw(network_socket *sock, network_queue *queue, GString *data);
 NETWORK_API int network_mysqld_queue_reset(network_socket *sock);
@@ -0,0 +1,126 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "network-profile.h"
+#include "network-mysqld.h"
+#include "chassis-event-thread.h"
+#include "chassis-timings.h"
+
+static const gchar *profile_section_names[] = {
+	"classify",
+	"tokenizer",
+	"sharding",
+	"routing",
+	"pool",
+};
+
+network_profile_t *network_profile_new(guint thread_count) {
+	network_profile_t *p = g_new0(network_profile_t, 1);
+
+	p->thread_count = thread_count;
+	p->threads = g_new0(network_profile_thread_t, thread_count);
+
+	/* my_timer_init() ran in chassis_timestamps_global_init() */
+	if (chassis_timestamps_global && chassis_timestamps_global->cycles_routine != 0 && chassis_timestamps_global->cycles_frequency != 0) {
+		p->use_cycles = TRUE;
+		p->frequency = chassis_timestamps_global->cycles_frequency;
+	} else {
+		p->use_cycles = FALSE;
+		p->frequency = G_GUINT64_CONSTANT(1000000000);
+	}
+
+	return p;
+}
+
+void network_profile_free(network_profile_t *p) {
+	if (!p) return;
+
+	g_free(p->threads);
+	g_free(p);
+}
+
+/**
+ * start counting from zero
+ *
+ * each thread clears its own counters when it adds the next time
+ */
+void network_profile_reset(network_profile_t *p) {
+	g_atomic_int_inc(&p->gen);
+}
+
+/**
+ * count ticks for slot in the calling thread
+ */
+void network_profile_add(network_profile_t *p, guint slot, guint64 ticks) {
+	guint ndx = chassis_event_thread_index();
+	network_profile_thread_t *t;
+	network_profile_counter_t *c;
+	gint gen = g_atomic_int_get(&p->gen);
+
+	if (ndx >= p->thread_count || slot >= PROFILE_MAX) return;
+	t = &(p->threads[ndx]);
+
+	if (t->gen != gen) {
+		memset(t->counters, 0, sizeof(t->counters));
+		t->gen = gen;
+	}
+
+	c = &(t->counters[slot]);
+	c->calls++;
+	c->cycles += ticks;
+	if (ticks > c->max_cycles) c->max_cycles = ticks;
+}
+
+/**
+ * sum up slot over all threads
+ *
+ * the counters are read without a lock, they may be a few calls behind
+ */
+void network_profile_sum(network_profile_t *p, guint slot, network_profile_counter_t *sum) {
+	gint gen = g_atomic_int_get(&p->gen);
+	guint i;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i = 0; i < p->thread_count; i++) {
+		network_profile_counter_t *c = &(p->threads[i].counters[slot]);
+
+		if (p->threads[i].gen != gen) continue;
+
+		sum->calls += c->calls;
+		sum->cycles += c->cycles;
+		if (c->max_cycles > sum->max_cycles) sum->max_cycles = c->max_cycles;
+	}
+}
+
+const gchar *network_profile_slot_name(guint slot) {
+	if (slot < NETWORK_PROFILE_STATES) return network_mysqld_con_state_get_name(slot);
+	if (slot < PROFILE_MAX) return profile_section_names[slot - NETWORK_PROFILE_STATES];
+
+	return NULL;
+}
@@ -0,0 +1,99 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifndef _NETWORK_PROFILE_H_
+#define _NETWORK_PROFILE_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "my_rdtsc.h"
+#include "network-exports.h"
+
+#define NETWORK_PROFILE_STATES 22	/**< CON_STATE_INIT ... CON_STATE_SEND_LOCAL_INFILE_RESULT */
+
+/**
+ * what is profiled: the time spent in each state of network_mysqld_con_handle() and the sections
+ * of proxy_read_query() and the connection pool which run inside of them
+ */
+typedef enum {
+	PROFILE_CLASSIFY = NETWORK_PROFILE_STATES, /**< sql_classify() and the plan cache lookup */
+	PROFILE_TOKENIZER,                         /**< sql_tokenizer() */
+	PROFILE_SHARDING,                          /**< sql_parse(), rewriting the query for the sub-tables */
+	PROFILE_ROUTING,                           /**< picking the backend for a query */
+	PROFILE_POOL,                              /**< taking a server connection from the pool or connecting */
+	PROFILE_MAX
+} network_profile_slot_t;
+
+typedef struct {
+	guint64 calls;
+	guint64 cycles;
+	guint64 max_cycles;
+} network_profile_counter_t;
+
+/**
+ * the counters of one event-thread, only written by that thread
+ */
+typedef struct {
+	gint gen;               /**< the counters are from before a reset if this isn't network_profile_t::gen */
+	network_profile_counter_t counters[PROFILE_MAX];
+} network_profile_thread_t;
+
+typedef struct {
+	volatile gint enabled;
+	volatile gint gen;      /**< bumped by network_profile_reset() */
+
+	network_profile_thread_t *threads; /**< event_thread_count + 1, 0 is the main-thread */
+	guint thread_count;
+
+	gboolean use_cycles;    /**< rdtsc and friends, my_timer_nanoseconds() if the platform has no cycle counter */
+	guint64 frequency;      /**< ticks of network_profile_now() per second */
+} network_profile_t;
+
+NETWORK_API network_profile_t *network_profile_new(guint thread_count);
+NETWORK_API void network_profile_free(network_profile_t *p);
+NETWORK_API void network_profile_reset(network_profile_t *p);
+NETWORK_API void network_profile_add(network_profile_t *p, guint slot, guint64 ticks);
+NETWORK_API void network_profile_sum(network_profile_t *p, guint slot, network_profile_counter_t *sum);
+NETWORK_API const gchar *network_profile_slot_name(guint slot);
+
+static inline guint64 network_profile_now(network_profile_t *p) {
+	return p->use_cycles ? my_timer_cycles() : my_timer_nanoseconds();
+}
+
+/**
+ * @return the start of a section or 0 if profiling is off
+ */
+static inline guint64 network_profile_start(network_profile_t *p) {
+	if (p == NULL || !g_atomic_int_get(&p->enabled)) return 0;
+
+	return network_profile_now(p);
+}
+
+static inline void network_profile_stop(network_profile_t *p, guint slot, guint64 start) {
+	if (start == 0) return;
+
+	network_profile_add(p, slot, network_profile_now(p) - start);
+}
+
+#endif /* _NETWORK_PROFILE_H_ */
@@ -0,0 +1,200 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "network-query-stats.h"
+
+#define S(x) x->str, x->len
+
+static void query_digest_free(query_digest_t *digest) {
+	g_string_free(digest->key, TRUE);
+	g_free(digest);
+}
+
+query_stats_t *query_stats_new(guint thread_count, guint max_digests) {
+	query_stats_t *stats = g_new0(query_stats_t, 1);
+	guint i;
+
+	stats->threads = g_new0(query_stats_thread_t, thread_count);
+	stats->thread_count = thread_count;
+	stats->max_digests = max_digests;
+
+	for (i = 0; i < thread_count; i++) {
+		query_stats_thread_t *t = &(stats->threads[i]);
+
+		t->digests = g_hash_table_new_full((GHashFunc)g_string_hash, (GEqualFunc)g_string_equal, NULL, (GDestroyNotify)query_digest_free);
+		t->list = g_ptr_array_sized_new(max_digests);
+		t->rand = g_rand_new();
+		t->mutex = g_mutex_new();
+	}
+
+	return stats;
+}
+
+void query_stats_free(query_stats_t *stats) {
+	guint i;
+
+	if (!stats) return;
+
+	for (i = 0; i < stats->thread_count; i++) {
+		query_stats_thread_t *t = &(stats->threads[i]);
+
+		g_hash_table_destroy(t->digests);
+		g_ptr_array_free(t->list, TRUE);
+		g_rand_free(t->rand);
+		g_mutex_free(t->mutex);
+	}
+
+	g_free(stats->threads);
+	g_free(stats);
+}
+
+/**
+ * the digest to give up for a new one
+ *
+ * the least counted of a few picked at random, looking at all of them would hold the mutex for too long
+ */
+static query_digest_t *query_digest_victim(query_stats_thread_t *t) {
+	query_digest_t *digest, *victim = NULL;
+	guint i;
+
+	for (i = 0; i < QUERY_STATS_EVICT_SAMPLES; i++) {
+		digest = g_ptr_array_index(t->list, g_rand_int_range(t->rand, 0, t->list->len));
+
+		if (victim == NULL || digest->count < victim->count) victim = digest;
+	}
+
+	return victim;
+}
+
+static void query_digest_remove(query_stats_thread_t *t, query_digest_t *digest) {
+	query_digest_t *last = g_ptr_array_index(t->list, t->list->len - 1);
+
+	/* the last one takes its place */
+	g_ptr_array_remove_index_fast(t->list, digest->index);
+	last->index = digest->index;
+
+	g_hash_table_remove(t->digests, digest->key);
+}
+
+/**
+ * count a query under its key, the default db, a '\0' and the fingerprint of the query
+ *
+ * if the table is full a rarely counted digest makes room, so new kinds of queries are still seen
+ *
+ * must be called by the thread which owns thread_ndx
+ */
+void query_stats_record(query_stats_t *stats, guint thread_ndx, GString *key, guint64 latency_us, guint64 rows, guint64 bytes, gboolean is_error) {
+	query_stats_thread_t *t = &(stats->threads[thread_ndx]);
+	guint gen = g_atomic_int_get(&stats->gen);
+	query_digest_t *digest;
+
+	if (key->len > QUERY_STATS_MAX_KEY) g_string_truncate(key, QUERY_STATS_MAX_KEY);
+
+	if (t->gen != gen) {
+		/* drop the digests from before the last reset, the readers hide them already */
+		g_mutex_lock(t->mutex);
+		g_ptr_array_set_size(t->list, 0);
+		g_hash_table_remove_all(t->digests);
+		t->gen = gen;
+		g_mutex_unlock(t->mutex);
+	}
+
+	if (NULL == (digest = g_hash_table_lookup(t->digests, key))) {
+		g_mutex_lock(t->mutex);
+		if (t->list->len >= stats->max_digests) {
+			query_digest_remove(t, query_digest_victim(t));
+			t->evicted++;
+		}
+		digest = g_new0(query_digest_t, 1);
+		digest->key = g_string_new_len(S(key));
+		digest->gen = gen;
+		digest->index = t->list->len;
+		g_ptr_array_add(t->list, digest);
+		g_hash_table_insert(t->digests, digest->key, digest);
+		g_mutex_unlock(t->mutex);
+	}
+
+	digest->count++;
+	if (is_error) digest->errors++;
+	digest->total_us += latency_us;
+	if (latency_us > digest->max_us) digest->max_us = latency_us;
+	digest->rows += rows;
+	digest->bytes += bytes;
+}
+
+/**
+ * sum up the digests of all threads
+ *
+ * the counters are read while the threads update them, a digest may miss the queries in flight
+ *
+ * @return array of query_digest_t, free it with g_ptr_array_free(..., TRUE)
+ */
+GPtrArray *query_stats_merge(query_stats_t *stats) {
+	GHashTable *merged = g_hash_table_new((GHashFunc)g_string_hash, (GEqualFunc)g_string_equal);
+	GPtrArray *digests = g_ptr_array_new_with_free_func((GDestroyNotify)query_digest_free);
+	guint gen = g_atomic_int_get(&stats->gen);
+	guint i;
+
+	for (i = 0; i < stats->thread_count; i++) {
+		query_stats_thread_t *t = &(stats->threads[i]);
+		GHashTableIter iter;
+		query_digest_t *digest;
+
+		g_mutex_lock(t->mutex);
+		g_hash_table_iter_init(&iter, t->digests);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&digest)) {
+			query_digest_t *sum;
+
+			if (digest->gen != gen) continue;
+
+			if (NULL == (sum = g_hash_table_lookup(merged, digest->key))) {
+				sum = g_new0(query_digest_t, 1);
+				sum->key = g_string_new_len(S(digest->key));
+				sum->gen = gen;
+				g_hash_table_insert(merged, sum->key, sum);
+				g_ptr_array_add(digests, sum);
+			}
+
+			sum->count += digest->count;
+			sum->errors += digest->errors;
+			sum->total_us += digest->total_us;
+			if (digest->max_us > sum->max_us) sum->max_us = digest->max_us;
+			sum->rows += digest->rows;
+			sum->bytes += digest->bytes;
+		}
+		g_mutex_unlock(t->mutex);
+	}
+
+	g_hash_table_destroy(merged);
+
+	return digests;
+}
+
+/**
+ * start counting from zero
+ *
+ * each thread drops its digests when it counts the next query, until then they are hidden
+ */
+void query_stats_reset(query_stats_t *stats) {
+	g_atomic_int_inc(&stats->gen);
+}
@@ -0,0 +1,95 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+ 
+
+#ifndef _NETWORK_QUERY_STATS_H_
+#define _NETWORK_QUERY_STATS_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "network-exports.h"
+
+#define QUERY_STATS_MAX_KEY 1024	/**< longer digests are cut, like the digests of performance_schema */
+#define QUERY_STATS_EVICT_SAMPLES 8	/**< digests looked at to find one to give up */
+
+/**
+ * the counters of one query digest
+ *
+ * the key is the default db, a '\0' and the fingerprint of the query
+ */
+typedef struct {
+	GString *key;
+	guint gen;              /**< the counters are from before a reset if this isn't query_stats_t::gen */
+	guint index;            /**< in query_stats_thread_t::list */
+
+	guint64 count;
+	guint64 errors;
+	guint64 total_us;       /**< latency from reading the query to writing the last packet of its result */
+	guint64 max_us;
+	guint64 rows;
+	guint64 bytes;
+} query_digest_t;
+
+/**
+ * the digests of one event-thread
+ *
+ * only the owning thread adds to the table and counts. it looks up the digests without a lock,
+ * the mutex is only taken to add or remove a digest and by the readers
+ */
+typedef struct {
+	GHashTable *digests;    /**< key => query_digest_t */
+	GPtrArray *list;        /**< the digests again, to pick some at random */
+	GRand *rand;
+	guint gen;              /**< the query_stats_t::gen the digests are counted for */
+	GMutex *mutex;
+	guint64 evicted;        /**< digests given up to make room for new ones */
+} query_stats_thread_t;
+
+typedef struct {
+	query_stats_thread_t *threads;
+	guint thread_count;
+	guint max_digests;      /**< per thread */
+	volatile gint gen;      /**< bumped by query_stats_reset() */
+} query_stats_t;
+
+/**
+ * the client query a connection runs, counted when its result is written to the client
+ *
+ * a sharded query runs as several sub-queries, they are summed up
+ */
+typedef struct {
+	GString *key;           /**< default db, '\0' and the fingerprint of the query, NULL until the first one */
+	guint64 start;          /**< when the query was read, 0 if it isn't counted */
+	guint64 rows;
+	guint64 bytes;
+	gboolean is_error;
+} query_stats_trace_t;
+
+NETWORK_API query_stats_t *query_stats_new(guint thread_count, guint max_digests);
+NETWORK_API void query_stats_free(query_stats_t *stats);
+NETWORK_API void query_stats_record(query_stats_t *stats, guint thread_ndx, GString *key, guint64 latency_us, guint64 rows, guint64 bytes, gboolean is_error);
+NETWORK_API GPtrArray *query_stats_merge(query_stats_t *stats);
+NETWORK_API void query_stats_reset(query_stats_t *stats);
+
+#endif /* _NETWORK_QUERY_STATS_H_ */
@@ -0,0 +1,167 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "network-slow-query.h"
+
+#define SLOW_QUERY_READ_RETRIES 3
+
+slow_queries_t *slow_queries_new(guint ring_num, guint ring_size, guint64 threshold_us) {
+	slow_queries_t *sq = g_new0(slow_queries_t, 1);
+	guint i;
+
+	sq->rings = g_new0(slow_query_ring_t, ring_num);
+	sq->ring_num = ring_num;
+	sq->ring_size = ring_size;
+	sq->threshold_us = threshold_us;
+
+	for (i = 0; i < ring_num; i++) {
+		sq->rings[i].entries = g_new0(slow_query_t, ring_size);
+	}
+
+	return sq;
+}
+
+void slow_queries_free(slow_queries_t *sq) {
+	guint i;
+
+	if (!sq) return;
+
+	for (i = 0; i < sq->ring_num; i++) {
+		g_free(sq->rings[i].entries);
+	}
+	g_free(sq->rings);
+	g_free(sq);
+}
+
+static void slow_query_copy_name(gchar *dst, const gchar *src) {
+	if (src) {
+		g_strlcpy(dst, src, SLOW_QUERY_MAX_NAME);
+	} else {
+		dst[0] = '\0';
+	}
+}
+
+/**
+ * record a slow query in the ring of the calling event-thread
+ *
+ * @param ndx  chassis_event_thread_index() of the caller, it owns the ring
+ */
+void slow_queries_record(slow_queries_t *sq, guint ndx, slow_query_trace_t *trace, guint64 total_us,
+		const gchar *client, const gchar *user, const gchar *db) {
+	slow_query_ring_t *ring;
+	slow_query_t *e;
+
+	if (ndx >= sq->ring_num) return;
+
+	ring = &(sq->rings[ndx]);
+	e = &(ring->entries[ring->next]);
+	if (++ring->next == sq->ring_size) ring->next = 0;
+
+	g_atomic_int_inc(&e->seq); /* odd: readers skip the entry */
+
+	e->time = time(NULL);
+	e->total_us = total_us;
+	/* only the used part of the query */
+	memcpy(&e->trace, trace, G_STRUCT_OFFSET(slow_query_trace_t, query) + trace->query_len);
+	slow_query_copy_name(e->client, client);
+	slow_query_copy_name(e->user, user);
+	slow_query_copy_name(e->db, db);
+
+	g_atomic_int_inc(&e->seq);
+
+	ring->recorded++;
+}
+
+static gint slow_query_cmp(gconstpointer a, gconstpointer b) {
+	const slow_query_t *qa = *(const slow_query_t **)a;
+	const slow_query_t *qb = *(const slow_query_t **)b;
+
+	if (qa->time != qb->time) return qa->time > qb->time ? -1 : 1;
+	if (qa->total_us != qb->total_us) return qa->total_us > qb->total_us ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * copy the recorded slow queries of all event-threads
+ *
+ * entries which are rewritten while they are copied are left out
+ *
+ * @return the newest first, free with g_ptr_array_free(..., TRUE) after freeing the entries with g_free()
+ */
+GPtrArray *slow_queries_get(slow_queries_t *sq) {
+	GPtrArray *queries = g_ptr_array_new();
+	guint i, j;
+
+	for (i = 0; i < sq->ring_num; i++) {
+		slow_query_ring_t *ring = &(sq->rings[i]);
+
+		for (j = 0; j < sq->ring_size; j++) {
+			slow_query_t *e = &(ring->entries[j]);
+			slow_query_t *copy = NULL;
+			int retry;
+
+			for (retry = 0; retry < SLOW_QUERY_READ_RETRIES; retry++) {
+				gint seq = g_atomic_int_get(&e->seq);
+
+				if (seq == 0) break;
+				if (seq & 1) continue;
+
+				if (!copy) copy = g_new(slow_query_t, 1);
+				memcpy(copy, (slow_query_t *)e, sizeof(*copy));
+
+				if (g_atomic_int_get(&e->seq) == seq) break;
+			}
+
+			if (copy && retry < SLOW_QUERY_READ_RETRIES) {
+				copy->trace.query_len = MIN(copy->trace.query_len, SLOW_QUERY_MAX_QUERY);
+				g_ptr_array_add(queries, copy);
+			} else if (copy) {
+				g_free(copy);
+			}
+		}
+	}
+
+	g_ptr_array_sort(queries, slow_query_cmp);
+
+	return queries;
+}
+
+/**
+ * @return the slow queries recorded since the start, including the overwritten ones
+ */
+guint64 slow_queries_recorded(slow_queries_t *sq) {
+	guint64 sum = 0;
+	guint i;
+
+	for (i = 0; i < sq->ring_num; i++) {
+		sum += sq->rings[i].recorded;
+	}
+
+	return sum;
+}
@@ -0,0 +1,104 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifndef _NETWORK_SLOW_QUERY_H_
+#define _NETWORK_SLOW_QUERY_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+
+#include <glib.h>
+
+#include "network-exports.h"
+
+#define SLOW_QUERY_MAX_QUERY 256	/**< longer queries are cut */
+#define SLOW_QUERY_MAX_NAME  64	/**< addresses, user and db */
+
+/**
+ * where the time of one query went, filled in by the proxy while the query runs
+ *
+ * the timestamps are from chassis_get_rel_microseconds(), the phases add up to the time between
+ * reading the query and having written the last packet of its result to the client
+ */
+typedef struct {
+	guint64 start;          /**< proxy_read_query() got the query, 0 if no query is traced */
+	guint64 sent;           /**< the current injection went to the backend */
+	guint64 result_done;    /**< the last packet of the result came in, writing it to the client starts */
+
+	guint64 route_us;       /**< classify, parse and pick the backend, without the pool */
+	guint64 pool_us;        /**< taking server connections from the pool, connecting included */
+	guint64 connect_us;     /**< of that: self_connect() to a backend */
+	guint64 repair_us;      /**< COM_INIT_DB, SET NAMES and COM_CHANGE_USER to sync the server connection */
+	guint64 backend_us;     /**< the query itself, the slowest shard of a fanned-out query */
+	guint64 client_us;      /**< writing the result to the client */
+
+	guint repairs;          /**< injected queries to sync the server connection */
+	guint queries;          /**< sent to the backends, more than 1 for sharded queries */
+	guint8 command;         /**< COM_* */
+	gboolean is_error;
+	gchar backend[SLOW_QUERY_MAX_NAME]; /**< the last server which answered, empty for fanned-out queries */
+
+	guint query_len;
+	gchar query[SLOW_QUERY_MAX_QUERY];
+} slow_query_trace_t;
+
+/**
+ * a recorded slow query
+ */
+typedef struct {
+	volatile gint seq;      /**< odd while the owning thread writes the entry, 0 if it is unused */
+	time_t time;            /**< when the query finished */
+	guint64 total_us;
+	slow_query_trace_t trace;
+	gchar client[SLOW_QUERY_MAX_NAME];
+	gchar user[SLOW_QUERY_MAX_NAME];
+	gchar db[SLOW_QUERY_MAX_NAME];
+} slow_query_t;
+
+/**
+ * the last slow queries of one event-thread
+ *
+ * only the owning thread writes, the oldest entry is overwritten. readers copy the entries
+ * and retry if the sequence number changed meanwhile
+ */
+typedef struct {
+	slow_query_t *entries;
+	guint next;             /**< the entry written next */
+	guint64 recorded;
+} slow_query_ring_t;
+
+typedef struct {
+	slow_query_ring_t *rings;  /**< event_thread_count + 1, 0 is the main-thread */
+	guint ring_num;
+	guint ring_size;
+	guint64 threshold_us;   /**< queries which take longer are recorded */
+} slow_queries_t;
+
+NETWORK_API slow_queries_t *slow_queries_new(guint ring_num, guint ring_size, guint64 threshold_us);
+NETWORK_API void slow_queries_free(slow_queries_t *sq);
+NETWORK_API void slow_queries_record(slow_queries_t *sq, guint ndx, slow_query_trace_t *trace, guint64 total_us,
+		const gchar *client, const gchar *user, const gchar *db);
+NETWORK_API GPtrArray *slow_queries_get(slow_queries_t *sq);
+NETWORK_API guint64 slow_queries_recorded(slow_queries_t *sq);
+
+#endif /* _NETWORK_SLOW_QUERY_H_ */
@@ -0,0 +1,712 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#include <glib.h>
+
+#include "network-sql-log.h"
+
+/**
+ * write all of [data, data + len)
+ */
+static void sql_log_write(sql_log_t *log, const gchar *data, gsize len) {
+	while (len > 0) {
+		gssize n = write(log->fd, data, len);
+
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			g_critical("%s: writing the sql-log failed: %s (%d)", G_STRLOC, g_strerror(errno), errno);
+			return;
+		}
+		data += n;
+		len -= n;
+		log->written += n;
+	}
+}
+
+/**
+ * compress and write the pending block
+ */
+static void sql_log_flush_block(sql_log_t *log) {
+	GString *header;
+
+	if (log->block->len == 0) return;
+
+	g_string_truncate(log->packed, 0);
+	sql_log_compress(log->packed, (guchar *)log->block->str, log->block->len);
+
+	header = g_string_sized_new(20);
+	sql_log_varint_append(header, log->block->len);
+	if (log->packed->len < log->block->len) {
+		sql_log_varint_append(header, log->packed->len);
+		sql_log_write(log, header->str, header->len);
+		sql_log_write(log, log->packed->str, log->packed->len);
+	} else {
+		/* stored as is */
+		sql_log_varint_append(header, 0);
+		sql_log_write(log, header->str, header->len);
+		sql_log_write(log, log->block->str, log->block->len);
+	}
+	g_string_free(header, TRUE);
+
+	g_string_truncate(log->block, 0);
+}
+
+static void sql_log_output(sql_log_t *log, const gchar *data, gsize len) {
+	if (!(log->flags & SQL_LOG_COMPRESSED)) {
+		sql_log_write(log, data, len);
+		return;
+	}
+
+	g_string_append_len(log->block, data, len);
+}
+
+/**
+ * write out what the event-threads appended since the last call
+ *
+ * @return bytes taken from the rings
+ */
+static gsize sql_log_drain(sql_log_t *log) {
+	gsize total = 0;
+	guint i;
+
+	for (i = 0; i < log->ring_num; i++) {
+		sql_log_ring_t *ring = &(log->rings[i]);
+		guint tail = (guint)ring->tail;
+		guint head = (guint)g_atomic_int_get(&ring->head);
+
+		/* at most two chunks: up to the end of the buffer and from its start */
+		while (tail != head) {
+			guint offset = tail & (ring->size - 1);
+			guint len = MIN(head - tail, ring->size - offset);
+
+			sql_log_output(log, ring->buf + offset, len);
+			tail += len;
+			total += len;
+		}
+
+		g_atomic_int_set(&ring->tail, (gint)tail);
+
+		/*
+		 * a ring only holds whole records, but the part at the end of its buffer may stop inside one.
+		 * blocks are only cut after all of it, a cut file then ends with whole records
+		 */
+		if ((log->flags & SQL_LOG_COMPRESSED) && log->block->len >= SQL_LOG_BLOCK_SIZE) sql_log_flush_block(log);
+	}
+
+	return total;
+}
+
+static gpointer sql_log_writer(gpointer user_data) {
+	sql_log_t *log = user_data;
+
+	while (!g_atomic_int_get(&log->is_stopped)) {
+		guint64 dropped;
+
+		if (sql_log_drain(log) == 0) {
+			/* don't hold back records when it is quiet */
+			if (log->flags & SQL_LOG_COMPRESSED) sql_log_flush_block(log);
+			g_usleep(log->interval_us);
+		}
+
+		/* at most every 10 seconds */
+		if ((dropped = sql_log_dropped(log)) != log->reported && time(NULL) >= log->reported_at + 10) {
+			log->reported_at = time(NULL);
+			g_warning("%s: the sql-log buffers were full, %" G_GUINT64_FORMAT " records dropped so far", G_STRLOC, dropped);
+			log->reported = dropped;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * walk the records (or blocks) of a binary sql-log
+ *
+ * only the length prefixes are parsed, the file is read in SQL_LOG_BLOCK_SIZE chunks
+ *
+ * @return the offset behind the last complete record
+ */
+static off_t sql_log_complete_len(int fd, off_t size, guint flags) {
+	guchar *buf = g_malloc(SQL_LOG_BLOCK_SIZE);
+	off_t buf_off = 0;
+	gssize buf_len = 0;
+	off_t pos = SQL_LOG_HEADER_LEN;
+
+	while (pos < size) {
+		const guchar *start, *p, *end;
+		guint64 len, packed;
+
+		/* keep room for the two varints of a block header */
+		if (pos < buf_off || pos - buf_off + 20 > buf_len) {
+			buf_off = pos;
+			if (-1 == (buf_len = pread(fd, buf, SQL_LOG_BLOCK_SIZE, pos))) break;
+		}
+
+		start = p = buf + (pos - buf_off);
+		end = buf + buf_len;
+
+		if (!sql_log_varint_get(&p, end, &len)) break;
+		if (flags & SQL_LOG_COMPRESSED) {
+			if (!sql_log_varint_get(&p, end, &packed)) break;
+			if (packed) len = packed;
+		}
+
+		if (len > (guint64)(size - pos - (p - start))) break;
+
+		pos += (p - start) + len;
+	}
+
+	g_free(buf);
+
+	return pos;
+}
+
+/**
+ * write the header to a new binary sql-log, check it if we append
+ */
+static gboolean sql_log_header(int fd, const gchar *filename, guint flags) {
+	gchar header[SQL_LOG_HEADER_LEN];
+	gchar found[SQL_LOG_HEADER_LEN];
+	struct stat st;
+	off_t complete;
+
+	memcpy(header, SQL_LOG_MAGIC, sizeof(SQL_LOG_MAGIC) - 1);
+	header[6] = SQL_LOG_VERSION;
+	header[7] = flags;
+
+	if (-1 == fstat(fd, &st)) {
+		g_critical("%s: fstat(%s) failed: %s (%d)", G_STRLOC, filename, g_strerror(errno), errno);
+		return FALSE;
+	}
+
+	if (st.st_size == 0) {
+		if (sizeof(header) != write(fd, header, sizeof(header))) {
+			g_critical("%s: writing the header of %s failed: %s (%d)", G_STRLOC, filename, g_strerror(errno), errno);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	if (sizeof(found) != pread(fd, found, sizeof(found), 0) || 0 != memcmp(header, found, sizeof(header))) {
+		g_critical("%s: %s isn't a sql-log of this format, move it away", G_STRLOC, filename);
+		return FALSE;
+	}
+
+	/* a crash may have cut the last record (or block), drop it before we append to it */
+	if ((complete = sql_log_complete_len(fd, st.st_size, flags)) < st.st_size) {
+		g_message("%s: %s ends with a incomplete record, cutting off its last %" G_GINT64_FORMAT " bytes",
+				G_STRLOC, filename, (gint64)(st.st_size - complete));
+
+		if (-1 == ftruncate(fd, complete)) {
+			g_critical("%s: ftruncate(%s) failed: %s (%d)", G_STRLOC, filename, g_strerror(errno), errno);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * open the sql-log and start its writer-thread
+ *
+ * @param flags        SQL_LOG_BINARY and SQL_LOG_COMPRESSED, 0 for lines of text
+ * @param ring_num     the number of event-threads
+ * @param ring_size    bytes buffered per event-thread, rounded up to a power of two
+ * @param interval_us  how long the writer waits for new records
+ * @return NULL if the file can't be opened
+ */
+sql_log_t *sql_log_new(const gchar *filename, guint flags, guint ring_num, guint ring_size, gulong interval_us) {
+	sql_log_t *log;
+	guint i;
+	int fd;
+
+	if (-1 == (fd = open(filename, O_RDWR | O_APPEND | O_CREAT, 0644))) {
+		g_critical("%s: open(%s) failed: %s (%d)", G_STRLOC, filename, g_strerror(errno), errno);
+		return NULL;
+	}
+
+	if ((flags & SQL_LOG_BINARY) && !sql_log_header(fd, filename, flags)) {
+		close(fd);
+		return NULL;
+	}
+
+	log = g_new0(sql_log_t, 1);
+	log->fd = fd;
+	log->flags = flags;
+	log->interval_us = interval_us;
+	log->ring_num = ring_num;
+	log->rings = g_new0(sql_log_ring_t, ring_num);
+
+	if (flags & SQL_LOG_COMPRESSED) {
+		log->block = g_string_sized_new(SQL_LOG_BLOCK_SIZE * 2);
+		log->packed = g_string_sized_new(SQL_LOG_BLOCK_SIZE * 2);
+	}
+
+	ring_size = 1 << g_bit_storage(MAX(ring_size, 4096) - 1);
+	for (i = 0; i < ring_num; i++) {
+		log->rings[i].buf = g_malloc(ring_size);
+		log->rings[i].size = ring_size;
+		log->rings[i].scratch = g_string_sized_new(1024);
+		log->rings[i].rand = g_random_int() | 1;
+		log->rings[i].limits = g_new0(sql_log_limit_t, SQL_LOG_LIMIT_SLOTS);
+	}
+
+	log->writer = g_thread_create(sql_log_writer, log, TRUE, NULL);
+
+	return log;
+}
+
+/**
+ * stop the writer, write out what is left and close the file
+ */
+void sql_log_free(sql_log_t *log) {
+	guint i;
+
+	if (!log) return;
+
+	g_atomic_int_set(&log->is_stopped, 1);
+	if (log->writer) g_thread_join(log->writer);
+
+	sql_log_drain(log);
+	if (log->flags & SQL_LOG_COMPRESSED) {
+		sql_log_flush_block(log);
+		g_string_free(log->block, TRUE);
+		g_string_free(log->packed, TRUE);
+	}
+	close(log->fd);
+
+	for (i = 0; i < log->ring_num; i++) {
+		g_free(log->rings[i].buf);
+		g_string_free(log->rings[i].scratch, TRUE);
+		g_free(log->rings[i].limits);
+	}
+	g_free(log->rings);
+	g_free(log);
+}
+
+/**
+ * append a record to the ring of the calling event-thread
+ *
+ * @return FALSE if the ring is full and the record was dropped
+ */
+gboolean sql_log_append(sql_log_t *log, guint ring_ndx, const gchar *data, gsize len) {
+	sql_log_ring_t *ring = &(log->rings[ring_ndx]);
+	guint head = (guint)ring->head;
+	guint tail = (guint)g_atomic_int_get(&ring->tail);
+	guint offset = head & (ring->size - 1);
+	guint first;
+
+	if (len > ring->size - (head - tail)) {
+		ring->dropped++;
+		return FALSE;
+	}
+
+	first = MIN(len, ring->size - offset);
+	memcpy(ring->buf + offset, data, first);
+	memcpy(ring->buf, data + first, len - first);
+
+	/* publish the record after it is copied */
+	g_atomic_int_set(&ring->head, (gint)(head + len));
+
+	return TRUE;
+}
+
+/**
+ * the current time as [mm/dd/yyyy hh:mm:ss], formatted once a second per event-thread
+ */
+const gchar *sql_log_timestamp(sql_log_t *log, guint ring_ndx) {
+	sql_log_ring_t *ring = &(log->rings[ring_ndx]);
+	time_t t = time(NULL);
+
+	if (t != ring->ts_sec) {
+		struct tm tm;
+
+		localtime_r(&t, &tm);
+		g_snprintf(ring->ts, sizeof(ring->ts), "[%02d/%02d/%d %02d:%02d:%02d]", tm.tm_mon+1, tm.tm_mday, tm.tm_year+1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		ring->ts_sec = t;
+	}
+
+	return ring->ts;
+}
+
+/**
+ * a empty buffer of the event-thread to build a record in
+ */
+GString *sql_log_scratch(sql_log_t *log, guint ring_ndx) {
+	GString *scratch = log->rings[ring_ndx].scratch;
+
+	g_string_truncate(scratch, 0);
+
+	return scratch;
+}
+
+/**
+ * the records dropped by all event-threads
+ */
+guint64 sql_log_dropped(sql_log_t *log) {
+	guint64 dropped = 0;
+	guint i;
+
+	for (i = 0; i < log->ring_num; i++) {
+		dropped += log->rings[i].dropped;
+	}
+
+	return dropped;
+}
+
+/**
+ * pick 1 in n records, 0 picks none
+ *
+ * @return TRUE if the record should be logged
+ */
+gboolean sql_log_sample(sql_log_t *log, guint ring_ndx, guint n) {
+	sql_log_ring_t *ring = &(log->rings[ring_ndx]);
+	guint32 x = ring->rand;
+
+	if (n == 1) return TRUE;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	ring->rand = x;
+
+	if (n == 0 || x % n != 0) {
+		ring->sampled_out++;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * let at most rate records of a digest per second pass, counted per event-thread
+ *
+ * a digest gets a slot of its set which isn't used in this second. if all of them are, it counts
+ * against the least used one: digests which collide share their budget rather than resetting
+ * each other's count
+ *
+ * @return TRUE if the record should be logged
+ */
+gboolean sql_log_limit(sql_log_t *log, guint ring_ndx, guint64 digest, guint rate) {
+	sql_log_ring_t *ring = &(log->rings[ring_ndx]);
+	sql_log_limit_t *set, *slot = NULL, *expired = NULL, *least = NULL;
+	guint32 hash = (guint32)(digest ^ (digest >> 32));
+	time_t t = time(NULL);
+	guint i;
+
+	set = &(ring->limits[(hash % (SQL_LOG_LIMIT_SLOTS / SQL_LOG_LIMIT_WAYS)) * SQL_LOG_LIMIT_WAYS]);
+	for (i = 0; i < SQL_LOG_LIMIT_WAYS; i++) {
+		sql_log_limit_t *s = &(set[i]);
+
+		if (s->sec != t) {
+			if (s->hash == hash) slot = s;
+			if (!expired) expired = s;
+		} else if (s->hash == hash) {
+			slot = s;
+			break;
+		} else if (!least || s->count < least->count) {
+			least = s;
+		}
+	}
+
+	if (slot == NULL) slot = expired;
+	if (slot == NULL) {
+		slot = least;
+	} else if (slot->sec != t) {
+		slot->hash = hash;
+		slot->sec = t;
+		slot->count = 0;
+	}
+
+	if (slot->count >= rate) {
+		ring->limited++;
+		return FALSE;
+	}
+	slot->count++;
+
+	return TRUE;
+}
+
+guint64 sql_log_sampled_out(sql_log_t *log) {
+	guint64 n = 0;
+	guint i;
+
+	for (i = 0; i < log->ring_num; i++) n += log->rings[i].sampled_out;
+
+	return n;
+}
+
+guint64 sql_log_limited(sql_log_t *log) {
+	guint64 n = 0;
+	guint i;
+
+	for (i = 0; i < log->ring_num; i++) n += log->rings[i].limited;
+
+	return n;
+}
+
+/**
+ * FNV-1a, 64 bit
+ */
+guint64 sql_log_digest(const gchar *s, gsize len) {
+	guint64 hash = G_GUINT64_CONSTANT(14695981039346656037);
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (guchar)s[i]) * G_GUINT64_CONSTANT(1099511628211);
+	}
+
+	return hash;
+}
+
+static guint sql_log_varint_len(guint64 v) {
+	guint n = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+
+	return n;
+}
+
+void sql_log_varint_append(GString *s, guint64 v) {
+	while (v >= 0x80) {
+		g_string_append_c(s, (gchar)(v | 0x80));
+		v >>= 7;
+	}
+	g_string_append_c(s, (gchar)v);
+}
+
+/**
+ * decode a varint and move *p behind it
+ *
+ * @return FALSE if the varint runs over end or is longer than 64 bit
+ */
+gboolean sql_log_varint_get(const guchar **p, const guchar *end, guint64 *v) {
+	const guchar *q = *p;
+	guint64 r = 0;
+	guint shift;
+
+	for (shift = 0; q < end && shift < 64; shift += 7) {
+		guchar c = *q++;
+
+		r |= (guint64)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*p = q;
+			*v = r;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+void sql_log_record_append(GString *s, const sql_log_record_t *rec) {
+	guint64 len;
+	guint i;
+
+	len = 1 + sql_log_varint_len(rec->time) + sql_log_varint_len(rec->latency_us) +
+		sql_log_varint_len(rec->client) + sql_log_varint_len(rec->backend) + 8 +
+		sql_log_varint_len(rec->rows) + sql_log_varint_len(rec->bytes) +
+		sql_log_varint_len(rec->query_len) + rec->query_len;
+
+	sql_log_varint_append(s, len);
+	g_string_append_c(s, (gchar)rec->flags);
+	sql_log_varint_append(s, rec->time);
+	sql_log_varint_append(s, rec->latency_us);
+	sql_log_varint_append(s, rec->client);
+	sql_log_varint_append(s, rec->backend);
+	for (i = 0; i < 8; i++) {
+		g_string_append_c(s, (gchar)(rec->digest >> (i * 8)));
+	}
+	sql_log_varint_append(s, rec->rows);
+	sql_log_varint_append(s, rec->bytes);
+	sql_log_varint_append(s, rec->query_len);
+	g_string_append_len(s, rec->query, rec->query_len);
+}
+
+/**
+ * decode the record at p
+ *
+ * @return the length of the record, 0 if it isn't complete yet, -1 if it is broken
+ */
+gssize sql_log_record_get(const guchar *p, gsize len, sql_log_record_t *rec) {
+	const guchar *end = p + len;
+	const guchar *start = p;
+	guint64 rec_len, query_len;
+	guint i;
+
+	if (!sql_log_varint_get(&p, end, &rec_len)) {
+		/* a varint has at most 10 bytes */
+		return len < 10 ? 0 : -1;
+	}
+	if (rec_len > (guint64)(end - p)) return 0;
+	end = p + rec_len;
+
+	if (p == end) return -1;
+	rec->flags = *p++;
+
+	if (!sql_log_varint_get(&p, end, &rec->time) ||
+	    !sql_log_varint_get(&p, end, &rec->latency_us) ||
+	    !sql_log_varint_get(&p, end, &rec->client) ||
+	    !sql_log_varint_get(&p, end, &rec->backend)) return -1;
+
+	if (end - p < 8) return -1;
+	rec->digest = 0;
+	for (i = 0; i < 8; i++) {
+		rec->digest |= (guint64)*p++ << (i * 8);
+	}
+
+	if (!sql_log_varint_get(&p, end, &rec->rows) ||
+	    !sql_log_varint_get(&p, end, &rec->bytes) ||
+	    !sql_log_varint_get(&p, end, &query_len)) return -1;
+
+	if (query_len > (guint64)(end - p)) return -1;
+	rec->query = (const gchar *)p;
+	rec->query_len = query_len;
+
+	return end - start;
+}
+
+/*
+ * a LZ77 in the spirit of LZF: a control byte below 32 is followed by c + 1 literals,
+ * otherwise it is a match of (c >> 5) + 2 bytes (7 means a extra length byte follows)
+ * at the offset ((c & 0x1f) << 8) + next byte + 1 back in the output
+ */
+#define SQL_LOG_LZ_HASH_BITS 13
+#define SQL_LOG_LZ_MAX_OFF   (1 << 13)
+#define SQL_LOG_LZ_MAX_LIT   32
+#define SQL_LOG_LZ_MAX_MATCH (7 + 255 + 2)
+
+static void sql_log_lz_literals(GString *dst, const guchar *lit, gsize len) {
+	while (len > 0) {
+		gsize n = MIN(len, SQL_LOG_LZ_MAX_LIT);
+
+		g_string_append_c(dst, (gchar)(n - 1));
+		g_string_append_len(dst, (const gchar *)lit, n);
+		lit += n;
+		len -= n;
+	}
+}
+
+/**
+ * append the compressed [src, src + len) to dst
+ */
+void sql_log_compress(GString *dst, const guchar *src, gsize len) {
+	gsize *htab = g_new0(gsize, 1 << SQL_LOG_LZ_HASH_BITS); /* position + 1, 0 is empty */
+	gsize ip = 0, lit = 0;
+
+	while (ip + 3 <= len) {
+		guint32 h = ((guint32)src[ip] << 16) | ((guint32)src[ip + 1] << 8) | src[ip + 2];
+		gsize ref;
+
+		h = (h * 2654435761U) >> (32 - SQL_LOG_LZ_HASH_BITS);
+		ref = htab[h];
+		htab[h] = ip + 1;
+
+		if (ref != 0 && ip - (ref - 1) <= SQL_LOG_LZ_MAX_OFF && 0 == memcmp(src + ref - 1, src + ip, 3)) {
+			gsize off = ip - ref; /* distance - 1 */
+			gsize max = MIN(len - ip, SQL_LOG_LZ_MAX_MATCH);
+			gsize mlen = 3;
+
+			while (mlen < max && src[ref - 1 + mlen] == src[ip + mlen]) mlen++;
+
+			sql_log_lz_literals(dst, src + lit, ip - lit);
+
+			mlen -= 2;
+			if (mlen < 7) {
+				g_string_append_c(dst, (gchar)((mlen << 5) | (off >> 8)));
+			} else {
+				g_string_append_c(dst, (gchar)((7 << 5) | (off >> 8)));
+				g_string_append_c(dst, (gchar)(mlen - 7));
+			}
+			g_string_append_c(dst, (gchar)(off & 0xff));
+
+			ip += mlen + 2;
+			lit = ip;
+			continue;
+		}
+		ip++;
+	}
+
+	sql_log_lz_literals(dst, src + lit, len - lit);
+
+	g_free(htab);
+}
+
+/**
+ * append the decompressed [src, src + len) to dst
+ *
+ * @return FALSE if the data is broken
+ */
+gboolean sql_log_decompress(GString *dst, const guchar *src, gsize len) {
+	const guchar *end = src + len;
+
+	while (src < end) {
+		guint c = *src++;
+
+		if (c < SQL_LOG_LZ_MAX_LIT) {
+			if ((gsize)(end - src) < c + 1) return FALSE;
+			g_string_append_len(dst, (const gchar *)src, c + 1);
+			src += c + 1;
+		} else {
+			gsize mlen = c >> 5;
+			gsize off, from, i;
+
+			if (mlen == 7) {
+				if (src == end) return FALSE;
+				mlen += *src++;
+			}
+			mlen += 2;
+
+			if (src == end) return FALSE;
+			off = (((gsize)(c & 0x1f)) << 8) + *src++ + 1;
+			if (off > dst->len) return FALSE;
+
+			/* the match may overlap with what it produces */
+			from = dst->len - off;
+			g_string_set_size(dst, dst->len + mlen);
+			for (i = 0; i < mlen; i++) {
+				dst->str[from + off + i] = dst->str[from + i];
+			}
+		}
+	}
+
+	return TRUE;
+}
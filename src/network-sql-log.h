@@ -0,0 +1,162 @@
+/* $%BEGINLICENSE%$
+ Copyright (c) 2008, 2010, Oracle and/or its affiliates. All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as
+ published by the Free Software Foundation; version 2 of the
+ License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ 02110-1301  USA
+
+ $%ENDLICENSE%$ */
+
+#ifndef _NETWORK_SQL_LOG_H_
+#define _NETWORK_SQL_LOG_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <glib.h>
+
+#include "network-exports.h"
+
+#define SQL_LOG_LIMIT_SLOTS 1024
+#define SQL_LOG_LIMIT_WAYS  4     /**< a digest may use any slot of its set */
+
+/**
+ * the binary format of --sql-log-format=binary
+ *
+ * the file starts with the 8 byte header SQL_LOG_MAGIC, SQL_LOG_VERSION and the flags, the records follow.
+ * with SQL_LOG_COMPRESSED the records are put into blocks of SQL_LOG_BLOCK_SIZE or a bit more, a record
+ * never spans two blocks. a block is
+ *
+ *   varint  length of the data
+ *   varint  length of the compressed data, 0 if the data is stored as is
+ *   the (compressed) data
+ *
+ * a record is
+ *
+ *   varint  length of the rest of the record, fields added later go at the end
+ *   byte    SQL_LOG_RECORD_ERR if the query failed
+ *   varint  unix time in seconds
+ *   varint  latency in microseconds
+ *   varint  client, ipv4 << 16 | port, 0 for other address families
+ *   varint  backend, the same
+ *   8 bytes digest, FNV-1a of the default db, \0 and the fingerprint of the query, little-endian
+ *   varint  rows
+ *   varint  bytes
+ *   varint  length of the query
+ *   the query without the command byte
+ *
+ * varints are 7 bits per byte, least significant first, the high bit is set if more bytes follow
+ */
+#define SQL_LOG_MAGIC "ATLSQL"
+#define SQL_LOG_VERSION 1
+#define SQL_LOG_HEADER_LEN 8
+
+#define SQL_LOG_BINARY     0x01 /**< write records instead of lines */
+#define SQL_LOG_COMPRESSED 0x02 /**< compress the records in blocks, only with SQL_LOG_BINARY */
+
+#define SQL_LOG_RECORD_ERR 0x01
+
+#define SQL_LOG_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+	guint flags;            /**< SQL_LOG_RECORD_ERR */
+	guint64 time;
+	guint64 latency_us;
+	guint64 client;
+	guint64 backend;
+	guint64 digest;
+	guint64 rows;
+	guint64 bytes;
+	const gchar *query;     /**< not \0-terminated */
+	gsize query_len;
+} sql_log_record_t;
+
+/**
+ * records logged for a digest in the current second, for --sql-log-digest-rate
+ */
+typedef struct {
+	guint32 hash;
+	time_t sec;
+	guint count;
+} sql_log_limit_t;
+
+/**
+ * the buffer of one event-thread
+ *
+ * a single-producer, single-consumer ring: the event-thread appends and moves head, the
+ * writer-thread writes out and moves tail. head and tail only grow, size is a power of two.
+ */
+typedef struct {
+	gchar *buf;
+	guint size;
+
+	volatile gint head;     /**< only written by the event-thread */
+	volatile gint tail;     /**< only written by the writer-thread */
+
+	guint64 dropped;        /**< records which didn't fit, only written by the event-thread */
+
+	time_t ts_sec;          /**< the second ts is formatted for */
+	gchar ts[24];           /**< [mm/dd/yyyy hh:mm:ss] */
+	GString *scratch;       /**< to build the record in */
+
+	guint32 rand;           /**< xorshift state of the sampling */
+	sql_log_limit_t *limits; /**< SQL_LOG_LIMIT_SLOTS in sets of SQL_LOG_LIMIT_WAYS */
+	guint64 sampled_out;    /**< records skipped by the sampling */
+	guint64 limited;        /**< records skipped by the rate limit */
+} sql_log_ring_t;
+
+/**
+ * the sql-log, written by its own thread
+ */
+typedef struct {
+	int fd;
+	guint flags;            /**< SQL_LOG_BINARY, SQL_LOG_COMPRESSED */
+
+	GString *block;         /**< records not compressed yet, only with SQL_LOG_COMPRESSED */
+	GString *packed;        /**< the compressed block */
+
+	sql_log_ring_t *rings;  /**< one per event-thread */
+	guint ring_num;
+
+	GThread *writer;
+	volatile gint is_stopped;
+	gulong interval_us;     /**< how long the writer sleeps if the rings are empty */
+
+	guint64 written;        /**< bytes written, only written by the writer-thread */
+	guint64 reported;       /**< dropped records which are already logged as warning */
+	time_t reported_at;
+} sql_log_t;
+
+NETWORK_API sql_log_t *sql_log_new(const gchar *filename, guint flags, guint ring_num, guint ring_size, gulong interval_us);
+NETWORK_API void sql_log_free(sql_log_t *log);
+NETWORK_API gboolean sql_log_append(sql_log_t *log, guint ring_ndx, const gchar *data, gsize len);
+NETWORK_API const gchar *sql_log_timestamp(sql_log_t *log, guint ring_ndx);
+NETWORK_API GString *sql_log_scratch(sql_log_t *log, guint ring_ndx);
+NETWORK_API guint64 sql_log_dropped(sql_log_t *log);
+NETWORK_API gboolean sql_log_sample(sql_log_t *log, guint ring_ndx, guint n);
+NETWORK_API gboolean sql_log_limit(sql_log_t *log, guint ring_ndx, guint64 digest, guint rate);
+NETWORK_API guint64 sql_log_sampled_out(sql_log_t *log);
+NETWORK_API guint64 sql_log_limited(sql_log_t *log);
+
+NETWORK_API guint64 sql_log_digest(const gchar *s, gsize len);
+NETWORK_API void sql_log_varint_append(GString *s, guint64 v);
+NETWORK_API gboolean sql_log_varint_get(const guchar **p, const guchar *end, guint64 *v);
+NETWORK_API void sql_log_record_append(GString *s, const sql_log_record_t *rec);
+NETWORK_API gssize sql_log_record_get(const guchar *p, gsize len, sql_log_record_t *rec);
+NETWORK_API void sql_log_compress(GString *dst, const guchar *src, gsize len);
+NETWORK_API gboolean sql_log_decompress(GString *dst, const guchar *src, gsize len);
+
+#endif /* _NETWORK_SQL_LOG_H_ */